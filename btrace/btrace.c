@@ -1,14 +1,19 @@
 #include "btrace.h"
 
+#include <sha2.h>
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BTRACE_LOG_VAR "BTRACE_LOG"
+#define BTRACE_HASH_INPUTS_VAR "BTRACE_HASH_INPUTS"
 
 #define EINTR_LOOP(expr)                        \
     ({                                          \
@@ -26,52 +31,100 @@ struct PidList {
     PidList *next;
 };
 
-static void lockFile(FILE *fp);
-static void unlockFile(FILE *fp);
+/* The pidlist of this process, formatted once, and the PID it belongs to. */
+static BtraceBuffer thePidList;
+static pid_t thePidListPid;
+
+static void appendToLog(const char *logPath, const BtraceBuffer *record);
+static int openLog(const char *logPath);
 static char *portableGetCwd(void);
-static void logExecution(FILE *logfp);
+static void logExecution(BtraceBuffer *record);
+static void writeTimeAndPidList(BtraceBuffer *record);
+static void logInputs(BtraceBuffer *record);
+static bool isSourceFile(const char *path);
+static char *dependencyFilePath(char **args, size_t argCount);
+static size_t readDependencies(char *content, char ***depsOut);
+static void writeHashes(BtraceBuffer *record, char **paths, size_t count);
 static PidList *getPidList(pid_t pid);
 static PidList *reversePidList(PidList *pidList);
 static void freePidList(PidList *pidList);
 
+/* Every process of a traced build runs this, so it must not serialize the
+ * build.  The record is formatted in memory first, then appended with a single
+ * write() on an O_APPEND descriptor.  The kernel positions and copies each such
+ * write as a unit, so concurrent processes' records don't interleave, and no
+ * file lock is needed.  (NFS doesn't honor O_APPEND atomically.  For a log on
+ * NFS, make BTRACE_LOG a directory instead; see openLog.) */
 __attribute__((constructor))
 static void processInit(void)
 {
-    const char *logFileName = getenv(BTRACE_LOG_VAR);
-    if (logFileName == NULL || logFileName[0] == '\0')
+    const char *logPath = getenv(BTRACE_LOG_VAR);
+    if (logPath == NULL || logPath[0] == '\0')
         return;
 
-    FILE *logfp = fopen(logFileName, "a");
-    assert(logfp != NULL && "Error opening trace file for append.");
-    lockFile(logfp);
-    logExecution(logfp);
-    fflush(logfp);
-    unlockFile(logfp);
-    fclose(logfp);
+    BtraceBuffer record = { NULL, 0, 0 };
+    logExecution(&record);
+    appendToLog(logPath, &record);
+    btrace_bufferFree(&record);
 }
 
-static void lockFile(FILE *fp)
+/* With BTRACE_HASH_INPUTS=1, a compile command (one with -c and a source file
+ * argument) also logs a second record as it exits, once its output exists.
+ * The record has the process' pidlist, and instead of an argv, the SHA-256 of
+ * each source file ("sources") and, if the command wrote a -MD or -MMD
+ * dependency file, of each file listed there ("deps").  The converter puts
+ * them in the compile database, so the indexer can tell which TUs changed
+ * without hashing their inputs again. */
+__attribute__((destructor))
+static void processExit(void)
 {
-    struct flock lock;
-    memset(&lock, 0, sizeof(lock));
-    lock.l_type = F_WRLCK;
-    lock.l_whence = SEEK_SET;
-    lock.l_start = 0;
-    lock.l_len = 0;
-    int lockRet = EINTR_LOOP(fcntl(fileno(fp), F_SETLKW, &lock));
-    assert(lockRet == 0 && "Error locking trace file.");
+    const char *logPath = getenv(BTRACE_LOG_VAR);
+    const char *hashInputs = getenv(BTRACE_HASH_INPUTS_VAR);
+    if (logPath == NULL || logPath[0] == '\0' ||
+            hashInputs == NULL || strcmp(hashInputs, "1") != 0)
+        return;
+
+    /* A forked child that exits without exec'ing runs this too, but its
+     * argv is its parent's. */
+    if (thePidListPid != getpid())
+        return;
+
+    BtraceBuffer record = { NULL, 0, 0 };
+    logInputs(&record);
+    if (record.size > 0)
+        appendToLog(logPath, &record);
+    btrace_bufferFree(&record);
 }
 
-static void unlockFile(FILE *fp)
+static void appendToLog(const char *logPath, const BtraceBuffer *record)
 {
-    struct flock lock;
-    memset(&lock, 0, sizeof(lock));
-    lock.l_type = F_UNLCK;
-    lock.l_whence = SEEK_SET;
-    lock.l_start = 0;
-    lock.l_len = 0;
-    int unlockRet = fcntl(fileno(fp), F_SETLK, &lock);
-    assert(unlockRet == 0 && "Error unlocking trace file.");
+    const int fd = openLog(logPath);
+    assert(fd != -1 && "Error opening trace file for append.");
+    const ssize_t written =
+        EINTR_LOOP(write(fd, record->data, record->size));
+    assert(written == (ssize_t)record->size && "Error writing trace file.");
+    (void)written;
+    close(fd);
+}
+
+/* If BTRACE_LOG ends with a slash, it names a directory, and each process
+ * appends to its own "<pid>.log" file there, so processes never share a file.
+ * (A reused PID shares its predecessor's file, which is fine, because each
+ * record is still a single append.)  Otherwise, every process appends to
+ * BTRACE_LOG itself. */
+static int openLog(const char *logPath)
+{
+    const int flags = O_WRONLY | O_APPEND | O_CREAT;
+    const size_t logPathLen = strlen(logPath);
+    if (logPath[logPathLen - 1] != '/')
+        return EINTR_LOOP(open(logPath, flags, 0666));
+
+    char *path = malloc(logPathLen + 32);
+    assert(path != NULL && "malloc() call failed.");
+    sprintf(path, "%s%d.log", logPath, (int)getpid());
+    const int fd = EINTR_LOOP(open(path, flags, 0666));
+    free(path);
+    return fd;
 }
 
 /* This function behaves the same as getcwd(NULL, 0) on most Unix operating
@@ -90,54 +143,283 @@ static char *portableGetCwd(void)
     return NULL;
 }
 
-static void logExecution(FILE *logfp)
+static void logExecution(BtraceBuffer *record)
 {
-    fputs("{", logfp);
+    btrace_bufferPuts(record, "{");
 
     {
-        fputs("\"cwd\":", logfp);
+        btrace_bufferPuts(record, "\"cwd\":");
         char *cwd = portableGetCwd();
-        btrace_writeJsonStr(logfp, cwd != NULL ? cwd : "");
+        btrace_writeJsonStr(record, cwd != NULL ? cwd : "");
         free(cwd);
-        fputs(",", logfp);
+        btrace_bufferPuts(record, ",");
     }
 
+    writeTimeAndPidList(record);
+    btrace_bufferPuts(record, ",");
+
     {
+        btrace_bufferPuts(record, "\"argv\":[");
+        char *argBlock = NULL;
+        size_t argBlockSize = 0;
+        btrace_getArgBlock(&argBlock, &argBlockSize);
+        size_t argIndex = 0;
+        while (argIndex < argBlockSize) {
+            if (argIndex > 0)
+                btrace_bufferPutc(record, ',');
+            btrace_writeJsonStr(record, &argBlock[argIndex]);
+            argIndex += strlen(&argBlock[argIndex]) + 1;
+        }
+        free(argBlock);
+        btrace_bufferPuts(record, "]");
+    }
+
+    btrace_bufferPuts(record, "}\n");
+}
+
+static void writeTimeAndPidList(BtraceBuffer *record)
+{
+    char number[64];
+
+    {
+        /* The time of the record, in microseconds.  The converter orders the
+         * records of a log directory by it, so that a parent's record comes
+         * before its children's.  The monotonic clock is shared by every
+         * process and, unlike the wall clock, never steps backwards (e.g.
+         * when NTP corrects it). */
+        long long micros;
+#if defined(CLOCK_MONOTONIC)
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        micros = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        micros = (long long)now.tv_sec * 1000000 + now.tv_usec;
+#endif
+        sprintf(number, "\"time\":%lld,", micros);
+        btrace_bufferPuts(record, number);
+    }
+
+    if (thePidListPid != getpid()) {
         PidList *const pidList = reversePidList(getPidList(getpid()));
         assert(pidList != NULL && "Error getting PID ancestor list.");
-        fputs("\"pidlist\":[", logfp);
+        btrace_bufferFree(&thePidList);
+        btrace_bufferPuts(&thePidList, "\"pidlist\":[");
         int prevPid = 0;
         long long prevStartTime = 0;
         for (PidList *p = pidList; p != NULL; p = p->next) {
             if (p != pidList)
-                fputs(",", logfp);
+                btrace_bufferPutc(&thePidList, ',');
             int deltaPid = (int)p->pid - prevPid;
             long long deltaStartTime = (long long)p->startTime - prevStartTime;
-            fprintf(logfp, "%d,%lld", deltaPid, deltaStartTime);
+            sprintf(number, "%d,%lld", deltaPid, deltaStartTime);
+            btrace_bufferPuts(&thePidList, number);
             prevPid = p->pid;
             prevStartTime = p->startTime;
         }
-        fputs("],", logfp);
+        btrace_bufferPuts(&thePidList, "]");
         freePidList(pidList);
+        thePidListPid = getpid();
     }
+    btrace_bufferAppend(record, thePidList.data, thePidList.size);
+}
 
-    {
-        fputs("\"argv\":[", logfp);
-        char *argBlock = NULL;
-        size_t argBlockSize = 0;
-        btrace_getArgBlock(&argBlock, &argBlockSize);
-        size_t argIndex = 0;
-        while (argIndex < argBlockSize) {
-            if (argIndex > 0)
-                putc_unlocked(',', logfp);
-            btrace_writeJsonStr(logfp, &argBlock[argIndex]);
-            argIndex += strlen(&argBlock[argIndex]) + 1;
+/* Leaves the record empty if this isn't a compile command. */
+static void logInputs(BtraceBuffer *record)
+{
+    char *argBlock = NULL;
+    size_t argBlockSize = 0;
+    btrace_getArgBlock(&argBlock, &argBlockSize);
+
+    size_t argCount = 0;
+    for (size_t i = 0; i < argBlockSize; i += strlen(&argBlock[i]) + 1)
+        argCount++;
+    char **args = malloc((argCount + 1) * sizeof(char*));
+    assert(args != NULL && "malloc() call failed.");
+    argCount = 0;
+    for (size_t i = 0; i < argBlockSize; i += strlen(&argBlock[i]) + 1)
+        args[argCount++] = &argBlock[i];
+
+    bool compile = false;
+    size_t sourceCount = 0;
+    char **sources = malloc((argCount + 1) * sizeof(char*));
+    assert(sources != NULL && "malloc() call failed.");
+    for (size_t i = 1; i < argCount; ++i) {
+        if (strcmp(args[i], "-c") == 0)
+            compile = true;
+        else if (args[i][0] != '-' && isSourceFile(args[i]))
+            sources[sourceCount++] = args[i];
+    }
+
+    if (compile && sourceCount > 0) {
+        btrace_bufferPuts(record, "{");
+        writeTimeAndPidList(record);
+        btrace_bufferPuts(record, ",\"sources\":{");
+        writeHashes(record, sources, sourceCount);
+        btrace_bufferPuts(record, "}");
+
+        char *depFile = dependencyFilePath(args, argCount);
+        char *depContent = NULL;
+        if (depFile != NULL &&
+                btrace_readEntireFile(depFile, &depContent, NULL)) {
+            char **deps = NULL;
+            const size_t depCount = readDependencies(depContent, &deps);
+            btrace_bufferPuts(record, ",\"deps\":{");
+            writeHashes(record, deps, depCount);
+            btrace_bufferPuts(record, "}");
+            free(deps);
         }
-        free(argBlock);
-        fputs("]", logfp);
+        free(depContent);
+        free(depFile);
+
+        btrace_bufferPuts(record, "}\n");
     }
 
-    fputs("}\n", logfp);
+    free(sources);
+    free(args);
+    free(argBlock);
+}
+
+/* The same extensions that sw-btrace-to-compiledb recognizes. */
+static bool isSourceFile(const char *path)
+{
+    static const char *const kExtensions[] = {
+        ".c", ".cc", ".cpp", ".cxx", ".c++", NULL
+    };
+    const size_t pathLen = strlen(path);
+    for (size_t i = 0; kExtensions[i] != NULL; ++i) {
+        const size_t extLen = strlen(kExtensions[i]);
+        if (pathLen > extLen &&
+                strcmp(path + pathLen - extLen, kExtensions[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* Returns the malloc-allocated path of the dependency file that a -MD or -MMD
+ * compile writes, or NULL.  As with GCC and Clang, it is the -MF argument, or
+ * else the -o argument (or, without one, the source file's basename) with its
+ * extension replaced by ".d".  The preprocessor options -Wp,-MD,<file> and
+ * -Wp,-MMD,<file> (used by the Linux kernel's build) name the file
+ * themselves.  Without -MD or -MMD, an -MF file isn't written, and may be
+ * left over from an earlier build. */
+static char *dependencyFilePath(char **args, size_t argCount)
+{
+    bool writesDeps = false;
+    const char *depFile = NULL;
+    const char *output = NULL;
+    const char *source = NULL;
+    for (size_t i = 1; i < argCount; ++i) {
+        if (strcmp(args[i], "-MD") == 0 || strcmp(args[i], "-MMD") == 0) {
+            writesDeps = true;
+        } else if (strncmp(args[i], "-Wp,-MD,", 8) == 0) {
+            writesDeps = true;
+            depFile = args[i] + 8;
+        } else if (strncmp(args[i], "-Wp,-MMD,", 9) == 0) {
+            writesDeps = true;
+            depFile = args[i] + 9;
+        } else if (strcmp(args[i], "-MF") == 0 && i + 1 < argCount) {
+            depFile = args[++i];
+        } else if (strncmp(args[i], "-MF", 3) == 0) {
+            depFile = args[i] + 3;
+        } else if (strcmp(args[i], "-o") == 0 && i + 1 < argCount) {
+            output = args[++i];
+        } else if (args[i][0] != '-' && isSourceFile(args[i])) {
+            source = args[i];
+        }
+    }
+    if (!writesDeps)
+        return NULL;
+    if (depFile != NULL)
+        return strdup(depFile);
+
+    const char *base = output;
+    if (base == NULL) {
+        base = strrchr(source, '/');
+        base = base != NULL ? base + 1 : source;
+    }
+    char *path = malloc(strlen(base) + 3);
+    assert(path != NULL && "malloc() call failed.");
+    strcpy(path, base);
+    char *dot = strrchr(path, '.');
+    if (dot != NULL && strchr(dot, '/') == NULL)
+        *dot = '\0';
+    strcat(path, ".d");
+    return path;
+}
+
+/* Split the prerequisites of the first rule of a make-style dependency file
+ * into paths, in place.  A backslash-newline continues the rule, and "\ ",
+ * "\#", and "$$" stand for a space, '#', and '$'.  Returns the number of
+ * paths, and a malloc-allocated array of them in depsOut. */
+static size_t readDependencies(char *content, char ***depsOut)
+{
+    size_t count = 0;
+    size_t capacity = 64;
+    char **deps = malloc(capacity * sizeof(char*));
+    assert(deps != NULL && "malloc() call failed.");
+
+    char *in = strchr(content, ':');
+    in = in != NULL ? in + 1 : content + strlen(content);
+    while (true) {
+        while (*in == ' ' || *in == '\t' ||
+                (in[0] == '\\' && in[1] == '\n'))
+            in += *in == '\\' ? 2 : 1;
+        if (*in == '\0' || *in == '\n')
+            break;
+        char *out = in;
+        if (count == capacity) {
+            capacity *= 2;
+            deps = realloc(deps, capacity * sizeof(char*));
+            assert(deps != NULL && "realloc() call failed.");
+        }
+        deps[count++] = out;
+        while (*in != '\0' && *in != ' ' && *in != '\t' && *in != '\n' &&
+                !(in[0] == '\\' && in[1] == '\n')) {
+            if (in[0] == '\\' && (in[1] == ' ' || in[1] == '#'))
+                in++;
+            else if (in[0] == '$' && in[1] == '$')
+                in++;
+            *out++ = *in++;
+        }
+        const char stop = *in;
+        if (stop == '\\')
+            in += 2;
+        else if (stop != '\0' && stop != '\n')
+            in++;
+        *out = '\0';
+        if (stop == '\0' || stop == '\n')
+            break;
+    }
+
+    *depsOut = deps;
+    return count;
+}
+
+/* Write a "path":"hash" member for each file that can be read. */
+static void writeHashes(BtraceBuffer *record, char **paths, size_t count)
+{
+    bool first = true;
+    for (size_t i = 0; i < count; ++i) {
+        char *content = NULL;
+        size_t size = 0;
+        if (!btrace_readEntireFile(paths[i], &content, &size))
+            continue;
+        unsigned char digest[SHA256_DIGEST_SIZE];
+        sha256((const unsigned char*)content, (unsigned int)size, digest);
+        free(content);
+
+        char hex[SHA256_DIGEST_SIZE * 2 + 1];
+        for (int j = 0; j < SHA256_DIGEST_SIZE; ++j)
+            sprintf(&hex[j * 2], "%02x", digest[j]);
+        if (!first)
+            btrace_bufferPutc(record, ',');
+        first = false;
+        btrace_writeJsonStr(record, paths[i]);
+        btrace_bufferPutc(record, ':');
+        btrace_writeJsonStr(record, hex);
+    }
 }
 
 /* Get the list of all ancestor processes (and a start time to guard against
@@ -206,20 +488,52 @@ static void freePidList(PidList *pidList)
     }
 }
 
-void btrace_writeJsonStr(FILE *logfp, const char *str)
+void btrace_bufferAppend(BtraceBuffer *buf, const char *data, size_t size)
+{
+    if (buf->size + size > buf->capacity) {
+        size_t capacity = buf->capacity > 0 ? buf->capacity : 4096;
+        while (buf->size + size > capacity)
+            capacity *= 2;
+        buf->data = realloc(buf->data, capacity);
+        assert(buf->data != NULL && "realloc() call failed.");
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+void btrace_bufferPuts(BtraceBuffer *buf, const char *str)
+{
+    btrace_bufferAppend(buf, str, strlen(str));
+}
+
+void btrace_bufferPutc(BtraceBuffer *buf, char ch)
+{
+    btrace_bufferAppend(buf, &ch, 1);
+}
+
+void btrace_bufferFree(BtraceBuffer *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+void btrace_writeJsonStr(BtraceBuffer *buf, const char *str)
 {
-    putc_unlocked('"', logfp);
+    btrace_bufferPutc(buf, '"');
     for (size_t i = 0; str[i] != '\0'; ++i)
-        btrace_writeJsonStrChar(logfp, str[i]);
-    putc_unlocked('"', logfp);
+        btrace_writeJsonStrChar(buf, str[i]);
+    btrace_bufferPutc(buf, '"');
 }
 
-void btrace_writeJsonStrChar(FILE *logfp, char ch)
+void btrace_writeJsonStrChar(BtraceBuffer *buf, char ch)
 {
-#define CASE(in, out)                   \
-        case in:                        \
-            putc_unlocked('\\', logfp); \
-            putc_unlocked(out, logfp);  \
+#define CASE(in, out)                           \
+        case in:                                \
+            btrace_bufferPutc(buf, '\\');       \
+            btrace_bufferPutc(buf, out);        \
             break;
 
     /* A JSON string can contain any Unicode character other than '"' or '\' or
@@ -237,17 +551,16 @@ void btrace_writeJsonStrChar(FILE *logfp, char ch)
         default: {
             const unsigned char uch = ch;
             if (uch <= 31 || uch == 0x7f) {
-                putc_unlocked('\\', logfp);
-                putc_unlocked('u', logfp);
-                putc_unlocked('0', logfp);
-                putc_unlocked('0', logfp);
-                putc_unlocked("0123456789abcdef"[uch >> 4], logfp);
-                putc_unlocked("0123456789abcdef"[uch & 0xf], logfp);
+                char escape[7] = "\\u00";
+                escape[4] = "0123456789abcdef"[uch >> 4];
+                escape[5] = "0123456789abcdef"[uch & 0xf];
+                btrace_bufferAppend(buf, escape, 6);
             } else {
-                putc_unlocked(ch, logfp);
+                btrace_bufferPutc(buf, ch);
             }
         }
     }
+#undef CASE
 }
 
 /* It would be convenient if we could allocate a buffer upfront for the file,
@@ -10,8 +10,22 @@
 
 /* OS-independent. */
 
-void btrace_writeJsonStr(FILE *logfp, const char *str);
-void btrace_writeJsonStrChar(FILE *logfp, char ch);
+/* A growable, malloc-allocated buffer.  A process formats its whole record in
+ * one of these, then writes it to the log with a single write() call. */
+typedef struct BtraceBuffer BtraceBuffer;
+struct BtraceBuffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+void btrace_bufferAppend(BtraceBuffer *buf, const char *data, size_t size);
+void btrace_bufferPuts(BtraceBuffer *buf, const char *str);
+void btrace_bufferPutc(BtraceBuffer *buf, char ch);
+void btrace_bufferFree(BtraceBuffer *buf);
+
+void btrace_writeJsonStr(BtraceBuffer *buf, const char *str);
+void btrace_writeJsonStrChar(BtraceBuffer *buf, char ch);
 bool btrace_readEntireFile(
     const char *path,
     char **contentOut,
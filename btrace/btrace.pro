@@ -7,6 +7,8 @@ TARGET = sw-btrace
 TEMPLATE = lib
 
 SOURCES += btrace.c
+INCLUDEPATH += ../third_party/libsha2
+SOURCES += ../third_party/libsha2/sha2.c
 linux-*: SOURCES += btrace_linux.c
 freebsd-*: SOURCES += btrace_freebsd.c
 darwin-*|macx-*: SOURCES += btrace_darwin.c
@@ -94,12 +94,38 @@ bool ASTIndexer::TraverseTypeLoc(clang::TypeLoc tl)
 
 bool ASTIndexer::TraverseDecl(clang::Decl *d)
 {
+    if (isDeclInSkippedFile(d))
+        return true;
     Switcher<Context> sw1(m_thisContext, 0);
     Switcher<Context> sw2(m_childContext, 0);
     return base::TraverseDecl(d);
 }
 
 
+// Returns true if all of the declaration's text comes from a file that
+// another TU is indexing, so that traversing it cannot record anything.
+// Namespaces and linkage specifications are always traversed, because they can
+// enclose #include directives.
+bool ASTIndexer::isDeclInSkippedFile(clang::Decl *d)
+{
+    if (d == NULL ||
+            m_indexerContext.options().headerClaimer == NULL ||
+            llvm::isa<clang::TranslationUnitDecl>(d) ||
+            llvm::isa<clang::NamespaceDecl>(d) ||
+            llvm::isa<clang::LinkageSpecDecl>(d))
+        return false;
+    clang::SourceManager &sm = m_indexerContext.sourceManager();
+    const clang::SourceLocation beginLoc = sm.getExpansionLoc(d->getLocStart());
+    const clang::SourceLocation endLoc = sm.getExpansionLoc(d->getLocEnd());
+    if (beginLoc.isInvalid() || endLoc.isInvalid())
+        return false;
+    const clang::FileID fileID = sm.getFileID(beginLoc);
+    if (fileID != sm.getFileID(endLoc))
+        return false;
+    return m_indexerContext.fileContext(fileID).isSkipped();
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Expression context propagation
 
@@ -297,6 +323,8 @@ bool ASTIndexer::VisitCXXConstructExpr(clang::CXXConstructExpr *e)
 
 void ASTIndexer::RecordDeclRefExpr(clang::NamedDecl *d, clang::SourceLocation loc, clang::Expr *e, Context context)
 {
+    if (!m_indexerContext.recordsLocals() && isLocalVariable(d))
+        return;
     if (llvm::isa<clang::FunctionDecl>(*d)) {
         // XXX: This code seems sloppy, but I suspect it will work well enough.
         if (context & CF_Called)
@@ -385,6 +413,21 @@ void ASTIndexer::traverseDeclContextHelper(clang::DeclContext *d)
     }
 }
 
+// When the TU's PCH was indexed by a separate job, only traverse the
+// declarations parsed in this TU.  Using noload_decls avoids deserializing
+// every top-level declaration in the PCH.  (Template instantiations of PCH
+// templates are reached through their templates, so they are skipped too.)
+bool ASTIndexer::TraverseTranslationUnitDecl(clang::TranslationUnitDecl *d)
+{
+    if (!m_indexerContext.options().pchIsIndexed)
+        return base::TraverseTranslationUnitDecl(d);
+    for (clang::Decl *child : d->noload_decls()) {
+        if (!child->isFromASTFile() && !llvm::isa<clang::BlockDecl>(child))
+            TraverseDecl(child);
+    }
+    return true;
+}
+
 // Overriding TraverseCXXRecordDecl lets us mark the base-class references
 // with the "Base-Class" kind.
 bool ASTIndexer::TraverseCXXRecordDecl(clang::CXXRecordDecl *d)
@@ -470,8 +513,11 @@ bool ASTIndexer::VisitDecl(clang::Decl *d)
                 // Vector::A.
                 templateParameterListsHelper(fd);
 #endif
+                // A function whose body was skipped (see
+                // IndexerOptions::projectRoots) is still a definition.
                 RefType refType;
-                refType = fd->isThisDeclarationADefinition() ?
+                refType = fd->isThisDeclarationADefinition() ||
+                        fd->hasSkippedBody() ?
                             RT_Definition : RT_Declaration;
                 SymbolType symbolType;
                 if (llvm::isa<clang::CXXMethodDecl>(fd)) {
@@ -621,6 +667,17 @@ static inline bool isNamedDeclUnnamed(clang::NamedDecl *d)
     return d->getDeclName().isIdentifier() && d->getIdentifier() == NULL;
 }
 
+// Returns true for the declarations recorded as ST_LocalVariable or
+// ST_Parameter.  (See VisitDecl.)
+bool ASTIndexer::isLocalVariable(clang::NamedDecl *d)
+{
+    if (llvm::isa<clang::ParmVarDecl>(d))
+        return true;
+    if (clang::VarDecl *vd = llvm::dyn_cast<clang::VarDecl>(d))
+        return vd->getParentFunctionOrMethod() != NULL;
+    return false;
+}
+
 std::pair<Location, Location> ASTIndexer::getDeclRefRange(
         IndexerFileContext &fileContext,
         clang::NamedDecl *decl,
@@ -716,11 +773,21 @@ void ASTIndexer::RecordDeclRef(
     if (isNamedDeclUnnamed(d))
         return;
 
+    // Skip whatever the indexing profile omits before doing any other work.
+    if (!m_indexerContext.isRecorded(refType))
+        return;
+    if (!m_indexerContext.recordsLocals() &&
+            (symbolType == ST_LocalVariable || symbolType == ST_Parameter ||
+             (symbolType == ST_Max && isLocalVariable(d))))
+        return;
+
     beginLoc = m_indexerContext.sourceManager().getSpellingLoc(beginLoc);
     clang::FileID fileID;
     if (beginLoc.isValid())
         fileID = m_indexerContext.sourceManager().getFileID(beginLoc);
     IndexerFileContext &fileContext = m_indexerContext.fileContext(fileID);
+    if (fileContext.isSkipped())
+        return;
     indexdb::ID symbolID = fileContext.getDeclSymbolID(d);
     std::pair<Location, Location> range = getDeclRefRange(fileContext, d, beginLoc);
 
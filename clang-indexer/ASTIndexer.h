@@ -44,7 +44,9 @@ private:
     RefType m_typeContext;
 
     // Misc routines
-    bool shouldVisitTemplateInstantiations() const { return true; }
+    bool shouldVisitTemplateInstantiations() const {
+        return m_indexerContext.options().profile == IP_Full;
+    }
     bool shouldUseDataRecursionFor(clang::Stmt *s) const;
 
     // Dispatcher routines
@@ -52,6 +54,7 @@ private:
     bool TraverseType(clang::QualType t);
     bool TraverseTypeLoc(clang::TypeLoc tl);
     bool TraverseDecl(clang::Decl *d);
+    bool isDeclInSkippedFile(clang::Decl *d);
 
     // Expression context propagation
     bool TraverseCallExpr(clang::CallExpr *e) { return TraverseCallCommon(e); }
@@ -86,6 +89,7 @@ private:
 
     // Declaration and TypeLoc handling
     void traverseDeclContextHelper(clang::DeclContext *d);
+    bool TraverseTranslationUnitDecl(clang::TranslationUnitDecl *d);
     bool TraverseCXXRecordDecl(clang::CXXRecordDecl *d);
     bool TraverseNamespaceAliasDecl(clang::NamespaceAliasDecl *d);
     bool TraverseClassTemplateSpecializationDecl(
@@ -95,6 +99,7 @@ private:
     bool VisitTypeLoc(clang::TypeLoc tl);
 
     // Reference recording
+    static bool isLocalVariable(clang::NamedDecl *d);
     std::pair<Location, Location> getDeclRefRange(
             IndexerFileContext &fileContext,
             clang::NamedDecl *decl,
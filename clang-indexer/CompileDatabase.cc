@@ -0,0 +1,399 @@
+#include "CompileDatabase.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <unordered_set>
+
+namespace indexer {
+
+///////////////////////////////////////////////////////////////////////////////
+// JsonReader
+
+namespace {
+
+// A minimal pull parser for JSON text, read from a file through a fixed-size
+// buffer.  It only provides what readCompileDatabase needs.
+class JsonReader
+{
+public:
+    JsonReader(FILE *fp) : m_fp(fp), m_pos(0), m_end(0) {}
+
+    // Skip whitespace and return the next character without consuming it.
+    // Returns EOF at the end of the file.
+    int peek();
+
+    // Consume the next non-whitespace character if it is ch.
+    bool accept(char ch);
+
+    bool readString(std::string &output);
+    bool skipValue();
+
+private:
+    int get();
+    bool fill();
+    bool readHex4(unsigned int &value);
+    bool skipLiteral(const char *text);
+
+    FILE *m_fp;
+    size_t m_pos;
+    size_t m_end;
+    char m_buffer[65536];
+};
+
+bool JsonReader::fill()
+{
+    m_pos = 0;
+    m_end = fread(m_buffer, 1, sizeof(m_buffer), m_fp);
+    return m_end > 0;
+}
+
+int JsonReader::get()
+{
+    if (m_pos == m_end && !fill())
+        return EOF;
+    return static_cast<unsigned char>(m_buffer[m_pos++]);
+}
+
+int JsonReader::peek()
+{
+    while (true) {
+        if (m_pos == m_end && !fill())
+            return EOF;
+        const char ch = m_buffer[m_pos];
+        if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r')
+            return static_cast<unsigned char>(ch);
+        m_pos++;
+    }
+}
+
+bool JsonReader::accept(char ch)
+{
+    if (peek() != static_cast<unsigned char>(ch))
+        return false;
+    m_pos++;
+    return true;
+}
+
+bool JsonReader::readHex4(unsigned int &value)
+{
+    value = 0;
+    for (int i = 0; i < 4; ++i) {
+        const int ch = get();
+        value <<= 4;
+        if (ch >= '0' && ch <= '9')
+            value |= ch - '0';
+        else if (ch >= 'a' && ch <= 'f')
+            value |= ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F')
+            value |= ch - 'A' + 10;
+        else
+            return false;
+    }
+    return true;
+}
+
+static void appendUtf8(std::string &output, unsigned int cp)
+{
+    if (cp < 0x80) {
+        output.push_back(cp);
+    } else if (cp < 0x800) {
+        output.push_back(0xC0 | (cp >> 6));
+        output.push_back(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        output.push_back(0xE0 | (cp >> 12));
+        output.push_back(0x80 | ((cp >> 6) & 0x3F));
+        output.push_back(0x80 | (cp & 0x3F));
+    } else {
+        output.push_back(0xF0 | (cp >> 18));
+        output.push_back(0x80 | ((cp >> 12) & 0x3F));
+        output.push_back(0x80 | ((cp >> 6) & 0x3F));
+        output.push_back(0x80 | (cp & 0x3F));
+    }
+}
+
+bool JsonReader::readString(std::string &output)
+{
+    output.clear();
+    if (!accept('"'))
+        return false;
+    while (true) {
+        // Copy the run of plain characters in the buffer at once.
+        const size_t start = m_pos;
+        while (m_pos < m_end && m_buffer[m_pos] != '"' &&
+                m_buffer[m_pos] != '\\')
+            m_pos++;
+        output.append(m_buffer + start, m_pos - start);
+        const int ch = get();
+        if (ch == '"')
+            return true;
+        if (ch == EOF)
+            return false;
+        if (ch != '\\') {
+            // The buffer was empty.
+            output.push_back(ch);
+            continue;
+        }
+        const int escape = get();
+        switch (escape) {
+        case '"':   output.push_back('"'); break;
+        case '\\':  output.push_back('\\'); break;
+        case '/':   output.push_back('/'); break;
+        case 'b':   output.push_back('\b'); break;
+        case 'f':   output.push_back('\f'); break;
+        case 'n':   output.push_back('\n'); break;
+        case 'r':   output.push_back('\r'); break;
+        case 't':   output.push_back('\t'); break;
+        case 'u': {
+            unsigned int cp;
+            if (!readHex4(cp))
+                return false;
+            // Combine a UTF-16 surrogate pair.
+            if (cp >= 0xD800 && cp < 0xDC00) {
+                unsigned int low;
+                if (get() != '\\' || get() != 'u' || !readHex4(low) ||
+                        low < 0xDC00 || low >= 0xE000)
+                    return false;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            }
+            appendUtf8(output, cp);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+}
+
+bool JsonReader::skipLiteral(const char *text)
+{
+    for (; *text != '\0'; ++text) {
+        if (get() != static_cast<unsigned char>(*text))
+            return false;
+    }
+    return true;
+}
+
+bool JsonReader::skipValue()
+{
+    const int ch = peek();
+    if (ch == '"') {
+        std::string temp;
+        return readString(temp);
+    } else if (ch == '[' || ch == '{') {
+        const char close = ch == '[' ? ']' : '}';
+        m_pos++;
+        if (accept(close))
+            return true;
+        do {
+            if (close == '}') {
+                std::string key;
+                if (!readString(key) || !accept(':'))
+                    return false;
+            }
+            if (!skipValue())
+                return false;
+        } while (accept(','));
+        return accept(close);
+    } else if (ch == 't') {
+        return skipLiteral("true");
+    } else if (ch == 'f') {
+        return skipLiteral("false");
+    } else if (ch == 'n') {
+        return skipLiteral("null");
+    } else if (ch == '-' || (ch >= '0' && ch <= '9')) {
+        while (true) {
+            const int next = peek();
+            if (next == EOF || next == '\0' ||
+                    !strchr("+-.0123456789eE", next))
+                return true;
+            m_pos++;
+        }
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Compile database reading
+
+static bool readCompileCommand(
+        JsonReader &reader,
+        CompileCommand &command,
+        std::string &temp)
+{
+    command.directory.clear();
+    command.file.clear();
+    command.arguments.clear();
+    command.inputHashes.clear();
+    if (!reader.accept('{'))
+        return false;
+    if (reader.accept('}'))
+        return true;
+    bool hasArguments = false;
+    do {
+        std::string key;
+        if (!reader.readString(key) || !reader.accept(':'))
+            return false;
+        if (key == "directory") {
+            if (!reader.readString(command.directory))
+                return false;
+        } else if (key == "file") {
+            if (!reader.readString(command.file))
+                return false;
+        } else if (key == "arguments") {
+            // The arguments array takes precedence over the command string.
+            hasArguments = true;
+            command.arguments.clear();
+            if (!reader.accept('['))
+                return false;
+            if (!reader.accept(']')) {
+                do {
+                    if (!reader.readString(temp))
+                        return false;
+                    command.arguments.push_back(temp);
+                } while (reader.accept(','));
+                if (!reader.accept(']'))
+                    return false;
+            }
+        } else if (key == "command" && !hasArguments) {
+            if (!reader.readString(temp))
+                return false;
+            command.arguments = splitShellCommandLine(temp);
+        } else if (key == "input-hashes") {
+            if (!reader.accept('{'))
+                return false;
+            if (!reader.accept('}')) {
+                do {
+                    std::string path;
+                    if (!reader.readString(path) || !reader.accept(':') ||
+                            !reader.readString(temp))
+                        return false;
+                    command.inputHashes.push_back(
+                                std::make_pair(std::move(path), temp));
+                } while (reader.accept(','));
+                if (!reader.accept('}'))
+                    return false;
+            }
+        } else {
+            if (!reader.skipValue())
+                return false;
+        }
+    } while (reader.accept(','));
+    return reader.accept('}');
+}
+
+bool readCompileDatabase(
+        const std::string &path,
+        const std::function<void(CompileCommand &command)> &callback)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+        return false;
+    std::unique_ptr<JsonReader> reader(new JsonReader(fp));
+    CompileCommand command;
+    std::string temp;
+    bool success = reader->accept('[');
+    if (success && !reader->accept(']')) {
+        do {
+            success = readCompileCommand(*reader, command, temp);
+            if (!success)
+                break;
+            callback(command);
+        } while (reader->accept(','));
+        success = success && reader->accept(']');
+    }
+    success = success && reader->peek() == EOF;
+    fclose(fp);
+    return success;
+}
+
+// Split a command line into words the way a POSIX shell would, without any
+// expansions.  Single quotes preserve everything up to the closing quote.
+// Within double quotes, a backslash only escapes $, `, ", \, and newline.
+// Elsewhere, a backslash escapes any character, and a backslash-newline pair
+// is removed.
+std::vector<std::string> splitShellCommandLine(const std::string &commandLine)
+{
+    std::vector<std::string> result;
+    std::string word;
+    bool inWord = false;
+    const size_t size = commandLine.size();
+    for (size_t i = 0; i < size; ++i) {
+        const char ch = commandLine[i];
+        if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
+            if (inWord) {
+                result.push_back(word);
+                word.clear();
+                inWord = false;
+            }
+        } else if (ch == '\'') {
+            inWord = true;
+            size_t end = commandLine.find('\'', i + 1);
+            if (end == std::string::npos)
+                end = size;
+            word.append(commandLine, i + 1, end - i - 1);
+            i = end;
+        } else if (ch == '"') {
+            inWord = true;
+            for (++i; i < size && commandLine[i] != '"'; ++i) {
+                if (commandLine[i] == '\\' && i + 1 < size &&
+                        commandLine[i + 1] != '\0' &&
+                        strchr("$`\"\\\n", commandLine[i + 1])) {
+                    ++i;
+                    if (commandLine[i] == '\n')
+                        continue;
+                }
+                word.push_back(commandLine[i]);
+            }
+        } else if (ch == '\\') {
+            if (i + 1 < size) {
+                ++i;
+                if (commandLine[i] != '\n') {
+                    inWord = true;
+                    word.push_back(commandLine[i]);
+                }
+            }
+        } else {
+            inWord = true;
+            word.push_back(ch);
+        }
+    }
+    if (inWord)
+        result.push_back(word);
+    return result;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// InternedArgv
+
+// The pool's strings are never freed.  An unordered_set never moves its
+// elements, so pointers to them stay valid.
+static std::unordered_set<std::string> &argumentPool()
+{
+    static std::unordered_set<std::string> *pool =
+            new std::unordered_set<std::string>;
+    return *pool;
+}
+
+InternedArgv::InternedArgv(const std::vector<std::string> &argv)
+{
+    std::unordered_set<std::string> &pool = argumentPool();
+    m_args.reserve(argv.size());
+    for (const std::string &arg : argv)
+        m_args.push_back(&*pool.insert(arg).first);
+}
+
+std::vector<std::string> InternedArgv::strings() const
+{
+    std::vector<std::string> result;
+    result.reserve(m_args.size());
+    for (const std::string *arg : m_args)
+        result.push_back(*arg);
+    return result;
+}
+
+} // namespace indexer
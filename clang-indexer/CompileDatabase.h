@@ -0,0 +1,66 @@
+#ifndef INDEXER_COMPILEDATABASE_H
+#define INDEXER_COMPILEDATABASE_H
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace indexer {
+
+// JSON compilation database reading
+//
+// The compile_commands.json files generated for large projects can have
+// hundreds of thousands of entries and more than a gigabyte of flags, so the
+// database is read a token at a time instead of as a JSON document, and each
+// entry is passed to a callback as soon as it is parsed.
+//
+// An entry gives its command line either as a "command" string, which is
+// split into words following the POSIX shell quoting rules, or as an
+// "arguments" array.
+//
+// sw-btrace-to-compiledb can also write an "input-hashes" object, which maps
+// the path of every file the compile read (the source file and its -MD
+// dependencies) to a hash of the file's content as of the build.
+
+struct CompileCommand {
+    std::string directory;
+    std::string file;
+    std::vector<std::string> arguments;
+    std::vector<std::pair<std::string, std::string> > inputHashes;
+};
+
+// Returns false if the file cannot be read or is not a compile database.  The
+// entries preceding a syntax error have already been passed to the callback.
+bool readCompileDatabase(
+        const std::string &path,
+        const std::function<void(CompileCommand &command)> &callback);
+
+std::vector<std::string> splitShellCommandLine(const std::string &commandLine);
+
+
+///////////////////////////////////////////////////////////////////////////////
+// InternedArgv
+
+// A command line whose strings are interned in a process-wide pool.  The TUs
+// of a project mostly share their flags, so each distinct argument is stored
+// once, and a TU's command line costs a pointer per argument.  The pool is
+// not thread-safe, so InternedArgv objects must only be created on the main
+// thread, but they can be read from any thread.
+class InternedArgv
+{
+public:
+    InternedArgv() {}
+    explicit InternedArgv(const std::vector<std::string> &argv);
+    size_t size() const { return m_args.size(); }
+    bool empty() const { return m_args.empty(); }
+    const std::string &operator[](size_t i) const { return *m_args[i]; }
+    std::vector<std::string> strings() const;
+
+private:
+    std::vector<const std::string*> m_args;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_COMPILEDATABASE_H
@@ -0,0 +1,173 @@
+#include "ContentHash.h"
+
+#include <MurmurHash3.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include <json/json.h>
+
+#include "Util.h"
+
+namespace indexer {
+
+// Version of the hash cache file format.  A file with a different version is
+// ignored.
+const int kHashCacheFileVersion = 1;
+
+const char kCommandHashMetadata[] = "command-hash";
+const char kInputHashesMetadata[] = "input-hashes";
+const char kBuildInputsHashMetadata[] = "build-inputs-hash";
+
+std::string contentHash(const char *data, size_t size)
+{
+    uint64_t hash[2];
+    MurmurHash3_x64_128(data, size, 0, hash);
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx",
+             static_cast<unsigned long long>(hash[0]),
+             static_cast<unsigned long long>(hash[1]));
+    return buf;
+}
+
+std::string commandLineHash(
+        const std::string &workingDirectory,
+        const std::vector<std::string> &argv)
+{
+    std::string text = workingDirectory;
+    text.push_back('\0');
+    for (const std::string &arg : argv) {
+        text += arg;
+        text.push_back('\0');
+    }
+    return contentHash(text.data(), text.size());
+}
+
+// The input hashes are stored as one "<hash> <path>" line per file.
+std::string formatInputHashes(
+        const std::vector<std::pair<std::string, std::string> > &inputs)
+{
+    std::string text;
+    for (const auto &input : inputs) {
+        text += input.second;
+        text += ' ';
+        text += input.first;
+        text += '\n';
+    }
+    return text;
+}
+
+bool parseInputHashes(
+        const std::string &text,
+        std::vector<std::pair<std::string, std::string> > &inputs)
+{
+    inputs.clear();
+    std::istringstream stream(text);
+    std::string line;
+    while (std::getline(stream, line)) {
+        const size_t space = line.find(' ');
+        if (space == std::string::npos)
+            return false;
+        inputs.push_back(std::make_pair(line.substr(space + 1),
+                                        line.substr(0, space)));
+    }
+    return true;
+}
+
+std::string buildInputsHash(
+        std::vector<std::pair<std::string, std::string> > inputs)
+{
+    if (inputs.empty())
+        return std::string();
+    std::sort(inputs.begin(), inputs.end());
+    const std::string text = formatInputHashes(inputs);
+    return contentHash(text.data(), text.size());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FileHashCache
+
+bool FileHashCache::load(const std::string &path)
+{
+    std::ifstream f(path.c_str());
+    if (!f.good())
+        return false;
+    Json::Reader reader;
+    Json::Value rootJson;
+    if (!reader.parse(f, rootJson) ||
+            !rootJson.isObject() ||
+            rootJson["version"].asInt() != kHashCacheFileVersion)
+        return false;
+
+    const Json::Value &filesJson = rootJson["files"];
+    if (!filesJson.isObject())
+        return false;
+    for (Json::ValueIterator it = filesJson.begin(), itEnd = filesJson.end();
+            it != itEnd; ++it) {
+        const Json::Value &fileJson = *it;
+        Entry entry;
+        entry.modTime = static_cast<time_t>(fileJson["modTime"].asInt64());
+        entry.size = fileJson["size"].asUInt64();
+        entry.hash = fileJson["hash"].asString();
+        m_entries[it.key().asString()] = entry;
+    }
+    return true;
+}
+
+bool FileHashCache::save(const std::string &path) const
+{
+    Json::Value filesJson(Json::objectValue);
+    for (const auto &pair : m_entries) {
+        Json::Value fileJson(Json::objectValue);
+        fileJson["modTime"] = Json::Int64(pair.second.modTime);
+        fileJson["size"] = Json::UInt64(pair.second.size);
+        fileJson["hash"] = pair.second.hash;
+        filesJson[pair.first] = fileJson;
+    }
+    Json::Value rootJson(Json::objectValue);
+    rootJson["version"] = kHashCacheFileVersion;
+    rootJson["files"] = filesJson;
+
+    std::ofstream f(path.c_str());
+    if (!f.good())
+        return false;
+    Json::FastWriter writer;
+    f << writer.write(rootJson);
+    return f.good();
+}
+
+std::string FileHashCache::hash(const std::string &path)
+{
+    uint64_t size = 0;
+    const time_t modTime = getPathModTime(path, &size);
+    if (modTime == kInvalidTime)
+        return std::string();
+    auto it = m_entries.find(path);
+    if (it != m_entries.end() &&
+            it->second.modTime == modTime && it->second.size == size)
+        return it->second.hash;
+
+    std::ifstream f(path.c_str(), std::ios::binary);
+    if (!f.good())
+        return std::string();
+    const std::string content((std::istreambuf_iterator<char>(f)),
+                              std::istreambuf_iterator<char>());
+    Entry entry;
+    entry.modTime = modTime;
+    entry.size = size;
+    entry.hash = contentHash(content.data(), content.size());
+
+    // Modification times have a resolution of one second, so a file modified
+    // in the current second could change again without its time changing.
+    // Don't trust the time of such a file later.
+    if (modTime < time(NULL) - 1)
+        m_entries[path] = entry;
+    else
+        m_entries.erase(path);
+    return entry.hash;
+}
+
+} // namespace indexer
@@ -0,0 +1,79 @@
+#ifndef INDEXER_CONTENTHASH_H
+#define INDEXER_CONTENTHASH_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace indexer {
+
+// Incremental indexing
+//
+// Each idx archive records a hash of the command that produced it (the
+// working directory and the compiler arguments) and a content hash of every
+// file the compiler read.  An --incremental run reuses the archive if the
+// command is unchanged and every input still has the same content, regardless
+// of modification times, so touching a file (e.g. by switching branches and
+// back) does not force a reindex.
+//
+// The hashes are 128-bit MurmurHash3 values, printed as 32 hex digits.
+//
+// A compile database written by sw-btrace-to-compiledb from a trace with
+// --hash-inputs lists each TU's inputs and their hashes as of the build.  The
+// archive then also records a hash of that list, and while the list is
+// unchanged, the archive is reused without hashing its inputs again.  This
+// trusts that the sources haven't changed since the traced build.
+
+std::string contentHash(const char *data, size_t size);
+std::string commandLineHash(
+        const std::string &workingDirectory,
+        const std::vector<std::string> &argv);
+
+// Archive metadata keys.
+extern const char kCommandHashMetadata[];
+extern const char kInputHashesMetadata[];
+extern const char kBuildInputsHashMetadata[];
+
+std::string formatInputHashes(
+        const std::vector<std::pair<std::string, std::string> > &inputs);
+bool parseInputHashes(
+        const std::string &text,
+        std::vector<std::pair<std::string, std::string> > &inputs);
+
+// A hash of a compile database entry's input-hashes, independent of their
+// order.  Returns an empty string for an empty list.
+std::string buildInputsHash(
+        std::vector<std::pair<std::string, std::string> > inputs);
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FileHashCache
+
+// Remembers the content hash of each file along with the file's modification
+// time and size, so unchanged files are not read again.  The cache is saved
+// between --index-project runs.
+class FileHashCache
+{
+public:
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+
+    // Returns an empty string if the file can't be read.
+    std::string hash(const std::string &path);
+
+private:
+    struct Entry {
+        time_t modTime;
+        uint64_t size;
+        std::string hash;
+    };
+
+    std::unordered_map<std::string, Entry> m_entries;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_CONTENTHASH_H
@@ -0,0 +1,164 @@
+#include "CostModel.h"
+
+#include <fstream>
+#include <string>
+
+#include <json/json.h>
+
+#include "Util.h"
+
+namespace indexer {
+
+// Version of the stats file format.  A file with a different version is
+// ignored.
+const int kStatsFileVersion = 1;
+
+// Each #include line is weighted as much as this many kilobytes of source
+// text.  The value is a rough guess; only the relative order of the
+// predictions matters much, and it is only used for TUs without history.
+const double kIncludeWeightKB = 8.0;
+
+CostModel::CostModel() :
+    m_averagesValid(false),
+    m_secondsPerHeuristicUnit(1.0),
+    m_averagePeakMemoryKB(0)
+{
+}
+
+// Read the stats recorded by an earlier run.  Returns false if the file does
+// not exist or cannot be parsed, in which case the model is left empty.
+bool CostModel::load(const std::string &path)
+{
+    std::ifstream f(path.c_str());
+    if (!f.good())
+        return false;
+    Json::Reader reader;
+    Json::Value rootJson;
+    if (!reader.parse(f, rootJson) ||
+            !rootJson.isObject() ||
+            rootJson["version"].asInt() != kStatsFileVersion)
+        return false;
+
+    const Json::Value &tusJson = rootJson["translationUnits"];
+    if (!tusJson.isObject())
+        return false;
+    for (Json::ValueIterator it = tusJson.begin(), itEnd = tusJson.end();
+            it != itEnd; ++it) {
+        const Json::Value &tuJson = *it;
+        TUStats stats;
+        stats.seconds = tuJson["seconds"].asDouble();
+        stats.peakMemoryKB = tuJson["peakMemoryKB"].asUInt64();
+        stats.outputBytes = tuJson["outputBytes"].asUInt64();
+        stats.sizeHeuristic = tuJson["sizeHeuristic"].asDouble();
+        m_stats[it.key().asString()] = stats;
+    }
+    m_averagesValid = false;
+    return true;
+}
+
+bool CostModel::save(const std::string &path) const
+{
+    Json::Value tusJson(Json::objectValue);
+    for (const auto &pair : m_stats) {
+        Json::Value tuJson(Json::objectValue);
+        tuJson["seconds"] = pair.second.seconds;
+        tuJson["peakMemoryKB"] = Json::UInt64(pair.second.peakMemoryKB);
+        tuJson["outputBytes"] = Json::UInt64(pair.second.outputBytes);
+        tuJson["sizeHeuristic"] = pair.second.sizeHeuristic;
+        tusJson[pair.first] = tuJson;
+    }
+    Json::Value rootJson(Json::objectValue);
+    rootJson["version"] = kStatsFileVersion;
+    rootJson["translationUnits"] = tusJson;
+
+    std::ofstream f(path.c_str());
+    if (!f.good())
+        return false;
+    Json::StyledStreamWriter writer;
+    writer.write(f, rootJson);
+    return f.good();
+}
+
+const TUStats *CostModel::lookup(const std::string &sourcePath) const
+{
+    auto it = m_stats.find(sourcePath);
+    return (it != m_stats.end()) ? &it->second : NULL;
+}
+
+void CostModel::record(const std::string &sourcePath, const TUStats &stats)
+{
+    m_stats[sourcePath] = stats;
+    m_averagesValid = false;
+}
+
+// Predict the number of seconds needed to index the TU.  Recorded TUs use
+// their last measured time.  For other TUs, the time is extrapolated from the
+// TU's current sizeHeuristic value.
+double CostModel::predictSeconds(
+        const std::string &sourcePath,
+        double sizeHeuristic)
+{
+    const TUStats *stats = lookup(sourcePath);
+    if (stats != NULL)
+        return stats->seconds;
+    computeAverages();
+    return sizeHeuristic * m_secondsPerHeuristicUnit;
+}
+
+// Predict the peak memory usage of the daemon while indexing the TU, or 0 if
+// nothing has been recorded yet.
+uint64_t CostModel::predictPeakMemoryKB(const std::string &sourcePath)
+{
+    const TUStats *stats = lookup(sourcePath);
+    if (stats != NULL)
+        return stats->peakMemoryKB;
+    computeAverages();
+    return m_averagePeakMemoryKB;
+}
+
+// A cheap estimate of the cost of indexing a source file: its size in
+// kilobytes, plus a fixed amount for each #include line.  Only the source file
+// itself is read; included headers are not followed.
+double CostModel::sizeHeuristic(const std::string &sourcePath)
+{
+    std::ifstream f(sourcePath.c_str());
+    if (!f.good())
+        return 0.0;
+    uint64_t byteCount = 0;
+    int includeCount = 0;
+    std::string line;
+    while (std::getline(f, line)) {
+        byteCount += line.size() + 1;
+        size_t pos = line.find_first_not_of(" \t");
+        if (pos == std::string::npos || line[pos] != '#')
+            continue;
+        pos = line.find_first_not_of(" \t", pos + 1);
+        if (pos != std::string::npos &&
+                line.compare(pos, 7, "include") == 0)
+            includeCount++;
+    }
+    return byteCount / 1024.0 + includeCount * kIncludeWeightKB;
+}
+
+void CostModel::computeAverages()
+{
+    if (m_averagesValid)
+        return;
+    double totalSeconds = 0.0;
+    double totalHeuristic = 0.0;
+    uint64_t totalPeakMemoryKB = 0;
+    for (const auto &pair : m_stats) {
+        totalPeakMemoryKB += pair.second.peakMemoryKB;
+        if (pair.second.sizeHeuristic > 0.0) {
+            totalSeconds += pair.second.seconds;
+            totalHeuristic += pair.second.sizeHeuristic;
+        }
+    }
+    m_secondsPerHeuristicUnit =
+            (totalHeuristic > 0.0) ? totalSeconds / totalHeuristic : 1.0;
+    m_averagePeakMemoryKB =
+            m_stats.empty() ? 0 : totalPeakMemoryKB / m_stats.size();
+    m_averagesValid = true;
+}
+
+} // namespace indexer
@@ -0,0 +1,53 @@
+#ifndef INDEXER_COSTMODEL_H
+#define INDEXER_COSTMODEL_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+namespace indexer {
+
+// Measurements recorded for a translation unit the last time it was indexed.
+struct TUStats {
+    TUStats() :
+        seconds(0), peakMemoryKB(0), outputBytes(0), sizeHeuristic(0) {}
+    double seconds;         // Wall-clock time spent indexing the TU.
+    uint64_t peakMemoryKB;  // Peak RSS of the daemon while indexing it.
+    uint64_t outputBytes;   // Size of the TU's idx archive.
+    double sizeHeuristic;   // sizeHeuristic() of the source file at the time.
+};
+
+// The cost model predicts how expensive each translation unit is to index,
+// using the stats recorded by earlier --index-project runs.  indexProject
+// starts the most expensive TUs first (longest-processing-time-first
+// scheduling), so that a few huge TUs do not start late and stretch out the
+// end of the job.
+//
+// A TU that has never been indexed is estimated from the size of its source
+// file and its number of #include lines.  The estimate is converted to
+// seconds using the ratio observed over the recorded TUs.  Its memory usage
+// is estimated as the average over the recorded TUs.
+class CostModel
+{
+public:
+    CostModel();
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+    const TUStats *lookup(const std::string &sourcePath) const;
+    void record(const std::string &sourcePath, const TUStats &stats);
+    double predictSeconds(const std::string &sourcePath, double sizeHeuristic);
+    uint64_t predictPeakMemoryKB(const std::string &sourcePath);
+    static double sizeHeuristic(const std::string &sourcePath);
+
+private:
+    void computeAverages();
+
+    std::unordered_map<std::string, TUStats> m_stats;
+    bool m_averagesValid;
+    double m_secondsPerHeuristicUnit;
+    uint64_t m_averagePeakMemoryKB;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_COSTMODEL_H
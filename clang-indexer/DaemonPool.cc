@@ -1,92 +1,449 @@
 #include "DaemonPool.h"
 
 #include <QCoreApplication>
+#include <QThread>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
 
+#if !defined(_WIN32)
+#include <signal.h>
+#endif
+
+#include "HeaderRegistry.h"
 #include "Process.h"
+#include "Trace.h"
 #include "Util.h"
 
 namespace indexer {
 
+// No job has timed out on the daemon.
+const uint64_t kNoJob = static_cast<uint64_t>(-1);
+
+// How often the watchdog looks for jobs that have run too long.
+const int kWatchdogIntervalMS = 1000;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Daemon
 
-Daemon::Daemon()
+Daemon::Daemon(const std::vector<std::string> &extraArgs) :
+    m_nextJobId(0),
+    m_readerJobId(0),
+    m_readerStartTime(0),
+    m_failed(false),
+    m_timedOutJobId(kNoJob),
+    m_lastPeakMemoryKB(0),
+    m_queuedJobCount(0),
+    m_assignedJobCount(0),
+    m_retiring(false),
+    m_memoryKB(0),
+    m_chargeKB(0)
 {
     std::string program =
             QCoreApplication::instance()->applicationFilePath().toStdString();
     std::vector<std::string> args;
     args.push_back("--daemon");
+    args.insert(args.end(), extraArgs.begin(), extraArgs.end());
     m_process = new Process(program, args);
 }
 
+// Closing the daemon's stdin tells it to exit.
 Daemon::~Daemon()
 {
-    fprintf(m_process->stdoutFile(), "\n");
     delete m_process;
 }
 
 int Daemon::run(
         const std::string &workingDirectory,
-        const std::vector<std::string> &args)
+        const std::vector<std::string> &args,
+        DaemonJobStats *stats,
+        HeaderRegistry *headerRegistry,
+        DaemonJobOutcome *outcome,
+        std::vector<std::string> *claimedKeys)
 {
     // Send the job.
-    fprintf(m_process->stdinFile(), "%s\n", workingDirectory.c_str());
-    for (const std::string &arg : args) {
-        // TODO: What about embedded newlines in arguments?
-        fprintf(m_process->stdinFile(), "%s\n", arg.c_str());
-    }
-    fprintf(m_process->stdinFile(), "\n");
-    fflush(m_process->stdinFile());
+    QMutexLocker lock(&m_mutex);
+    DaemonJob job;
+    job.id = m_nextJobId++;
+    job.workingDirectory = workingDirectory;
+    job.args = args;
+    DaemonMessage message(DM_Job);
+    addJob(message, job, m_argumentEncoder);
+    if (!m_failed && !message.write(m_process->stdinFile()))
+        m_failed = true;
+    const uint64_t jobId = job.id;
+    if (jobId == m_readerJobId)
+        m_readerStartTime = monotonicSeconds();
 
-    // Wait for completion.
-    while (true) {
-        bool isEof;
-        std::string line = readLine(m_process->stdoutFile(), &isEof);
-        if (isEof) {
-            std::cerr << "sw-clang-indexer: daemon exited unexpectedly"
-                      << std::endl;
-            return 1;
+    // Wait for the earlier jobs to finish, then for this one.
+    while (m_readerJobId != jobId)
+        m_readerChanged.wait(&m_mutex);
+    DaemonJobStats jobStats;
+    DaemonJobOutcome jobOutcome = DJO_Lost;
+    std::vector<std::string> jobClaimedKeys;
+    if (!m_failed) {
+        lock.unlock();
+        const bool success = readReplies(jobId, jobStats, headerRegistry,
+                                         jobClaimedKeys);
+        // Without the job's output, another TU (or a retry of this one) must
+        // index the headers it claimed.
+        if ((!success || jobStats.statusCode != 0) && headerRegistry != NULL) {
+            headerRegistry->release(jobClaimedKeys);
+            jobClaimedKeys.clear();
         }
-        if (stringStartsWith(line, "DONE ")) {
-            return atoi(line.c_str() + 5);
+        lock.relock();
+        if (success) {
+            jobOutcome = DJO_Done;
+        } else {
+            // The daemon may have been killed for an earlier job, just as
+            // it finished.
+            if (m_timedOutJobId == jobId)
+                jobOutcome = DJO_TimedOut;
+            else if (m_timedOutJobId == kNoJob)
+                jobOutcome = DJO_Crashed;
+            m_failed = true;
         }
     }
+    if (jobOutcome == DJO_Done)
+        m_lastPeakMemoryKB = jobStats.peakMemoryKB;
+    m_readerJobId++;
+    m_readerStartTime = monotonicSeconds();
+    m_readerChanged.wakeAll();
+    if (stats != NULL)
+        *stats = jobStats;
+    if (outcome != NULL)
+        *outcome = jobOutcome;
+    if (claimedKeys != NULL)
+        claimedKeys->swap(jobClaimedKeys);
+    return jobOutcome == DJO_Done ? jobStats.statusCode : 1;
+}
+
+// Read the daemon's messages about the job until it is done.  Returns false
+// if the daemon exits or sends something unexpected.  The keys of the headers
+// the job was granted are appended to claimedKeys.
+bool Daemon::readReplies(
+        uint64_t jobId,
+        DaemonJobStats &stats,
+        HeaderRegistry *headerRegistry,
+        std::vector<std::string> &claimedKeys)
+{
+    DaemonMessage message;
+    while (message.read(m_process->stdoutFile())) {
+        if (message.readUInt() != jobId)
+            return false;
+        if (message.type() == DM_Claim) {
+            const std::string key = message.readString();
+            if (message.failed())
+                return false;
+            const bool granted = headerRegistry == NULL ||
+                    headerRegistry->claim(key);
+            if (granted && headerRegistry != NULL)
+                claimedKeys.push_back(key);
+            DaemonMessage reply(DM_ClaimReply);
+            reply.addUInt(granted ? 1 : 0);
+            QMutexLocker lock(&m_mutex);
+            if (!reply.write(m_process->stdinFile()))
+                return false;
+        } else if (message.type() == DM_Done) {
+            stats = readJobStats(message);
+            const uint64_t eventCount = message.readUInt();
+            for (uint64_t i = 0; i < eventCount && !message.failed(); ++i)
+                addTraceEvent(message.readString());
+            return !message.failed();
+        } else {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool Daemon::hasFailed()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_failed;
+}
+
+uint64_t Daemon::lastPeakMemoryKB()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_lastPeakMemoryKB;
+}
+
+// Kill the daemon if its current job started more than timeoutSeconds ago.
+// The job's reader then sees the daemon's output end.  The pool's mutex must
+// be held, so that the daemon isn't being deleted.
+void Daemon::killIfTimedOut(double now, int timeoutSeconds)
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_failed || m_readerJobId == m_nextJobId ||
+            now - m_readerStartTime < timeoutSeconds)
+        return;
+    m_timedOutJobId = m_readerJobId;
+    m_failed = true;
+    m_process->kill();
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////
 // DaemonPool
 
-DaemonPool::DaemonPool()
+DaemonPoolOptions::DaemonPoolOptions() :
+    maxDaemons(QThread::idealThreadCount()),
+    memoryBudgetKB(physicalMemoryKB() / 4 * 3),
+    maxJobsPerDaemon(100),
+    maxDaemonMemoryKB(2 * 1024 * 1024),
+    pipelineDepth(2),
+    jobTimeoutSeconds(1800),
+    maxJobAttempts(3)
+{
+    if (maxDaemons < 1)
+        maxDaemons = 1;
+}
+
+void DaemonPool::WatchdogThread::run()
+{
+    QMutexLocker lock(&m_pool->m_mutex);
+    while (!m_pool->m_stopping) {
+        const double now = monotonicSeconds();
+        for (Daemon *daemon : m_pool->m_liveDaemons)
+            daemon->killIfTimedOut(now, m_pool->m_options.jobTimeoutSeconds);
+        m_pool->m_stopRequested.wait(&m_pool->m_mutex, kWatchdogIntervalMS);
+    }
+}
+
+DaemonPool::DaemonPool(const DaemonPoolOptions &options) :
+    m_options(options),
+    m_busyCount(0),
+    m_reservedMemoryKB(0),
+    m_watchdogThread(this),
+    m_stopping(false)
 {
+    if (m_options.maxDaemons < 1)
+        m_options.maxDaemons = 1;
+    if (m_options.pipelineDepth < 1)
+        m_options.pipelineDepth = 1;
+    if (m_options.maxJobAttempts < 1)
+        m_options.maxJobAttempts = 1;
+#if !defined(_WIN32)
+    // Writing a job to a daemon that has died must not kill the indexer.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    if (m_options.jobTimeoutSeconds > 0)
+        m_watchdogThread.start();
 }
 
 DaemonPool::~DaemonPool()
 {
+    {
+        QMutexLocker lock(&m_mutex);
+        m_stopping = true;
+        m_stopRequested.wakeAll();
+    }
+    m_watchdogThread.wait();
     for (Daemon *daemon : m_daemons)
         delete daemon;
 }
 
-Daemon *DaemonPool::get()
+uint64_t DaemonPool::daemonChargeKB(const Daemon *daemon)
+{
+    if (daemon->m_expectedMemoryKB.empty())
+        return 0;
+    return std::max(daemon->m_memoryKB,
+                    *std::max_element(daemon->m_expectedMemoryKB.begin(),
+                                      daemon->m_expectedMemoryKB.end()));
+}
+
+// Returns the busy daemon with the fewest queued jobs, if it has room for
+// another.  The pool's mutex must be held.
+Daemon *DaemonPool::queueableDaemon()
 {
-    LockGuard<Mutex> lock(m_mutex);
-    if (!m_daemons.empty()) {
-        Daemon *result = m_daemons.back();
-        m_daemons.pop_back();
-        return result;
-    } else {
-        return new Daemon();
+    Daemon *result = NULL;
+    for (Daemon *daemon : m_liveDaemons) {
+        if (daemon->m_retiring ||
+                daemon->m_queuedJobCount >= m_options.pipelineDepth)
+            continue;
+        if (result == NULL ||
+                daemon->m_queuedJobCount < result->m_queuedJobCount)
+            result = daemon;
+    }
+    return result;
+}
+
+Daemon *DaemonPool::get(uint64_t expectedMemoryKB)
+{
+    TraceSpan span("wait for daemon");
+    QMutexLocker lock(&m_mutex);
+    while (true) {
+        Daemon *daemon = NULL;
+        bool startDaemon = false;
+        if (!m_daemons.empty()) {
+            daemon = m_daemons.back();
+        } else if (static_cast<int>(m_liveDaemons.size()) <
+                   m_options.maxDaemons) {
+            startDaemon = true;
+        } else {
+            daemon = queueableDaemon();
+        }
+        uint64_t oldChargeKB = 0;
+        uint64_t newChargeKB = expectedMemoryKB;
+        if (daemon != NULL) {
+            oldChargeKB = daemon->m_chargeKB;
+            newChargeKB = std::max(std::max(oldChargeKB, expectedMemoryKB),
+                                   daemon->m_memoryKB);
+        }
+        const bool admit =
+                m_busyCount == 0 ||
+                ((daemon != NULL || startDaemon) &&
+                 (m_options.memoryBudgetKB == 0 ||
+                  m_reservedMemoryKB - oldChargeKB + newChargeKB <=
+                        m_options.memoryBudgetKB));
+        if (!admit) {
+            m_jobFinished.wait(&m_mutex);
+            continue;
+        }
+        if (startDaemon) {
+            daemon = new Daemon(m_options.daemonArgs);
+            m_liveDaemons.push_back(daemon);
+        } else if (daemon->m_queuedJobCount == 0) {
+            m_daemons.pop_back();
+        }
+        daemon->m_queuedJobCount++;
+        daemon->m_expectedMemoryKB.push_back(expectedMemoryKB);
+        daemon->m_chargeKB = newChargeKB;
+        if (m_options.maxJobsPerDaemon > 0 &&
+                ++daemon->m_assignedJobCount >= m_options.maxJobsPerDaemon)
+            daemon->m_retiring = true;
+        m_reservedMemoryKB += newChargeKB - oldChargeKB;
+        m_busyCount++;
+        return daemon;
     }
 }
 
 void DaemonPool::release(Daemon *daemon)
 {
-    LockGuard<Mutex> lock(m_mutex);
-    m_daemons.push_back(daemon);
+    // Measure the daemon now that the job is done.  (It may have started its
+    // next queued job already.)  Fall back to the peak it reported if the OS
+    // can't tell us about another process.
+    uint64_t memoryKB = daemon->m_process->memoryUsageKB();
+    if (memoryKB == 0)
+        memoryKB = daemon->lastPeakMemoryKB();
+    const bool failed = daemon->hasFailed();
+
+    bool remove = false;
+    {
+        QMutexLocker lock(&m_mutex);
+        daemon->m_memoryKB = memoryKB;
+        daemon->m_queuedJobCount--;
+        daemon->m_expectedMemoryKB.pop_front();
+        m_reservedMemoryKB -= daemon->m_chargeKB;
+        daemon->m_chargeKB = daemonChargeKB(daemon);
+        m_reservedMemoryKB += daemon->m_chargeKB;
+        m_busyCount--;
+        if (failed ||
+                (m_options.maxDaemonMemoryKB > 0 &&
+                 memoryKB > m_options.maxDaemonMemoryKB))
+            daemon->m_retiring = true;
+        if (daemon->m_queuedJobCount == 0) {
+            if (daemon->m_retiring) {
+                m_liveDaemons.erase(std::find(m_liveDaemons.begin(),
+                                              m_liveDaemons.end(), daemon));
+                remove = true;
+            } else {
+                m_daemons.push_back(daemon);
+            }
+        }
+        m_jobFinished.wakeAll();
+    }
+    if (remove)
+        delete daemon;
+}
+
+int DaemonPool::run(
+        Daemon *daemon,
+        const std::string &label,
+        const std::string &workingDirectory,
+        const std::vector<std::string> &args,
+        uint64_t expectedMemoryKB,
+        DaemonJobStats *stats,
+        HeaderRegistry *headerRegistry,
+        std::vector<std::string> *claimedKeys)
+{
+    DaemonJobProblem problem;
+    problem.label = label;
+    int statusCode;
+    while (true) {
+        DaemonJobOutcome outcome;
+        statusCode = daemon->run(workingDirectory, args, stats,
+                                 headerRegistry, &outcome, claimedKeys);
+        release(daemon);
+        if (outcome == DJO_Done)
+            problem.succeeded = true;
+        if (outcome == DJO_Crashed) {
+            problem.crashCount++;
+            std::cerr << "warning: " << label << ": the indexer daemon crashed"
+                      << std::endl;
+        } else if (outcome == DJO_TimedOut) {
+            problem.timedOut = true;
+            std::cerr << "warning: " << label << ": killed the indexer daemon "
+                      << "after " << m_options.jobTimeoutSeconds
+                      << " seconds" << std::endl;
+        }
+        if (outcome == DJO_Done || outcome == DJO_TimedOut ||
+                problem.crashCount >= m_options.maxJobAttempts)
+            break;
+        TraceSpan span("retry job", label);
+        daemon = get(expectedMemoryKB);
+    }
+    if (problem.crashCount > 0 || problem.timedOut) {
+        QMutexLocker lock(&m_mutex);
+        m_problems.push_back(problem);
+    }
+    return statusCode;
+}
+
+std::vector<DaemonJobProblem> DaemonPool::problems()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_problems;
+}
+
+DaemonPoolStatus DaemonPool::status()
+{
+    QMutexLocker lock(&m_mutex);
+    DaemonPoolStatus result;
+    result.daemonCount = m_liveDaemons.size();
+    result.busyCount = m_liveDaemons.size() - m_daemons.size();
+    for (Daemon *daemon : m_liveDaemons) {
+        const uint64_t residentKB = daemon->m_process->memoryUsageKB();
+        result.residentKB += residentKB != 0 ? residentKB : daemon->m_memoryKB;
+    }
+    return result;
+}
+
+void reportJobProblems(const std::vector<DaemonJobProblem> &problems)
+{
+    if (problems.empty())
+        return;
+    int failedCount = 0;
+    for (const DaemonJobProblem &problem : problems) {
+        if (!problem.succeeded)
+            failedCount++;
+    }
+    std::cerr << "warning: " << problems.size() << " job(s) crashed or timed "
+              << "out, and " << failedCount << " of them failed:" << std::endl;
+    for (const DaemonJobProblem &problem : problems) {
+        std::cerr << "    " << problem.label << ": ";
+        if (problem.crashCount > 0)
+            std::cerr << "crashed " << problem.crashCount << " time(s)";
+        if (problem.crashCount > 0 && problem.timedOut)
+            std::cerr << ", ";
+        if (problem.timedOut)
+            std::cerr << "timed out";
+        std::cerr << (problem.succeeded ? ", then succeeded" : ", failed")
+                  << std::endl;
+    }
 }
 
 } // namespace indexer
@@ -1,49 +1,191 @@
 #ifndef INDEXER_DAEMONPOOL_H
 #define INDEXER_DAEMONPOOL_H
 
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <stdint.h>
+#include <deque>
 #include <string>
 #include <vector>
 
-#include "Mutex.h"
+#include "DaemonProtocol.h"
 
 namespace indexer {
 
+class HeaderRegistry;
 class Process;
 
 
 ///////////////////////////////////////////////////////////////////////////////
 // Daemon
 
+// How a job ended on its daemon.  A daemon that crashes (or is killed) fails
+// its current job and the jobs queued behind it, which are lost without
+// having started.
+enum DaemonJobOutcome {
+    DJO_Done,           // The daemon finished the job.  See its status code.
+    DJO_Crashed,        // The daemon died while running the job.
+    DJO_TimedOut,       // The daemon was killed for taking too long on it.
+    DJO_Lost            // The daemon died before starting the job.
+};
+
+// Several threads can run jobs on a daemon at once.  Each sends its job right
+// away, so the daemon has the next job as soon as it finishes one, and then
+// waits for the earlier jobs' replies to be read before reading its own.
 class Daemon
 {
     friend class DaemonPool;
 private:
-    Daemon();
+    Daemon(const std::vector<std::string> &extraArgs);
     ~Daemon();
 public:
     int run(const std::string &workingDirectory,
-            const std::vector<std::string> &args);
+            const std::vector<std::string> &args,
+            DaemonJobStats *stats=NULL,
+            HeaderRegistry *headerRegistry=NULL,
+            DaemonJobOutcome *outcome=NULL,
+            std::vector<std::string> *claimedKeys=NULL);
 private:
+    bool readReplies(uint64_t jobId,
+                     DaemonJobStats &stats,
+                     HeaderRegistry *headerRegistry,
+                     std::vector<std::string> &claimedKeys);
+    bool hasFailed();
+    uint64_t lastPeakMemoryKB();
+    void killIfTimedOut(double now, int timeoutSeconds);
+
     Process *m_process;
+
+    // m_mutex serializes the writes to the daemon and guards these fields.
+    QMutex m_mutex;
+    QWaitCondition m_readerChanged;
+    ArgumentEncoder m_argumentEncoder;
+    uint64_t m_nextJobId;
+    uint64_t m_readerJobId;     // The job whose replies are being read.
+    double m_readerStartTime;   // When the daemon started that job.
+    bool m_failed;
+    uint64_t m_timedOutJobId;   // The job the pool killed the daemon for.
+    uint64_t m_lastPeakMemoryKB;
+
+    // These fields are guarded by the pool's mutex.
+    int m_queuedJobCount;
+    int m_assignedJobCount;
+    bool m_retiring;
+    uint64_t m_memoryKB;
+    std::deque<uint64_t> m_expectedMemoryKB;    // One per queued job.
+    uint64_t m_chargeKB;
 };
 
 
 ///////////////////////////////////////////////////////////////////////////////
 // DaemonPool
 
+struct DaemonPoolOptions {
+    DaemonPoolOptions();
+    int maxDaemons;                 // Maximum number of daemons running jobs.
+    uint64_t memoryBudgetKB;        // 0 for no budget.
+    int maxJobsPerDaemon;           // 0 for no limit.
+    uint64_t maxDaemonMemoryKB;     // 0 for no limit.
+    int pipelineDepth;              // Jobs queued on a daemon at once.
+    int jobTimeoutSeconds;          // 0 for no limit.
+    int maxJobAttempts;             // Runs of a job whose daemon crashes.
+    std::vector<std::string> daemonArgs;    // Extra --daemon arguments.
+};
+
+// A snapshot of the pool for progress reporting.
+struct DaemonPoolStatus {
+    DaemonPoolStatus() : daemonCount(0), busyCount(0), residentKB(0) {}
+    int daemonCount;
+    int busyCount;          // Daemons with a job.
+    uint64_t residentKB;    // Total resident set size of the daemons.
+};
+
+// A job that crashed its daemon or timed out, for the end-of-run report.
+struct DaemonJobProblem {
+    DaemonJobProblem() : crashCount(0), timedOut(false), succeeded(false) {}
+    std::string label;
+    int crashCount;
+    bool timedOut;
+    bool succeeded;     // Whether a later attempt finished the job.
+};
+
+// The pool limits both the number of concurrent jobs and their estimated
+// total memory usage.  get() blocks until the job is admitted.  A daemon is
+// charged the largest of its queued jobs' estimates and its resident set size
+// measured after its previous job.  A job is always admitted when no other
+// job is running, so a TU larger than the whole budget still runs, just on
+// its own.
+//
+// get() prefers an idle daemon, then a new one, and once there are maxDaemons
+// daemons, it queues the job behind the jobs of the least busy daemon with
+// fewer than pipelineDepth of them.  The queued jobs of a daemon run one at a
+// time, so queueing a job only adds to the daemon's charge if its estimate is
+// the largest.
+//
+// A daemon accumulates state across jobs, so the pool replaces it after
+// maxJobsPerDaemon jobs or once its resident set exceeds maxDaemonMemoryKB.
+// A daemon that dies is replaced too.
+//
+// run() runs a job on a daemon from get() and releases it.  If the daemon
+// crashes on the job, the job runs again on another daemon, up to
+// maxJobAttempts times in all, and jobs lost behind it run again without
+// counting as an attempt.  With a jobTimeoutSeconds limit, a watchdog thread
+// kills a daemon that has spent longer than that on one job.  A timed-out job
+// isn't retried, because it would most likely time out again.  The pool
+// remembers the jobs that crashed or timed out, for a report at the end.
+//
+// With a HeaderRegistry, a job's header claims only stand if it finishes with
+// a zero status.  Otherwise they are released, so that another TU indexes the
+// headers.  run() returns the claims of a successful job in claimedKeys, for
+// a caller that may still discard the job's output.
 class DaemonPool
 {
 public:
-    DaemonPool();
+    DaemonPool(const DaemonPoolOptions &options=DaemonPoolOptions());
     ~DaemonPool();
-    Daemon *get();
+    Daemon *get(uint64_t expectedMemoryKB=0);
     void release(Daemon *daemon);
+    int run(Daemon *daemon,
+            const std::string &label,
+            const std::string &workingDirectory,
+            const std::vector<std::string> &args,
+            uint64_t expectedMemoryKB=0,
+            DaemonJobStats *stats=NULL,
+            HeaderRegistry *headerRegistry=NULL,
+            std::vector<std::string> *claimedKeys=NULL);
+    DaemonPoolStatus status();
+    std::vector<DaemonJobProblem> problems();
 
 private:
-    Mutex m_mutex;
-    std::vector<Daemon*> m_daemons;
+    class WatchdogThread : public QThread {
+    public:
+        WatchdogThread(DaemonPool *pool) : m_pool(pool) {}
+    protected:
+        void run();
+    private:
+        DaemonPool *m_pool;
+    };
+
+    Daemon *queueableDaemon();
+    static uint64_t daemonChargeKB(const Daemon *daemon);
+
+    DaemonPoolOptions m_options;
+    QMutex m_mutex;
+    QWaitCondition m_jobFinished;
+    std::vector<Daemon*> m_daemons;       // Idle daemons.
+    std::vector<Daemon*> m_liveDaemons;   // Idle and busy daemons.
+    int m_busyCount;                      // Queued jobs.
+    uint64_t m_reservedMemoryKB;
+    WatchdogThread m_watchdogThread;
+    QWaitCondition m_stopRequested;
+    bool m_stopping;
+    std::vector<DaemonJobProblem> m_problems;
 };
 
+// Print the jobs that crashed or timed out to stderr.
+void reportJobProblems(const std::vector<DaemonJobProblem> &problems);
+
 } // namespace indexer
 
 #endif // INDEXER_DAEMONPOOL_H
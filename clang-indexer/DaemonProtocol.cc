@@ -0,0 +1,265 @@
+#include "DaemonProtocol.h"
+
+#include <cstdlib>
+#include <iostream>
+
+namespace indexer {
+
+// Larger sizes mean the stream is out of sync.
+const uint32_t kMaxMessageSize = 256 * 1024 * 1024;
+
+// A Result carries a whole TU's index archive, which can exceed the usual
+// limit, so it may use any size that the header can hold.
+const uint32_t kMaxResultMessageSize = UINT32_MAX;
+
+uint32_t maxMessageSize(int type)
+{
+    return type == DM_Result ? kMaxResultMessageSize : kMaxMessageSize;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DaemonMessage
+
+void DaemonMessage::addUInt(uint64_t value)
+{
+    while (value >= 0x80) {
+        m_payload.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    m_payload.push_back(static_cast<char>(value));
+}
+
+void DaemonMessage::addString(const std::string &str)
+{
+    addUInt(str.size());
+    m_payload += str;
+}
+
+uint64_t DaemonMessage::readUInt()
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (m_pos >= m_payload.size())
+            break;
+        const unsigned char byte = m_payload[m_pos++];
+        result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return result;
+    }
+    m_failed = true;
+    return 0;
+}
+
+std::string DaemonMessage::readString()
+{
+    const uint64_t size = readUInt();
+    if (m_failed || size > m_payload.size() - m_pos) {
+        m_failed = true;
+        return std::string();
+    }
+    std::string result(m_payload, m_pos, size);
+    m_pos += size;
+    return result;
+}
+
+bool DaemonMessage::write(FILE *fp) const
+{
+    if (m_payload.size() > maxMessageSize(m_type))
+        return false;
+    const uint32_t size = m_payload.size();
+    const unsigned char header[5] = {
+        static_cast<unsigned char>(size),
+        static_cast<unsigned char>(size >> 8),
+        static_cast<unsigned char>(size >> 16),
+        static_cast<unsigned char>(size >> 24),
+        static_cast<unsigned char>(m_type),
+    };
+    return fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+            fwrite(m_payload.data(), 1, size, fp) == size &&
+            fflush(fp) == 0;
+}
+
+bool DaemonMessage::read(FILE *fp)
+{
+    unsigned char header[5];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header))
+        return false;
+    const uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) |
+            (static_cast<uint32_t>(header[3]) << 24);
+    if (size > maxMessageSize(header[4]))
+        return false;
+    m_type = header[4];
+    m_payload.resize(size);
+    m_pos = 0;
+    m_failed = false;
+    return size == 0 || fread(&m_payload[0], 1, size, fp) == size;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DaemonJobStats
+
+void addJobStats(DaemonMessage &message, const DaemonJobStats &stats)
+{
+    message.addUInt(static_cast<uint32_t>(stats.statusCode));
+    message.addUInt(static_cast<uint64_t>(stats.seconds * 1e6));
+    message.addUInt(stats.peakMemoryKB);
+    message.addUInt(stats.refCount);
+    message.addUInt(stats.outputBytes);
+    message.addUInt(stats.errorCount);
+    message.addUInt(stats.warningCount);
+    message.addString(stats.firstError);
+}
+
+DaemonJobStats readJobStats(DaemonMessage &message)
+{
+    DaemonJobStats stats;
+    stats.statusCode = static_cast<int32_t>(message.readUInt());
+    stats.seconds = message.readUInt() / 1e6;
+    stats.peakMemoryKB = message.readUInt();
+    stats.refCount = message.readUInt();
+    stats.outputBytes = message.readUInt();
+    stats.errorCount = message.readUInt();
+    stats.warningCount = message.readUInt();
+    stats.firstError = message.readString();
+    if (message.failed())
+        stats.statusCode = 1;
+    return stats;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ArgumentEncoder
+
+void ArgumentEncoder::add(DaemonMessage &message, const std::string &arg)
+{
+    auto it = m_ids.find(arg);
+    if (it != m_ids.end()) {
+        message.addUInt(it->second << 1);
+        return;
+    }
+    const uint64_t id = m_ids.size();
+    m_ids[arg] = id;
+    message.addUInt(id << 1 | 1);
+    message.addString(arg);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ArgumentDecoder
+
+bool ArgumentDecoder::read(DaemonMessage &message, std::string &arg)
+{
+    const uint64_t ref = message.readUInt();
+    const uint64_t id = ref >> 1;
+    if (ref & 1) {
+        if (id != m_strings.size())
+            return false;
+        m_strings.push_back(message.readString());
+    } else if (id >= m_strings.size()) {
+        return false;
+    }
+    arg = m_strings[id];
+    return !message.failed();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DaemonJob
+
+void addJob(
+        DaemonMessage &message,
+        const DaemonJob &job,
+        ArgumentEncoder &encoder)
+{
+    message.addUInt(job.id);
+    message.addString(job.workingDirectory);
+    message.addUInt(job.args.size());
+    for (const std::string &arg : job.args)
+        encoder.add(message, arg);
+}
+
+bool readJob(DaemonMessage &message, DaemonJob &job, ArgumentDecoder &decoder)
+{
+    job.id = message.readUInt();
+    job.workingDirectory = message.readString();
+    const uint64_t argCount = message.readUInt();
+    job.args.clear();
+    for (uint64_t i = 0; i < argCount && !message.failed(); ++i) {
+        std::string arg;
+        if (!decoder.read(message, arg))
+            return false;
+        job.args.push_back(arg);
+    }
+    return !message.failed();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DaemonChannel
+
+DaemonChannel::DaemonChannel(FILE *input, FILE *output) :
+    m_input(input),
+    m_output(output),
+    m_currentJobId(0)
+{
+}
+
+void DaemonChannel::protocolError(const char *what)
+{
+    std::cerr << "sw-clang-indexer daemon error: " << what << std::endl;
+    exit(1);
+}
+
+bool DaemonChannel::nextJob(DaemonJob &job)
+{
+    if (!m_pendingJobs.empty()) {
+        job = std::move(m_pendingJobs.front());
+        m_pendingJobs.pop_front();
+    } else {
+        DaemonMessage message;
+        if (!message.read(m_input))
+            return false;
+        if (message.type() != DM_Job || !readJob(message, job, m_decoder))
+            protocolError("expected a job");
+    }
+    m_currentJobId = job.id;
+    return true;
+}
+
+bool DaemonChannel::claim(const std::string &key)
+{
+    DaemonMessage request(DM_Claim);
+    request.addUInt(m_currentJobId);
+    request.addString(key);
+    if (!request.write(m_output))
+        protocolError("cannot send a claim");
+    while (true) {
+        DaemonMessage message;
+        if (!message.read(m_input))
+            protocolError("no reply to a claim");
+        if (message.type() == DM_ClaimReply)
+            return message.readUInt() != 0;
+        DaemonJob job;
+        if (message.type() != DM_Job || !readJob(message, job, m_decoder))
+            protocolError("expected a claim reply");
+        m_pendingJobs.push_back(std::move(job));
+    }
+}
+
+void DaemonChannel::finishJob(
+        const DaemonJobStats &stats,
+        const std::vector<std::string> &traceEvents)
+{
+    DaemonMessage message(DM_Done);
+    message.addUInt(m_currentJobId);
+    addJobStats(message, stats);
+    message.addUInt(traceEvents.size());
+    for (const std::string &event : traceEvents)
+        message.addString(event);
+    if (!message.write(m_output))
+        protocolError("cannot send a job's status");
+}
+
+} // namespace indexer
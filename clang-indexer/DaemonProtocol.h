@@ -0,0 +1,165 @@
+#ifndef INDEXER_DAEMONPROTOCOL_H
+#define INDEXER_DAEMONPROTOCOL_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace indexer {
+
+// Daemon protocol
+//
+// The parent process and a daemon exchange messages over the daemon's stdin
+// and stdout.  A message is a 4-byte little-endian payload size, a type byte,
+// and the payload.  Integers in the payload are unsigned LEB128 varints, and
+// a string is its size followed by its bytes, so arguments can contain any
+// byte, newlines included.
+//
+// Parent to daemon:
+//
+//     Job         job-id, working-directory, arg-count, args...
+//     ClaimReply  granted (0 or 1)
+//
+// Daemon to parent:
+//
+//     Claim       job-id, key
+//     Done        job-id, DaemonJobStats fields, trace-event-count, events...
+//
+// The arguments of a Job are interned for the life of the daemon.  An
+// argument is sent as (id << 1 | 1) followed by the string the first time,
+// and as (id << 1) afterwards.  Most arguments repeat across a project's
+// TUs, so after the first job, a command line costs a byte or two per
+// argument.
+//
+// The parent can queue several jobs before the first one finishes.  The
+// daemon runs them in order.  While it waits for a ClaimReply, it reads and
+// queues any Jobs ahead of the reply.  The daemon exits at the end of its
+// stdin.
+
+enum DaemonMessageType {
+    DM_Job = 1,
+    DM_ClaimReply = 2,
+    DM_Claim = 3,
+    DM_Done = 4,
+    // Distributed indexing.  (See Distributed.h.)
+    DM_Hello = 5,
+    DM_Result = 6
+};
+
+// The largest payload that DaemonMessage::read accepts for a message type.
+// write refuses larger payloads.
+uint32_t maxMessageSize(int type);
+
+class DaemonMessage
+{
+public:
+    explicit DaemonMessage(int type=0) : m_type(type), m_pos(0),
+                                         m_failed(false) {}
+    int type() const { return m_type; }
+
+    void addUInt(uint64_t value);
+    void addString(const std::string &str);
+
+    // A read past the end of the payload returns 0 or an empty string and
+    // sets the failed flag.
+    uint64_t readUInt();
+    std::string readString();
+    bool failed() const { return m_failed; }
+    size_t size() const { return m_payload.size(); }
+
+    // Returns false on an I/O error.  write flushes the stream.
+    bool write(FILE *fp) const;
+    // Returns false at the end of the stream or on a truncated message.
+    bool read(FILE *fp);
+
+private:
+    int m_type;
+    std::string m_payload;
+    size_t m_pos;
+    bool m_failed;
+};
+
+// The status of a job, which the daemon sends in its Done message.
+struct DaemonJobStats {
+    DaemonJobStats() :
+        statusCode(1), seconds(0), peakMemoryKB(0), refCount(0),
+        outputBytes(0), errorCount(0), warningCount(0) {}
+    int statusCode;
+    double seconds;
+    uint64_t peakMemoryKB;
+    uint64_t refCount;          // References recorded in the archive.
+    uint64_t outputBytes;       // Size of the archive.
+    uint64_t errorCount;        // Parser diagnostics.
+    uint64_t warningCount;
+    std::string firstError;     // "path:line:column: message"
+};
+
+void addJobStats(DaemonMessage &message, const DaemonJobStats &stats);
+DaemonJobStats readJobStats(DaemonMessage &message);
+
+// The parent's half of the argument interning.  There is one per daemon.
+class ArgumentEncoder
+{
+public:
+    void add(DaemonMessage &message, const std::string &arg);
+private:
+    std::unordered_map<std::string, uint64_t> m_ids;
+};
+
+// The daemon's half.
+class ArgumentDecoder
+{
+public:
+    // Returns false on a malformed or unknown argument.
+    bool read(DaemonMessage &message, std::string &arg);
+private:
+    std::vector<std::string> m_strings;
+};
+
+struct DaemonJob {
+    DaemonJob() : id(0) {}
+    uint64_t id;
+    std::string workingDirectory;
+    std::vector<std::string> args;
+};
+
+void addJob(DaemonMessage &message,
+            const DaemonJob &job,
+            ArgumentEncoder &encoder);
+bool readJob(DaemonMessage &message, DaemonJob &job, ArgumentDecoder &decoder);
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DaemonChannel
+
+// The daemon's end of the protocol.
+class DaemonChannel
+{
+public:
+    DaemonChannel(FILE *input, FILE *output);
+
+    // Returns false at the end of the input.  Exits on a protocol error.
+    bool nextJob(DaemonJob &job);
+
+    // Ask the parent whether the current job should index a header.
+    bool claim(const std::string &key);
+
+    void finishJob(const DaemonJobStats &stats,
+                   const std::vector<std::string> &traceEvents);
+
+private:
+    void protocolError(const char *what);
+
+    FILE *m_input;
+    FILE *m_output;
+    uint64_t m_currentJobId;
+    std::deque<DaemonJob> m_pendingJobs;
+    ArgumentDecoder m_decoder;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_DAEMONPROTOCOL_H
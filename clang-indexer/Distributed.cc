@@ -0,0 +1,642 @@
+#include "Distributed.h"
+
+#include <QTemporaryFile>
+#include <QThreadPool>
+#include <QtConcurrentRun>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+#if !defined(_WIN32)
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "Trace.h"
+#include "Util.h"
+
+namespace indexer {
+
+// A job is given up on after this many workers have left while running it.
+const int kMaxJobAttempts = 3;
+
+// A worker started before its coordinator keeps trying to connect this long.
+const int kConnectTimeoutSeconds = 60;
+
+// A sanity limit on the slots a worker announces.
+const uint64_t kMaxWorkerSlots = 4096;
+
+struct RemoteJob {
+    RemoteJob() : expectedMemoryKB(0), attempts(1), copies(0), startTime(0),
+                  done(false), statusCode(1) {}
+    DaemonJob job;
+    uint64_t expectedMemoryKB;
+    int attempts;           // Times the job was queued.
+    int copies;             // Workers running the job.
+    double startTime;
+    bool done;
+    int statusCode;
+    DaemonJobStats stats;
+    std::string archive;
+};
+
+struct RemoteWorker {
+    class Thread : public QThread {
+    public:
+        Thread(WorkerPool *pool, RemoteWorker *worker) :
+            m_pool(pool), m_worker(worker) {}
+    protected:
+        void run() { m_pool->readWorker(m_worker); }
+    private:
+        WorkerPool *m_pool;
+        RemoteWorker *m_worker;
+    };
+
+    RemoteWorker(WorkerPool *pool, int fd, const std::string &name) :
+        fd(fd), input(NULL), output(NULL), name(name), slotCount(0),
+        abandonedCount(0), thread(pool, this) {}
+
+    int fd;
+    FILE *input;
+    FILE *output;
+    std::string name;
+    int slotCount;                  // 0 until the Hello arrives.
+    std::vector<RemoteJob*> jobs;   // Running jobs.
+    int abandonedCount;             // Running copies of finished jobs.
+    ArgumentEncoder argumentEncoder;
+    Thread thread;
+};
+
+// Split HOST:PORT.  HOST is empty if the address is just a port.
+static bool splitAddress(
+        const std::string &address,
+        std::string &host,
+        std::string &port)
+{
+    const size_t colon = address.rfind(':');
+    host = colon == std::string::npos ? "" : address.substr(0, colon);
+    port = colon == std::string::npos ? address : address.substr(colon + 1);
+    return !port.empty() &&
+            port.find_first_not_of("0123456789") == std::string::npos;
+}
+
+static bool readFileContent(const std::string &path, std::string &content)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+        return false;
+    content.assign(std::istreambuf_iterator<char>(file),
+                   std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+static bool writeFileContent(const std::string &path, const std::string &content)
+{
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(content.data(), content.size());
+    file.close();
+    return !file.fail();
+}
+
+#if !defined(_WIN32)
+
+static void configureSocket(int fd)
+{
+    // Jobs are small messages that should go out right away, and a machine
+    // that drops off the network should eventually read as a disconnection.
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+}
+
+static std::string peerName(const struct sockaddr *addr, socklen_t size)
+{
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    if (getnameinfo(addr, size, host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        return "unknown";
+    return std::string(host) + ":" + port;
+}
+
+// Open a TCP socket bound to, or connected to, the address.  Returns -1 on
+// failure.
+static int openTcpSocket(const std::string &address, bool bindToAddress)
+{
+    std::string host;
+    std::string port;
+    if (!splitAddress(address, host, port)) {
+        std::cerr << "warning: invalid address: " << address << std::endl;
+        return -1;
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = bindToAddress ? AI_PASSIVE : 0;
+    struct addrinfo *addrs = NULL;
+    const int error = getaddrinfo(host.empty() ? NULL : host.c_str(),
+                                  port.c_str(), &hints, &addrs);
+    if (error != 0) {
+        std::cerr << "warning: cannot resolve " << address << ": "
+                  << gai_strerror(error) << std::endl;
+        return -1;
+    }
+    int fd = -1;
+    int savedErrno = 0;
+    for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd == -1) {
+            savedErrno = errno;
+            continue;
+        }
+        if (bindToAddress) {
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+                    ::listen(fd, SOMAXCONN) == 0)
+                break;
+        } else if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            configureSocket(fd);
+            break;
+        }
+        savedErrno = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd == -1 && bindToAddress) {
+        std::cerr << "warning: cannot listen on " << address << ": "
+                  << strerror(savedErrno) << std::endl;
+    }
+    errno = savedErrno;
+    return fd;
+}
+
+#endif // !defined(_WIN32)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// WorkerPool
+
+void WorkerPool::AcceptThread::run()
+{
+    m_pool->acceptWorkers();
+}
+
+WorkerPool::WorkerPool() :
+    m_listenFd(-1),
+    m_acceptThread(this),
+    m_stopping(false),
+    m_nextJobId(0)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+#if !defined(_WIN32)
+    std::vector<RemoteWorker*> workers;
+    {
+        QMutexLocker lock(&m_mutex);
+        m_stopping = true;
+        // Closing the connections tells the workers to exit, and wakes up
+        // the reader threads, which move their workers to m_goneWorkers.
+        for (RemoteWorker *worker : m_workers)
+            shutdown(worker->fd, SHUT_RDWR);
+    }
+    if (m_listenFd != -1) {
+        shutdown(m_listenFd, SHUT_RDWR);
+        m_acceptThread.wait();
+        close(m_listenFd);
+    }
+    QMutexLocker lock(&m_mutex);
+    while (!m_workers.empty()) {
+        RemoteWorker *worker = m_workers.back();
+        lock.unlock();
+        worker->thread.wait();
+        lock.relock();
+    }
+    workers.swap(m_goneWorkers);
+    lock.unlock();
+    for (RemoteWorker *worker : workers) {
+        worker->thread.wait();
+        fclose(worker->input);
+        fclose(worker->output);
+        delete worker;
+    }
+#endif
+}
+
+bool WorkerPool::listen(const std::string &address)
+{
+#if defined(_WIN32)
+    std::cerr << "warning: --listen is not supported on Windows" << std::endl;
+    return false;
+#else
+    m_listenFd = openTcpSocket(address, true);
+    if (m_listenFd == -1)
+        return false;
+    // A worker that goes away mid-write must not kill the coordinator.
+    signal(SIGPIPE, SIG_IGN);
+    m_acceptThread.start();
+    return true;
+#endif
+}
+
+void WorkerPool::acceptWorkers()
+{
+#if !defined(_WIN32)
+    while (true) {
+        struct sockaddr_storage addr;
+        socklen_t addrSize = sizeof(addr);
+        const int fd = accept(m_listenFd,
+                              reinterpret_cast<struct sockaddr*>(&addr),
+                              &addrSize);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            QMutexLocker lock(&m_mutex);
+            if (!m_stopping)
+                perror("warning: accept");
+            return;
+        }
+        configureSocket(fd);
+        RemoteWorker *worker = new RemoteWorker(
+                    this, fd,
+                    peerName(reinterpret_cast<struct sockaddr*>(&addr),
+                             addrSize));
+        worker->input = fdopen(fd, "rb");
+        worker->output = fdopen(dup(fd), "wb");
+        QMutexLocker lock(&m_mutex);
+        if (m_stopping || worker->input == NULL || worker->output == NULL) {
+            lock.unlock();
+            if (worker->input != NULL)
+                fclose(worker->input);
+            else
+                close(fd);
+            if (worker->output != NULL)
+                fclose(worker->output);
+            delete worker;
+            continue;
+        }
+        m_workers.push_back(worker);
+        worker->thread.start();
+    }
+#endif
+}
+
+// The reader thread of a worker.
+void WorkerPool::readWorker(RemoteWorker *worker)
+{
+    DaemonMessage hello;
+    uint64_t slotCount = 0;
+    if (hello.read(worker->input) && hello.type() == DM_Hello)
+        slotCount = std::min<uint64_t>(hello.readUInt(), kMaxWorkerSlots);
+    if (slotCount == 0) {
+        QMutexLocker lock(&m_mutex);
+        if (!m_stopping) {
+            std::cerr << "warning: " << worker->name
+                      << " did not introduce itself as a worker" << std::endl;
+        }
+        removeWorker(worker);
+        return;
+    }
+    std::cout << "Worker " << worker->name << " joined with " << slotCount
+              << " slot(s)" << std::endl;
+    {
+        QMutexLocker lock(&m_mutex);
+        worker->slotCount = slotCount;
+        dispatch();
+    }
+
+    while (true) {
+        DaemonMessage message;
+        if (!message.read(worker->input))
+            break;
+        if (message.type() != DM_Result) {
+            std::cerr << "warning: unexpected message from worker "
+                      << worker->name << std::endl;
+            break;
+        }
+        const uint64_t jobId = message.readUInt();
+        const DaemonJobStats stats = readJobStats(message);
+        std::string archive = message.readString();
+        if (message.failed()) {
+            std::cerr << "warning: malformed result from worker "
+                      << worker->name << std::endl;
+            break;
+        }
+        QMutexLocker lock(&m_mutex);
+        finishJob(worker, jobId, stats, archive);
+    }
+    QMutexLocker lock(&m_mutex);
+    removeWorker(worker);
+}
+
+// Record the first result of a job.  The mutex must be held.
+void WorkerPool::finishJob(
+        RemoteWorker *worker,
+        uint64_t jobId,
+        const DaemonJobStats &stats,
+        std::string &archive)
+{
+    auto it = std::find_if(worker->jobs.begin(), worker->jobs.end(),
+                           [jobId](const RemoteJob *job) {
+        return job->job.id == jobId;
+    });
+    if (it == worker->jobs.end()) {
+        // Another copy of the job finished first.
+        if (worker->abandonedCount > 0)
+            worker->abandonedCount--;
+        dispatch();
+        return;
+    }
+    RemoteJob *job = *it;
+    worker->jobs.erase(it);
+    job->copies--;
+    job->done = true;
+    job->statusCode = stats.statusCode;
+    job->stats = stats;
+    job->archive.swap(archive);
+    // Let the workers running other copies take new jobs once they finish.
+    for (RemoteWorker *other : m_workers) {
+        auto copy = std::find(other->jobs.begin(), other->jobs.end(), job);
+        if (copy != other->jobs.end()) {
+            other->jobs.erase(copy);
+            other->abandonedCount++;
+            job->copies--;
+        }
+    }
+    m_jobFinished.wakeAll();
+    dispatch();
+}
+
+// Forget a disconnected or misbehaving worker, and queue its jobs again.  The
+// mutex must be held.
+void WorkerPool::removeWorker(RemoteWorker *worker)
+{
+    auto it = std::find(m_workers.begin(), m_workers.end(), worker);
+    if (it == m_workers.end())
+        return;
+    m_workers.erase(it);
+    m_goneWorkers.push_back(worker);
+#if !defined(_WIN32)
+    // The worker may still be connected, e.g. after a malformed message.
+    // Closing the connection makes it exit instead of waiting for jobs.
+    shutdown(worker->fd, SHUT_RDWR);
+#endif
+    if (m_stopping)
+        return;
+    if (worker->slotCount > 0) {
+        std::cerr << "warning: worker " << worker->name << " left with "
+                  << worker->jobs.size() << " job(s) running" << std::endl;
+    }
+    for (RemoteJob *job : worker->jobs) {
+        if (--job->copies > 0)
+            continue;
+        if (job->attempts >= kMaxJobAttempts) {
+            std::cerr << "warning: giving up on a job after "
+                      << job->attempts << " attempts" << std::endl;
+            job->done = true;
+            job->statusCode = 1;
+            m_jobFinished.wakeAll();
+        } else {
+            job->attempts++;
+            m_queue.push_front(job);
+        }
+    }
+    worker->jobs.clear();
+    dispatch();
+}
+
+// Send queued jobs to the workers with free slots.  Once the queue is empty,
+// let them steal copies of the running jobs.  The mutex must be held.
+void WorkerPool::dispatch()
+{
+    while (true) {
+        RemoteWorker *worker = NULL;
+        int bestFreeSlots = 0;
+        for (RemoteWorker *candidate : m_workers) {
+            const int freeSlots = candidate->slotCount -
+                    static_cast<int>(candidate->jobs.size()) -
+                    candidate->abandonedCount;
+            if (freeSlots > bestFreeSlots) {
+                worker = candidate;
+                bestFreeSlots = freeSlots;
+            }
+        }
+        if (worker == NULL)
+            return;
+        RemoteJob *job = NULL;
+        if (!m_queue.empty()) {
+            job = m_queue.front();
+            m_queue.pop_front();
+        } else {
+            job = stealableJob(worker);
+            if (job == NULL)
+                return;
+        }
+        sendJob(worker, job);
+    }
+}
+
+// The job that has been running the longest with a single copy, on a worker
+// other than the thief.  The mutex must be held.
+RemoteJob *WorkerPool::stealableJob(const RemoteWorker *thief)
+{
+    RemoteJob *result = NULL;
+    for (RemoteWorker *worker : m_workers) {
+        if (worker == thief)
+            continue;
+        for (RemoteJob *job : worker->jobs) {
+            if (job->copies == 1 &&
+                    (result == NULL || job->startTime < result->startTime))
+                result = job;
+        }
+    }
+    return result;
+}
+
+// The mutex must be held.
+void WorkerPool::sendJob(RemoteWorker *worker, RemoteJob *job)
+{
+    worker->jobs.push_back(job);
+    if (job->copies++ == 0)
+        job->startTime = monotonicSeconds();
+    DaemonMessage message(DM_Job);
+    addJob(message, job->job, worker->argumentEncoder);
+    message.addUInt(job->expectedMemoryKB);
+    if (!message.write(worker->output)) {
+        // The reader thread will see the disconnection, and queue the job
+        // again.
+#if !defined(_WIN32)
+        shutdown(worker->fd, SHUT_RDWR);
+#endif
+    }
+}
+
+int WorkerPool::run(
+        const std::string &workingDirectory,
+        const std::vector<std::string> &args,
+        uint64_t expectedMemoryKB,
+        const std::string &outputPath,
+        DaemonJobStats *stats)
+{
+    RemoteJob job;
+    job.job.workingDirectory = workingDirectory;
+    job.job.args = args;
+    job.expectedMemoryKB = expectedMemoryKB;
+    {
+        TraceSpan span("wait for worker");
+        QMutexLocker lock(&m_mutex);
+        job.job.id = m_nextJobId++;
+        m_queue.push_back(&job);
+        dispatch();
+        while (!job.done)
+            m_jobFinished.wait(&m_mutex);
+    }
+    if (job.statusCode == 0 && !writeFileContent(outputPath, job.archive)) {
+        std::cerr << "warning: cannot write " << outputPath << std::endl;
+        job.statusCode = 1;
+    }
+    if (stats != NULL) {
+        *stats = job.stats;
+        stats->statusCode = job.statusCode;
+    }
+    return job.statusCode;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Worker
+
+namespace {
+
+struct WorkerContext {
+    DaemonPool *daemonPool;
+    FILE *output;
+    QMutex outputMutex;
+};
+
+} // anonymous namespace
+
+static void runRemoteJob(
+        WorkerContext *context,
+        DaemonJob job,
+        uint64_t expectedMemoryKB)
+{
+    DaemonJobStats stats;
+    std::string archive;
+    QTemporaryFile tempFile;
+    if (job.args.size() >= 2 && job.args[0] == "--index-file" &&
+            tempFile.open()) {
+        job.args[1] = tempFile.fileName().toStdString();
+        Daemon *daemon = context->daemonPool->get(expectedMemoryKB);
+        context->daemonPool->run(daemon, "job " + std::to_string(job.id),
+                                 job.workingDirectory, job.args,
+                                 expectedMemoryKB, &stats);
+        if (stats.statusCode == 0 && !readFileContent(job.args[1], archive))
+            stats.statusCode = 1;
+    } else {
+        std::cerr << "sw-clang-indexer worker warning: cannot run job "
+                  << job.id << std::endl;
+    }
+
+    DaemonMessage message(DM_Result);
+    message.addUInt(job.id);
+    addJobStats(message, stats);
+    message.addString(archive);
+    if (message.size() > maxMessageSize(DM_Result)) {
+        // The coordinator would drop the connection, so fail the job instead.
+        std::cerr << "sw-clang-indexer worker warning: the output of job "
+                  << job.id << " is too large to send" << std::endl;
+        stats.statusCode = 1;
+        stats.firstError = "the worker's output is too large to send";
+        message = DaemonMessage(DM_Result);
+        message.addUInt(job.id);
+        addJobStats(message, stats);
+        message.addString(std::string());
+    }
+    QMutexLocker lock(&context->outputMutex);
+    // If the coordinator is gone, the main loop sees the end of its input.
+    message.write(context->output);
+}
+
+int runWorker(const std::string &address, const DaemonPoolOptions &options)
+{
+#if defined(_WIN32)
+    std::cerr << "sw-clang-indexer worker error: --worker is not supported on "
+              << "Windows" << std::endl;
+    return 1;
+#else
+    int fd = -1;
+    const double deadline = monotonicSeconds() + kConnectTimeoutSeconds;
+    while ((fd = openTcpSocket(address, false)) == -1) {
+        if (errno != ECONNREFUSED || monotonicSeconds() > deadline) {
+            std::cerr << "sw-clang-indexer worker error: cannot connect to "
+                      << address << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        sleep(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    FILE *input = fdopen(fd, "rb");
+    FILE *output = fdopen(dup(fd), "wb");
+    if (input == NULL || output == NULL) {
+        perror("sw-clang-indexer worker error: fdopen");
+        return 1;
+    }
+
+    const int slotCount = std::max(1, options.maxDaemons) *
+            std::max(1, options.pipelineDepth);
+    QThreadPool::globalInstance()->setMaxThreadCount(slotCount);
+    DaemonPool daemonPool(options);
+    WorkerContext context;
+    context.daemonPool = &daemonPool;
+    context.output = output;
+    DaemonMessage hello(DM_Hello);
+    hello.addUInt(slotCount);
+    if (!hello.write(output)) {
+        perror("sw-clang-indexer worker error: cannot send hello");
+        return 1;
+    }
+    std::cout << "Connected to " << address << " with " << slotCount
+              << " slot(s)" << std::endl;
+
+    ArgumentDecoder decoder;
+    int status = 0;
+    while (true) {
+        DaemonMessage message;
+        if (!message.read(input))
+            break;
+        DaemonJob job;
+        if (message.type() != DM_Job || !readJob(message, job, decoder)) {
+            std::cerr << "sw-clang-indexer worker error: malformed job"
+                      << std::endl;
+            status = 1;
+            break;
+        }
+        const uint64_t expectedMemoryKB = message.readUInt();
+        QtConcurrent::run(runRemoteJob, &context, job, expectedMemoryKB);
+    }
+    // Let the running jobs finish before closing the connection.  Their
+    // results are dropped if the coordinator is gone.
+    QThreadPool::globalInstance()->waitForDone();
+    fclose(input);
+    fclose(output);
+    reportJobProblems(daemonPool.problems());
+    return status;
+#endif
+}
+
+} // namespace indexer
@@ -0,0 +1,117 @@
+#ifndef INDEXER_DISTRIBUTED_H
+#define INDEXER_DISTRIBUTED_H
+
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "DaemonPool.h"
+#include "DaemonProtocol.h"
+
+namespace indexer {
+
+// Distributed indexing
+//
+// --index-project --listen=[HOST:]PORT makes the indexer a coordinator.
+// Instead of running the TUs on its own daemons, it hands them to worker
+// processes (--worker=HOST:PORT), which connect to it over TCP, possibly from
+// other machines.  A worker runs the jobs on its own daemon pool and sends
+// each idx archive back, and the coordinator merges them as usual.  The
+// workers must see the sources and the compilers at the same paths as the
+// coordinator, e.g. on a shared checkout.
+//
+// Workers can join at any time.  When a worker leaves or dies, its jobs are
+// queued again, at most kMaxJobAttempts times.  Each worker is sent at most as
+// many jobs as it has slots (daemons times pipeline depth).  Once the queue is
+// empty, a worker with a free slot also starts a copy of the longest-running
+// job of another worker, and the first copy to finish wins, so the end of the
+// run isn't held up by one slow or overloaded machine.
+//
+// The messages are DaemonMessages (see DaemonProtocol.h).
+//
+// Worker to coordinator:
+//
+//     Hello       slot-count
+//     Result      job-id, DaemonJobStats fields, archive
+//
+// Coordinator to worker:
+//
+//     Job         job-id, working-directory, arg-count, args...,
+//                 expected-memory-kb
+//
+// The Job's arguments are interned as for a daemon.  They are an --index-file
+// command line, whose output path the worker replaces with its own temporary
+// file.  A Result may be as large as the 4-byte size allows; if the archive
+// doesn't fit, the worker reports the job as failed, without the archive.
+// The worker exits when the coordinator closes the connection, which it also
+// does when the worker sends a malformed message.
+
+struct RemoteJob;
+struct RemoteWorker;
+
+// The coordinator's end.
+class WorkerPool
+{
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    // Start accepting workers.  Returns false if the address can't be bound.
+    bool listen(const std::string &address);
+
+    // Run an --index-file job on a worker, and write its archive to
+    // outputPath.  Blocks until a worker has finished the job.  Returns the
+    // job's status.
+    int run(const std::string &workingDirectory,
+            const std::vector<std::string> &args,
+            uint64_t expectedMemoryKB,
+            const std::string &outputPath,
+            DaemonJobStats *stats=NULL);
+
+    // Disallow copying of this class.
+    WorkerPool(const WorkerPool &other) = delete;
+    WorkerPool &operator=(const WorkerPool &other) = delete;
+
+private:
+    class AcceptThread : public QThread {
+    public:
+        AcceptThread(WorkerPool *pool) : m_pool(pool) {}
+    protected:
+        void run();
+    private:
+        WorkerPool *m_pool;
+    };
+    friend struct RemoteWorker;
+
+    void acceptWorkers();
+    void readWorker(RemoteWorker *worker);
+    void finishJob(RemoteWorker *worker,
+                   uint64_t jobId,
+                   const DaemonJobStats &stats,
+                   std::string &archive);
+    void removeWorker(RemoteWorker *worker);
+    void dispatch();
+    RemoteJob *stealableJob(const RemoteWorker *thief);
+    void sendJob(RemoteWorker *worker, RemoteJob *job);
+
+    int m_listenFd;
+    AcceptThread m_acceptThread;
+    QMutex m_mutex;
+    QWaitCondition m_jobFinished;
+    bool m_stopping;
+    uint64_t m_nextJobId;
+    std::deque<RemoteJob*> m_queue;
+    std::vector<RemoteWorker*> m_workers;       // Connected workers.
+    std::vector<RemoteWorker*> m_goneWorkers;   // Joined by the destructor.
+};
+
+// The worker's end.  Runs the coordinator's jobs until it disconnects.
+int runWorker(const std::string &address, const DaemonPoolOptions &options);
+
+} // namespace indexer
+
+#endif // INDEXER_DISTRIBUTED_H
@@ -0,0 +1,242 @@
+#include "FileCache.h"
+
+#include <clang/Basic/VirtualFileSystem.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/ErrorOr.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Util.h"
+
+namespace indexer {
+
+// Stat results are reused for this many seconds.
+const double kStatCacheSeconds = 30.0;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// CachedFile
+
+class CachedFile : public clang::vfs::File
+{
+public:
+    CachedFile(const clang::vfs::Status &status,
+               std::shared_ptr<const std::string> content) :
+        m_status(status), m_content(content)
+    {
+    }
+
+    llvm::ErrorOr<clang::vfs::Status> status() override { return m_status; }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(
+            const llvm::Twine &name,
+            int64_t fileSize,
+            bool requiresNullTerminator,
+            bool isVolatile) override
+    {
+        // The buffer does not own the content.  The cache keeps the content
+        // alive until the TU is finished.
+        return llvm::MemoryBuffer::getMemBuffer(
+                    llvm::StringRef(m_content->data(), m_content->size()),
+                    name.str(),
+                    requiresNullTerminator);
+    }
+
+    std::error_code close() override { return std::error_code(); }
+
+    void setName(llvm::StringRef name) override { m_status.setName(name); }
+
+private:
+    clang::vfs::Status m_status;
+    std::shared_ptr<const std::string> m_content;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// CachingFileSystem
+
+class CachingFileSystem : public clang::vfs::FileSystem
+{
+public:
+    CachingFileSystem(
+            llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> base,
+            uint64_t memoryLimitBytes);
+    void beginTranslationUnit();
+
+    llvm::ErrorOr<clang::vfs::Status> status(const llvm::Twine &path) override;
+    llvm::ErrorOr<std::unique_ptr<clang::vfs::File>> openFileForRead(
+            const llvm::Twine &path) override;
+    clang::vfs::directory_iterator dir_begin(
+            const llvm::Twine &dir, std::error_code &ec) override;
+
+private:
+    struct StatEntry {
+        StatEntry() : isValid(false), time(0.0) {}
+        bool isValid;
+        double time;
+        std::error_code error;
+        clang::vfs::Status status;
+    };
+
+    struct ContentEntry {
+        llvm::sys::TimeValue mtime;
+        uint64_t size;
+        uint64_t lastUse;
+        std::shared_ptr<const std::string> content;
+    };
+
+    std::string cacheKey(const llvm::Twine &path);
+
+    llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> m_base;
+    uint64_t m_memoryLimitBytes;
+    uint64_t m_contentBytes;
+    uint64_t m_useCounter;
+    std::unordered_map<std::string, StatEntry> m_statCache;
+    std::unordered_map<std::string, ContentEntry> m_contentCache;
+
+    // Contents handed out during the current TU.  They must outlive the TU
+    // even if their cache entry is replaced.
+    std::vector<std::shared_ptr<const std::string> > m_pinnedContent;
+};
+
+CachingFileSystem::CachingFileSystem(
+        llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> base,
+        uint64_t memoryLimitBytes) :
+    m_base(base),
+    m_memoryLimitBytes(memoryLimitBytes),
+    m_contentBytes(0),
+    m_useCounter(0)
+{
+}
+
+// Paths are cached by absolute path, because the daemon changes its working
+// directory between TUs.
+std::string CachingFileSystem::cacheKey(const llvm::Twine &path)
+{
+    llvm::SmallString<256> result;
+    path.toVector(result);
+    llvm::sys::fs::make_absolute(result);
+    return result.str();
+}
+
+void CachingFileSystem::beginTranslationUnit()
+{
+    m_pinnedContent.clear();
+    if (m_contentBytes <= m_memoryLimitBytes)
+        return;
+
+    // Drop the least recently used contents until the cache is at most 3/4
+    // full, so that eviction doesn't happen before every TU.
+    std::vector<std::pair<uint64_t, std::string> > entries;
+    for (const auto &pair : m_contentCache)
+        entries.push_back(std::make_pair(pair.second.lastUse, pair.first));
+    std::sort(entries.begin(), entries.end());
+    const uint64_t target = m_memoryLimitBytes / 4 * 3;
+    for (const auto &entry : entries) {
+        if (m_contentBytes <= target)
+            break;
+        auto it = m_contentCache.find(entry.second);
+        m_contentBytes -= it->second.content->size();
+        m_contentCache.erase(it);
+    }
+}
+
+llvm::ErrorOr<clang::vfs::Status> CachingFileSystem::status(
+        const llvm::Twine &path)
+{
+    const double now = monotonicSeconds();
+    StatEntry &entry = m_statCache[cacheKey(path)];
+    if (!entry.isValid || now - entry.time > kStatCacheSeconds) {
+        llvm::ErrorOr<clang::vfs::Status> result = m_base->status(path);
+        entry.isValid = true;
+        entry.time = now;
+        entry.error = result ? std::error_code() : result.getError();
+        if (result)
+            entry.status = *result;
+    }
+    if (entry.error)
+        return entry.error;
+    clang::vfs::Status result = entry.status;
+    result.setName(path.str());
+    return result;
+}
+
+llvm::ErrorOr<std::unique_ptr<clang::vfs::File>>
+CachingFileSystem::openFileForRead(const llvm::Twine &path)
+{
+    llvm::ErrorOr<clang::vfs::Status> fileStatus = status(path);
+    if (!fileStatus)
+        return fileStatus.getError();
+    if (!fileStatus->isRegularFile())
+        return m_base->openFileForRead(path);
+
+    const std::string key = cacheKey(path);
+    auto it = m_contentCache.find(key);
+    if (it == m_contentCache.end() ||
+            it->second.mtime != fileStatus->getLastModificationTime() ||
+            it->second.size != fileStatus->getSize()) {
+        llvm::ErrorOr<std::unique_ptr<clang::vfs::File>> file =
+                m_base->openFileForRead(path);
+        if (!file)
+            return file.getError();
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+                (*file)->getBuffer(path, fileStatus->getSize());
+        if (!buffer)
+            return buffer.getError();
+        ContentEntry entry;
+        entry.mtime = fileStatus->getLastModificationTime();
+        entry.size = fileStatus->getSize();
+        entry.content = std::make_shared<const std::string>(
+                    (*buffer)->getBufferStart(), (*buffer)->getBufferSize());
+        if (it != m_contentCache.end()) {
+            m_contentBytes -= it->second.content->size();
+            it->second = entry;
+        } else {
+            it = m_contentCache.insert(std::make_pair(key, entry)).first;
+        }
+        m_contentBytes += entry.content->size();
+    }
+    it->second.lastUse = ++m_useCounter;
+    m_pinnedContent.push_back(it->second.content);
+    return std::unique_ptr<clang::vfs::File>(
+                new CachedFile(*fileStatus, it->second.content));
+}
+
+clang::vfs::directory_iterator CachingFileSystem::dir_begin(
+        const llvm::Twine &dir, std::error_code &ec)
+{
+    return m_base->dir_begin(dir, ec);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// File cache API
+
+static llvm::IntrusiveRefCntPtr<CachingFileSystem> theFileCache;
+
+void enableFileCache(uint64_t memoryLimitBytes)
+{
+    theFileCache = new CachingFileSystem(
+                clang::vfs::getRealFileSystem(), memoryLimitBytes);
+}
+
+// Returns the process' file cache, or NULL if it is not enabled.
+clang::vfs::FileSystem *fileCache()
+{
+    return theFileCache.get();
+}
+
+// Call before indexing each TU.
+void beginFileCacheTranslationUnit()
+{
+    if (theFileCache)
+        theFileCache->beginTranslationUnit();
+}
+
+} // namespace indexer
@@ -0,0 +1,34 @@
+#ifndef INDEXER_FILECACHE_H
+#define INDEXER_FILECACHE_H
+
+#include <stdint.h>
+
+namespace clang {
+    namespace vfs {
+        class FileSystem;
+    }
+}
+
+namespace indexer {
+
+// A daemon indexes many TUs that mostly include the same headers.  The file
+// cache is a process-wide caching virtual file system, shared by the
+// FileManagers of all of the TUs indexed by the process, so each header is
+// stat'ed and read once rather than once per TU.
+//
+// Stat results (including failed lookups, which dominate header search) are
+// trusted for a short time.  File contents are reused as long as the file's
+// modification time and size are unchanged.  When the cached contents exceed
+// the memory limit, the least recently used files are dropped before the next
+// TU starts.  (They can't be dropped during a TU, because the TU's
+// SourceManager refers to them.)
+//
+// The cache is not thread-safe; the daemon indexes one TU at a time.
+
+void enableFileCache(uint64_t memoryLimitBytes);
+clang::vfs::FileSystem *fileCache();
+void beginFileCacheTranslationUnit();
+
+} // namespace indexer
+
+#endif // INDEXER_FILECACHE_H
@@ -0,0 +1,77 @@
+#include "HeaderRegistry.h"
+
+#include <cstring>
+
+#include "ContentHash.h"
+#include "DaemonProtocol.h"
+#include "Util.h"
+
+namespace indexer {
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DaemonHeaderClaimer
+
+DaemonHeaderClaimer::DaemonHeaderClaimer(
+        DaemonChannel &channel,
+        const std::string &contextHash) :
+    m_channel(channel),
+    m_contextHash(contextHash)
+{
+}
+
+bool DaemonHeaderClaimer::claim(
+        const std::string &path,
+        const char *content,
+        size_t size)
+{
+    return m_channel.claim(m_contextHash + " " +
+                           contentHash(content, size) + " " + path);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// HeaderRegistry
+
+bool HeaderRegistry::claim(const std::string &key)
+{
+    LockGuard<Mutex> lock(m_mutex);
+    return m_claimed.insert(key).second;
+}
+
+void HeaderRegistry::release(const std::vector<std::string> &keys)
+{
+    LockGuard<Mutex> lock(m_mutex);
+    for (const std::string &key : keys)
+        m_claimed.erase(key);
+}
+
+// Hash the preprocessing context of a TU.  TUs that differ only in the name of
+// the source file and the names of their outputs (object and dependency
+// files) have the same context, so they can share header index entries.
+std::string headerContextHash(
+        const std::string &workingDirectory,
+        const std::vector<std::string> &clangArgv,
+        const std::string &sourceFilePath)
+{
+    const char *const sourceBasename = const_basename(sourceFilePath.c_str());
+    std::string text = workingDirectory;
+    text.push_back('\0');
+    for (size_t i = 0; i < clangArgv.size(); ++i) {
+        const std::string &arg = clangArgv[i];
+        if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+            ++i;
+            continue;
+        }
+        if (stringStartsWith(arg, "-o") || stringStartsWith(arg, "-M"))
+            continue;
+        if (arg[0] != '-' &&
+                strcmp(const_basename(arg.c_str()), sourceBasename) == 0)
+            continue;
+        text += arg;
+        text.push_back('\0');
+    }
+    return contentHash(text.data(), text.size());
+}
+
+} // namespace indexer
@@ -0,0 +1,96 @@
+#ifndef INDEXER_HEADERREGISTRY_H
+#define INDEXER_HEADERREGISTRY_H
+
+#include <cstddef>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "Mutex.h"
+
+namespace indexer {
+
+class DaemonChannel;
+
+// Cross-TU header deduplication
+//
+// Most headers are included by many TUs and produce the same index entry in
+// each of them.  The merge step already drops duplicate entries by hash, but
+// only after every daemon has traversed, recorded, and compressed the header.
+// With --index-project --dedup-headers, the parent process instead keeps a
+// registry of the headers that some TU has already claimed, and the other TUs
+// skip those headers entirely.
+//
+// A header is identified by its path, a hash of its content, and a hash of
+// the TU's preprocessing context (the working directory and the compiler
+// arguments, minus the ones naming the TU's own input and outputs).  A header
+// whose expansion depends on macros defined by the file that includes it is
+// still indexed only once per context, so its references may be incomplete.
+//
+// When the indexer first sees a header, the daemon sends a Claim message with
+// the header's key, and waits for the parent's reply.  (See DaemonProtocol.h.)
+//
+// A claim only stands if its TU's idx file is written.  When a TU crashes,
+// times out, fails, or writes no idx file, its claims are released, and the
+// next TU that includes one of those headers indexes it.  (A TU that was
+// refused the header while the claim was held has skipped it already.)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// HeaderClaimer
+
+class HeaderClaimer
+{
+public:
+    virtual ~HeaderClaimer() {}
+    // Returns true if the current TU should index the header.
+    virtual bool claim(const std::string &path,
+                       const char *content,
+                       size_t size) = 0;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DaemonHeaderClaimer
+
+// The daemon side of the claim protocol.
+class DaemonHeaderClaimer : public HeaderClaimer
+{
+public:
+    DaemonHeaderClaimer(DaemonChannel &channel,
+                        const std::string &contextHash);
+    bool claim(const std::string &path,
+               const char *content,
+               size_t size) override;
+
+private:
+    DaemonChannel &m_channel;
+    std::string m_contextHash;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// HeaderRegistry
+
+// The parent side of the claim protocol.  It is shared by all of the threads
+// running daemon jobs.  The claims of a job that doesn't produce an index are
+// released, so that a later TU indexes those headers instead.
+class HeaderRegistry
+{
+public:
+    bool claim(const std::string &key);
+    void release(const std::vector<std::string> &keys);
+
+private:
+    Mutex m_mutex;
+    std::unordered_set<std::string> m_claimed;
+};
+
+std::string headerContextHash(
+        const std::string &workingDirectory,
+        const std::vector<std::string> &clangArgv,
+        const std::string &sourceFilePath);
+
+} // namespace indexer
+
+#endif // INDEXER_HEADERREGISTRY_H
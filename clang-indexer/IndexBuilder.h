@@ -28,6 +28,7 @@ public:
             indexdb::ID symbolID);
 
     indexdb::ID insertSymbol(const char *symbol) { return m_symbolStringTable->insert(symbol); }
+    indexdb::ID insertSymbol(const char *symbol, uint32_t size, uint32_t hash) { return m_symbolStringTable->insert(symbol, size, hash); }
     indexdb::ID insertRefType(const char *refType) { return m_refTypeStringTable->insert(refType); }
     indexdb::ID insertSymbolType(const char *symbolType) { return m_symbolTypeStringTable->insert(symbolType); }
     const char *lookupSymbol(indexdb::ID symbolID) { return m_symbolStringTable->item(symbolID); }
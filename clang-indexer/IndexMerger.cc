@@ -0,0 +1,819 @@
+#include "IndexMerger.h"
+
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "../libindexdb/FileIo.h"
+#include "../libindexdb/IndexArchiveReader.h"
+#include "../libindexdb/IndexDb.h"
+#include "../libindexdb/RowCopier.h"
+#include "../libindexdb/SegmentedIndex.h"
+#include "../libindexdb/ShardedIndex.h"
+#include "IndexBuilder.h"
+#include "SymbolDictionary.h"
+#include "Trace.h"
+#include "Util.h"
+
+namespace indexer {
+
+using indexdb::RowCopier;
+using indexdb::TextRow;
+using indexdb::kConstantColumn;
+
+// Once the index has this many deltas, a --delta merge rewrites the whole
+// index instead of adding another one.
+const size_t kMaxDeltaSegments = 16;
+
+// The first line of a checkpoint journal, followed by the run's key.
+const char kCheckpointJournalSignature[] = "sw-clang-indexer checkpoint ";
+
+static std::string hexString(const std::string &data)
+{
+    std::string result;
+    for (size_t i = 0; i < data.size(); ++i) {
+        char buf[3];
+        snprintf(buf, sizeof(buf), "%02x",
+                 static_cast<unsigned char>(data[i]));
+        result += buf;
+    }
+    return result;
+}
+
+// The inverse of hexString.  Returns an empty string if hex is malformed.
+static std::string unhexString(const std::string &hex)
+{
+    std::string result;
+    if (hex.size() % 2 != 0)
+        return result;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        const char buf[3] = { hex[i], hex[i + 1], '\0' };
+        char *end = NULL;
+        const unsigned long byte = strtoul(buf, &end, 16);
+        if (end != buf + 2)
+            return std::string();
+        result.push_back(static_cast<char>(byte));
+    }
+    return result;
+}
+
+// Files are identified in the index by their path symbol, which is the entry
+// name prefixed with '@'.
+static std::string pathSymbol(const std::string &entryName)
+{
+    return "@" + entryName;
+}
+
+static void createManifestTables(indexdb::Index &manifest)
+{
+    std::vector<std::string> entryColumns;
+    entryColumns.push_back("Symbol");       // Path symbol
+    entryColumns.push_back("EntryHash");    // Hex hash of an archive entry
+    manifest.addTable("Entry", entryColumns);
+
+    std::vector<std::string> symbolColumns;
+    symbolColumns.push_back("Symbol");      // Path symbol
+    symbolColumns.push_back("Symbol");
+    symbolColumns.push_back("SymbolType");
+    manifest.addTable("PathSymbol", symbolColumns);
+
+    std::vector<std::string> globalSymbolColumns;
+    globalSymbolColumns.push_back("Symbol");    // Path symbol
+    globalSymbolColumns.push_back("Symbol");
+    manifest.addTable("PathGlobalSymbol", globalSymbolColumns);
+
+    // The same rows, keyed by symbol, for finding a symbol's other files.
+    std::vector<std::string> symbolPathColumns;
+    symbolPathColumns.push_back("Symbol");
+    symbolPathColumns.push_back("SymbolType");
+    symbolPathColumns.push_back("Symbol");  // Path symbol
+    manifest.addTable("SymbolPath", symbolPathColumns);
+
+    std::vector<std::string> globalSymbolPathColumns;
+    globalSymbolPathColumns.push_back("Symbol");
+    globalSymbolPathColumns.push_back("Symbol");    // Path symbol
+    manifest.addTable("GlobalSymbolPath", globalSymbolPathColumns);
+}
+
+// Finalize the index and add its ReferenceIndex and SymbolTypeIndex tables.
+static void finalizeIndex(indexdb::Index &index)
+{
+    TraceSpan span("finalize index");
+    index.finalizeTables();
+    {
+        IndexBuilder locationPopulator(index);
+        locationPopulator.populateIndexTables();
+    }
+    index.finalizeTables();
+}
+
+// Call func(0) .. func(count - 1) on a thread pool of its own, because the
+// global pool's threads may all be waiting on daemons.
+static void runInParallel(int count, const std::function<void(int)> &func)
+{
+    class Task : public QRunnable {
+    public:
+        Task(const std::function<void(int)> &func, int i) :
+            m_func(func), m_i(i) {}
+        void run() { m_func(m_i); }
+    private:
+        const std::function<void(int)> &m_func;
+        int m_i;
+    };
+    QThreadPool pool;
+    pool.setMaxThreadCount(std::min(count, QThread::idealThreadCount()));
+    for (int i = 0; i < count; ++i)
+        pool.start(new Task(func, i));
+    pool.waitForDone();
+}
+
+// Returns the IDs of the path symbols of the named files that exist in the
+// index's Symbol string table.
+static std::unordered_set<indexdb::ID> lookupPathSymbols(
+        const indexdb::Index &index,
+        const std::set<std::string> &entryNames)
+{
+    std::unordered_set<indexdb::ID> result;
+    const indexdb::StringTable *symbols = index.stringTable("Symbol");
+    if (symbols == NULL || symbols->size() == 0)
+        return result;
+    for (const std::string &name : entryNames) {
+        indexdb::ID id = symbols->id(pathSymbol(name).c_str());
+        if (id != indexdb::kInvalidID)
+            result.insert(id);
+    }
+    return result;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// IndexMerger
+
+// Only incremental merges write a manifest.  They start from the existing
+// index if it has a usable manifest.
+IndexMerger::IndexMerger(
+        const std::string &indexPath,
+        const std::string &manifestPath,
+        bool incremental,
+        bool writeDelta) :
+    m_indexPath(indexPath),
+    m_manifestPath(manifestPath),
+    m_isIncremental(false),
+    m_writeDelta(false),
+    m_symbolDictionary(NULL),
+    m_index(new indexdb::Index),
+    m_checkpointJournalPath(indexPath + ".checkpoint"),
+    m_checkpointInterval(0),
+    m_nextCheckpointTime(0),
+    m_checkpointCount(0)
+{
+    // Make sure the non-index tables exist.  They are usually created when
+    // the first source file is merged, but it's possible that no source files
+    // exist.
+    IndexBuilder builder(*m_index, /*createIndexTables=*/false);
+
+    if (incremental) {
+        m_manifest.reset(new indexdb::Index);
+        createManifestTables(*m_manifest);
+        m_isIncremental = loadPreviousManifest();
+    }
+    if (writeDelta && m_isIncremental) {
+        m_writeDelta = indexdb::deltaSegmentPaths(m_indexPath).size() <
+                kMaxDeltaSegments;
+    }
+}
+
+IndexMerger::~IndexMerger()
+{
+}
+
+// Only non-incremental merges can write shards.
+void IndexMerger::setShardCount(int shardCount)
+{
+    assert(!m_isIncremental && !m_manifest);
+    m_shards.clear();
+    if (shardCount <= 1)
+        return;
+    for (int i = 0; i < shardCount; ++i) {
+        m_shards.emplace_back(new indexdb::Index);
+        IndexBuilder builder(*m_shards.back(), /*createIndexTables=*/false);
+    }
+}
+
+// Only non-incremental, unsharded merges can write checkpoints.  Returns the
+// keys of the TUs merged into the checkpoints of an earlier run with the same
+// runKey, whose archives needn't be added again.  Any other checkpoints are
+// removed.
+std::unordered_set<std::string> IndexMerger::startCheckpoints(
+        const std::string &runKey,
+        double intervalSeconds)
+{
+    assert(!m_isIncremental && !m_manifest && m_shards.empty());
+    assert(intervalSeconds > 0);
+    m_checkpointInterval = intervalSeconds;
+    m_nextCheckpointTime = monotonicSeconds() + intervalSeconds;
+    std::unordered_set<std::string> result;
+    if (!loadCheckpoints(runKey, result)) {
+        removeCheckpoints();
+        result.clear();
+        m_mergedEntrySet.clear();
+        m_checkpointCount = 0;
+    }
+
+    // Rewrite the journal without the records of an unfinished checkpoint.
+    const std::string tempPath = m_checkpointJournalPath + ".tmp";
+    FILE *journal = fopen(tempPath.c_str(), "w");
+    if (journal == NULL) {
+        std::cerr << "warning: cannot write " << tempPath << std::endl;
+        return result;
+    }
+    fprintf(journal, "%s%s\n", kCheckpointJournalSignature, runKey.c_str());
+    for (const std::string &hash : m_mergedEntrySet)
+        fprintf(journal, "entry %s\n", hexString(hash).c_str());
+    for (const std::string &key : result)
+        fprintf(journal, "tu %s\n", key.c_str());
+    for (size_t i = 0; i < m_checkpointCount; ++i)
+        fprintf(journal, "segment %d\n", static_cast<int>(i));
+    const bool success = !ferror(journal);
+    fclose(journal);
+    if (!success ||
+            std::rename(tempPath.c_str(),
+                        m_checkpointJournalPath.c_str()) != 0) {
+        std::cerr << "warning: cannot write " << m_checkpointJournalPath
+                  << std::endl;
+    }
+    return result;
+}
+
+std::string IndexMerger::checkpointPath(size_t segment)
+{
+    return m_checkpointJournalPath + "." + std::to_string(segment);
+}
+
+// Read the journal of an earlier run.  Returns false if there is none, or if
+// the run's key differs.
+bool IndexMerger::loadCheckpoints(
+        const std::string &runKey,
+        std::unordered_set<std::string> &checkpointKeys)
+{
+    std::ifstream journal(m_checkpointJournalPath.c_str());
+    std::string line;
+    if (!std::getline(journal, line) ||
+            line != kCheckpointJournalSignature + runKey)
+        return false;
+    std::vector<std::string> entries;
+    std::vector<std::string> keys;
+    while (std::getline(journal, line)) {
+        if (stringStartsWith(line, "entry ")) {
+            const std::string hash = unhexString(line.substr(6));
+            if (hash.empty())
+                break;
+            entries.push_back(hash);
+        } else if (stringStartsWith(line, "tu ")) {
+            keys.push_back(line.substr(3));
+        } else if (line == "segment " + std::to_string(m_checkpointCount) &&
+                   getPathModTime(checkpointPath(m_checkpointCount)) !=
+                        kInvalidTime) {
+            m_mergedEntrySet.insert(entries.begin(), entries.end());
+            checkpointKeys.insert(keys.begin(), keys.end());
+            entries.clear();
+            keys.clear();
+            m_checkpointCount++;
+        } else {
+            break;
+        }
+    }
+    return true;
+}
+
+// Write the rows merged since the last checkpoint as the next segment, and
+// then record it in the journal.  A segment that isn't in the journal yet is
+// overwritten by the next run.
+void IndexMerger::writeCheckpoint()
+{
+    TraceSpan span("write checkpoint");
+    m_index->finalizeTables();
+    m_index->write(checkpointPath(m_checkpointCount));
+    FILE *journal = fopen(m_checkpointJournalPath.c_str(), "a");
+    if (journal != NULL) {
+        for (const std::string &hash : m_uncheckpointedEntries)
+            fprintf(journal, "entry %s\n", hash.c_str());
+        for (const std::string &key : m_uncheckpointedKeys)
+            fprintf(journal, "tu %s\n", key.c_str());
+        fprintf(journal, "segment %d\n", static_cast<int>(m_checkpointCount));
+        fclose(journal);
+    } else {
+        std::cerr << "warning: cannot write " << m_checkpointJournalPath
+                  << std::endl;
+    }
+    m_checkpointCount++;
+    m_uncheckpointedEntries.clear();
+    m_uncheckpointedKeys.clear();
+    m_index.reset(new indexdb::Index);
+    IndexBuilder builder(*m_index, /*createIndexTables=*/false);
+    m_dictionarySymbolIDs.clear();
+    m_nextCheckpointTime = monotonicSeconds() + m_checkpointInterval;
+}
+
+// Merge the checkpoint segments and the rows merged since the last one.
+void IndexMerger::mergeCheckpoints()
+{
+    if (m_checkpointCount == 0)
+        return;
+    TraceSpan span("merge checkpoints");
+    m_index->finalizeTables();
+    std::unique_ptr<indexdb::Index> merged(new indexdb::Index);
+    IndexBuilder builder(*merged, /*createIndexTables=*/false);
+    for (size_t i = 0; i < m_checkpointCount; ++i) {
+        indexdb::Index segment(checkpointPath(i));
+        merged->merge(segment);
+    }
+    merged->merge(*m_index);
+    m_index = std::move(merged);
+}
+
+void IndexMerger::removeCheckpoints()
+{
+    std::remove(m_checkpointJournalPath.c_str());
+    for (size_t i = 0;
+            getPathModTime(checkpointPath(i)) != kInvalidTime; ++i)
+        std::remove(checkpointPath(i).c_str());
+}
+
+bool IndexMerger::loadPreviousManifest()
+{
+    if (getPathModTime(m_indexPath) == kInvalidTime ||
+            getPathModTime(m_manifestPath) == kInvalidTime)
+        return false;
+    {
+        indexdb::UnmappedReader reader(m_manifestPath);
+        if (!reader.peekSignature(indexdb::kIndexSignature))
+            return false;
+    }
+    // The manifest's deltas are written before the index's, so a merge that
+    // was interrupted between the two leaves more manifest deltas.
+    if (indexdb::deltaSegmentPaths(m_manifestPath).size() !=
+            indexdb::deltaSegmentPaths(m_indexPath).size())
+        return false;
+    indexdb::SegmentedIndex manifest(m_manifestPath);
+    for (const TextRow &row : manifest.query("Entry", TextRow())) {
+        // Strip the '@' of the path symbol.
+        m_previousEntries[row[0].substr(1)].insert(row[1]);
+    }
+    return true;
+}
+
+// Merge the archive's entries.  For an incremental merge, the entries are
+// only recorded here, and the changed ones are merged by finish.
+void IndexMerger::addArchive(
+        const std::string &archivePath,
+        const std::string &checkpointKey)
+{
+    TraceSpan span("merge archive", archivePath);
+    indexdb::IndexArchiveReader archive(archivePath);
+    for (int i = 0; i < archive.size(); ++i) {
+        const indexdb::IndexArchiveReader::Entry &entry = archive.entry(i);
+        if (m_isIncremental) {
+            EntryLocation location;
+            location.archivePath = archivePath;
+            location.entryIndex = i;
+            m_currentEntries[entry.name].insert(
+                        std::make_pair(hexString(entry.hash), location));
+            continue;
+        }
+        if (!m_mergedEntrySet.insert(entry.hash).second)
+            continue;
+        if (m_checkpointInterval > 0)
+            m_uncheckpointedEntries.push_back(hexString(entry.hash));
+        mergeEntry(archive, i);
+    }
+    if (m_checkpointInterval > 0) {
+        if (!checkpointKey.empty())
+            m_uncheckpointedKeys.push_back(checkpointKey);
+        if (monotonicSeconds() >= m_nextCheckpointTime)
+            writeCheckpoint();
+    }
+}
+
+static bool keepAllRows(const indexdb::Row &)
+{
+    return true;
+}
+
+void IndexMerger::mergeEntry(
+        indexdb::IndexArchiveReader &archive,
+        int entryIndex)
+{
+    const indexdb::IndexArchiveReader::Entry &entry =
+            archive.entry(entryIndex);
+    std::unique_ptr<indexdb::Index> fileIndex(archive.openEntry(entryIndex));
+    if (!m_shards.empty()) {
+        // The symbol dictionary's IDs are translated for m_index only, so the
+        // shards look up the entry's strings.
+        std::set<std::string> skippedTables;
+        skippedTables.insert(kSymbolDictionaryIDTable);
+        const int shard = indexdb::shardOfString(
+                    pathSymbol(entry.name).c_str(), m_shards.size());
+        m_shards[shard]->merge(*fileIndex,
+                               std::map<std::string,
+                                        std::vector<indexdb::ID> >(),
+                               skippedTables);
+        return;
+    }
+    mergeIndex(archive, *fileIndex);
+    if (!m_manifest)
+        return;
+
+    // Attribute the entry's symbol rows to its file.
+    const indexdb::ID pathID = m_manifest->stringTable("Symbol")->insert(
+                pathSymbol(entry.name).c_str());
+    {
+        indexdb::Row row(2);
+        row[0] = pathID;
+        row[1] = m_manifest->stringTable("EntryHash")->insert(
+                    hexString(entry.hash).c_str());
+        m_manifest->table("Entry")->add(row);
+    }
+    RowCopier copier(*fileIndex, *m_manifest);
+    copier.copyRows("Symbol", "PathSymbol", { kConstantColumn, 0, 1 },
+                    keepAllRows, pathID);
+    copier.copyRows("GlobalSymbol", "PathGlobalSymbol", { kConstantColumn, 0 },
+                    keepAllRows, pathID);
+    copier.copyRows("Symbol", "SymbolPath", { 0, 1, kConstantColumn },
+                    keepAllRows, pathID);
+    copier.copyRows("GlobalSymbol", "GlobalSymbolPath", { 0, kConstantColumn },
+                    keepAllRows, pathID);
+}
+
+// Merge an entry's index into m_index.  If the entry has IDs from the
+// current symbol dictionary, its symbols are translated through them.
+void IndexMerger::mergeIndex(
+        indexdb::IndexArchiveReader &archive,
+        const indexdb::Index &fileIndex)
+{
+    std::set<std::string> skippedTables;
+    skippedTables.insert(kSymbolDictionaryIDTable);
+    std::map<std::string, std::vector<indexdb::ID> > stringIdMaps;
+    const indexdb::Table *dictionaryIDTable =
+            fileIndex.table(kSymbolDictionaryIDTable);
+    const indexdb::StringTable *symbols = fileIndex.stringTable("Symbol");
+    if (m_symbolDictionary != NULL && dictionaryIDTable != NULL &&
+            symbols != NULL &&
+            archive.metadata(kSymbolDictionaryMetadata) ==
+                m_symbolDictionary->token()) {
+        indexdb::StringTable *destSymbols = m_index->stringTable("Symbol");
+        std::vector<indexdb::ID> &symbolIdMap = stringIdMaps["Symbol"];
+        symbolIdMap.resize(symbols->size(), indexdb::kInvalidID);
+        indexdb::Row row(2);
+        for (auto it = dictionaryIDTable->begin(),
+                itEnd = dictionaryIDTable->end(); it != itEnd; ++it) {
+            it.value(row);
+            auto inserted = m_dictionarySymbolIDs.insert(
+                        std::make_pair(row[1], indexdb::kInvalidID));
+            if (inserted.second) {
+                inserted.first->second = destSymbols->insert(
+                            m_symbolDictionary->item(row[1]),
+                            m_symbolDictionary->itemSize(row[1]),
+                            m_symbolDictionary->itemHash(row[1]));
+            }
+            symbolIdMap[row[0]] = inserted.first->second;
+        }
+        for (indexdb::ID id = 0; id < symbolIdMap.size(); ++id) {
+            if (symbolIdMap[id] == indexdb::kInvalidID) {
+                symbolIdMap[id] = destSymbols->insert(
+                            symbols->item(id), symbols->itemSize(id),
+                            symbols->itemHash(id));
+            }
+        }
+    }
+    m_index->merge(fileIndex, stringIdMaps, skippedTables);
+}
+
+// Called after all archives are added.  Writes the index and the manifest.
+void IndexMerger::finish()
+{
+    if (m_isIncremental && !mergeChangedFiles())
+        return;
+    if (m_writeDelta) {
+        writeDelta();
+    } else if (!m_shards.empty()) {
+        writeShards();
+    } else {
+        mergeCheckpoints();
+        write();
+    }
+    if (m_checkpointInterval > 0)
+        removeCheckpoints();
+}
+
+// Update the previous index with the entries of the files whose entries
+// changed.  Returns false if nothing changed.
+bool IndexMerger::mergeChangedFiles()
+{
+    TraceSpan span("merge changed files");
+    std::set<std::string> affectedFiles;
+    for (const auto &pair : m_previousEntries) {
+        auto it = m_currentEntries.find(pair.first);
+        if (it == m_currentEntries.end() ||
+                it->second.size() != pair.second.size()) {
+            affectedFiles.insert(pair.first);
+            continue;
+        }
+        for (const auto &current : it->second) {
+            if (pair.second.find(current.first) == pair.second.end()) {
+                affectedFiles.insert(pair.first);
+                break;
+            }
+        }
+    }
+    for (const auto &pair : m_currentEntries) {
+        if (m_previousEntries.find(pair.first) == m_previousEntries.end())
+            affectedFiles.insert(pair.first);
+    }
+    std::cout << affectedFiles.size() << " of " << m_currentEntries.size()
+              << " indexed files changed" << std::endl;
+    if (affectedFiles.empty())
+        return false;
+
+    if (m_writeDelta)
+        collectRemovedRows(affectedFiles);
+    else
+        copyUnaffectedRows(affectedFiles);
+
+    // Merge the current entries of the affected files.
+    std::map<std::string, std::unique_ptr<indexdb::IndexArchiveReader> >
+            archives;
+    for (const std::string &name : affectedFiles) {
+        auto it = m_currentEntries.find(name);
+        if (it == m_currentEntries.end())
+            continue;
+        for (const auto &pair : it->second) {
+            const EntryLocation &location = pair.second;
+            std::unique_ptr<indexdb::IndexArchiveReader> &archive =
+                    archives[location.archivePath];
+            if (!archive) {
+                archive.reset(new indexdb::IndexArchiveReader(
+                                  location.archivePath));
+            }
+            mergeEntry(*archive, location.entryIndex);
+        }
+    }
+    return true;
+}
+
+// Copy the rows of the unaffected files from the previous index and
+// manifest.  The old index's Symbol and GlobalSymbol tables can't be
+// attributed to files, so they are rebuilt from the manifest.
+void IndexMerger::copyUnaffectedRows(
+        const std::set<std::string> &affectedFiles)
+{
+    std::unique_ptr<indexdb::Index> oldIndex(
+                indexdb::openSegmentedIndex(m_indexPath));
+    std::unique_ptr<indexdb::Index> oldManifest(
+                indexdb::openSegmentedIndex(m_manifestPath));
+    const std::unordered_set<indexdb::ID> oldIndexPaths =
+            lookupPathSymbols(*oldIndex, affectedFiles);
+    const std::unordered_set<indexdb::ID> oldManifestPaths =
+            lookupPathSymbols(*oldManifest, affectedFiles);
+    auto isIndexRowKept = [&](const indexdb::Row &row) {
+        return oldIndexPaths.find(row[0]) == oldIndexPaths.end();
+    };
+    auto isManifestRowKept = [&](const indexdb::Row &row) {
+        return oldManifestPaths.find(row[0]) == oldManifestPaths.end();
+    };
+    auto isSymbolPathRowKept = [&](const indexdb::Row &row) {
+        return oldManifestPaths.find(row[row.count() - 1]) ==
+                oldManifestPaths.end();
+    };
+
+    RowCopier indexCopier(*oldIndex, *m_index);
+    indexCopier.copyRows("Reference", "Reference", { 0, 1, 2, 3, 4, 5 },
+                         isIndexRowKept);
+
+    RowCopier manifestCopier(*oldManifest, *m_manifest);
+    manifestCopier.copyRows("Entry", "Entry", { 0, 1 }, isManifestRowKept);
+    manifestCopier.copyRows("PathSymbol", "PathSymbol", { 0, 1, 2 },
+                            isManifestRowKept);
+    manifestCopier.copyRows("PathGlobalSymbol", "PathGlobalSymbol", { 0, 1 },
+                            isManifestRowKept);
+    manifestCopier.copyRows("SymbolPath", "SymbolPath", { 0, 1, 2 },
+                            isSymbolPathRowKept);
+    manifestCopier.copyRows("GlobalSymbolPath", "GlobalSymbolPath", { 0, 1 },
+                            isSymbolPathRowKept);
+
+    RowCopier symbolCopier(*oldManifest, *m_index);
+    symbolCopier.copyRows("PathSymbol", "Symbol", { 1, 2 },
+                          isManifestRowKept);
+    symbolCopier.copyRows("PathGlobalSymbol", "GlobalSymbol", { 1 },
+                          isManifestRowKept);
+}
+
+// Record the rows that the affected files contributed to the previous index
+// and manifest, for the delta's removed tables.  A Symbol or GlobalSymbol row
+// is only removed if no unaffected file contributed it too.
+void IndexMerger::collectRemovedRows(
+        const std::set<std::string> &affectedFiles)
+{
+    indexdb::SegmentedIndex oldIndex(m_indexPath);
+    indexdb::SegmentedIndex oldManifest(m_manifestPath);
+    m_removedIndex.reset(new indexdb::Index);
+    IndexBuilder builder(*m_removedIndex, /*createIndexTables=*/false);
+    m_removedManifest.reset(new indexdb::Index);
+    createManifestTables(*m_removedManifest);
+
+    std::set<std::string> affectedPaths;
+    for (const std::string &name : affectedFiles)
+        affectedPaths.insert(pathSymbol(name));
+
+    std::set<TextRow> symbols;
+    std::set<TextRow> globalSymbols;
+    for (const std::string &path : affectedPaths) {
+        const TextRow prefix(1, path);
+        for (const TextRow &row : oldIndex.query("Reference", prefix))
+            indexdb::addTextRow(*m_removedIndex, "Reference", row);
+        for (const TextRow &row : oldManifest.query("Entry", prefix))
+            indexdb::addTextRow(*m_removedManifest, "Entry", row);
+        for (const TextRow &row : oldManifest.query("PathSymbol", prefix)) {
+            indexdb::addTextRow(*m_removedManifest, "PathSymbol", row);
+            indexdb::addTextRow(*m_removedManifest, "SymbolPath",
+                                { row[1], row[2], row[0] });
+            symbols.insert({ row[1], row[2] });
+        }
+        for (const TextRow &row :
+                oldManifest.query("PathGlobalSymbol", prefix)) {
+            indexdb::addTextRow(*m_removedManifest, "PathGlobalSymbol", row);
+            indexdb::addTextRow(*m_removedManifest, "GlobalSymbolPath",
+                                { row[1], row[0] });
+            globalSymbols.insert({ row[1] });
+        }
+    }
+
+    auto isOnlyFromAffectedPaths = [&](const std::set<TextRow> &rows) {
+        for (const TextRow &row : rows) {
+            if (affectedPaths.find(row.back()) == affectedPaths.end())
+                return false;
+        }
+        return true;
+    };
+    for (const TextRow &symbol : symbols) {
+        if (isOnlyFromAffectedPaths(oldManifest.query("SymbolPath", symbol)))
+            indexdb::addTextRow(*m_removedIndex, "Symbol", symbol);
+    }
+    for (const TextRow &symbol : globalSymbols) {
+        if (isOnlyFromAffectedPaths(
+                    oldManifest.query("GlobalSymbolPath", symbol)))
+            indexdb::addTextRow(*m_removedIndex, "GlobalSymbol", symbol);
+    }
+}
+
+void IndexMerger::write()
+{
+    finalizeIndex(*m_index);
+
+    // Remove the old manifest first, so that a manifest never describes a
+    // different index.  The index's deltas belong to the old base.
+    std::remove(m_manifestPath.c_str());
+    indexdb::removeDeltaSegments(m_manifestPath);
+    indexdb::removeDeltaSegments(m_indexPath);
+    indexdb::removeShards(m_indexPath);
+    {
+        TraceSpan span("write index");
+        m_index->write(m_indexPath);
+    }
+    if (m_manifest) {
+        m_manifest->finalizeTables();
+        m_manifest->write(m_manifestPath);
+    }
+}
+
+// Write the index as shards, and then their manifest.  The merged shards are
+// partitioned by file, which is right for the Reference rows, but not for the
+// rows keyed by symbol, so each output shard is assembled from all of them.
+void IndexMerger::writeShards()
+{
+    TraceSpan span("write shards");
+    std::remove(m_manifestPath.c_str());
+    indexdb::removeDeltaSegments(m_manifestPath);
+    indexdb::removeDeltaSegments(m_indexPath);
+    indexdb::removeShards(m_indexPath);
+    runInParallel(m_shards.size(), [this](int shard) {
+        TraceSpan span("finalize merged shard", std::to_string(shard));
+        m_shards[shard]->finalizeTables();
+    });
+    runInParallel(m_shards.size(), [this](int shard) {
+        writeShard(shard);
+    });
+    indexdb::writeShardManifest(m_indexPath, m_shards.size());
+    std::cout << "Wrote " << m_shards.size() << " shards of " << m_indexPath
+              << std::endl;
+    m_shards.clear();
+}
+
+// Collect the output shard's rows from the finalized merged shards, which
+// other threads are reading too, and finalize and write it.
+void IndexMerger::writeShard(int shard)
+{
+    TraceSpan span("write shard", std::to_string(shard));
+    const int shardCount = m_shards.size();
+    indexdb::Index output;
+    IndexBuilder builder(output);
+    for (int i = 0; i < shardCount; ++i) {
+        const indexdb::Index &merged = *m_shards[i];
+        const indexdb::StringTable *symbols = merged.stringTable("Symbol");
+        auto isOwned = [&](indexdb::ID symbolID) {
+            return indexdb::shardOfHash(symbols->itemHash(symbolID),
+                                        shardCount) == shard;
+        };
+        RowCopier copier(merged, output);
+        if (i == shard) {
+            copier.copyRows("Reference", "Reference", { 0, 1, 2, 3, 4, 5 },
+                            keepAllRows);
+        }
+        copier.copyRows("Reference", "ReferenceIndex", { 4, 5, 0, 1, 2, 3 },
+                        [&](const indexdb::Row &row) {
+            return isOwned(row[4]);
+        });
+        auto isSymbolOwned = [&](const indexdb::Row &row) {
+            return isOwned(row[0]);
+        };
+        copier.copyRows("Symbol", "Symbol", { 0, 1 }, isSymbolOwned);
+        copier.copyRows("Symbol", "SymbolTypeIndex", { 1, 0 }, isSymbolOwned);
+        copier.copyRows("GlobalSymbol", "GlobalSymbol", { 0 }, isSymbolOwned);
+    }
+    output.finalizeTables();
+    output.write(indexdb::shardPath(m_indexPath, shard));
+}
+
+// Write the changes as a delta of the index and of the manifest, leaving
+// their base files alone.  The derived tables of the removed rows are
+// removed too.
+void IndexMerger::writeDelta()
+{
+    finalizeIndex(*m_index);
+    finalizeIndex(*m_removedIndex);
+    m_manifest->finalizeTables();
+    m_removedManifest->finalizeTables();
+    const std::string deltaPath = indexdb::nextDeltaSegmentPath(m_indexPath);
+    const std::string manifestDeltaPath =
+            indexdb::nextDeltaSegmentPath(m_manifestPath);
+    TraceSpan span("write delta", deltaPath);
+    if (!indexdb::writeDeltaSegment(m_manifestPath, *m_manifest,
+                                    *m_removedManifest)) {
+        std::cerr << "warning: cannot write " << manifestDeltaPath
+                  << std::endl;
+        return;
+    }
+    // The manifest and the index must have the same number of deltas.
+    if (!indexdb::writeDeltaSegment(m_indexPath, *m_index, *m_removedIndex)) {
+        std::cerr << "warning: cannot write " << deltaPath << std::endl;
+        std::remove(manifestDeltaPath.c_str());
+        return;
+    }
+    std::cout << "Wrote " << deltaPath << std::endl;
+}
+
+// Fold the deltas of the index and its manifest into their base files.
+void IndexMerger::compact(
+        const std::string &indexPath,
+        const std::string &manifestPath)
+{
+    const size_t deltaCount = indexdb::deltaSegmentPaths(indexPath).size();
+    if (deltaCount == 0) {
+        std::cout << indexPath << " has no deltas" << std::endl;
+        return;
+    }
+    std::unique_ptr<indexdb::Index> index(
+                indexdb::openSegmentedIndex(indexPath));
+    std::unique_ptr<indexdb::Index> manifest;
+    if (getPathModTime(manifestPath) != kInvalidTime &&
+            indexdb::deltaSegmentPaths(manifestPath).size() == deltaCount)
+        manifest.reset(indexdb::openSegmentedIndex(manifestPath));
+
+    // Replace the base files before removing the deltas, so that a crash or a
+    // full disk leaves the old, intact files, and a navigator that has the old
+    // base mapped keeps reading it.  The new base already has the deltas'
+    // changes, and applying them to it again is harmless, so a reader that
+    // sees the new base with the old deltas still sees the right rows.
+    if (!indexdb::replaceIndexFile(*index, indexPath)) {
+        std::cerr << "warning: cannot write " << indexPath << std::endl;
+        return;
+    }
+    if (!manifest || !indexdb::replaceIndexFile(*manifest, manifestPath)) {
+        // Without a manifest, the next incremental run starts over.
+        std::remove(manifestPath.c_str());
+    }
+    indexdb::removeDeltaSegments(manifestPath);
+    indexdb::removeDeltaSegments(indexPath);
+    std::cout << "Compacted " << deltaCount << " deltas into " << indexPath
+              << std::endl;
+}
+
+} // namespace indexer
@@ -0,0 +1,144 @@
+#ifndef INDEXER_INDEXMERGER_H
+#define INDEXER_INDEXMERGER_H
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../libindexdb/StringTable.h"
+
+namespace indexdb {
+    class Index;
+    class IndexArchiveReader;
+}
+
+namespace indexer {
+
+class SymbolDictionary;
+
+// Merging TU archives into the project index
+//
+// The project index is the union of the rows of the archive entries of every
+// TU.  Each archive entry describes one file.  All of an entry's Reference
+// rows are located in that file, and each of its Symbol and GlobalSymbol rows
+// is recorded along with a reference in that file, so every row of the merged
+// index can be attributed to the files whose entries produced it.
+//
+// When the merger writes a manifest, the manifest records, for each file, the
+// hashes of the entries merged for it and the Symbol and GlobalSymbol rows
+// those entries contributed.  A later --incremental run then compares the
+// entries of the current archives against the manifest.  A file is affected
+// if its set of entry hashes changed.  The new index is the previous index
+// minus the rows of the affected files, plus the rows of the affected files'
+// current entries, so the entries of unaffected files are never reopened, and
+// if no file is affected, the index is left alone.
+//
+// Normally the index file is rewritten as a whole.  With writeDelta, the
+// changes are instead written as a delta segment (see SegmentedIndex.h) of
+// the index and one of the manifest: the affected files' current rows are
+// added, and their previous rows are removed.  Once there are many deltas,
+// the merger rewrites the index instead.  compact folds the deltas back into
+// the base files.
+//
+// A non-incremental merge can instead write the index as a set of shards (see
+// ShardedIndex.h).  Each entry is merged into the shard of its file, and once
+// all are merged, the shards are finalized in parallel, and then each output
+// shard collects its symbols' rows from all of them, and is finalized and
+// written in parallel with the others.
+//
+// A non-incremental, unsharded merge can also write checkpoints, so that an
+// interrupted run can resume.  Every so often, the rows merged since the last
+// checkpoint are finalized and written as a segment ("index.checkpoint.N"),
+// and the merger starts over with an empty index.  A journal
+// ("index.checkpoint") then records the segment, the hashes of the entries it
+// holds, and the keys of the TUs whose archives were merged into it.  The
+// journal's first line is a key of the run's indexing options, and its lines
+// after the last segment are ignored.  A later run with the same key merges
+// the segments instead of the journal's TUs, and finish removes them once the
+// index is written.
+
+class IndexMerger
+{
+public:
+    IndexMerger(const std::string &indexPath,
+                const std::string &manifestPath,
+                bool incremental,
+                bool writeDelta);
+    ~IndexMerger();
+    static void compact(const std::string &indexPath,
+                        const std::string &manifestPath);
+    bool isIncremental() { return m_isIncremental; }
+    void setSymbolDictionary(SymbolDictionary *dictionary) {
+        m_symbolDictionary = dictionary;
+    }
+    void setShardCount(int shardCount);
+    std::unordered_set<std::string> startCheckpoints(
+            const std::string &runKey,
+            double intervalSeconds);
+    void addArchive(const std::string &archivePath,
+                    const std::string &checkpointKey=std::string());
+    void finish();
+
+private:
+    struct EntryLocation {
+        std::string archivePath;
+        int entryIndex;
+    };
+
+    bool loadPreviousManifest();
+    void mergeEntry(indexdb::IndexArchiveReader &archive, int entryIndex);
+    void mergeIndex(indexdb::IndexArchiveReader &archive,
+                    const indexdb::Index &fileIndex);
+    bool mergeChangedFiles();
+    void copyUnaffectedRows(const std::set<std::string> &affectedFiles);
+    void collectRemovedRows(const std::set<std::string> &affectedFiles);
+    void write();
+    void writeDelta();
+    void writeShards();
+    void writeShard(int shard);
+    std::string checkpointPath(size_t segment);
+    bool loadCheckpoints(const std::string &runKey,
+                         std::unordered_set<std::string> &checkpointKeys);
+    void writeCheckpoint();
+    void mergeCheckpoints();
+    void removeCheckpoints();
+
+    std::string m_indexPath;
+    std::string m_manifestPath;
+    bool m_isIncremental;
+    bool m_writeDelta;
+    SymbolDictionary *m_symbolDictionary;
+    std::unique_ptr<indexdb::Index> m_index;
+    std::unique_ptr<indexdb::Index> m_manifest;
+    std::unique_ptr<indexdb::Index> m_removedIndex;
+    std::unique_ptr<indexdb::Index> m_removedManifest;
+
+    // With shards, the entries are merged here instead of into m_index.
+    std::vector<std::unique_ptr<indexdb::Index> > m_shards;
+    std::unordered_set<std::string> m_mergedEntrySet;
+
+    // Maps symbol dictionary IDs to IDs in m_index's Symbol string table.
+    std::unordered_map<indexdb::ID, indexdb::ID> m_dictionarySymbolIDs;
+
+    // Checkpoints.  The journal's records since the last segment are kept
+    // until the next one is written.
+    std::string m_checkpointJournalPath;
+    double m_checkpointInterval;            // 0 without checkpoints.
+    double m_nextCheckpointTime;
+    size_t m_checkpointCount;               // Segments written.
+    std::vector<std::string> m_uncheckpointedEntries;   // Hex entry hashes.
+    std::vector<std::string> m_uncheckpointedKeys;
+
+    // The entry hashes of each file, keyed by the file's entry name.
+    std::unordered_map<std::string, std::set<std::string> > m_previousEntries;
+    std::unordered_map<std::string,
+                       std::map<std::string, EntryLocation> > m_currentEntries;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_INDEXMERGER_H
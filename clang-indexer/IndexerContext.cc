@@ -2,9 +2,15 @@
 
 #include <clang/Basic/FileManager.h>
 #include <clang/Basic/SourceManager.h>
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
 
 #include "../libindexdb/IndexDb.h"
 #include "../libindexdb/IndexArchiveBuilder.h"
+#include "ContentHash.h"
+#include "HeaderRegistry.h"
 #include "NameGenerator.h"
 #include "Util.h"
 
@@ -65,19 +71,70 @@ static_assert(sizeof(symbolTypeNames) / sizeof(symbolTypeNames[0]) == ST_Max,
 ///////////////////////////////////////////////////////////////////////////////
 // IndexerFileContext
 
+// Replaces SourceManager::getLineNumber and getColumnNumber, which are too
+// slow to call for every reference.  Like them, this treats "\n", "\r",
+// "\r\n", and "\n\r" as line endings, and counts columns in bytes.
 Location IndexerFileContext::location(clang::SourceLocation spellingLoc)
 {
+    if (m_lineStarts.empty())
+        computeLineStarts();
+
+    const unsigned int offset =
+            m_context.sourceManager().getFileOffset(spellingLoc);
+    size_t lineIndex = m_lastLineIndex;
+    if (offset < m_lineStarts[lineIndex] ||
+            (lineIndex + 1 < m_lineStarts.size() &&
+                offset >= m_lineStarts[lineIndex + 1])) {
+        if (lineIndex + 2 < m_lineStarts.size() &&
+                offset >= m_lineStarts[lineIndex + 1] &&
+                offset < m_lineStarts[lineIndex + 2]) {
+            ++lineIndex;
+        } else {
+            lineIndex = std::upper_bound(m_lineStarts.begin(),
+                                         m_lineStarts.end(),
+                                         offset) - m_lineStarts.begin() - 1;
+        }
+        m_lastLineIndex = lineIndex;
+    }
+
     Location ret;
     ret.fileID = m_indexPathID;
-    clang::SourceManager &sourceManager = m_context.sourceManager();
-    unsigned int offset = sourceManager.getFileOffset(spellingLoc);
-    // TODO: The comment for getLineNumber says it's slow.  Is this going to
-    // be a problem?
-    ret.line = sourceManager.getLineNumber(m_clangFileID, offset);
-    ret.column = sourceManager.getColumnNumber(m_clangFileID, offset);
+    ret.line = lineIndex + 1;
+    ret.column = offset - m_lineStarts[lineIndex] + 1;
     return ret;
 }
 
+void IndexerFileContext::computeLineStarts()
+{
+    m_lineStarts.push_back(0);
+    m_lastLineIndex = 0;
+    bool invalid = false;
+    const llvm::MemoryBuffer *buffer =
+            m_context.sourceManager().getBuffer(m_clangFileID, &invalid);
+    if (invalid || buffer == NULL)
+        return;
+    const char *const start = buffer->getBufferStart();
+    const char *const end = buffer->getBufferEnd();
+
+    // Most files have no carriage returns, so memchr can find the newlines.
+    if (memchr(start, '\r', end - start) == NULL) {
+        const char *p = start;
+        while ((p = static_cast<const char*>(
+                    memchr(p, '\n', end - p))) != NULL) {
+            ++p;
+            m_lineStarts.push_back(p - start);
+        }
+        return;
+    }
+    for (const char *p = start; p < end; ++p) {
+        if (*p != '\n' && *p != '\r')
+            continue;
+        if (p + 1 < end && (p[1] == '\n' || p[1] == '\r') && p[1] != *p)
+            ++p;
+        m_lineStarts.push_back(p + 1 - start);
+    }
+}
+
 indexdb::ID IndexerFileContext::getDeclSymbolID(clang::NamedDecl *decl)
 {
     // Get the symbolID for the declaration.
@@ -86,9 +143,12 @@ indexdb::ID IndexerFileContext::getDeclSymbolID(clang::NamedDecl *decl)
     if (it != m_declNameCache.end()) {
         symbolID = it->second;
     } else {
-        m_tempSymbolName.clear();
-        getDeclName(decl, m_tempSymbolName);
-        symbolID = m_builder.insertSymbol(m_tempSymbolName.c_str());
+        // The name is shared with the other files of the TU.
+        const indexdb::StringTable &names = m_context.declNames();
+        const indexdb::ID nameID = m_context.getDeclNameID(decl);
+        symbolID = m_builder.insertSymbol(names.item(nameID),
+                                          names.itemSize(nameID),
+                                          names.itemHash(nameID));
         m_declNameCache[decl] = symbolID;
     }
     return symbolID;
@@ -97,12 +157,15 @@ indexdb::ID IndexerFileContext::getDeclSymbolID(clang::NamedDecl *decl)
 IndexerFileContext::IndexerFileContext(
         IndexerContext &context,
         clang::FileID fileID,
-        const std::string &pathSymbolName) :
+        const std::string &pathSymbolName,
+        bool isSkipped) :
     m_context(context),
     m_clangFileID(fileID),
+    m_isSkipped(isSkipped),
     m_index(new indexdb::Index),
     m_indexPathID(indexdb::kInvalidID),
-    m_builder(*m_index, /*createIndexTables=*/false)
+    m_builder(*m_index, /*createIndexTables=*/false),
+    m_lastLineIndex(0)
 {
     std::fill(&m_refTypeIDs[0],
               &m_refTypeIDs[RT_Max],
@@ -133,11 +196,35 @@ indexdb::ID IndexerFileContext::createSymbolTypeID(SymbolType symbolType)
 IndexerContext::IndexerContext(
         clang::SourceManager &sourceManager,
         clang::Preprocessor &preprocessor,
-        indexdb::IndexArchiveBuilder &archive) :
+        indexdb::IndexArchiveBuilder &archive,
+        const IndexerOptions &options) :
     m_sourceManager(sourceManager),
     m_preprocessor(preprocessor),
-    m_archive(archive)
+    m_archive(archive),
+    m_options(options)
 {
+    for (int i = 0; i < RT_Max; ++i)
+        m_recordedRefTypes[i] = true;
+    if (options.profile != IP_Full) {
+        m_recordedRefTypes[RT_Expansion] = false;
+        m_recordedRefTypes[RT_DefinedTest] = false;
+    }
+    if (options.profile == IP_DefsOnly) {
+        for (int i = 0; i < RT_Max; ++i) {
+            switch (static_cast<RefType>(i)) {
+            case RT_BaseClass:
+            case RT_Called:
+            case RT_Declaration:
+            case RT_Definition:
+            case RT_Included:
+            case RT_Undefinition:
+                break;
+            default:
+                m_recordedRefTypes[i] = false;
+                break;
+            }
+        }
+    }
 }
 
 // Get the IndexerFileContext associated with the given file ID.  Create a new
@@ -154,22 +241,19 @@ IndexerFileContext &IndexerContext::fileContext(clang::FileID fileID)
 
     // Get the name for the file.
     std::string pathSymbolName = "@";
-    {
-        const clang::FileEntry *pFE =
-                m_sourceManager.getFileEntryForID(fileID);
-        if (pFE != NULL) {
-            char *filename = portableRealPath(pFE->getName());
-            if (filename != NULL) {
-                pathSymbolName += filename;
-                free(filename);
-            }
-        } else {
-            pathSymbolName +=
-                    m_sourceManager.getBuffer(fileID)->getBufferIdentifier();
+    const clang::FileEntry *pFE = m_sourceManager.getFileEntryForID(fileID);
+    if (pFE != NULL) {
+        char *filename = portableRealPath(pFE->getName());
+        if (filename != NULL) {
+            pathSymbolName += filename;
+            free(filename);
         }
-        if (pathSymbolName.size() == 1)
-            pathSymbolName += "<blank>";
+    } else {
+        pathSymbolName +=
+                m_sourceManager.getBuffer(fileID)->getBufferIdentifier();
     }
+    if (pathSymbolName.size() == 1)
+        pathSymbolName += "<blank>";
 
     IndexerFileContext *ret = NULL;
 
@@ -180,17 +264,96 @@ IndexerFileContext &IndexerContext::fileContext(clang::FileID fileID)
     }
 
     if (ret == NULL) {
-        ret = new IndexerFileContext(*this, fileID, pathSymbolName);
+        // Ask the claimer whether another TU is indexing this header.  The
+        // main file and the built-in buffers are not claimed.
+        const bool isMainFile = fileID == m_sourceManager.getMainFileID();
+        bool isSkipped = isMainFile && m_options.skipMainFile;
+        if (m_options.headerClaimer != NULL && pFE != NULL && !isMainFile) {
+            const llvm::MemoryBuffer *buffer =
+                    m_sourceManager.getBuffer(fileID);
+            isSkipped = !m_options.headerClaimer->claim(
+                        pathSymbolName.substr(1),
+                        buffer->getBufferStart(),
+                        buffer->getBufferSize());
+        }
+        ret = new IndexerFileContext(*this, fileID, pathSymbolName, isSkipped);
         m_fileNameMap[pathSymbolName] = ret;
         m_fileContextSet.insert(ret);
         assert(pathSymbolName[0] == '@');
-        m_archive.insert(pathSymbolName.substr(1), ret->index());
+        if (!isSkipped)
+            m_archive.insert(pathSymbolName.substr(1), ret->index());
     }
 
     m_fileIDMap[fileID] = ret;
     return *ret;
 }
 
+bool IndexerContext::isOutsideProjectRoots(clang::SourceLocation loc)
+{
+    if (m_options.projectRoots.empty() || loc.isInvalid())
+        return false;
+    loc = m_sourceManager.getExpansionLoc(loc);
+    const clang::FileEntry *pFE =
+            m_sourceManager.getFileEntryForID(m_sourceManager.getFileID(loc));
+    if (pFE == NULL)
+        return false;
+    auto it = m_outsideProjectRoots.find(pFE);
+    if (it != m_outsideProjectRoots.end())
+        return it->second;
+
+    bool isOutside = true;
+    char *filename = portableRealPath(pFE->getName());
+    if (filename != NULL) {
+        const size_t filenameLength = strlen(filename);
+        for (const std::string &root : m_options.projectRoots) {
+            if (filenameLength > root.size() &&
+                    filename[root.size()] == '/' &&
+                    !strncmp(filename, root.c_str(), root.size())) {
+                isOutside = false;
+                break;
+            }
+        }
+        free(filename);
+    }
+    m_outsideProjectRoots[pFE] = isOutside;
+    return isOutside;
+}
+
+indexdb::ID IndexerContext::getDeclNameID(clang::NamedDecl *decl)
+{
+    auto it = m_declNameIDs.find(decl);
+    if (it != m_declNameIDs.end())
+        return it->second;
+    m_tempSymbolName.clear();
+    getDeclName(decl, m_tempSymbolName);
+    const indexdb::ID nameID = m_declNames.insert(m_tempSymbolName.c_str(),
+                                                  m_tempSymbolName.size());
+    m_declNameIDs[decl] = nameID;
+    return nameID;
+}
+
+// Store the content hash of every file read by the TU in the archive, so that
+// an incremental run can tell whether the archive is still up-to-date.
+void IndexerContext::recordInputHashes()
+{
+    std::map<std::string, std::string> hashes;
+    for (auto it = m_sourceManager.fileinfo_begin(),
+            itEnd = m_sourceManager.fileinfo_end(); it != itEnd; ++it) {
+        const llvm::MemoryBuffer *buffer = it->second->getRawBuffer();
+        if (buffer == NULL)
+            continue;
+        char *filename = portableRealPath(it->first->getName());
+        if (filename == NULL)
+            continue;
+        hashes[filename] = contentHash(buffer->getBufferStart(),
+                                       buffer->getBufferSize());
+        free(filename);
+    }
+    std::vector<std::pair<std::string, std::string> > inputs(
+                hashes.begin(), hashes.end());
+    m_archive.setMetadata(kInputHashesMetadata, formatInputHashes(inputs));
+}
+
 IndexerContext::~IndexerContext()
 {
     for (IndexerFileContext *fileContext : m_fileContextSet)
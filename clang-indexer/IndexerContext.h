@@ -4,14 +4,16 @@
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <clang/Basic/FileManager.h>
 #include <clang/Basic/SourceManager.h>
 
 #include "../libindexdb/IndexDb.h"
 #include "../libindexdb/IndexArchiveBuilder.h"
-#include "Location.h"
 #include "IndexBuilder.h"
+#include "IndexerOptions.h"
+#include "Location.h"
 
 namespace clang {
     class NamedDecl;
@@ -98,6 +100,10 @@ public:
     Location location(clang::SourceLocation spellingLoc);
     indexdb::ID getDeclSymbolID(clang::NamedDecl *decl);
 
+    // A skipped file is indexed by another TU.  Nothing should be recorded
+    // in it, and its index is not added to the archive.
+    bool isSkipped() { return m_isSkipped; }
+
     // Disallow copying of this class.
     IndexerFileContext(IndexerFileContext &other) = delete;
     IndexerFileContext &operator=(IndexerFileContext &other) = delete;
@@ -106,20 +112,28 @@ private:
     IndexerFileContext(
             IndexerContext &context,
             clang::FileID fileID,
-            const std::string &pathSymbolName);
+            const std::string &pathSymbolName,
+            bool isSkipped);
     indexdb::ID createRefTypeID(RefType refType);
     indexdb::ID createSymbolTypeID(SymbolType symbolType);
+    void computeLineStarts();
 
     IndexerContext &m_context;
     clang::FileID m_clangFileID;
+    bool m_isSkipped;
     indexdb::Index *m_index;
     indexdb::ID m_indexPathID;
     IndexBuilder m_builder;
 
-    std::string m_tempSymbolName;
     std::unordered_map<clang::NamedDecl*, indexdb::ID> m_declNameCache;
     indexdb::ID m_refTypeIDs[RT_Max];
     indexdb::ID m_symbolTypeIDs[ST_Max];
+
+    // The offset of the start of each line of the file, computed on the first
+    // call to location.  Consecutive references tend to be on the same or
+    // nearby lines, so the line of the previous lookup is tried first.
+    std::vector<unsigned int> m_lineStarts;
+    size_t m_lastLineIndex;
 };
 
 
@@ -132,12 +146,30 @@ public:
     IndexerContext(
             clang::SourceManager &sourceManager,
             clang::Preprocessor &preprocessor,
-            indexdb::IndexArchiveBuilder &archive);
+            indexdb::IndexArchiveBuilder &archive,
+            const IndexerOptions &options);
     ~IndexerContext();
     clang::SourceManager &sourceManager() { return m_sourceManager; }
     clang::Preprocessor &preprocessor() { return m_preprocessor; }
     indexdb::IndexArchiveBuilder &archive() { return m_archive; }
+    const IndexerOptions &options() { return m_options; }
+
+    // Whether the indexing profile records this kind of reference, and
+    // references to local variables and parameters.
+    bool isRecorded(RefType refType) { return m_recordedRefTypes[refType]; }
+    bool recordsLocals() { return m_options.profile == IP_Full; }
+
+    // Whether the location is in a file outside the options' project roots.
+    // Always false if there are no project roots.
+    bool isOutsideProjectRoots(clang::SourceLocation loc);
     IndexerFileContext &fileContext(clang::FileID fileID);
+    void recordInputHashes();
+
+    // Each declaration's symbol name, generated once per TU.  The names are
+    // interned in declNames, whose itemHash can be passed to the file
+    // contexts' string tables.
+    indexdb::ID getDeclNameID(clang::NamedDecl *decl);
+    const indexdb::StringTable &declNames() { return m_declNames; }
 
     // Disallow copying of this class.
     IndexerContext(IndexerContext &other) = delete;
@@ -153,9 +185,16 @@ private:
     clang::SourceManager &m_sourceManager;
     clang::Preprocessor &m_preprocessor;
     indexdb::IndexArchiveBuilder &m_archive;
+    IndexerOptions m_options;
+    bool m_recordedRefTypes[RT_Max];
     std::unordered_map<clang::FileID, IndexerFileContext*, FileIDHash> m_fileIDMap;
     std::unordered_map<std::string, IndexerFileContext*> m_fileNameMap;
     std::unordered_set<IndexerFileContext*> m_fileContextSet;
+    std::unordered_map<const clang::FileEntry*, bool> m_outsideProjectRoots;
+
+    std::string m_tempSymbolName;
+    indexdb::StringTable m_declNames;
+    std::unordered_map<clang::NamedDecl*, indexdb::ID> m_declNameIDs;
 };
 
 } // namespace indexer
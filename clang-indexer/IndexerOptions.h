@@ -0,0 +1,56 @@
+#ifndef INDEXER_INDEXEROPTIONS_H
+#define INDEXER_INDEXEROPTIONS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace indexer {
+
+class HeaderClaimer;
+
+// How much of a TU to index.  The lighter profiles are much faster and yield a
+// smaller index, which is enough for finding where global symbols are
+// declared, defined, and called.
+enum IndexProfile {
+    // Record everything.
+    IP_Full,
+    // Omit local variables and parameters, macro expansions and #if defined()
+    // tests, and template instantiations.
+    IP_Globals,
+    // Like IP_Globals, but also omit every reference other than declarations,
+    // definitions, calls, base classes, #include, and #undef.
+    IP_DefsOnly
+};
+
+struct IndexerOptions {
+    IndexerOptions() :
+        headerClaimer(NULL),
+        skipMainFile(false),
+        pchIsIndexed(false),
+        profile(IP_Full)
+    {
+    }
+
+    // If non-NULL, headers that the claimer refuses are not indexed.
+    HeaderClaimer *headerClaimer;
+
+    // Do not index the main file itself, only the files it includes.  This is
+    // used for the generated prefix header of an automatic PCH.
+    bool skipMainFile;
+
+    // The TU uses an -include-pch whose headers were indexed by a separate
+    // job, so declarations deserialized from the PCH are not traversed.
+    bool pchIsIndexed;
+
+    IndexProfile profile;
+
+    // If non-empty, the bodies of functions defined outside these directories
+    // (which must be real paths) are skipped by the parser and not indexed.
+    // The functions' declarations are still indexed.
+    std::vector<std::string> projectRoots;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_INDEXEROPTIONS_H
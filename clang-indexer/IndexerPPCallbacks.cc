@@ -37,6 +37,8 @@ void IndexerPPCallbacks::InclusionDirective(
     // Get the location of the #include filename.
     auto range = getIncludeFilenameLoc(filenameRange);
     IndexerFileContext &fileContext = *std::get<0>(range);
+    if (fileContext.isSkipped())
+        return;
 
     // Get the path ID of the included file.
     indexdb::ID symbolID;
@@ -119,6 +121,8 @@ void IndexerPPCallbacks::recordReference(
         const clang::Token &macroNameToken,
         RefType refType)
 {
+    if (!m_context.isRecorded(refType))
+        return;
     llvm::StringRef macroName = macroNameToken.getIdentifierInfo()->getName();
     m_tempSymbolName.clear();
     m_tempSymbolName.push_back('#');
@@ -129,6 +133,8 @@ void IndexerPPCallbacks::recordReference(
     if (sloc.isValid())
         fileID = m_context.sourceManager().getFileID(sloc);
     IndexerFileContext &fileContext = m_context.fileContext(fileID);
+    if (fileContext.isSkipped())
+        return;
     Location start = fileContext.location(sloc);
     Location end = start;
     end.column += macroName.size();
@@ -5,9 +5,11 @@
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 
 #if defined(SOURCEWEB_UNIX)
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -20,6 +22,7 @@
 #define NOMINMAX 1
 #endif
 #include <windows.h>
+#include <psapi.h>
 #endif // _WIN32
 
 #include "Mutex.h"
@@ -206,14 +209,15 @@ Process::Process(
     // Calling close() on these file descriptors will call CloseHandle().
     // (i.e. Ownership of the HANDLE is transferred.  See the _open_osfhandle
     // MSDN page.)
+    // The daemon protocol is binary.
     int stdinFd = _open_osfhandle(reinterpret_cast<intptr_t>(hStdinWrite),
-                                  _O_TEXT | _O_RDWR);
+                                  _O_BINARY | _O_RDWR);
     int stdoutFd = _open_osfhandle(reinterpret_cast<intptr_t>(hStdoutRead),
-                                   _O_TEXT | _O_RDONLY);
+                                   _O_BINARY | _O_RDONLY);
     assert(stdinFd != -1);
     assert(stdoutFd != -1);
-    m_stdinFile = _fdopen(stdinFd, "wt");
-    m_stdoutFile = _fdopen(stdoutFd, "rt");
+    m_stdinFile = _fdopen(stdinFd, "wb");
+    m_stdoutFile = _fdopen(stdoutFd, "rb");
     assert(m_stdinFile != NULL);
     assert(m_stdoutFile != NULL);
 #else
@@ -259,6 +263,52 @@ int Process::wait()
 #endif
 }
 
+// Kill the process without waiting for it.  Its pipes see end-of-file once
+// it is gone.  The caller must ensure that it isn't being reaped at the same
+// time.
+void Process::kill()
+{
+#if defined(SOURCEWEB_UNIX)
+    if (!m_p->reaped)
+        ::kill(m_p->pid, SIGKILL);
+#elif defined(_WIN32)
+    if (!m_p->reaped)
+        TerminateProcess(m_p->hproc, 1);
+#else
+#error "Process::kill not implemented on this OS."
+#endif
+}
+
+// Returns the current resident set size of the process, in kilobytes, or 0 if
+// it cannot be determined (e.g. the process has exited, or the OS is not
+// supported).
+uint64_t Process::memoryUsageKB()
+{
+#if defined(__linux__)
+    if (m_p->reaped)
+        return 0;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", static_cast<int>(m_p->pid));
+    std::ifstream status(path);
+    std::string line;
+    while (std::getline(status, line)) {
+        if (stringStartsWith(line, "VmRSS:"))
+            return strtoull(line.c_str() + 6, NULL, 10);
+    }
+    return 0;
+#elif defined(_WIN32)
+    if (m_p->reaped)
+        return 0;
+    PROCESS_MEMORY_COUNTERS counters;
+    memset(&counters, 0, sizeof(counters));
+    if (!GetProcessMemoryInfo(m_p->hproc, &counters, sizeof(counters)))
+        return 0;
+    return counters.WorkingSetSize / 1024;
+#else
+    return 0;
+#endif
+}
+
 void Process::closeStdin()
 {
     if (m_stdinFile != NULL) {
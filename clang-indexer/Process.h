@@ -1,6 +1,8 @@
 #ifndef INDEXER_PROCESS_H
 #define INDEXER_PROCESS_H
 
+#include <stdint.h>
+
 #include <cstdio>
 #include <string>
 #include <vector>
@@ -27,6 +29,8 @@ public:
     void closeStdin();
     void closeStdout();
     int wait();
+    void kill();
+    uint64_t memoryUsageKB();
     static Mutex &creationMutex() { return m_creationMutex; }
 private:
     ProcessPrivate *m_p;
@@ -0,0 +1,273 @@
+#include "Progress.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "DaemonPool.h"
+#include "Util.h"
+
+namespace indexer {
+
+const unsigned long kReportIntervalMS = 1000;
+
+// Connect to a Unix socket.  Returns -1 on failure.
+static int connectUnixSocket(const std::string &path)
+{
+#if defined(_WIN32)
+    std::cerr << "warning: --progress-socket is not supported on Windows"
+              << std::endl;
+    return -1;
+#else
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "warning: socket path too long: " << path << std::endl;
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("warning: socket");
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) != 0) {
+        std::cerr << "warning: cannot connect to " << path << ": "
+                  << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+void ProgressReporter::Thread::run()
+{
+    QMutexLocker lock(&m_reporter->m_mutex);
+    while (!m_reporter->m_stopping) {
+        lock.unlock();
+        m_reporter->report();
+        lock.relock();
+        if (!m_reporter->m_stopping)
+            m_reporter->m_stopRequested.wait(&m_reporter->m_mutex,
+                                             kReportIntervalMS);
+    }
+}
+
+ProgressReporter::ProgressReporter(
+        const ProgressOptions &options,
+        DaemonPool *daemonPool) :
+    m_daemonPool(daemonPool),
+    m_fd(options.fd),
+    m_ownsFd(false),
+    m_thread(this),
+    m_stopping(false),
+    m_phase("planning"),
+    m_startTime(monotonicSeconds()),
+    m_firstStartTime(0),
+    m_lastFinishTime(0),
+    m_totalCount(0),
+    m_doneCount(0),
+    m_failedCount(0),
+    m_inFlightCount(0),
+    m_indexedCount(0),
+    m_mergedCount(0),
+    m_mergedBytes(0),
+    m_queuedPredictedSeconds(0),
+    m_donePredictedSeconds(0)
+{
+    if (!options.socketPath.empty()) {
+        m_fd = connectUnixSocket(options.socketPath);
+        m_ownsFd = m_fd != -1;
+    }
+#if !defined(_WIN32)
+    // A monitor that goes away must not kill the indexer.  Writes to a closed
+    // pipe or socket fail with EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    if (m_thread.isRunning())
+        stop();
+    if (m_ownsFd) {
+#if defined(_WIN32)
+        _close(m_fd);
+#else
+        close(m_fd);
+#endif
+    }
+}
+
+void ProgressReporter::start()
+{
+    m_thread.start();
+}
+
+void ProgressReporter::stop()
+{
+    {
+        QMutexLocker lock(&m_mutex);
+        m_stopping = true;
+        m_phase = "done";
+        m_stopRequested.wakeAll();
+    }
+    m_thread.wait();
+    report();
+}
+
+void ProgressReporter::setPhase(const char *phase)
+{
+    QMutexLocker lock(&m_mutex);
+    m_phase = phase;
+}
+
+void ProgressReporter::addQueuedTUs(int count, double predictedSeconds)
+{
+    QMutexLocker lock(&m_mutex);
+    m_totalCount += count;
+    m_queuedPredictedSeconds += predictedSeconds;
+}
+
+void ProgressReporter::addReusedTUs(int count)
+{
+    QMutexLocker lock(&m_mutex);
+    m_totalCount += count;
+    m_doneCount += count;
+}
+
+// The checkpoint that a resumed run starts from has already merged these TUs.
+void ProgressReporter::addResumedTUs(int count)
+{
+    QMutexLocker lock(&m_mutex);
+    m_totalCount += count;
+    m_doneCount += count;
+    m_mergedCount += count;
+}
+
+void ProgressReporter::startTU()
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_firstStartTime == 0)
+        m_firstStartTime = monotonicSeconds();
+    m_inFlightCount++;
+}
+
+void ProgressReporter::finishTU(double predictedSeconds, bool success)
+{
+    QMutexLocker lock(&m_mutex);
+    m_inFlightCount--;
+    m_doneCount++;
+    m_indexedCount++;
+    if (!success)
+        m_failedCount++;
+    m_donePredictedSeconds += predictedSeconds;
+    m_lastFinishTime = monotonicSeconds();
+}
+
+void ProgressReporter::mergeTU(uint64_t bytes)
+{
+    QMutexLocker lock(&m_mutex);
+    m_mergedCount++;
+    m_mergedBytes += bytes;
+}
+
+void ProgressReporter::report()
+{
+    // Query the pool first.  It reads the daemons' memory usage from the OS.
+    const DaemonPoolStatus poolStatus = m_daemonPool->status();
+
+    QMutexLocker lock(&m_mutex);
+    if (m_fd == -1)
+        return;
+    const double now = monotonicSeconds();
+    const int queuedCount = m_totalCount - m_doneCount - m_inFlightCount;
+    const double indexingSeconds =
+            m_firstStartTime == 0 ? 0.0 : now - m_firstStartTime;
+    const double tusPerSecond =
+            indexingSeconds > 0 ? m_indexedCount / indexingSeconds : 0.0;
+    char eta[32] = "null";
+    if (!strcmp(m_phase, "indexing") && indexingSeconds > 0) {
+        // Scale the predicted cost of the remaining work by the time the
+        // finished TUs took per predicted second.  Without predictions, fall
+        // back to counting TUs.
+        double remaining = -1;
+        if (m_donePredictedSeconds > 0) {
+            remaining = (m_queuedPredictedSeconds - m_donePredictedSeconds) *
+                    indexingSeconds / m_donePredictedSeconds;
+        } else if (m_indexedCount > 0) {
+            remaining = (queuedCount + m_inFlightCount) *
+                    indexingSeconds / m_indexedCount;
+        }
+        if (remaining >= 0)
+            snprintf(eta, sizeof(eta), "%.1f", remaining);
+    }
+    const double lastEventTime =
+            m_lastFinishTime != 0 ? m_lastFinishTime :
+            m_firstStartTime != 0 ? m_firstStartTime : m_startTime;
+
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"phase\":\"%s\",\"elapsed_s\":%.1f,"
+             "\"tus_total\":%d,\"tus_done\":%d,\"tus_failed\":%d,"
+             "\"tus_in_flight\":%d,\"tus_queued\":%d,\"tus_per_s\":%.2f,"
+             "\"bytes_merged\":%llu,\"merge_queue\":%d,"
+             "\"daemons\":%d,\"daemons_busy\":%d,\"daemon_rss_kb\":%llu,"
+             "\"eta_s\":%s,\"idle_s\":%.1f}\n",
+             m_phase, now - m_startTime,
+             m_totalCount, m_doneCount, m_failedCount,
+             m_inFlightCount, queuedCount, tusPerSecond,
+             static_cast<unsigned long long>(m_mergedBytes),
+             m_doneCount - m_mergedCount,
+             poolStatus.daemonCount, poolStatus.busyCount,
+             static_cast<unsigned long long>(poolStatus.residentKB),
+             eta, now - lastEventTime);
+    writeLine(line);
+}
+
+// Write the line in full, or give up on reporting.  The mutex must be held.
+void ProgressReporter::writeLine(const std::string &line)
+{
+    size_t offset = 0;
+    while (offset < line.size()) {
+#if defined(_WIN32)
+        const int amount = _write(m_fd, line.data() + offset,
+                                  line.size() - offset);
+#else
+        const ssize_t amount = write(m_fd, line.data() + offset,
+                                     line.size() - offset);
+        if (amount == -1 && errno == EINTR)
+            continue;
+#endif
+        if (amount <= 0) {
+            std::cerr << "warning: cannot write progress: "
+                      << strerror(errno) << std::endl;
+            if (m_ownsFd) {
+#if defined(_WIN32)
+                _close(m_fd);
+#else
+                close(m_fd);
+#endif
+                m_ownsFd = false;
+            }
+            m_fd = -1;
+            return;
+        }
+        offset += amount;
+    }
+}
+
+} // namespace indexer
@@ -0,0 +1,105 @@
+#ifndef INDEXER_PROGRESS_H
+#define INDEXER_PROGRESS_H
+
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <stdint.h>
+#include <string>
+
+namespace indexer {
+
+class DaemonPool;
+
+// Progress reporting
+//
+// With --progress=json, --index-project writes a line of JSON describing the
+// run once a second, and once more when the run finishes, e.g.:
+//
+//     {"phase":"indexing","elapsed_s":12.0,"tus_total":400,"tus_done":120,
+//      "tus_failed":0,"tus_in_flight":8,"tus_queued":272,"tus_per_s":10.00,
+//      "bytes_merged":5242880,"merge_queue":3,"daemons":8,"daemons_busy":8,
+//      "daemon_rss_kb":2097152,"eta_s":28.0,"idle_s":0.2}
+//
+// (The real lines are not wrapped.)  The phase is planning, indexing,
+// writing, or done.  The TU counts include the automatic PCHs, the reused
+// idx files, and the TUs resumed from a checkpoint.  tus_done counts the TUs
+// whose idx files are ready, and merge_queue the ones among them that are
+// still waiting to be merged.  A resumed TU is already merged.
+// eta_s is the time left for indexing, predicted from the cost model's per-TU
+// estimates scaled by how the finished TUs compare to theirs.  It is null
+// until the first TU finishes and once indexing is over.  idle_s is the time
+// since a TU last finished, which tells a stuck run from a slow one.
+//
+// The lines go to a file descriptor (stderr by default), or to a Unix socket
+// that a monitor is listening on.
+
+struct ProgressOptions {
+    ProgressOptions() : enabled(false), fd(2) {}
+    bool enabled;
+    int fd;
+    std::string socketPath;     // Overrides fd.
+};
+
+class ProgressReporter
+{
+public:
+    ProgressReporter(const ProgressOptions &options, DaemonPool *daemonPool);
+    ~ProgressReporter();
+
+    // Start the reporting thread.
+    void start();
+
+    // Call stop() to write the final report.
+    void stop();
+
+    void setPhase(const char *phase);
+    void addQueuedTUs(int count, double predictedSeconds);
+    void addReusedTUs(int count);
+    void addResumedTUs(int count);
+    void startTU();
+    void finishTU(double predictedSeconds, bool success);
+    void mergeTU(uint64_t bytes);
+
+    // Disallow copying of this class.
+    ProgressReporter(const ProgressReporter &other) = delete;
+    ProgressReporter &operator=(const ProgressReporter &other) = delete;
+
+private:
+    class Thread : public QThread {
+    public:
+        Thread(ProgressReporter *reporter) : m_reporter(reporter) {}
+    protected:
+        void run();
+    private:
+        ProgressReporter *m_reporter;
+    };
+
+    void report();
+    void writeLine(const std::string &line);
+
+    DaemonPool *m_daemonPool;
+    int m_fd;
+    bool m_ownsFd;
+    Thread m_thread;
+    QMutex m_mutex;
+    QWaitCondition m_stopRequested;
+    bool m_stopping;
+    const char *m_phase;
+    double m_startTime;
+    double m_firstStartTime;
+    double m_lastFinishTime;
+    int m_totalCount;
+    int m_doneCount;
+    int m_failedCount;
+    int m_inFlightCount;
+    int m_indexedCount;
+    int m_mergedCount;
+    uint64_t m_mergedBytes;
+    double m_queuedPredictedSeconds;
+    double m_donePredictedSeconds;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_PROGRESS_H
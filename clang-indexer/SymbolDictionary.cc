@@ -0,0 +1,312 @@
+#include "SymbolDictionary.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../libindexdb/IndexArchiveBuilder.h"
+#include "../libindexdb/IndexDb.h"
+#include "ContentHash.h"
+
+namespace indexer {
+
+const char kSymbolDictionaryMetadata[] = "symbol-dictionary";
+const char kSymbolDictionaryIDTable[] = "SymbolDictionaryID";
+
+const char kSignature[8] = { 'S', 'W', 'S', 'Y', 'M', 'D', '1', '\0' };
+const uint32_t kSlotCount = 1 << 24;
+const uint64_t kArenaSize = 1 << 30;
+const uint64_t kHeaderSize = 128;
+
+// Stop inserting long before the hash table is full, to keep probe sequences
+// short.
+const uint64_t kMaxSymbolCount = kSlotCount / 4 * 3;
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+              "std::atomic<uint64_t> must have the size of uint64_t");
+
+struct SymbolDictionary::Header {
+    char signature[8];
+    uint32_t slotCount;
+    uint32_t padding;
+    uint64_t arenaSize;
+    char token[32];
+    std::atomic<uint64_t> arenaUsed;
+    std::atomic<uint64_t> symbolCount;
+};
+
+// A slot is 0 if empty.  Otherwise, its high 32 bits are the string's hash,
+// and its low 32 bits are the offset of the string's record in the arena.  A
+// record is the string's 32-bit size followed by the NUL-terminated string.
+// Offset 0 is never used.
+
+static std::atomic<uint64_t> &slotAt(uint64_t *slots, indexdb::ID id)
+{
+    return *reinterpret_cast<std::atomic<uint64_t>*>(&slots[id]);
+}
+
+static uint64_t recordSize(uint32_t size)
+{
+    // Keep the records' size fields aligned.
+    return (sizeof(uint32_t) + size + 1 + 3) & ~static_cast<uint64_t>(3);
+}
+
+SymbolDictionary::SymbolDictionary() : m_data(NULL), m_size(0)
+{
+}
+
+SymbolDictionary::~SymbolDictionary()
+{
+    unmap();
+}
+
+SymbolDictionary::Header *SymbolDictionary::header() const
+{
+    static_assert(sizeof(Header) <= kHeaderSize,
+                  "SymbolDictionary::Header is too large");
+    return static_cast<Header*>(m_data);
+}
+
+uint64_t *SymbolDictionary::slots() const
+{
+    return reinterpret_cast<uint64_t*>(static_cast<char*>(m_data) +
+                                       kHeaderSize);
+}
+
+char *SymbolDictionary::arena() const
+{
+    return static_cast<char*>(m_data) + kHeaderSize +
+            header()->slotCount * sizeof(uint64_t);
+}
+
+#ifdef _WIN32
+
+bool SymbolDictionary::open(const std::string &path)
+{
+    return false;
+}
+
+bool SymbolDictionary::create(const std::string &path)
+{
+    return false;
+}
+
+bool SymbolDictionary::map(int fd)
+{
+    return false;
+}
+
+void SymbolDictionary::unmap()
+{
+}
+
+#else
+
+bool SymbolDictionary::open(const std::string &path)
+{
+    unmap();
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd == -1)
+        return false;
+    const bool result = map(fd);
+    close(fd);
+    if (!result)
+        return false;
+    const Header *h = header();
+    if (m_size < kHeaderSize ||
+            memcmp(h->signature, kSignature, sizeof(kSignature)) != 0 ||
+            m_size != kHeaderSize + h->slotCount * sizeof(uint64_t) +
+                    h->arenaSize) {
+        unmap();
+        return false;
+    }
+    m_token.assign(h->token, sizeof(h->token));
+    return true;
+}
+
+bool SymbolDictionary::create(const std::string &path)
+{
+    unmap();
+    remove(path.c_str());
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+        return false;
+    // The file is sparse, so its pages only take up space once used.
+    const uint64_t size = kHeaderSize + kSlotCount * sizeof(uint64_t) +
+            kArenaSize;
+    bool result = ftruncate(fd, size) == 0 && map(fd);
+    close(fd);
+    if (!result)
+        return false;
+
+    char seed[256];
+    snprintf(seed, sizeof(seed), "%s %ld %ld %p", path.c_str(),
+             static_cast<long>(time(NULL)), static_cast<long>(getpid()),
+             static_cast<void*>(&seed));
+    m_token = contentHash(seed, strlen(seed));
+    Header *h = header();
+    h->slotCount = kSlotCount;
+    h->arenaSize = kArenaSize;
+    assert(m_token.size() == sizeof(h->token));
+    memcpy(h->token, m_token.data(), sizeof(h->token));
+    h->arenaUsed.store(sizeof(uint64_t));
+    h->symbolCount.store(0);
+    memcpy(h->signature, kSignature, sizeof(kSignature));
+    return true;
+}
+
+bool SymbolDictionary::map(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(kHeaderSize))
+        return false;
+    void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (data == MAP_FAILED)
+        return false;
+    m_data = data;
+    m_size = st.st_size;
+    return true;
+}
+
+void SymbolDictionary::unmap()
+{
+    if (m_data != NULL)
+        munmap(m_data, m_size);
+    m_data = NULL;
+    m_size = 0;
+    m_token.clear();
+}
+
+#endif
+
+// Open the dictionary, or replace it with an empty one if it doesn't exist or
+// is half full.
+bool SymbolDictionary::openOrCreate(const std::string &path)
+{
+    if (open(path) &&
+            header()->symbolCount.load() < kMaxSymbolCount / 2 &&
+            header()->arenaUsed.load() < header()->arenaSize / 2)
+        return true;
+    return create(path);
+}
+
+indexdb::ID SymbolDictionary::insert(
+        const char *data,
+        uint32_t size,
+        uint32_t hash)
+{
+    Header *h = header();
+    uint64_t *s = slots();
+    char *a = arena();
+    uint64_t recordOffset = 0;
+    indexdb::ID id = hash % h->slotCount;
+    for (uint32_t probe = 0; probe < h->slotCount; ++probe) {
+        std::atomic<uint64_t> &slot = slotAt(s, id);
+        uint64_t value = slot.load(std::memory_order_acquire);
+        if (value == 0) {
+            if (h->symbolCount.load(std::memory_order_relaxed) >=
+                    kMaxSymbolCount)
+                return indexdb::kInvalidID;
+            if (recordOffset == 0) {
+                const uint64_t recordBytes = recordSize(size);
+                recordOffset = h->arenaUsed.fetch_add(recordBytes);
+                if (recordOffset + recordBytes > h->arenaSize)
+                    return indexdb::kInvalidID;
+                memcpy(a + recordOffset, &size, sizeof(size));
+                memcpy(a + recordOffset + sizeof(size), data, size);
+                a[recordOffset + sizeof(size) + size] = '\0';
+            }
+            const uint64_t newValue =
+                    (static_cast<uint64_t>(hash) << 32) | recordOffset;
+            if (slot.compare_exchange_strong(value, newValue,
+                                             std::memory_order_acq_rel)) {
+                h->symbolCount.fetch_add(1, std::memory_order_relaxed);
+                return id;
+            }
+            // Another daemon filled the slot first.  value is now its
+            // contents.
+        }
+        if ((value >> 32) == hash) {
+            const char *record = a + static_cast<uint32_t>(value);
+            uint32_t recordStringSize;
+            memcpy(&recordStringSize, record, sizeof(recordStringSize));
+            if (recordStringSize == size &&
+                    memcmp(record + sizeof(uint32_t), data, size) == 0)
+                return id;
+        }
+        id = (id + 1) % h->slotCount;
+    }
+    return indexdb::kInvalidID;
+}
+
+const char *SymbolDictionary::item(indexdb::ID id) const
+{
+    const uint64_t value = slotAt(slots(), id).load(std::memory_order_acquire);
+    assert(value != 0);
+    return arena() + static_cast<uint32_t>(value) + sizeof(uint32_t);
+}
+
+uint32_t SymbolDictionary::itemSize(indexdb::ID id) const
+{
+    uint32_t result;
+    memcpy(&result, item(id) - sizeof(uint32_t), sizeof(result));
+    return result;
+}
+
+uint32_t SymbolDictionary::itemHash(indexdb::ID id) const
+{
+    return slotAt(slots(), id).load(std::memory_order_acquire) >> 32;
+}
+
+bool recordSymbolDictionaryIDs(
+        indexdb::IndexArchiveBuilder &archive,
+        SymbolDictionary &dictionary)
+{
+    // Look up every symbol before changing any entry.
+    std::map<indexdb::Index*, std::vector<indexdb::ID> > entryIDs;
+    for (const auto &pair : archive.indices()) {
+        const indexdb::StringTable *symbols =
+                pair.second->stringTable("Symbol");
+        if (symbols == NULL)
+            continue;
+        std::vector<indexdb::ID> &ids = entryIDs[pair.second];
+        ids.resize(symbols->size());
+        for (indexdb::ID id = 0; id < symbols->size(); ++id) {
+            ids[id] = dictionary.insert(symbols->item(id),
+                                        symbols->itemSize(id),
+                                        symbols->itemHash(id));
+            if (ids[id] == indexdb::kInvalidID)
+                return false;
+        }
+    }
+
+    std::vector<std::string> columns;
+    columns.push_back("Symbol");
+    columns.push_back("");          // Dictionary ID
+    for (const auto &pair : entryIDs) {
+        indexdb::Table *table =
+                pair.first->addTable(kSymbolDictionaryIDTable, columns);
+        indexdb::Row row(2);
+        for (indexdb::ID id = 0; id < pair.second.size(); ++id) {
+            row[0] = id;
+            row[1] = pair.second[id];
+            table->add(row);
+        }
+    }
+    archive.setMetadata(kSymbolDictionaryMetadata, dictionary.token());
+    return true;
+}
+
+} // namespace indexer
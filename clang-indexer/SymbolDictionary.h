@@ -0,0 +1,87 @@
+#ifndef INDEXER_SYMBOLDICTIONARY_H
+#define INDEXER_SYMBOLDICTIONARY_H
+
+#include <stdint.h>
+#include <string>
+
+#include "../libindexdb/StringTable.h"
+
+namespace indexdb {
+    class IndexArchiveBuilder;
+}
+
+namespace indexer {
+
+// Project-wide symbol dictionary
+//
+// Each archive entry has its own Symbol string table, so merging an entry
+// into the project index means looking up every one of its symbol strings in
+// the index's table.  With --index-project --symbol-dictionary, the daemons
+// share a dictionary that assigns every symbol a project-wide ID.  Each entry
+// then carries a SymbolDictionaryID table mapping its Symbol IDs to
+// dictionary IDs, and the merger translates the entry's rows through integer
+// IDs alone.  Each distinct symbol string is copied into the index once, from
+// the dictionary.
+//
+// The dictionary is a file that every daemon maps into memory: a header, a
+// fixed-size open-addressing hash table, and an append-only arena of
+// strings.  A symbol's ID is the index of its hash table slot.  Insertion is
+// lock-free: a daemon appends the string to the arena, then publishes it by
+// compare-and-swapping the slot from empty to the string's hash and offset.
+// (A daemon that loses the race leaves its copy of the string unused.)
+// Nothing is ever removed, and the hash table is never resized; once the
+// dictionary fills up, the daemons stop using it, and the next
+// --index-project run starts a new one.
+//
+// The dictionary is kept between runs so that the idx files reused by
+// --incremental runs keep their dictionary IDs.  Each dictionary has a random
+// token, which the archives record.
+
+extern const char kSymbolDictionaryMetadata[];
+extern const char kSymbolDictionaryIDTable[];
+
+class SymbolDictionary
+{
+public:
+    SymbolDictionary();
+    ~SymbolDictionary();
+    bool open(const std::string &path);
+    bool openOrCreate(const std::string &path);
+    const std::string &token() const { return m_token; }
+
+    // Returns kInvalidID if the dictionary is full.  The hash must be the
+    // StringTable::hashString of the string.
+    indexdb::ID insert(const char *data, uint32_t size, uint32_t hash);
+    const char *item(indexdb::ID id) const;
+    uint32_t itemSize(indexdb::ID id) const;
+    uint32_t itemHash(indexdb::ID id) const;
+
+    // Disallow copying of this class.
+    SymbolDictionary(SymbolDictionary &other) = delete;
+    SymbolDictionary &operator=(SymbolDictionary &other) = delete;
+
+private:
+    struct Header;
+
+    bool create(const std::string &path);
+    bool map(int fd);
+    void unmap();
+    Header *header() const;
+    uint64_t *slots() const;
+    char *arena() const;
+
+    void *m_data;
+    uint64_t m_size;
+    std::string m_token;
+};
+
+// Add a SymbolDictionaryID table to each of the archive's entries and record
+// the dictionary's token in the archive.  Returns false, leaving the archive
+// alone, if the dictionary is full.
+bool recordSymbolDictionaryIDs(
+        indexdb::IndexArchiveBuilder &archive,
+        SymbolDictionary &dictionary);
+
+} // namespace indexer
+
+#endif // INDEXER_SYMBOLDICTIONARY_H
@@ -8,10 +8,14 @@
 #include <clang/Basic/FileManager.h>
 #include <clang/Basic/FileSystemOptions.h>
 #include <clang/Basic/SourceManager.h>
+#include <clang/Basic/VirtualFileSystem.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendAction.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/MultiplexConsumer.h>
 #include <clang/Lex/Preprocessor.h>
 #include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/SmallString.h>
 #include <llvm/ADT/StringRef.h>
 #include <iostream>
 #include <memory>
@@ -21,9 +25,11 @@
 #include "../libindexdb/IndexDb.h"
 #include "../libindexdb/IndexArchiveBuilder.h"
 #include "ASTIndexer.h"
+#include "FileCache.h"
 #include "IndexBuilder.h"
 #include "IndexerContext.h"
 #include "IndexerPPCallbacks.h"
+#include "Trace.h"
 
 namespace indexer {
 
@@ -37,24 +43,110 @@ public:
 
 private:
     void HandleTranslationUnit(clang::ASTContext &ctx);
+    bool shouldSkipFunctionBody(clang::Decl *d);
 
     IndexerContext &m_context;
 };
 
 void IndexerASTConsumer::HandleTranslationUnit(clang::ASTContext &ctx)
 {
+    TraceSpan span("index AST");
     ASTIndexer iv(m_context);
     iv.indexDecl(ctx.getTranslationUnitDecl());
+    m_context.recordInputHashes();
+}
+
+// The parser only asks when SkipFunctionBodies is set.  (See IndexerAction.)
+// Sema still parses the bodies it needs, e.g. those of constexpr functions.
+bool IndexerASTConsumer::shouldSkipFunctionBody(clang::Decl *d)
+{
+    return m_context.isOutsideProjectRoots(d->getLocation());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DiagnosticCounter
+
+// Counts the parser's diagnostics, and keeps the text of the first error.
+class DiagnosticCounter : public clang::DiagnosticConsumer {
+public:
+    DiagnosticCounter(TUDiagnostics &diagnostics) :
+        m_diagnostics(diagnostics)
+    {
+    }
+
+    void HandleDiagnostic(clang::DiagnosticsEngine::Level level,
+                          const clang::Diagnostic &info) override;
+
+private:
+    TUDiagnostics &m_diagnostics;
+};
+
+void DiagnosticCounter::HandleDiagnostic(
+        clang::DiagnosticsEngine::Level level,
+        const clang::Diagnostic &info)
+{
+    clang::DiagnosticConsumer::HandleDiagnostic(level, info);
+    if (level == clang::DiagnosticsEngine::Warning) {
+        m_diagnostics.warningCount++;
+        return;
+    }
+    if (level < clang::DiagnosticsEngine::Error)
+        return;
+    m_diagnostics.errorCount++;
+    if (!m_diagnostics.firstError.empty())
+        return;
+    if (info.getLocation().isValid() && info.hasSourceManager()) {
+        const clang::PresumedLoc ploc =
+                info.getSourceManager().getPresumedLoc(info.getLocation());
+        if (ploc.isValid()) {
+            m_diagnostics.firstError = std::string(ploc.getFilename()) + ":" +
+                    std::to_string(ploc.getLine()) + ":" +
+                    std::to_string(ploc.getColumn()) + ": ";
+        }
+    }
+    llvm::SmallString<128> message;
+    info.FormatDiagnostic(message);
+    m_diagnostics.firstError += message.str().str();
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////
 // IndexerAction
 
+static IndexerContext *createIndexerContext(
+        clang::CompilerInstance &ci,
+        indexdb::IndexArchiveBuilder &archive,
+        const IndexerOptions &options)
+{
+    return new IndexerContext(
+                ci.getSourceManager(),
+                ci.getPreprocessor(),
+                archive,
+                options);
+}
+
+static void addIndexerPPCallbacks(
+        clang::CompilerInstance &ci,
+        IndexerContext &context,
+        TUDiagnostics *diagnostics)
+{
+    if (diagnostics != NULL)
+        ci.getDiagnostics().setClient(new DiagnosticCounter(*diagnostics));
+    else
+        ci.getDiagnostics().setClient(new clang::IgnoringDiagConsumer);
+    ci.getPreprocessor().addPPCallbacks(
+        std::unique_ptr<clang::PPCallbacks>(
+            new IndexerPPCallbacks(context)));
+}
+
 class IndexerAction : public clang::ASTFrontendAction {
 public:
-    IndexerAction(indexdb::IndexArchiveBuilder &archive) :
-        m_archive(archive), m_context(NULL)
+    IndexerAction(indexdb::IndexArchiveBuilder &archive,
+                  const IndexerOptions &options,
+                  TUDiagnostics *diagnostics) :
+        m_archive(archive), m_options(options), m_diagnostics(diagnostics),
+        m_context(NULL)
     {
     }
 
@@ -65,12 +157,8 @@ public:
 
 private:
     IndexerContext &getContext(clang::CompilerInstance &ci) {
-        if (m_context == NULL) {
-            m_context = new IndexerContext(
-                        ci.getSourceManager(),
-                        ci.getPreprocessor(),
-                        m_archive);
-        }
+        if (m_context == NULL)
+            m_context = createIndexerContext(ci, m_archive, m_options);
         return *m_context;
     }
 
@@ -83,14 +171,74 @@ private:
 
     virtual bool BeginSourceFileAction(clang::CompilerInstance &ci,
                                        llvm::StringRef filename) {
-        ci.getDiagnostics().setClient(new clang::IgnoringDiagConsumer);
-        ci.getPreprocessor().addPPCallbacks(
-            std::unique_ptr<clang::PPCallbacks>(
-                new IndexerPPCallbacks(getContext(ci))));
+        addIndexerPPCallbacks(ci, getContext(ci), m_diagnostics);
+        // The PCHIndexerAction can't skip bodies, because the PCH needs them.
+        if (!m_options.projectRoots.empty())
+            ci.getFrontendOpts().SkipFunctionBodies = true;
         return true;
     }
 
     indexdb::IndexArchiveBuilder &m_archive;
+    IndexerOptions m_options;
+    TUDiagnostics *m_diagnostics;
+    IndexerContext *m_context;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// PCHIndexerAction
+
+// Writes a precompiled header (to the -o path) and indexes the headers it
+// contains, from a single parse.
+class PCHIndexerAction : public clang::WrapperFrontendAction {
+public:
+    PCHIndexerAction(indexdb::IndexArchiveBuilder &archive,
+                     const IndexerOptions &options,
+                     TUDiagnostics *diagnostics) :
+        clang::WrapperFrontendAction(new clang::GeneratePCHAction),
+        m_archive(archive), m_options(options), m_diagnostics(diagnostics),
+        m_context(NULL)
+    {
+    }
+
+    ~PCHIndexerAction()
+    {
+        delete m_context;
+    }
+
+private:
+    IndexerContext &getContext(clang::CompilerInstance &ci) {
+        if (m_context == NULL)
+            m_context = createIndexerContext(ci, m_archive, m_options);
+        return *m_context;
+    }
+
+    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+            clang::CompilerInstance &ci,
+            llvm::StringRef inFile) {
+        std::unique_ptr<clang::ASTConsumer> pchConsumer =
+                clang::WrapperFrontendAction::CreateASTConsumer(ci, inFile);
+        if (!pchConsumer)
+            return nullptr;
+        std::vector<std::unique_ptr<clang::ASTConsumer> > consumers;
+        consumers.push_back(std::move(pchConsumer));
+        consumers.push_back(std::unique_ptr<clang::ASTConsumer>(
+            new IndexerASTConsumer(getContext(ci))));
+        return std::unique_ptr<clang::ASTConsumer>(
+            new clang::MultiplexConsumer(std::move(consumers)));
+    }
+
+    virtual bool BeginSourceFileAction(clang::CompilerInstance &ci,
+                                       llvm::StringRef filename) {
+        if (!clang::WrapperFrontendAction::BeginSourceFileAction(ci, filename))
+            return false;
+        addIndexerPPCallbacks(ci, getContext(ci), m_diagnostics);
+        return true;
+    }
+
+    indexdb::IndexArchiveBuilder &m_archive;
+    IndexerOptions m_options;
+    TUDiagnostics *m_diagnostics;
     IndexerContext *m_context;
 };
 
@@ -98,13 +246,44 @@ private:
 ///////////////////////////////////////////////////////////////////////////////
 // indexTranslationUnit
 
+// Each TU gets its own FileManager, because the FileManager caches relative
+// paths, and the working directory changes between TUs.  If the process has
+// a file cache, the FileManagers share it.
+static clang::FileManager *createFileManager()
+{
+    clang::vfs::FileSystem *cache = fileCache();
+    if (cache == NULL)
+        return new clang::FileManager(clang::FileSystemOptions());
+    beginFileCacheTranslationUnit();
+    return new clang::FileManager(
+                clang::FileSystemOptions(),
+                llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem>(cache));
+}
+
 void indexTranslationUnit(
         const std::vector<std::string> &argv,
-        indexdb::IndexArchiveBuilder &archive)
+        indexdb::IndexArchiveBuilder &archive,
+        const IndexerOptions &options,
+        TUDiagnostics *diagnostics)
+{
+    llvm::IntrusiveRefCntPtr<clang::FileManager> fm(createFileManager());
+    std::unique_ptr<IndexerAction> action(
+                new IndexerAction(archive, options, diagnostics));
+    clang::tooling::ToolInvocation ti(argv, action.release(), fm.get());
+    ti.run();
+}
+
+// The argv must compile a header (e.g. -x c++-header) with an -o option naming
+// the PCH file to write.
+void buildPrecompiledHeader(
+        const std::vector<std::string> &argv,
+        indexdb::IndexArchiveBuilder &archive,
+        const IndexerOptions &options,
+        TUDiagnostics *diagnostics)
 {
-    llvm::IntrusiveRefCntPtr<clang::FileManager> fm(
-        new clang::FileManager(clang::FileSystemOptions()));
-    std::unique_ptr<IndexerAction> action(new IndexerAction(archive));
+    llvm::IntrusiveRefCntPtr<clang::FileManager> fm(createFileManager());
+    std::unique_ptr<PCHIndexerAction> action(
+                new PCHIndexerAction(archive, options, diagnostics));
     clang::tooling::ToolInvocation ti(argv, action.release(), fm.get());
     ti.run();
 }
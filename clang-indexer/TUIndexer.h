@@ -4,15 +4,33 @@
 #include <string>
 #include <vector>
 
+#include "IndexerOptions.h"
+
 namespace indexdb {
     class IndexArchiveBuilder;
 }
 
 namespace indexer {
 
+// The parser's diagnostics for a TU.  Indexing carries on past errors.
+struct TUDiagnostics {
+    TUDiagnostics() : errorCount(0), warningCount(0) {}
+    unsigned errorCount;
+    unsigned warningCount;
+    std::string firstError;     // "path:line:column: message"
+};
+
 void indexTranslationUnit(
         const std::vector<std::string> &argv,
-        indexdb::IndexArchiveBuilder &archive);
+        indexdb::IndexArchiveBuilder &archive,
+        const IndexerOptions &options=IndexerOptions(),
+        TUDiagnostics *diagnostics=NULL);
+
+void buildPrecompiledHeader(
+        const std::vector<std::string> &argv,
+        indexdb::IndexArchiveBuilder &archive,
+        const IndexerOptions &options=IndexerOptions(),
+        TUDiagnostics *diagnostics=NULL);
 
 } // namespace indexer
 
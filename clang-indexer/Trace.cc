@@ -0,0 +1,216 @@
+#include "Trace.h"
+
+#include <cstdio>
+#include <map>
+#include <memory>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX 1
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "Mutex.h"
+#include "Util.h"
+
+namespace indexer {
+
+namespace {
+
+struct TraceState {
+    TraceState() : pid(0) {}
+    Mutex mutex;
+    int pid;
+    std::map<uint64_t, int> threadLanes;
+    std::vector<std::string> events;
+};
+
+} // anonymous namespace
+
+static TraceState *theTraceState;
+
+#if defined(_WIN32)
+
+static int currentProcessID()
+{
+    return GetCurrentProcessId();
+}
+
+static uint64_t currentThreadKey()
+{
+    return GetCurrentThreadId();
+}
+
+#else
+
+static int currentProcessID()
+{
+    return getpid();
+}
+
+static uint64_t currentThreadKey()
+{
+    // pthread_t is an integer on Linux and a pointer on OS X.
+    return (uintptr_t)pthread_self();
+}
+
+#endif
+
+static void appendJsonString(std::string &output, const char *text)
+{
+    output.push_back('"');
+    for (const char *p = text; *p != '\0'; ++p) {
+        const unsigned char ch = *p;
+        if (ch == '"' || ch == '\\') {
+            output.push_back('\\');
+            output.push_back(ch);
+        } else if (ch < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            output += buf;
+        } else {
+            output.push_back(ch);
+        }
+    }
+    output.push_back('"');
+}
+
+// Appends the pid, the tid, and the rest of the event's fields.  The trace
+// state's mutex must be held.
+static void finishEvent(TraceState &state, std::string &event)
+{
+    int &lane = state.threadLanes[currentThreadKey()];
+    if (lane == 0)
+        lane = state.threadLanes.size();
+    char buf[64];
+    snprintf(buf, sizeof(buf), ",\"pid\":%d,\"tid\":%d}", state.pid, lane);
+    event += buf;
+    state.events.push_back(std::move(event));
+}
+
+static std::string timestampJson(double seconds)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.1f", seconds * 1e6);
+    return buf;
+}
+
+void enableTrace(const std::string &processName)
+{
+    if (theTraceState != NULL)
+        return;
+    theTraceState = new TraceState;
+    theTraceState->pid = currentProcessID();
+    std::string event = "{\"name\":\"process_name\",\"ph\":\"M\","
+            "\"args\":{\"name\":";
+    appendJsonString(event, processName.c_str());
+    event += "}";
+    LockGuard<Mutex> lock(theTraceState->mutex);
+    finishEvent(*theTraceState, event);
+}
+
+bool isTraceEnabled()
+{
+    return theTraceState != NULL;
+}
+
+void addTraceEvent(const std::string &eventJson)
+{
+    if (theTraceState == NULL)
+        return;
+    LockGuard<Mutex> lock(theTraceState->mutex);
+    theTraceState->events.push_back(eventJson);
+}
+
+std::vector<std::string> takeTraceEvents()
+{
+    std::vector<std::string> result;
+    if (theTraceState == NULL)
+        return result;
+    LockGuard<Mutex> lock(theTraceState->mutex);
+    result.swap(theTraceState->events);
+    return result;
+}
+
+bool writeTrace(const std::string &path)
+{
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == NULL)
+        return false;
+    const std::vector<std::string> events = takeTraceEvents();
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < events.size(); ++i) {
+        fprintf(fp, "%s%s\n", events[i].c_str(),
+                i + 1 < events.size() ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    return fclose(fp) == 0;
+}
+
+void traceCounter(
+        const char *name,
+        const std::vector<std::pair<const char*, uint64_t> > &series)
+{
+    if (theTraceState == NULL)
+        return;
+    std::string event = "{\"name\":";
+    appendJsonString(event, name);
+    event += ",\"ph\":\"C\",\"ts\":" + timestampJson(monotonicSeconds()) +
+            ",\"args\":{";
+    for (size_t i = 0; i < series.size(); ++i) {
+        if (i > 0)
+            event += ",";
+        appendJsonString(event, series[i].first);
+        event += ":" + std::to_string(series[i].second);
+    }
+    event += "}";
+    LockGuard<Mutex> lock(theTraceState->mutex);
+    finishEvent(*theTraceState, event);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TraceSpan
+
+TraceSpan::TraceSpan(const char *name, const std::string &detail) :
+    m_name(name),
+    m_startTime(0)
+{
+    if (theTraceState == NULL)
+        return;
+    m_startTime = monotonicSeconds();
+    if (!detail.empty()) {
+        m_args = "\"detail\":";
+        appendJsonString(m_args, detail.c_str());
+    }
+}
+
+void TraceSpan::addArg(const char *name, uint64_t value)
+{
+    if (theTraceState == NULL)
+        return;
+    if (!m_args.empty())
+        m_args += ",";
+    appendJsonString(m_args, name);
+    m_args += ":" + std::to_string(value);
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (theTraceState == NULL)
+        return;
+    const double endTime = monotonicSeconds();
+    std::string event = "{\"name\":";
+    appendJsonString(event, m_name);
+    event += ",\"ph\":\"X\",\"ts\":" + timestampJson(m_startTime) +
+            ",\"dur\":" + timestampJson(endTime - m_startTime) +
+            ",\"args\":{" + m_args + "}";
+    LockGuard<Mutex> lock(theTraceState->mutex);
+    finishEvent(*theTraceState, event);
+}
+
+} // namespace indexer
@@ -0,0 +1,63 @@
+#ifndef INDEXER_TRACE_H
+#define INDEXER_TRACE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace indexer {
+
+// Chrome trace output
+//
+// With --index-project --trace=FILE, the indexer records how long each phase
+// of the run takes, and writes the events to FILE in the Chrome trace event
+// format, which chrome://tracing and Perfetto can display.  Each process is a
+// row, and each of its threads is a lane within the row.
+//
+// The daemons are started with --trace.  A daemon records the events of each
+// job and sends them to the parent process with the job's status.  Every
+// process timestamps its events with monotonicSeconds, which is system-wide on
+// the supported OSes, so the events line up.
+//
+// Tracing is off until enableTrace is called, and then costs a mutex lock per
+// event.
+
+void enableTrace(const std::string &processName);
+bool isTraceEnabled();
+
+// Add an event recorded by another process.
+void addTraceEvent(const std::string &eventJson);
+
+// Remove and return the events recorded so far.
+std::vector<std::string> takeTraceEvents();
+
+bool writeTrace(const std::string &path);
+
+// Record the current values of a counter.  Each series is a separate line of
+// the counter's graph.
+void traceCounter(
+        const char *name,
+        const std::vector<std::pair<const char*, uint64_t> > &series);
+
+// A TraceSpan records an event covering its lifetime, on the current thread's
+// lane.
+class TraceSpan
+{
+public:
+    TraceSpan(const char *name, const std::string &detail=std::string());
+    ~TraceSpan();
+    void addArg(const char *name, uint64_t value);
+
+    // Disallow copying of this class.
+    TraceSpan(const TraceSpan &other) = delete;
+    TraceSpan &operator=(const TraceSpan &other) = delete;
+
+private:
+    const char *m_name;
+    double m_startTime;
+    std::string m_args;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_TRACE_H
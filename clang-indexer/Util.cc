@@ -8,11 +8,16 @@
 #include <iostream>
 
 #if defined(SOURCEWEB_UNIX)
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #endif
 
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+
 #if defined(_WIN32)
 #ifndef NOMINMAX
 #define NOMINMAX 1
@@ -59,7 +64,9 @@ char *portableRealPath(const char *path)
 #endif
 }
 
-time_t getPathModTime(const std::string &path)
+// Returns kInvalidTime if the path does not exist.  If size is non-NULL, it is
+// set to the size of the file.
+time_t getPathModTime(const std::string &path, uint64_t *size)
 {
 #if defined(SOURCEWEB_UNIX)
     // TODO: What about symlinks?  It seems that the perfect behavior is to use
@@ -69,6 +76,8 @@ time_t getPathModTime(const std::string &path)
     struct stat buf;
     if (stat(path.c_str(), &buf) != 0)
         return kInvalidTime;
+    if (size != NULL)
+        *size = buf.st_size;
     return buf.st_mtime;
 #elif defined(_WIN32)
     // [rprichard] 2012-12-04.  Use GetFileAttributesEx instead of stat.  In my
@@ -85,6 +94,10 @@ time_t getPathModTime(const std::string &path)
     memset(&attrData, 0, sizeof(attrData));
     if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attrData))
         return kInvalidTime;
+    if (size != NULL) {
+        *size = static_cast<uint64_t>(attrData.nFileSizeHigh) << 32;
+        *size |= attrData.nFileSizeLow;
+    }
     uint64_t t;
     t = static_cast<uint64_t>(attrData.ftLastWriteTime.dwHighDateTime) << 32;
     t |= attrData.ftLastWriteTime.dwLowDateTime;
@@ -132,4 +145,51 @@ std::string readLine(FILE *fp, bool *isEof)
     return result;
 }
 
+// Returns the number of seconds elapsed since an arbitrary, fixed point in
+// the past.  The clock is unaffected by changes to the wall-clock time.
+double monotonicSeconds()
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return static_cast<double>(mach_absolute_time()) *
+            timebase.numer / timebase.denom / 1e9;
+#elif defined(SOURCEWEB_UNIX)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#elif defined(_WIN32)
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return static_cast<double>(counter.QuadPart) / frequency.QuadPart;
+#else
+#error "Not implemented on this OS."
+#endif
+}
+
+// Returns the amount of physical memory installed, in kilobytes, or 0 if it
+// cannot be determined.
+uint64_t physicalMemoryKB()
+{
+#if defined(SOURCEWEB_UNIX)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || pageSize <= 0)
+        return 0;
+    return static_cast<uint64_t>(pages) * (pageSize / 1024);
+#elif defined(_WIN32)
+    MEMORYSTATUSEX status;
+    memset(&status, 0, sizeof(status));
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status))
+        return 0;
+    return status.ullTotalPhys / 1024;
+#else
+#error "Not implemented on this OS."
+#endif
+}
+
 } // namespace indexer
@@ -3,6 +3,8 @@
 
 #include "../shared_headers/host.h"
 
+#include <stdint.h>
+
 #include <cstdio>
 #include <ctime>
 #include <string>
@@ -24,10 +26,12 @@ const time_t kInvalidTime = static_cast<time_t>(-1);
 
 const char *const_basename(const char *path);
 char *portableRealPath(const char *path);
-time_t getPathModTime(const std::string &path);
+time_t getPathModTime(const std::string &path, uint64_t *size = NULL);
 bool stringStartsWith(const std::string &str, const std::string &suffix);
 bool stringEndsWith(const std::string &str, const std::string &suffix);
 std::string readLine(FILE *fp, bool *isEof = NULL);
+double monotonicSeconds();
+uint64_t physicalMemoryKB();
 
 } // namespace indexer
 
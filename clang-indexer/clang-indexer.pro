@@ -12,29 +12,52 @@ CONFIG -= app_bundle
 
 SOURCES += \
     ASTIndexer.cc \
+    CompileDatabase.cc \
+    ContentHash.cc \
+    CostModel.cc \
     DaemonPool.cc \
+    DaemonProtocol.cc \
+    Distributed.cc \
+    FileCache.cc \
+    HeaderRegistry.cc \
     IndexBuilder.cc \
+    IndexMerger.cc \
     IndexerContext.cc \
     IndexerPPCallbacks.cc \
     Mutex.cc \
     NameGenerator.cc \
     Process.cc \
+    Progress.cc \
+    SymbolDictionary.cc \
     TUIndexer.cc \
+    Trace.cc \
     Util.cc \
     main.cc
 
 HEADERS += \
     ASTIndexer.h \
+    CompileDatabase.h \
+    ContentHash.h \
+    CostModel.h \
     DaemonPool.h \
+    DaemonProtocol.h \
+    Distributed.h \
+    FileCache.h \
+    HeaderRegistry.h \
     IndexBuilder.h \
+    IndexMerger.h \
     IndexerContext.h \
+    IndexerOptions.h \
     IndexerPPCallbacks.h \
     Location.h \
     Mutex.h \
     NameGenerator.h \
     Process.h \
+    Progress.h \
     Switcher.h \
+    SymbolDictionary.h \
     TUIndexer.h \
+    Trace.h \
     Util.h
 
 OTHER_FILES += \
@@ -61,6 +84,9 @@ win32 {
 QMAKE_CXXFLAGS_WARN_ON += -Wno-unused-parameter -Wno-uninitialized
 QMAKE_CXXFLAGS += -Wno-reserved-user-defined-literal
 
+# GetProcessMemoryInfo, used to measure the memory usage of daemons.
+win32: LIBS += -lpsapi
+
 include(../link-clang.pri)
 
 DEFINES += INDEXER_CLANG_DIR=$${CLANG_DIR}
@@ -8,11 +8,14 @@
 #include <QtConcurrentRun>
 #include <QtCore>
 #include <QtDebug>
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -24,16 +27,30 @@
 #include <unistd.h>
 #elif defined(_WIN32)
 #include <direct.h>
+#include <fcntl.h>
+#include <io.h>
 #endif
 
-#include <json/json.h>
-
 #include "../libindexdb/IndexArchiveBuilder.h"
 #include "../libindexdb/IndexArchiveReader.h"
+#include "../libindexdb/FileIo.h"
 #include "../libindexdb/IndexDb.h"
+#include "../libindexdb/PeakMemory.h"
+#include "../libindexdb/ShardedIndex.h"
+#include "CompileDatabase.h"
+#include "ContentHash.h"
+#include "CostModel.h"
 #include "DaemonPool.h"
+#include "DaemonProtocol.h"
+#include "Distributed.h"
+#include "FileCache.h"
+#include "HeaderRegistry.h"
 #include "IndexBuilder.h"
+#include "IndexMerger.h"
+#include "Progress.h"
+#include "SymbolDictionary.h"
 #include "TUIndexer.h"
+#include "Trace.h"
 #include "Util.h"
 
 namespace indexer {
@@ -45,74 +62,194 @@ namespace indexer {
 // which are at ../lib/clang/<VERSION>/include from the bin directory.
 const char kDriverPath[] = XSTRINGIFY(INDEXER_CLANG_DIR) "/bin/clang";
 
-static std::vector<std::string> splitCommandLine(const std::string &commandLine)
+// The default size limit of each daemon's file cache.
+const uint64_t kDefaultFileCacheSizeMB = 256;
+
+// Per-TU indexing stats are saved next to the index file and used by the next
+// --index-project run to schedule the most expensive TUs first.
+const char kCostModelPath[] = "index.stats";
+
+// The content hashes of the inputs of --incremental runs are cached here.
+const char kFileHashCachePath[] = "index.hashes";
+
+// The symbol dictionary of --symbol-dictionary runs.
+const char kSymbolDictionaryPath[] = "index.symbols";
+
+// The number of TUs an --index-project --listen coordinator hands out at
+// once, across all of its workers.
+const int kMaxRemoteJobs = 512;
+
+// A daemon started with --symbol-dictionary records its archives' symbols in
+// this dictionary.
+static std::unique_ptr<SymbolDictionary> theSymbolDictionary;
+
+// In a daemon, the connection to the parent, and the status of the current
+// job, which indexFile fills in.
+static DaemonChannel *theDaemonChannel;
+static DaemonJobStats theJobStats;
+
+// --incremental runs record which idx entries the index was merged from, so
+// that the next run only merges the changes.
+const char kIndexPath[] = "index";
+const char kIndexManifestPath[] = "index.manifest";
+
+// The options that --index-project passes to each --index-file and
+// --build-pch job.  They change what the job's archive contains, so the
+// archive records them, and an --incremental run only reuses archives indexed
+// with the same options.  The defaults aren't recorded, like in the archives
+// written before these options existed.
+struct IndexJobOptions {
+    IndexJobOptions() : profile(IP_Full) {}
+    IndexProfile profile;
+    std::vector<std::string> projectRoots;  // Real paths, sans trailing '/'
+};
+
+// The names of the --profile values, indexed by IndexProfile.
+const char *const kIndexProfileNames[] = { "full", "globals", "defs-only" };
+
+// Archive metadata keys.
+const char kIndexProfileMetadata[] = "index-profile";
+const char kProjectRootsMetadata[] = "project-roots";
+
+// If arg is --profile=<name> or --project-root=<dir>, store it in options and
+// return true.
+static bool parseIndexJobOption(
+        const std::string &arg,
+        IndexJobOptions &options)
 {
-    // Just split it by spaces for now.
-    // TODO: Get this actually right -- e.g. quotes, escapes, tabs, newlines
-    // TODO: On Windows, do we follow the weird Windows command-line
-    // convention?  Note that there are two known users of this format:  CMake
-    // generates it with -DCMAKE_EXPORT_COMPILE_COMMANDS and Clang's libtooling
-    // can consume it.  Both should be audited.
-    std::vector<std::string> result;
-    size_t start = 0;
-    while (start < commandLine.size()) {
-        size_t next = commandLine.find(' ', start);
-        if (next == std::string::npos)
-            next = commandLine.size();
-        if (next > start)
-            result.push_back(commandLine.substr(start, next - start));
-        start = next + 1;
+    if (stringStartsWith(arg, "--profile=")) {
+        const std::string name = arg.substr(strlen("--profile="));
+        for (size_t i = 0;
+                i < sizeof(kIndexProfileNames) / sizeof(kIndexProfileNames[0]);
+                ++i) {
+            if (name == kIndexProfileNames[i]) {
+                options.profile = static_cast<IndexProfile>(i);
+                return true;
+            }
+        }
+    } else if (stringStartsWith(arg, "--project-root=")) {
+        char *path = portableRealPath(
+                    arg.substr(strlen("--project-root=")).c_str());
+        if (path == NULL)
+            return false;
+        std::string root = path;
+        free(path);
+        if (!root.empty() && root.back() == '/')
+            root.pop_back();
+        options.projectRoots.push_back(root);
+        return true;
+    }
+    return false;
+}
+
+static void appendIndexJobArgs(
+        const IndexJobOptions &options,
+        std::vector<std::string> &args)
+{
+    if (options.profile != IP_Full)
+        args.push_back(std::string("--profile=") +
+                       kIndexProfileNames[options.profile]);
+    for (const std::string &root : options.projectRoots)
+        args.push_back("--project-root=" + (root.empty() ? "/" : root));
+}
+
+static std::string indexProfileMetadata(const IndexJobOptions &options)
+{
+    return options.profile == IP_Full ?
+                "" : kIndexProfileNames[options.profile];
+}
+
+static std::string projectRootsMetadata(const IndexJobOptions &options)
+{
+    std::string result;
+    for (const std::string &root : options.projectRoots) {
+        result += root;
+        result += '\n';
     }
     return result;
 }
 
+static void recordIndexJobMetadata(
+        const IndexJobOptions &options,
+        indexdb::IndexArchiveBuilder &archive)
+{
+    if (options.profile != IP_Full)
+        archive.setMetadata(kIndexProfileMetadata,
+                            indexProfileMetadata(options));
+    if (!options.projectRoots.empty())
+        archive.setMetadata(kProjectRootsMetadata,
+                            projectRootsMetadata(options));
+}
+
+static bool indexJobMetadataMatches(
+        const IndexJobOptions &options,
+        indexdb::IndexArchiveReader &archive)
+{
+    return archive.metadata(kIndexProfileMetadata) ==
+                indexProfileMetadata(options) &&
+            archive.metadata(kProjectRootsMetadata) ==
+                projectRootsMetadata(options);
+}
+
 struct SourceFileInfo {
+    SourceFileInfo() : wasIndexed(false), predictedSeconds(0) {}
     std::string sourceFilePath;
     std::string workingDirectory;
     std::string indexFilePath;
-    std::vector<std::string> clangArgv;
+    InternedArgv clangArgv;
+    std::string buildInputsHash;    // See ContentHash.h.
+    std::string pchPath;        // An automatic PCH to index the TU with.
+    bool wasIndexed;
+    double predictedSeconds;    // The cost model's estimate.
+    TUStats stats;
 };
 
+// Read the compile database.  The working directory of each command is made
+// absolute once per distinct directory.
 static void readSourcesJson(
-        const Json::Value &json,
+        const std::string &filename,
         std::vector<SourceFileInfo> &output)
 {
     output.clear();
+    std::unordered_map<std::string, QDir> workingDirectories;
 
-    for (Json::ValueIterator it = json.begin(), itEnd = json.end();
-            it != itEnd; ++it) {
-        Json::Value &sourceJson = *it;
+    auto addCommand = [&](CompileCommand &command) {
         SourceFileInfo sfi;
-        QDir workingDirectory(QString::fromStdString(
-                                  sourceJson["directory"].asString()));
+        auto dirIt = workingDirectories.find(command.directory);
+        if (dirIt == workingDirectories.end()) {
+            QDir dir(QString::fromStdString(command.directory));
+            dirIt = workingDirectories.insert(std::make_pair(
+                    command.directory, QDir(dir.absolutePath()))).first;
+        }
+        const QDir &workingDirectory = dirIt->second;
         sfi.workingDirectory = workingDirectory.absolutePath().toStdString();
         sfi.sourceFilePath =
                 QFileInfo(workingDirectory,
                     QString::fromStdString(
-                        sourceJson["file"].asString())).absoluteFilePath().toStdString();
-        sfi.clangArgv = splitCommandLine(sourceJson["command"].asString());
+                        command.file)).absoluteFilePath().toStdString();
+        std::vector<std::string> &clangArgv = command.arguments;
 
         // Replace the first argument with the known Clang driver.
-        if (sfi.clangArgv.size() >= 1) {
+        if (clangArgv.size() >= 1) {
             // TODO: What if the argument is actually Clang, such as
             // /usr/bin/clang?  Actually, can we get away with just using the
             // compiler in the JSON file?
-            bool isCXX = stringEndsWith(sfi.clangArgv[0], "++");
-            sfi.clangArgv[0] = kDriverPath;
+            bool isCXX = stringEndsWith(clangArgv[0], "++");
+            clangArgv[0] = kDriverPath;
             if (isCXX)
-                sfi.clangArgv[0] += "++";
+                clangArgv[0] += "++";
         }
 
         // Scan the argv looking for an -o argument specifying the output
         // object file.  Make the path absolute and change the suffix to
         // idx, then use this as the output index file's path.
-        for (size_t i = 0; i < sfi.clangArgv.size() - 1; ++i) {
-            if (sfi.clangArgv[i] == "-o" &&
-                    (stringEndsWith(sfi.clangArgv[i + 1], ".o") ||
-                              stringEndsWith(sfi.clangArgv[i + 1], ".obj"))) {
+        for (size_t i = 0; i + 1 < clangArgv.size(); ++i) {
+            if (clangArgv[i] == "-o" &&
+                    (stringEndsWith(clangArgv[i + 1], ".o") ||
+                              stringEndsWith(clangArgv[i + 1], ".obj"))) {
                 QFileInfo objFile(
                             workingDirectory,
-                            QString::fromStdString(sfi.clangArgv[i + 1]));
+                            QString::fromStdString(clangArgv[i + 1]));
                 std::string filePath =
                         objFile.absoluteFilePath().toStdString();
                 filePath.erase(filePath.begin() + filePath.rfind('.'),
@@ -137,86 +274,158 @@ static void readSourcesJson(
             sfi.indexFilePath = fileInfo.absoluteFilePath().toStdString();
         }
 
-        output.push_back(sfi);
-    }
-}
-
-static void readSourcesJson(
-        const std::string &filename,
-        std::vector<SourceFileInfo> &output)
-{
-    std::ifstream f(filename.c_str());
-    Json::Reader r;
-    Json::Value rootJson;
-    r.parse(f, rootJson);
-    readSourcesJson(rootJson, output);
-}
+        sfi.clangArgv = InternedArgv(clangArgv);
+        sfi.buildInputsHash = buildInputsHash(std::move(command.inputHashes));
+        output.push_back(std::move(sfi));
+    };
 
-static time_t getCachedPathModTime(
-        std::unordered_map<std::string, time_t> &fileTimeCache,
-        const std::string &path)
-{
-    auto it = fileTimeCache.find(path);
-    if (it != fileTimeCache.end()) {
-        return it->second;
-    } else {
-        time_t t = getPathModTime(path);
-        fileTimeCache[path] = t;
-        return t;
+    if (!readCompileDatabase(filename, addCommand)) {
+        std::cerr << "warning: error reading " << filename << std::endl;
     }
 }
 
-// TODO: We need to save the (workingDirectory, clang-args) in the index file
-// somehow, so that if they change, we don't reuse the index.
+// The idx file can be reused if it was produced by the same command and all
+// of its inputs still have the same content.  If the compile database lists
+// the inputs' hashes, and they are the ones the idx file was indexed with, the
+// inputs aren't read at all.
 static bool canReuseExistingIndexFile(
-        std::unordered_map<std::string, time_t> &fileTimeCache,
-        const SourceFileInfo &sfi)
+        FileHashCache &fileHashCache,
+        const SourceFileInfo &sfi,
+        const IndexJobOptions &jobOptions)
 {
-    if (sfi.indexFilePath.empty())
-        return false;
-    time_t indexTime = getPathModTime(sfi.indexFilePath);
-    if (indexTime == kInvalidTime)
+    if (sfi.indexFilePath.empty() ||
+            getPathModTime(sfi.indexFilePath) == kInvalidTime)
         return false;
+    {
+        // Archives written by older versions have a different signature.
+        indexdb::UnmappedReader reader(sfi.indexFilePath);
+        if (!reader.peekSignature(indexdb::kIndexArchiveSignature))
+            return false;
+    }
     indexdb::IndexArchiveReader archive(sfi.indexFilePath);
-    for (int i = 0, iEnd = archive.size(); i < iEnd; ++i) {
-        std::string path = archive.entry(i).name;
-        if (path[0] == '\0' || path[0] == '<')
-            continue;
-        time_t inputTime = getCachedPathModTime(fileTimeCache, path);
-        if (inputTime == kInvalidTime || inputTime > indexTime)
+    if (archive.metadata(kCommandHashMetadata) !=
+            commandLineHash(sfi.workingDirectory, sfi.clangArgv.strings()))
+        return false;
+    if (!indexJobMetadataMatches(jobOptions, archive))
+        return false;
+    if (!sfi.buildInputsHash.empty() &&
+            archive.metadata(kBuildInputsHashMetadata) == sfi.buildInputsHash)
+        return true;
+    std::vector<std::pair<std::string, std::string> > inputs;
+    if (!parseInputHashes(archive.metadata(kInputHashesMetadata), inputs) ||
+            inputs.empty())
+        return false;
+    for (const auto &input : inputs) {
+        if (fileHashCache.hash(input.first) != input.second)
             return false;
     }
     return true;
 }
 
+static std::string makeTempIndexFile()
+{
+    // TODO: In theory, these temporary files could take up an arbitrarily
+    // large amount of disk space, if the indexer were to get ahead of the
+    // merging step.  I'd like to enforce a cap on the number of temp files
+    // existing at a given time, but I'd have to be careful not to cause a
+    // deadlock considering that the merging happens in a deterministic
+    // order, so progress must always be possible on the next file to
+    // merge.  The indexing seems to be much slower than the merging step.
+    QTemporaryFile tempFile;
+    tempFile.setAutoRemove(false);
+    // TODO: Is this temporary file opened O_CLOEXEC?
+    bool success = tempFile.open();
+    assert(success && "Could not create temporary file (idx)");
+    return tempFile.fileName().toStdString();
+}
+
+// The state shared by the jobs of an --index-project run.
+struct ProjectJobContext {
+    DaemonPool *daemonPool;
+    WorkerPool *workerPool;         // NULL without --listen.
+    HeaderRegistry *headerRegistry;
+    const IndexJobOptions *jobOptions;
+    ProgressReporter *progress;     // NULL without --progress.
+};
+
 static std::string indexProjectFile(
-        DaemonPool *daemonPool,
-        SourceFileInfo *sfi)
+        const ProjectJobContext *context,
+        SourceFileInfo *sfi,
+        uint64_t expectedMemoryKB)
 {
-    if (sfi->indexFilePath.empty()) {
-        // TODO: In theory, these temporary files could take up an arbitrarily
-        // large amount of disk space, if the indexer were to get ahead of the
-        // merging step.  I'd like to enforce a cap on the number of temp files
-        // existing at a given time, but I'd have to be careful not to cause a
-        // deadlock considering that the merging happens in a deterministic
-        // order, so progress must always be possible on the next file to
-        // merge.  The indexing seems to be much slower than the merging step.
-        QTemporaryFile tempFile;
-        tempFile.setAutoRemove(false);
-        // TODO: Is this temporary file opened O_CLOEXEC?
-        bool success = tempFile.open();
-        assert(success && "Could not create temporary file (idx)");
-        sfi->indexFilePath = tempFile.fileName().toStdString();
-    }
-
-    Daemon *daemon = daemonPool->get();
+    if (sfi->indexFilePath.empty())
+        sfi->indexFilePath = makeTempIndexFile();
+
+    HeaderRegistry *headerRegistry = context->headerRegistry;
+    Daemon *daemon = NULL;
+    if (context->workerPool == NULL)
+        daemon = context->daemonPool->get(expectedMemoryKB);
+    if (context->progress != NULL)
+        context->progress->startTU();
+    const std::vector<std::string> clangArgv = sfi->clangArgv.strings();
     std::vector<std::string> args;
     args.push_back("--index-file");
     args.push_back(sfi->indexFilePath);
+    args.push_back("--command-hash=" +
+                   commandLineHash(sfi->workingDirectory, clangArgv));
+    if (!sfi->buildInputsHash.empty())
+        args.push_back("--build-inputs-hash=" + sfi->buildInputsHash);
+    if (headerRegistry != NULL) {
+        args.push_back("--header-context=" +
+                       headerContextHash(sfi->workingDirectory,
+                                         clangArgv,
+                                         sfi->sourceFilePath));
+    }
+    if (!sfi->pchPath.empty())
+        args.push_back("--pch-indexed");
+    appendIndexJobArgs(*context->jobOptions, args);
     args.push_back("--");
-    args.insert(args.end(), sfi->clangArgv.begin(), sfi->clangArgv.end());
-    daemon->run(sfi->workingDirectory, args);
-    daemonPool->release(daemon);
+    args.insert(args.end(), clangArgv.begin(), clangArgv.end());
+    if (!sfi->pchPath.empty()) {
+        // The -include-pch must come before any -include options.
+        const std::string pchArgs[] = { "-include-pch", sfi->pchPath };
+        auto it = args.end() - clangArgv.size() + 1;
+        args.insert(it, std::begin(pchArgs), std::end(pchArgs));
+    }
+    DaemonJobStats jobStats;
+    std::vector<std::string> claimedHeaders;
+    int statusCode;
+    if (context->workerPool != NULL) {
+        TraceSpan span("index TU remotely", sfi->sourceFilePath);
+        statusCode = context->workerPool->run(sfi->workingDirectory, args,
+                                              expectedMemoryKB,
+                                              sfi->indexFilePath, &jobStats);
+    } else {
+        TraceSpan span("index TU", sfi->sourceFilePath);
+        statusCode = context->daemonPool->run(daemon, sfi->sourceFilePath,
+                                              sfi->workingDirectory, args,
+                                              expectedMemoryKB, &jobStats,
+                                              headerRegistry, &claimedHeaders);
+    }
+    const uint64_t outputBytes =
+            QFileInfo(QString::fromStdString(sfi->indexFilePath)).size();
+    if (statusCode == 0 && outputBytes == 0) {
+        std::cerr << "warning: " << sfi->sourceFilePath
+                  << ": the indexer wrote no idx file" << std::endl;
+        statusCode = 1;
+        if (headerRegistry != NULL)
+            headerRegistry->release(claimedHeaders);
+    }
+
+    // The index of a TU with parse errors is incomplete.
+    if (jobStats.errorCount > 0) {
+        std::cerr << "warning: " << sfi->sourceFilePath << ": "
+                  << jobStats.errorCount << " parse error(s), the first: "
+                  << jobStats.firstError << std::endl;
+    }
+    if (statusCode == 0) {
+        sfi->wasIndexed = true;
+        sfi->stats.seconds = jobStats.seconds;
+        sfi->stats.peakMemoryKB = jobStats.peakMemoryKB;
+        sfi->stats.outputBytes = outputBytes;
+    }
+    if (context->progress != NULL)
+        context->progress->finishTU(sfi->predictedSeconds, statusCode == 0);
     return sfi->indexFilePath;
 }
 
@@ -262,10 +471,11 @@ void stripPCHIncludes(std::vector<SourceFileInfo> &sourceFiles)
     std::unordered_map<std::string, bool> isPCHInclude;
 
     for (auto &sfi : sourceFiles) {
+        std::vector<std::string> clangArgv = sfi.clangArgv.strings();
         std::vector<std::string> newClangArgv;
-        newClangArgv.reserve(sfi.clangArgv.size());
-        auto it = sfi.clangArgv.begin();
-        const auto itEnd = sfi.clangArgv.end();
+        newClangArgv.reserve(clangArgv.size());
+        auto it = clangArgv.begin();
+        const auto itEnd = clangArgv.end();
 
         while (it != itEnd) {
             if (*it != dashInclude || (it + 1) == itEnd) {
@@ -298,88 +508,784 @@ void stripPCHIncludes(std::vector<SourceFileInfo> &sourceFiles)
             it += 2;
         }
 
-        sfi.clangArgv = std::move(newClangArgv);
+        if (newClangArgv.size() != clangArgv.size())
+            sfi.clangArgv = InternedArgv(newClangArgv);
     }
 }
 
-static int indexProject(const std::string &argv0, bool incremental)
+// Returns the command line without the options that don't affect what the
+// indexer records, or that only affect it in minor ways: warnings, output
+// files, dependency files, debug info, and optimization levels.  (Although
+// -O defines __OPTIMIZE__, so coalescing by it is opt-in.)
+static std::vector<std::string> coalescableCommandLine(
+        const InternedArgv &clangArgv)
 {
-    std::vector<SourceFileInfo> sourceFiles;
-    readSourcesJson(std::string("compile_commands.json"), sourceFiles);
+    std::vector<std::string> result;
+    for (size_t i = 0; i < clangArgv.size(); ++i) {
+        const std::string &arg = clangArgv[i];
+        if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+            ++i;
+            continue;
+        }
+        if (arg == "-c" || arg == "-w" || arg == "-pipe" ||
+                arg == "-MD" || arg == "-MMD" || arg == "-MP" ||
+                stringStartsWith(arg, "-o") ||
+                arg == "-O" || arg == "-Ofast" ||
+                (arg.size() == 3 && arg[1] == 'O') ||
+                (stringStartsWith(arg, "-g") &&
+                 !stringStartsWith(arg, "-gcc-")) ||
+                stringStartsWith(arg, "-fdiagnostics-") ||
+                stringStartsWith(arg, "-fcolor-diagnostics") ||
+                stringStartsWith(arg, "-fno-color-diagnostics"))
+            continue;
+        // -Wp, -Wa, and -Wl pass options to other tools.
+        if (stringStartsWith(arg, "-W") && arg.size() > 2 &&
+                !(arg.size() >= 4 && arg[3] == ',' &&
+                  (arg[2] == 'p' || arg[2] == 'a' || arg[2] == 'l')))
+            continue;
+        result.push_back(arg);
+    }
+    return result;
+}
+
+// Remove the compile database entries that compile the same file the same way
+// as an earlier entry, e.g. because a test target recompiles a library's
+// sources, or because the database lists several build configurations.  With
+// coalesce, entries only differing by the coalescableCommandLine options are
+// also removed.
+static void removeDuplicateCommands(
+        std::vector<SourceFileInfo> &sourceFiles,
+        bool coalesce)
+{
+    std::unordered_set<std::string> seen;
+    std::vector<SourceFileInfo> result;
+    result.reserve(sourceFiles.size());
+    for (auto &sfi : sourceFiles) {
+        const std::string key = sfi.sourceFilePath + '\0' +
+                commandLineHash(sfi.workingDirectory,
+                                coalesce ?
+                                    coalescableCommandLine(sfi.clangArgv) :
+                                    sfi.clangArgv.strings());
+        if (seen.insert(key).second)
+            result.push_back(std::move(sfi));
+    }
+    if (result.size() < sourceFiles.size()) {
+        std::cout << "Skipping " << (sourceFiles.size() - result.size())
+                  << " duplicate compile commands" << std::endl;
+    }
+    sourceFiles = std::move(result);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Automatic precompiled headers
+
+// With --auto-pch, TUs whose sources begin with the same #include lines, and
+// that are compiled with the same flags, share a precompiled header built by
+// this indexer's own Clang.  (The project's own PCH files are unusable; see
+// stripPCHIncludes.)  A single job parses the shared prefix once, writing the
+// PCH and indexing the prefix's headers.  Each TU then loads the PCH with
+// -include-pch and skips the declarations that came from it.  The TU's own
+// #include lines are still processed, but include guards make the headers
+// already in the PCH empty.
+
+// A prefix is only worth a PCH if at least this many TUs share it.
+const size_t kAutoPCHMinTUs = 4;
+
+struct AutoPCH {
+    AutoPCH() : isBuilt(false) {}
+    SourceFileInfo prefix;      // The job compiling the prefix header.
+    std::string pchPath;
+    std::vector<SourceFileInfo*> users;
+    bool isBuilt;
+};
+
+// Returns the -x language to compile a prefix header for the given source.
+static std::string headerLanguage(const std::string &sourceFilePath)
+{
+    if (stringEndsWith(sourceFilePath, ".c"))
+        return "c-header";
+    else if (stringEndsWith(sourceFilePath, ".m"))
+        return "objective-c-header";
+    else if (stringEndsWith(sourceFilePath, ".mm"))
+        return "objective-c++-header";
+    else
+        return "c++-header";
+}
+
+// Read the #include lines at the start of a source file, skipping blank lines
+// and comments, and stopping at anything else (including other preprocessor
+// directives, which could affect the headers).  Each line is returned in a
+// normalized form that the prefix header can use.  Quoted includes found next
+// to the source file are made absolute.
+static std::vector<std::string> readLeadingIncludes(
+        const SourceFileInfo &sfi)
+{
+    std::vector<std::string> result;
+    std::ifstream f(sfi.sourceFilePath.c_str());
+    const QDir sourceDir = QFileInfo(
+                QString::fromStdString(sfi.sourceFilePath)).absoluteDir();
+    bool inComment = false;
+    std::string line;
+    while (std::getline(f, line)) {
+        size_t pos = 0;
+        if (inComment) {
+            pos = line.find("*/");
+            if (pos == std::string::npos)
+                continue;
+            inComment = false;
+            pos += 2;
+        }
+        pos = line.find_first_not_of(" \t\r", pos);
+        if (pos == std::string::npos || line.compare(pos, 2, "//") == 0)
+            continue;
+        if (line.compare(pos, 2, "/*") == 0) {
+            size_t end = line.find("*/", pos + 2);
+            if (end == std::string::npos) {
+                inComment = true;
+                continue;
+            }
+            if (line.find_first_not_of(" \t\r", end + 2) == std::string::npos)
+                continue;
+            break;
+        }
+        if (line[pos] != '#')
+            break;
+        pos = line.find_first_not_of(" \t", pos + 1);
+        if (pos == std::string::npos || line.compare(pos, 7, "include") != 0)
+            break;
+        pos = line.find_first_not_of(" \t", pos + 7);
+        if (pos == std::string::npos)
+            break;
+        const char close = line[pos] == '<' ? '>' : line[pos] == '"' ? '"' : 0;
+        const size_t end = close ? line.find(close, pos + 1) : std::string::npos;
+        if (end == std::string::npos)
+            break;
+        std::string name = line.substr(pos + 1, end - pos - 1);
+        if (close == '"') {
+            QFileInfo fi(sourceDir, QString::fromStdString(name));
+            if (fi.exists())
+                name = fi.absoluteFilePath().toStdString();
+            result.push_back("#include \"" + name + "\"");
+        } else {
+            result.push_back("#include <" + name + ">");
+        }
+    }
+    return result;
+}
+
+// A trie of leading #include lines.
+struct IncludePrefixNode {
+    std::map<std::string, std::unique_ptr<IncludePrefixNode> > children;
+    std::vector<SourceFileInfo*> tus;   // TUs whose leading includes end here.
+};
+
+// Assign TUs to prefixes bottom-up, so that each TU gets the longest prefix
+// that at least kAutoPCHMinTUs unassigned TUs share.  Returns the TUs below
+// the node that are still unassigned.
+static std::vector<SourceFileInfo*> assignIncludePrefixes(
+        IncludePrefixNode &node,
+        std::vector<std::string> &path,
+        std::vector<std::pair<std::vector<std::string>,
+                              std::vector<SourceFileInfo*> > > &output)
+{
+    std::vector<SourceFileInfo*> pending = node.tus;
+    for (auto &child : node.children) {
+        path.push_back(child.first);
+        std::vector<SourceFileInfo*> childPending =
+                assignIncludePrefixes(*child.second, path, output);
+        path.pop_back();
+        pending.insert(pending.end(), childPending.begin(), childPending.end());
+    }
+    if (!path.empty() && pending.size() >= kAutoPCHMinTUs) {
+        output.push_back(std::make_pair(path, pending));
+        pending.clear();
+    }
+    return pending;
+}
+
+// Returns a command line compiling the prefix header into a PCH with the same
+// flags as the given TU.
+static std::vector<std::string> makePCHCommandLine(
+        const SourceFileInfo &sfi,
+        const std::string &prefixPath,
+        const std::string &pchPath)
+{
+    const char *const sourceBasename = const_basename(sfi.sourceFilePath.c_str());
+    std::vector<std::string> result;
+    for (size_t i = 0; i < sfi.clangArgv.size(); ++i) {
+        const std::string &arg = sfi.clangArgv[i];
+        if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+            ++i;
+            continue;
+        }
+        if (arg == "-c" || stringStartsWith(arg, "-o") ||
+                stringStartsWith(arg, "-M"))
+            continue;
+        if (i > 0 && arg[0] != '-' &&
+                strcmp(const_basename(arg.c_str()), sourceBasename) == 0)
+            continue;
+        result.push_back(arg);
+    }
+    result.push_back("-x");
+    result.push_back(headerLanguage(sfi.sourceFilePath));
+    result.push_back(prefixPath);
+    result.push_back("-o");
+    result.push_back(pchPath);
+    return result;
+}
+
+// Group the TUs by compiler flags and language, then pick shared #include
+// prefixes within each group.  The generated prefix headers and PCH files are
+// temporary files owned by tempFiles.
+static void planAutoPCHs(
+        const std::vector<SourceFileInfo*> &tus,
+        std::vector<std::unique_ptr<AutoPCH> > &autoPCHs,
+        std::vector<std::unique_ptr<QTemporaryFile> > &tempFiles)
+{
+    std::map<std::string, std::vector<SourceFileInfo*> > groups;
+    for (SourceFileInfo *sfi : tus) {
+        std::string key = headerLanguage(sfi->sourceFilePath) + " " +
+                headerContextHash(sfi->workingDirectory,
+                                  sfi->clangArgv.strings(),
+                                  sfi->sourceFilePath);
+        groups[key].push_back(sfi);
+    }
+
+    for (const auto &group : groups) {
+        if (group.second.size() < kAutoPCHMinTUs)
+            continue;
+        IncludePrefixNode root;
+        for (SourceFileInfo *sfi : group.second) {
+            IncludePrefixNode *node = &root;
+            for (const std::string &line : readLeadingIncludes(*sfi)) {
+                std::unique_ptr<IncludePrefixNode> &child =
+                        node->children[line];
+                if (!child)
+                    child.reset(new IncludePrefixNode);
+                node = child.get();
+            }
+            node->tus.push_back(sfi);
+        }
+        std::vector<std::string> path;
+        std::vector<std::pair<std::vector<std::string>,
+                              std::vector<SourceFileInfo*> > > prefixes;
+        assignIncludePrefixes(root, path, prefixes);
+
+        for (const auto &prefix : prefixes) {
+            const QString tempPattern = QDir::tempPath() + "/sw-indexer-XXXXXX";
+            std::unique_ptr<QTemporaryFile> header(
+                        new QTemporaryFile(tempPattern + ".h"));
+            std::unique_ptr<QTemporaryFile> pch(
+                        new QTemporaryFile(tempPattern + ".pch"));
+            if (!header->open() || !pch->open())
+                continue;
+            for (const std::string &line : prefix.first) {
+                header->write(line.c_str());
+                header->write("\n");
+            }
+            header->close();
+            pch->close();
 
-    DaemonPool daemonPool;
-    std::unique_ptr<indexdb::Index> mergedIndex(new indexdb::Index);
-    std::vector<std::pair<std::string, QFuture<std::string> > > futures;
-    std::unordered_map<std::string, time_t> fileTimeCache;
+            std::unique_ptr<AutoPCH> autoPCH(new AutoPCH);
+            const SourceFileInfo &first = *prefix.second[0];
+            autoPCH->pchPath = pch->fileName().toStdString();
+            autoPCH->users = prefix.second;
+            autoPCH->prefix.sourceFilePath = header->fileName().toStdString();
+            autoPCH->prefix.workingDirectory = first.workingDirectory;
+            autoPCH->prefix.clangArgv = InternedArgv(makePCHCommandLine(
+                        first,
+                        autoPCH->prefix.sourceFilePath,
+                        autoPCH->pchPath));
+            std::cout << "Precompiling " << prefix.first.size()
+                      << " headers shared by " << prefix.second.size()
+                      << " TUs" << std::endl;
+            autoPCHs.push_back(std::move(autoPCH));
+            tempFiles.push_back(std::move(header));
+            tempFiles.push_back(std::move(pch));
+        }
+    }
+}
+
+// Build an automatic PCH and index its headers.  Returns the path of the idx
+// file.
+static std::string buildAutoPCH(
+        const ProjectJobContext *context,
+        AutoPCH *autoPCH)
+{
+    SourceFileInfo &prefix = autoPCH->prefix;
+    prefix.indexFilePath = makeTempIndexFile();
 
+    HeaderRegistry *headerRegistry = context->headerRegistry;
+    Daemon *daemon = context->daemonPool->get();
+    if (context->progress != NULL)
+        context->progress->startTU();
+    std::vector<std::string> args;
+    args.push_back("--build-pch");
+    args.push_back(prefix.indexFilePath);
+    if (headerRegistry != NULL) {
+        args.push_back("--header-context=" +
+                       headerContextHash(prefix.workingDirectory,
+                                         autoPCH->users[0]->clangArgv.strings(),
+                                         autoPCH->users[0]->sourceFilePath));
+    }
+    appendIndexJobArgs(*context->jobOptions, args);
+    args.push_back("--");
+    const std::vector<std::string> clangArgv = prefix.clangArgv.strings();
+    args.insert(args.end(), clangArgv.begin(), clangArgv.end());
+    std::vector<std::string> claimedHeaders;
+    int statusCode;
     {
-        // Make sure the non-index tables exist.  They are usually created when
-        // the first source file is merged, but it's possible that no source
-        // files exist.
-        IndexBuilder builder(*mergedIndex, /*createIndexTables=*/false);
+        TraceSpan span("build PCH", prefix.sourceFilePath);
+        statusCode = context->daemonPool->run(daemon, prefix.sourceFilePath,
+                                              prefix.workingDirectory, args,
+                                              0, NULL, headerRegistry,
+                                              &claimedHeaders);
     }
 
-    stripPCHIncludes(sourceFiles);
+    autoPCH->isBuilt = statusCode == 0 &&
+            QFileInfo(QString::fromStdString(autoPCH->pchPath)).size() > 0;
+    prefix.wasIndexed = autoPCH->isBuilt;
+    // Without the PCH, its users parse and index its headers themselves.
+    if (!autoPCH->isBuilt && headerRegistry != NULL)
+        headerRegistry->release(claimedHeaders);
+    if (context->progress != NULL)
+        context->progress->finishTU(0, autoPCH->isBuilt);
+    return prefix.indexFilePath;
+}
 
-    for (auto &sfi : sourceFiles) {
-        if (!incremental)
-            sfi.indexFilePath = "";
-        if (canReuseExistingIndexFile(fileTimeCache, sfi)) {
-            // TODO: It's inefficient to run identityString on a separate
-            // thread.
-            QFuture<std::string> future = QtConcurrent::run(
-                        identityString, sfi.indexFilePath);
-            futures.push_back(std::make_pair(sfi.sourceFilePath, future));
+struct IndexProjectOptions {
+    IndexProjectOptions() :
+        incremental(false), delta(false), dedupHeaders(false),
+        autoPCH(false), symbolDictionary(false),
+        skipExternalBodies(false), coalesceCommands(false), shardCount(1),
+        checkpointMinutes(0) {}
+    bool incremental;
+    bool delta;
+    bool dedupHeaders;
+    bool autoPCH;
+    bool symbolDictionary;
+    bool skipExternalBodies;
+    bool coalesceCommands;
+    int shardCount;
+    int checkpointMinutes;          // 0 without checkpoints.
+    IndexJobOptions job;
+    DaemonPoolOptions daemonPool;
+    ProgressOptions progress;
+    std::string tracePath;
+    std::string listenAddress;
+};
+
+// Identifies a TU in the merger's checkpoints.
+static std::string checkpointKey(const SourceFileInfo &sfi)
+{
+    return commandLineHash(sfi.workingDirectory, sfi.clangArgv.strings());
+}
+
+static int indexProject(const IndexProjectOptions &options)
+{
+    const bool incremental = options.incremental;
+    const bool distributed = !options.listenAddress.empty();
+
+    // With header deduplication, a TU's idx file lacks the headers claimed by
+    // other TUs, so it can't be reused on its own by a later run.  The header
+    // claims, the automatic PCHs, and the symbol dictionary all live on the
+    // coordinator's machine, so workers can't use them.
+    std::unique_ptr<HeaderRegistry> headerRegistry;
+    if (options.dedupHeaders) {
+        if (incremental) {
+            std::cerr << "warning: --dedup-headers is ignored with "
+                      << "--incremental" << std::endl;
+        } else if (distributed) {
+            std::cerr << "warning: --dedup-headers is ignored with --listen"
+                      << std::endl;
         } else {
+            headerRegistry.reset(new HeaderRegistry);
+        }
+    }
+    // Likewise, a TU indexed with an automatic PCH lacks the PCH's headers.
+    const bool useAutoPCH = options.autoPCH && !incremental && !distributed;
+    if (options.autoPCH && incremental) {
+        std::cerr << "warning: --auto-pch is ignored with --incremental"
+                  << std::endl;
+    } else if (options.autoPCH && distributed) {
+        std::cerr << "warning: --auto-pch is ignored with --listen"
+                  << std::endl;
+    }
+    // The project roots default to the directory of compile_commands.json.
+    IndexJobOptions jobOptions = options.job;
+    if (!options.skipExternalBodies) {
+        if (!jobOptions.projectRoots.empty()) {
+            std::cerr << "warning: --project-root is ignored without "
+                      << "--skip-external-bodies" << std::endl;
+        }
+        jobOptions.projectRoots.clear();
+    } else if (jobOptions.projectRoots.empty()) {
+        parseIndexJobOption("--project-root=.", jobOptions);
+    }
+
+    DaemonPoolOptions daemonPoolOptions = options.daemonPool;
+    if (!options.tracePath.empty()) {
+        enableTrace("sw-clang-indexer");
+        daemonPoolOptions.daemonArgs.push_back("--trace");
+    }
+
+    std::vector<SourceFileInfo> sourceFiles;
+    {
+        TraceSpan span("read compile database");
+        readSourcesJson(std::string("compile_commands.json"), sourceFiles);
+    }
+
+    // Each pool thread spends nearly all of its time waiting on a daemon, so
+    // there is no point in having more threads than the daemons can queue
+    // jobs for.  The workers' slots are only known once they join, so a
+    // coordinator keeps up to kMaxRemoteJobs jobs queued for them.
+    QThreadPool::globalInstance()->setMaxThreadCount(
+                distributed ? kMaxRemoteJobs :
+                std::max(1, options.daemonPool.maxDaemons) *
+                std::max(1, options.daemonPool.pipelineDepth));
+    std::unique_ptr<WorkerPool> workerPool;
+    if (distributed) {
+        workerPool.reset(new WorkerPool);
+        if (!workerPool->listen(options.listenAddress))
+            return 1;
+        std::cout << "Waiting for workers on " << options.listenAddress
+                  << std::endl;
+    }
+    SymbolDictionary symbolDictionary;
+    if (options.symbolDictionary && distributed) {
+        std::cerr << "warning: --symbol-dictionary is ignored with --listen"
+                  << std::endl;
+    } else if (options.symbolDictionary) {
+        if (symbolDictionary.openOrCreate(kSymbolDictionaryPath)) {
+            daemonPoolOptions.daemonArgs.push_back(
+                        "--symbol-dictionary=" +
+                        QFileInfo(kSymbolDictionaryPath)
+                            .absoluteFilePath().toStdString());
+        } else {
+            std::cerr << "warning: cannot create " << kSymbolDictionaryPath
+                      << std::endl;
+        }
+    }
+    DaemonPool daemonPool(daemonPoolOptions);
+    std::unique_ptr<ProgressReporter> progress;
+    if (options.progress.enabled) {
+        progress.reset(new ProgressReporter(options.progress, &daemonPool));
+        progress->start();
+    }
+    const ProjectJobContext jobContext = {
+        &daemonPool, workerPool.get(), headerRegistry.get(), &jobOptions,
+        progress.get()
+    };
+    if (options.delta && !incremental) {
+        std::cerr << "warning: --delta is ignored without --incremental"
+                  << std::endl;
+    }
+    IndexMerger merger(kIndexPath, kIndexManifestPath, incremental,
+                       options.delta);
+    if (!symbolDictionary.token().empty())
+        merger.setSymbolDictionary(&symbolDictionary);
+    // The manifest of an incremental run describes an unsharded index.
+    if (options.shardCount > 1 && incremental) {
+        std::cerr << "warning: --shards is ignored with --incremental"
+                  << std::endl;
+    } else {
+        merger.setShardCount(options.shardCount);
+    }
+    // A run resumes from the checkpoints of an earlier run with the same
+    // options, skipping the TUs they hold.  An incremental run reuses its idx
+    // files instead.
+    std::unordered_set<std::string> checkpointedTUs;
+    if (options.checkpointMinutes > 0 && incremental) {
+        std::cerr << "warning: --checkpoint-interval is ignored with "
+                  << "--incremental" << std::endl;
+    } else if (options.checkpointMinutes > 0 && options.shardCount > 1) {
+        std::cerr << "warning: --checkpoint-interval is ignored with --shards"
+                  << std::endl;
+    } else if (options.checkpointMinutes > 0) {
+        std::vector<std::string> runArgs;
+        appendIndexJobArgs(jobOptions, runArgs);
+        if (headerRegistry)
+            runArgs.push_back("--dedup-headers");
+        if (useAutoPCH)
+            runArgs.push_back("--auto-pch");
+        checkpointedTUs = merger.startCheckpoints(
+                    commandLineHash("", runArgs),
+                    options.checkpointMinutes * 60.0);
+        if (!checkpointedTUs.empty()) {
+            std::cout << "Resuming from a checkpoint of "
+                      << checkpointedTUs.size() << " TUs" << std::endl;
+        }
+    }
+    std::vector<std::pair<SourceFileInfo*, QFuture<std::string> > > futures;
+    FileHashCache fileHashCache;
+    if (incremental)
+        fileHashCache.load(kFileHashCachePath);
+    CostModel costModel;
+    costModel.load(kCostModelPath);
+
+    {
+        TraceSpan span("strip PCH includes");
+        stripPCHIncludes(sourceFiles);
+    }
+    {
+        TraceSpan span("remove duplicate commands");
+        removeDuplicateCommands(sourceFiles, options.coalesceCommands);
+    }
+
+    // Queue up the reusable index files first, then the TUs to index, most
+    // expensive first.  The thread pool starts jobs in the order they are
+    // queued, and merging happens in the same order.
+    std::vector<std::pair<double, SourceFileInfo*> > schedule;
+    int resumedCount = 0;
+    {
+        TraceSpan span("check reusable idx files");
+        for (auto &sfi : sourceFiles) {
+            if (!incremental)
+                sfi.indexFilePath = "";
+            if (canReuseExistingIndexFile(fileHashCache, sfi, jobOptions)) {
+                // TODO: It's inefficient to run identityString on a separate
+                // thread.
+                QFuture<std::string> future = QtConcurrent::run(
+                            identityString, sfi.indexFilePath);
+                futures.push_back(std::make_pair(&sfi, future));
+            } else if (!checkpointedTUs.empty() &&
+                       checkpointedTUs.count(checkpointKey(sfi)) > 0) {
+                resumedCount++;
+            } else {
+                sfi.stats.sizeHeuristic =
+                        CostModel::sizeHeuristic(sfi.sourceFilePath);
+                sfi.predictedSeconds =
+                        costModel.predictSeconds(sfi.sourceFilePath,
+                                                 sfi.stats.sizeHeuristic);
+                schedule.push_back(std::make_pair(sfi.predictedSeconds, &sfi));
+            }
+        }
+        std::stable_sort(schedule.begin(), schedule.end(),
+                         [](const std::pair<double, SourceFileInfo*> &x,
+                            const std::pair<double, SourceFileInfo*> &y) {
+            return x.first > y.first;
+        });
+        span.addArg("reused", futures.size());
+        span.addArg("resumed", resumedCount);
+        span.addArg("scheduled", schedule.size());
+    }
+    if (progress) {
+        double predictedSeconds = 0;
+        for (const auto &job : schedule)
+            predictedSeconds += job.first;
+        progress->addReusedTUs(futures.size());
+        progress->addResumedTUs(resumedCount);
+        progress->addQueuedTUs(schedule.size(), predictedSeconds);
+        progress->setPhase("indexing");
+    }
+
+    // Build the automatic PCHs before starting the TUs that use them.  Their
+    // idx files are merged first.
+    std::vector<std::unique_ptr<AutoPCH> > autoPCHs;
+    std::vector<std::unique_ptr<QTemporaryFile> > autoPCHFiles;
+    if (useAutoPCH) {
+        std::vector<SourceFileInfo*> tus;
+        for (const auto &job : schedule)
+            tus.push_back(job.second);
+        {
+            TraceSpan span("plan automatic PCHs");
+            planAutoPCHs(tus, autoPCHs, autoPCHFiles);
+        }
+        if (progress)
+            progress->addQueuedTUs(autoPCHs.size(), 0);
+        for (auto &autoPCH : autoPCHs) {
             QFuture<std::string> future = QtConcurrent::run(
-                        indexProjectFile, &daemonPool, &sfi);
-            futures.push_back(std::make_pair(sfi.sourceFilePath, future));
+                        buildAutoPCH, &jobContext, autoPCH.get());
+            futures.push_back(std::make_pair(&autoPCH->prefix, future));
+        }
+        for (auto &p : futures)
+            p.second.waitForFinished();
+        for (auto &autoPCH : autoPCHs) {
+            if (!autoPCH->isBuilt) {
+                std::cerr << "warning: failed to build a PCH for "
+                          << autoPCH->users.size() << " TUs" << std::endl;
+                continue;
+            }
+            for (SourceFileInfo *sfi : autoPCH->users)
+                sfi->pchPath = autoPCH->pchPath;
         }
     }
 
-    std::unordered_set<std::string> mergedEntrySet;
+    for (const auto &job : schedule) {
+        QFuture<std::string> future = QtConcurrent::run(
+                    indexProjectFile, &jobContext, job.second,
+                    costModel.predictPeakMemoryKB(job.second->sourceFilePath));
+        futures.push_back(std::make_pair(job.second, future));
+    }
 
     for (const auto &p : futures) {
-        std::string indexPath = p.second.result();
-        std::cout << "Indexed " << p.first << std::endl;
+        std::string indexPath;
         {
-            indexdb::IndexArchiveReader archive(indexPath);
-            for (int i = 0; i < archive.size(); ++i) {
-                if (mergedEntrySet.find(archive.entry(i).hash) !=
-                        mergedEntrySet.end())
-                    continue;
-                mergedEntrySet.insert(archive.entry(i).hash);
-                indexdb::Index *fileIndex = archive.openEntry(i);
-                mergedIndex->merge(*fileIndex);
-                delete fileIndex;
-            }
+            TraceSpan span("wait for TU", p.first->sourceFilePath);
+            indexPath = p.second.result();
         }
+        std::cout << "Indexed " << p.first->sourceFilePath << std::endl;
+        uint64_t indexSize = 0;
+        if (progress)
+            getPathModTime(indexPath, &indexSize);
+        // A TU that failed (e.g. for lack of memory) isn't checkpointed, so
+        // that a resumed run tries it again.
+        merger.addArchive(indexPath, p.first->wasIndexed ?
+                              checkpointKey(*p.first) : std::string());
+        if (progress)
+            progress->mergeTU(indexSize);
         if (!incremental)
             QFile(QString::fromStdString(indexPath)).remove();
     }
+    // Let the workers go.
+    workerPool.reset();
+    if (progress)
+        progress->setPhase("writing");
+    merger.finish();
 
-    mergedIndex->finalizeTables();
-    {
-        IndexBuilder locationPopulator(*mergedIndex);
-        locationPopulator.populateIndexTables();
+    for (const auto &sfi : sourceFiles) {
+        if (sfi.wasIndexed)
+            costModel.record(sfi.sourceFilePath, sfi.stats);
     }
-    mergedIndex->finalizeTables();
-    mergedIndex->write("index");
+    costModel.save(kCostModelPath);
+    if (incremental)
+        fileHashCache.save(kFileHashCachePath);
+    if (progress)
+        progress->stop();
+    reportJobProblems(daemonPool.problems());
 
+    if (!options.tracePath.empty() && !writeTrace(options.tracePath)) {
+        std::cerr << "warning: cannot write " << options.tracePath
+                  << std::endl;
+    }
     return 0;
 }
 
+struct IndexFileOptions {
+    IndexFileOptions() :
+        pchIsIndexed(false), buildPCH(false) {}
+    std::string headerContext;
+    std::string commandHash;
+    std::string buildInputsHash;
+    bool pchIsIndexed;
+    bool buildPCH;
+    IndexJobOptions job;
+};
+
 static int indexFile(
         const std::string &outputFile,
-        const std::vector<std::string> &clangArgv)
+        const std::vector<std::string> &clangArgv,
+        const IndexFileOptions &fileOptions)
 {
+    IndexerOptions options;
+    std::unique_ptr<DaemonHeaderClaimer> headerClaimer;
+    if (!fileOptions.headerContext.empty() && theDaemonChannel != NULL) {
+        headerClaimer.reset(
+                    new DaemonHeaderClaimer(*theDaemonChannel,
+                                            fileOptions.headerContext));
+        options.headerClaimer = headerClaimer.get();
+    }
+    options.pchIsIndexed = fileOptions.pchIsIndexed;
+    options.profile = fileOptions.job.profile;
+    options.projectRoots = fileOptions.job.projectRoots;
     indexdb::IndexArchiveBuilder archive;
-    indexTranslationUnit(clangArgv, archive);
-    archive.finalize();
-    archive.write(outputFile, /*compressed=*/true);
+    TUDiagnostics diagnostics;
+    if (fileOptions.buildPCH) {
+        TraceSpan span("parse and build PCH");
+        options.skipMainFile = true;
+        buildPrecompiledHeader(clangArgv, archive, options, &diagnostics);
+    } else {
+        TraceSpan span("parse and index");
+        indexTranslationUnit(clangArgv, archive, options, &diagnostics);
+    }
+    if (!fileOptions.commandHash.empty())
+        archive.setMetadata(kCommandHashMetadata, fileOptions.commandHash);
+    if (!fileOptions.buildInputsHash.empty())
+        archive.setMetadata(kBuildInputsHashMetadata,
+                            fileOptions.buildInputsHash);
+    recordIndexJobMetadata(fileOptions.job, archive);
+    if (theSymbolDictionary) {
+        TraceSpan span("record symbol dictionary IDs");
+        recordSymbolDictionaryIDs(archive, *theSymbolDictionary);
+    }
+    {
+        TraceSpan span("finalize archive");
+        archive.finalize();
+    }
+    {
+        TraceSpan span("write archive");
+        archive.write(outputFile, /*compressed=*/true);
+    }
+    uint64_t refCount = 0;
+    for (const auto &pair : archive.indices()) {
+        const indexdb::Table *refs = pair.second->table("Reference");
+        if (refs != NULL)
+            refCount += refs->size();
+    }
+    uint64_t outputBytes = 0;
+    if (getPathModTime(outputFile, &outputBytes) == kInvalidTime ||
+            outputBytes == 0) {
+        std::cerr << "warning: cannot write " << outputFile << std::endl;
+        return 1;
+    }
+    traceCounter("TU output", {
+        std::make_pair("refs", refCount),
+        std::make_pair("bytes", outputBytes)
+    });
+    theJobStats.refCount = refCount;
+    theJobStats.outputBytes = outputBytes;
+    theJobStats.errorCount = diagnostics.errorCount;
+    theJobStats.warningCount = diagnostics.warningCount;
+    theJobStats.firstError = diagnostics.firstError;
     return 0;
 }
 
+// If arg has the form <prefix><unsigned-integer>, store the integer in value
+// and return true.
+static bool parseUIntOption(
+        const std::string &arg,
+        const std::string &prefix,
+        uint64_t &value)
+{
+    if (!stringStartsWith(arg, prefix) || arg.size() == prefix.size())
+        return false;
+    char *end = NULL;
+    unsigned long long result = strtoull(arg.c_str() + prefix.size(), &end, 10);
+    if (*end != '\0')
+        return false;
+    value = result;
+    return true;
+}
+
+// The options of the local daemon pool, which --index-project and --worker
+// share.
+static bool parseDaemonPoolOption(
+        const std::string &arg,
+        DaemonPoolOptions &options)
+{
+    uint64_t value = 0;
+    if (parseUIntOption(arg, "--max-daemons=", value)) {
+        options.maxDaemons = value;
+    } else if (parseUIntOption(arg, "--memory-budget=", value)) {
+        options.memoryBudgetKB = value * 1024;
+    } else if (parseUIntOption(arg, "--daemon-max-jobs=", value)) {
+        options.maxJobsPerDaemon = value;
+    } else if (parseUIntOption(arg, "--daemon-max-memory=", value)) {
+        options.maxDaemonMemoryKB = value * 1024;
+    } else if (parseUIntOption(arg, "--daemon-pipeline=", value)) {
+        options.pipelineDepth = value;
+    } else if (parseUIntOption(arg, "--job-timeout=", value)) {
+        options.jobTimeoutSeconds = value;
+    } else if (parseUIntOption(arg, "--job-attempts=", value) && value >= 1) {
+        options.maxJobAttempts = value;
+    } else if (parseUIntOption(arg, "--file-cache-size=", value)) {
+        options.daemonArgs.push_back(arg);
+    } else {
+        return false;
+    }
+    return true;
+}
+
 static int runCommand(const std::vector<std::string> &argv)
 {
     const char *const kUsageTextPattern =
@@ -387,19 +1293,137 @@ static int runCommand(const std::vector<std::string> &argv)
             //        0         0         0         0         0         0         0         0
             "Usage: %s\n"
             "\n"
-            "    --index-project [--incremental]\n"
+            "    --index-project [options]\n"
             "          Index all of the translation units in the compile_commands.json file\n"
             "          and create a single merged index file named index.\n"
             "\n"
-            "          If --incremental is specified, then each translation unit's index is\n"
-            "          saved to a separate idx file, which is reused by later --index-project\n"
-            "          invocations if none of its referenced files have changed.\n"
+            "          --incremental\n"
+            "              Save each translation unit's index to a separate idx file, which\n"
+            "              is reused by later --index-project invocations if the compile\n"
+            "              command and the contents of the files it read are unchanged.\n"
+            "          --delta\n"
+            "              With --incremental, write the changed files' rows as a small\n"
+            "              index.delta.N file instead of rewriting the index.  The navigator\n"
+            "              reads the index and its deltas together.\n"
+            "          --max-daemons=N\n"
+            "              Run at most N indexer daemons at once.  Defaults to the number of\n"
+            "              CPUs.\n"
+            "          --memory-budget=MB\n"
+            "              Only start a translation unit if the expected memory usage of all\n"
+            "              running daemons stays within MB megabytes.  0 disables the\n"
+            "              budget.  Defaults to 3/4 of physical memory.\n"
+            "          --daemon-max-jobs=N\n"
+            "              Restart a daemon after it has indexed N translation units.  0\n"
+            "              disables the limit.  Defaults to 100.\n"
+            "          --daemon-max-memory=MB\n"
+            "              Restart a daemon once its resident memory exceeds MB megabytes.  0\n"
+            "              disables the limit.  Defaults to 2048.\n"
+            "          --daemon-pipeline=N\n"
+            "              Queue up to N jobs on each daemon, so that it starts its next job\n"
+            "              without waiting for the parent.  Defaults to 2.\n"
+            "          --job-timeout=SECONDS\n"
+            "              Kill a daemon that spends more than SECONDS on one translation\n"
+            "              unit, and give up on the translation unit.  0 disables the\n"
+            "              limit.  Defaults to 1800.\n"
+            "          --job-attempts=N\n"
+            "              Run a translation unit up to N times in all if its daemon crashes.\n"
+            "              Defaults to 3.\n"
+            "          --dedup-headers\n"
+            "              Index each header only once per distinct content and compiler\n"
+            "              flags, instead of once per translation unit that includes it.\n"
+            "              Ignored with --incremental.\n"
+            "          --auto-pch\n"
+            "              Find #include lines shared by the start of many source files,\n"
+            "              precompile them once, and index those TUs with the PCH.  Ignored\n"
+            "              with --incremental.\n"
+            "          --file-cache-size=MB\n"
+            "              Each daemon caches the headers it reads, up to MB megabytes, so\n"
+            "              that they aren't re-read for every translation unit.  0 disables\n"
+            "              the cache.  Defaults to 256.\n"
+            "          --symbol-dictionary\n"
+            "              Share a dictionary of symbol names (index.symbols) among the\n"
+            "              daemons, so that merging their output needs no string lookups.\n"
+            "          --profile=full|globals|defs-only\n"
+            "              How much to index.  globals omits local variables, parameters,\n"
+            "              macro expansions, #ifdef tests, and template instantiations.\n"
+            "              defs-only also omits every reference other than declarations,\n"
+            "              definitions, calls, base classes, #include, and #undef.  Both\n"
+            "              are much faster than the default, full.\n"
+            "          --skip-external-bodies\n"
+            "              Don't parse or index the bodies of functions defined outside the\n"
+            "              project roots, e.g. in system and third-party headers.\n"
+            "          --project-root=DIR\n"
+            "              A project root for --skip-external-bodies.  May be repeated.\n"
+            "              Defaults to the current directory.\n"
+            "          --coalesce-commands\n"
+            "              Entries that compile the same file with the same command are\n"
+            "              always indexed once.  With this option, commands that only differ\n"
+            "              by warning, output, debug-info, and optimization flags are also\n"
+            "              indexed once.\n"
+            "          --progress=json\n"
+            "              Write a line of JSON with the TU counts, throughput, daemon\n"
+            "              memory use, and estimated time left once a second.\n"
+            "          --progress-fd=N\n"
+            "              Write the progress lines to file descriptor N.  Defaults to 2.\n"
+            "          --progress-socket=PATH\n"
+            "              Write the progress lines to the Unix socket at PATH.\n"
+            "          --trace=FILE\n"
+            "              Write a Chrome trace of the run, including the daemons' work, to\n"
+            "              FILE.  Open it in chrome://tracing or Perfetto.\n"
+            "          --shards=N\n"
+            "              Write the index as N files (at most 64), partitioned by symbol\n"
+            "              and by file, which are built and written in parallel, and which\n"
+            "              the navigator queries in parallel.  Ignored with --incremental.\n"
+            "          --checkpoint-interval=MINUTES\n"
+            "              Save the merged index every MINUTES minutes, so that if the run\n"
+            "              is interrupted, rerunning the same command resumes from the last\n"
+            "              checkpoint.  Ignored with --incremental and --shards.\n"
+            "          --listen=[HOST:]PORT\n"
+            "              Coordinate a distributed run: send the translation units to the\n"
+            "              --worker processes that connect to PORT, and merge the idx files\n"
+            "              they send back.  Ignores --dedup-headers, --auto-pch, and\n"
+            "              --symbol-dictionary.\n"
             "\n"
-            "    --index-file index-out-file -- clang-path clang-arguments...\n"
+            "    --worker=HOST:PORT [options]\n"
+            "          Connect to an --index-project --listen coordinator, and index the\n"
+            "          translation units it sends until it finishes.  The sources must be at\n"
+            "          the same paths as on the coordinator's machine.  Accepts the\n"
+            "          --max-daemons, --memory-budget, --daemon-max-jobs,\n"
+            "          --daemon-max-memory, --daemon-pipeline, --job-timeout,\n"
+            "          --job-attempts, and --file-cache-size options of --index-project.\n"
+            "\n"
+            "    --compact\n"
+            "          Fold the index.delta.N files written by --delta back into the index.\n"
+            "\n"
+            "    --index-file index-out-file [options] -- clang-path clang-arguments...\n"
             "          Index a single translation unit.  Write the index to index-out-file.\n"
             "          clang-path must be the full path to a clang or clang++ driver\n"
             "          executable.  (This executable is not invoked, but libclang uses its\n"
-            "          path to locate header files like stdarg.h.)\n";
+            "          path to locate header files like stdarg.h.)\n"
+            "\n"
+            "          --command-hash=HASH\n"
+            "              Record HASH in the index as the hash of the compile command.\n"
+            "              Used internally by --index-project --incremental.\n"
+            "          --build-inputs-hash=HASH\n"
+            "              Record HASH in the index as the hash of the compile database\n"
+            "              entry's input-hashes.  Used internally by --index-project\n"
+            "              --incremental.\n"
+            "          --header-context=HASH\n"
+            "              Used internally by --index-project --dedup-headers.  Ask the\n"
+            "              parent process, over stdin/stdout, whether to index each header.\n"
+            "          --pch-indexed\n"
+            "              The headers of the clang arguments' -include-pch were indexed by\n"
+            "              --build-pch, so skip the declarations loaded from the PCH.\n"
+            "          --profile=full|globals|defs-only\n"
+            "              Same as the --index-project option.\n"
+            "          --project-root=DIR\n"
+            "              Skip the bodies of functions defined outside DIR (and any other\n"
+            "              --project-root).  Used internally by --skip-external-bodies.\n"
+            "\n"
+            "    --build-pch index-out-file [options] -- clang-path clang-arguments...\n"
+            "          Precompile a header to the clang arguments' -o path, and index the\n"
+            "          files it includes (but not the header itself).  Accepts the same\n"
+            "          options as --index-file.  Used internally by --auto-pch.\n";
 
             // TODO: I suspect it also uses the clang vs clang++ to decide between the C and
             // C++ languages.  Verify whether that's the case, and if so, mention it because
@@ -409,73 +1433,181 @@ static int runCommand(const std::vector<std::string> &argv)
     // TODO: Improve the argument parsing (allow --help anywhere, allow reversing the args)
 
     if (argv.size() >= 2 && argv[1] == "--index-project") {
-        bool incremental = argv.size() >= 3 && argv[2] == "--incremental";
-        return indexProject(argv[0], incremental);
-    } else if (argv.size() >= 6 &&
-               argv[1] == "--index-file" &&
-               argv[3] == "--") {
+        IndexProjectOptions options;
+        for (size_t i = 2; i < argv.size(); ++i) {
+            const std::string &arg = argv[i];
+            uint64_t value = 0;
+            if (arg == "--incremental") {
+                options.incremental = true;
+            } else if (arg == "--delta") {
+                options.delta = true;
+            } else if (arg == "--dedup-headers") {
+                options.dedupHeaders = true;
+            } else if (arg == "--auto-pch") {
+                options.autoPCH = true;
+            } else if (arg == "--symbol-dictionary") {
+                options.symbolDictionary = true;
+            } else if (arg == "--skip-external-bodies") {
+                options.skipExternalBodies = true;
+            } else if (arg == "--coalesce-commands") {
+                options.coalesceCommands = true;
+            } else if (arg == "--progress=json") {
+                options.progress.enabled = true;
+            } else if (parseUIntOption(arg, "--progress-fd=", value)) {
+                options.progress.fd = value;
+            } else if (stringStartsWith(arg, "--progress-socket=")) {
+                options.progress.socketPath =
+                        arg.substr(strlen("--progress-socket="));
+            } else if (stringStartsWith(arg, "--trace=")) {
+                options.tracePath = arg.substr(strlen("--trace="));
+            } else if (parseUIntOption(arg, "--shards=", value) &&
+                       value >= 1 && value <= indexdb::kMaxShardCount) {
+                options.shardCount = value;
+            } else if (parseUIntOption(arg, "--checkpoint-interval=", value)) {
+                options.checkpointMinutes = value;
+            } else if (stringStartsWith(arg, "--listen=")) {
+                options.listenAddress = arg.substr(strlen("--listen="));
+            } else if (!parseDaemonPoolOption(arg, options.daemonPool) &&
+                       !parseIndexJobOption(arg, options.job)) {
+                printf(kUsageTextPattern, argv[0].c_str());
+                return 1;
+            }
+        }
+        return indexProject(options);
+    } else if (argv.size() >= 2 && stringStartsWith(argv[1], "--worker=")) {
+        DaemonPoolOptions options;
+        for (size_t i = 2; i < argv.size(); ++i) {
+            if (!parseDaemonPoolOption(argv[i], options)) {
+                printf(kUsageTextPattern, argv[0].c_str());
+                return 1;
+            }
+        }
+        return runWorker(argv[1].substr(strlen("--worker=")), options);
+    } else if (argv.size() == 2 && argv[1] == "--compact") {
+        IndexMerger::compact(kIndexPath, kIndexManifestPath);
+        return 0;
+    } else if (argv.size() >= 3 &&
+               (argv[1] == "--index-file" || argv[1] == "--build-pch")) {
         std::string outputFile = argv[2];
-        std::vector<std::string> clangArgv = argv;
-        clangArgv.erase(clangArgv.begin(), clangArgv.begin() + 4);
-        return indexFile(outputFile, clangArgv);
+        IndexFileOptions options;
+        options.buildPCH = argv[1] == "--build-pch";
+        size_t i = 3;
+        for (; i < argv.size() && argv[i] != "--"; ++i) {
+            const std::string &arg = argv[i];
+            if (stringStartsWith(arg, "--header-context=")) {
+                options.headerContext = arg.substr(strlen("--header-context="));
+            } else if (stringStartsWith(arg, "--command-hash=")) {
+                options.commandHash = arg.substr(strlen("--command-hash="));
+            } else if (stringStartsWith(arg, "--build-inputs-hash=")) {
+                options.buildInputsHash =
+                        arg.substr(strlen("--build-inputs-hash="));
+            } else if (arg == "--pch-indexed") {
+                options.pchIsIndexed = true;
+            } else if (!parseIndexJobOption(arg, options.job)) {
+                printf(kUsageTextPattern, argv[0].c_str());
+                return 1;
+            }
+        }
+        // Expect the "--", the clang path, and at least one argument.
+        if (argv.size() - i < 3) {
+            printf(kUsageTextPattern, argv[0].c_str());
+            return 1;
+        }
+        std::vector<std::string> clangArgv(argv.begin() + i + 1, argv.end());
+        return indexFile(outputFile, clangArgv, options);
     } else {
         printf(kUsageTextPattern, argv[0].c_str());
         return 0;
     }
 }
 
-// Read a series of commands from stdin and run them.  After each command,
-// print a line "DONE <status-code>".  Daemon mode exists mostly to avoid
-// process creation overhead on Windows.
-//
-// The input for each command is a series of lines, starting with a working
-// directory line, followed by a line for each argument, followed by a blank
-// line.  The master process kills the daemon by closing the stdin pipe.
-//
-// Example input:
-//
-//     --index-file
-//     /tmp/hello1.idx
-//     --
-//     /tmp/hello1.c
-//     -DFOO=BAR
+// Move the daemon's stdout to a new file descriptor for the protocol, and
+// point stdout at stderr, so that nothing else the daemon prints can get mixed
+// into the protocol's messages.
+static FILE *takeStdoutForProtocol()
+{
+    fflush(stdout);
+#if defined(_WIN32)
+    const int fd = _dup(_fileno(stdout));
+    _dup2(_fileno(stderr), _fileno(stdout));
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(fd, _O_BINARY);
+    return _fdopen(fd, "wb");
+#else
+    const int fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    return fdopen(fd, "wb");
+#endif
+}
+
+// Run the jobs that the parent sends over stdin, reporting each one's status.
+// Daemon mode exists mostly to avoid process creation overhead on Windows, and
+// so that the file cache is shared by the TUs.  (See DaemonProtocol.h.)  A
+// job's arguments are a command line for runCommand, e.g.:
 //
-//     --index-file
-//     /tmp/hello2.idx
-//     --
-//     /tmp/hello2.c
-//     -DFOO=BAR
+//     --index-file /tmp/hello1.idx -- /usr/bin/clang /tmp/hello1.c -DFOO=BAR
 //
-static int runDaemon(const char *argv0)
+// A daemon started with --trace sends the trace events recorded during each
+// job with the job's status.
+static int runDaemon(
+        const char *argv0,
+        uint64_t fileCacheSizeMB,
+        const std::string &symbolDictionaryPath,
+        bool trace)
 {
-    while (true) {
-        std::string cwd = readLine(stdin);
-        if (cwd.empty())
-            return 0;
-        std::vector<std::string> commandArgv;
-        commandArgv.push_back(argv0);
-        // TODO: What about newlines embedded in arguments?
-        while (true) {
-            std::string line = readLine(stdin);
-            if (line.empty())
-                break;
-            commandArgv.push_back(line);
+    if (trace)
+        enableTrace("sw-clang-indexer daemon");
+    if (fileCacheSizeMB > 0)
+        enableFileCache(fileCacheSizeMB * 1024 * 1024);
+    if (!symbolDictionaryPath.empty()) {
+        theSymbolDictionary.reset(new SymbolDictionary);
+        if (!theSymbolDictionary->open(symbolDictionaryPath)) {
+            std::cerr << argv0 << " daemon warning: cannot open "
+                      << symbolDictionaryPath << std::endl;
+            theSymbolDictionary.reset();
         }
-        if (commandArgv.size() <= 1) {
+    }
+    FILE *output = takeStdoutForProtocol();
+    if (output == NULL) {
+        perror("sw-clang-indexer daemon error: cannot reopen stdout");
+        exit(1);
+    }
+    DaemonChannel channel(stdin, output);
+    theDaemonChannel = &channel;
+    DaemonJob job;
+    while (channel.nextJob(job)) {
+        if (job.args.empty()) {
             std::cerr << argv0 << " daemon error: "
                       << "command arguments missing." << std::endl;
             exit(1);
         }
-        if (chdir(cwd.c_str()) != 0) {
+        std::vector<std::string> commandArgv;
+        commandArgv.push_back(argv0);
+        commandArgv.insert(commandArgv.end(), job.args.begin(), job.args.end());
+        if (chdir(job.workingDirectory.c_str()) != 0) {
             std::stringstream err;
-            err << argv0 << " daemon error: chdir to " << cwd << " failed";
+            err << argv0 << " daemon error: chdir to "
+                << job.workingDirectory << " failed";
             perror(err.str().c_str());
             exit(1);
         }
-        int statusCode = runCommand(commandArgv);
-        printf("DONE %d\n", statusCode);
-        fflush(stdout);
+        indexdb::resetPeakMemoryUsage();
+        theJobStats = DaemonJobStats();
+        const double startTime = monotonicSeconds();
+        int statusCode;
+        {
+            TraceSpan span(
+                    "daemon job",
+                    commandArgv.size() > 2 ? commandArgv[2] : std::string());
+            statusCode = runCommand(commandArgv);
+        }
+        theJobStats.statusCode = statusCode;
+        theJobStats.seconds = monotonicSeconds() - startTime;
+        theJobStats.peakMemoryKB = indexdb::peakMemoryUsageKB();
+        channel.finishJob(theJobStats, takeTraceEvents());
     }
+    theDaemonChannel = NULL;
+    return 0;
 }
 
 } // namespace indexer
@@ -484,8 +1616,26 @@ int main(int argc, char *argv[])
 {
     QCoreApplication app(argc, argv);
 
-    if (argc == 2 && !strcmp(argv[1], "--daemon")) {
-        return indexer::runDaemon(argv[0]);
+    if (argc >= 2 && !strcmp(argv[1], "--daemon")) {
+        uint64_t fileCacheSizeMB = indexer::kDefaultFileCacheSizeMB;
+        std::string symbolDictionaryPath;
+        bool trace = false;
+        for (int i = 2; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg == "--trace") {
+                trace = true;
+            } else if (indexer::stringStartsWith(arg, "--symbol-dictionary=")) {
+                symbolDictionaryPath =
+                        arg.substr(strlen("--symbol-dictionary="));
+            } else if (!indexer::parseUIntOption(arg, "--file-cache-size=",
+                                                 fileCacheSizeMB)) {
+                std::cerr << argv[0] << " daemon error: unrecognized option "
+                          << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        return indexer::runDaemon(argv[0], fileCacheSizeMB,
+                                  symbolDictionaryPath, trace);
     } else {
         std::vector<std::string> commandArgv;
         for (int i = 0; i < argc; ++i)
@@ -134,6 +134,10 @@ int main(int argc, char *argv[])
             // This code was copied-and-pasted to below.
 
             indexdb::IndexArchiveReader archive(path);
+            for (const auto &pair : archive.allMetadata()) {
+                std::cout << "METADATA: " << pair.first << std::endl;
+                std::cout << pair.second << std::endl;
+            }
             for (int i = 0; i < archive.size(); ++i) {
                 std::cout << "FILE: " << archive.entry(i).name;
                 std::string hash = archive.entry(i).hash;
@@ -0,0 +1,468 @@
+#include "Workload.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <unordered_set>
+
+#include "../libindexdb/IndexArchiveBuilder.h"
+#include "../libindexdb/IndexDb.h"
+
+namespace bench {
+
+static const char *const kWords[] = {
+    "Source", "Manager", "Decl", "Context", "Type", "Map", "Dense", "Small",
+    "Vector", "String", "Ref", "Buffer", "File", "Entry", "Location", "Token",
+    "Lexer", "Parser", "Sema", "Expr", "Stmt", "Value", "Use", "Builder",
+    "Info", "Table", "Index", "Reader", "Writer", "Stream", "Node", "Tree",
+    "List", "Set", "Iterator", "Range", "Handle", "Pool", "Cache", "Scope",
+    "Visitor", "Action", "Result", "Error", "Options", "State", "Module",
+    "Target",
+};
+
+static const char *const kNamespaceWords[] = {
+    "std", "llvm", "clang", "boost", "detail", "internal", "impl", "sema",
+    "driver", "support", "util", "io", "v1", "__1", "ast", "codegen",
+};
+
+static const char *const kVerbs[] = {
+    "get", "set", "is", "has", "create", "find", "insert", "erase", "visit",
+    "emit", "lookup", "add", "remove", "build", "parse", "read", "write",
+    "begin", "end", "size",
+};
+
+static const char *const kParamTypes[] = {
+    "int", "unsigned int", "bool", "const char *", "size_t",
+    "const std::string &", "llvm::StringRef", "void *", "double", "const T &",
+};
+
+template <typename T, size_t N>
+static const T &pick(std::mt19937_64 &rng, const T (&array)[N])
+{
+    return array[uniformInt(rng, N)];
+}
+
+// Combine a seed with a value, so that each file gets its own stream of
+// random numbers.
+static uint64_t mixSeed(uint64_t seed, uint64_t value)
+{
+    uint64_t x = seed + 0x9e3779b97f4a7c15ULL * (value + 1);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+double uniformDouble(std::mt19937_64 &rng)
+{
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+uint32_t uniformInt(std::mt19937_64 &rng, uint32_t n)
+{
+    return static_cast<uint32_t>(((rng() >> 32) * n) >> 32);
+}
+
+WorkloadOptions::WorkloadOptions() :
+    symbolCount(100000),
+    headerCount(2000),
+    tuCount(100),
+    refsPerTU(20000),
+    headersPerTU(40),
+    zipfExponent(1.1),
+    seed(1)
+{
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ZipfDistribution
+
+ZipfDistribution::ZipfDistribution(uint32_t n, double exponent)
+{
+    assert(n > 0);
+    m_cdf.resize(n);
+    double sum = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        sum += 1.0 / pow(i + 1.0, exponent);
+        m_cdf[i] = sum;
+    }
+    for (double &value : m_cdf)
+        value /= sum;
+}
+
+uint32_t ZipfDistribution::operator()(std::mt19937_64 &rng) const
+{
+    const double u = uniformDouble(rng);
+    const size_t rank =
+            std::upper_bound(m_cdf.begin(), m_cdf.end(), u) - m_cdf.begin();
+    return static_cast<uint32_t>(std::min(rank, m_cdf.size() - 1));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Name generation
+
+// The indexer's symbol types, as in IndexerContext.cc.
+enum SymbolKind {
+    ST_Class, ST_Constructor, ST_Destructor, ST_Enum, ST_Enumerator, ST_Field,
+    ST_Function, ST_GlobalVariable, ST_LocalVariable, ST_Macro, ST_Method,
+    ST_Namespace, ST_Parameter, ST_Path, ST_Struct, ST_Typedef, ST_Union
+};
+
+static std::string camelCase(std::mt19937_64 &rng, int wordCount)
+{
+    std::string result;
+    for (int i = 0; i < wordCount; ++i)
+        result += pick(rng, kWords);
+    return result;
+}
+
+static std::string lowerCamelCase(std::mt19937_64 &rng, int wordCount)
+{
+    std::string result = camelCase(rng, wordCount);
+    result[0] = tolower(result[0]);
+    return result;
+}
+
+static std::string parameterList(std::mt19937_64 &rng)
+{
+    std::string result = "(";
+    const int count = uniformInt(rng, 4);
+    for (int i = 0; i < count; ++i) {
+        if (i > 0)
+            result += ", ";
+        result += pick(rng, kParamTypes);
+    }
+    return result + ")";
+}
+
+static std::string lastComponent(const std::string &name)
+{
+    const size_t colons = name.rfind("::");
+    return colons == std::string::npos ? name : name.substr(colons + 2);
+}
+
+// Generate distinct C++-like names.  Classes live in a tree of namespaces, and
+// most names are members of the classes, so names share their prefixes.
+static void generateSymbols(
+        uint32_t count,
+        std::mt19937_64 &rng,
+        std::vector<std::string> &names,
+        std::vector<uint8_t> &types)
+{
+    std::unordered_set<std::string> seen;
+    auto add = [&](const std::string &name, SymbolKind type) {
+        if (names.size() >= count || !seen.insert(name).second)
+            return false;
+        names.push_back(name);
+        types.push_back(type);
+        return true;
+    };
+
+    std::vector<std::string> namespaces;
+    const uint32_t namespaceCount = std::max<uint32_t>(4, count / 2000);
+    for (uint32_t i = 0; namespaces.size() < namespaceCount && i < count; ++i) {
+        std::string name;
+        if (!namespaces.empty() && uniformDouble(rng) < 0.7)
+            name = namespaces[uniformInt(rng, namespaces.size())] + "::";
+        name += pick(rng, kNamespaceWords);
+        if (add(name, ST_Namespace))
+            namespaces.push_back(name);
+    }
+
+    std::vector<std::string> classes;
+    const uint32_t classCount = std::max<uint32_t>(8, count / 40);
+    for (uint32_t i = 0; classes.size() < classCount && i < count; ++i) {
+        const std::string name =
+                namespaces[uniformInt(rng, namespaces.size())] + "::" +
+                camelCase(rng, 1 + uniformInt(rng, 3));
+        if (add(name, uniformDouble(rng) < 0.7 ? ST_Class : ST_Struct))
+            classes.push_back(name);
+    }
+
+    while (names.size() < count) {
+        const std::string &ns = namespaces[uniformInt(rng, namespaces.size())];
+        const std::string &cls = classes[uniformInt(rng, classes.size())];
+        const double kind = uniformDouble(rng);
+        if (kind < 0.40) {
+            add(cls + "::" + pick(rng, kVerbs) +
+                    camelCase(rng, uniformInt(rng, 3)) + parameterList(rng) +
+                    (uniformDouble(rng) < 0.3 ? " const" : ""),
+                ST_Method);
+        } else if (kind < 0.55) {
+            add(cls + "::m_" + lowerCamelCase(rng, 1 + uniformInt(rng, 2)),
+                ST_Field);
+        } else if (kind < 0.60) {
+            if (uniformDouble(rng) < 0.7)
+                add(cls + "::" + lastComponent(cls) + parameterList(rng),
+                    ST_Constructor);
+            else
+                add(cls + "::~" + lastComponent(cls) + "()", ST_Destructor);
+        } else if (kind < 0.75) {
+            add(ns + "::" + pick(rng, kVerbs) +
+                    camelCase(rng, 1 + uniformInt(rng, 2)) + parameterList(rng),
+                ST_Function);
+        } else if (kind < 0.80) {
+            add(ns + "::g_" + lowerCamelCase(rng, 1 + uniformInt(rng, 2)),
+                ST_GlobalVariable);
+        } else if (kind < 0.85) {
+            std::string name = pick(rng, kWords);
+            for (int i = uniformInt(rng, 3); i >= 0; --i)
+                name += std::string("_") + pick(rng, kWords);
+            std::transform(name.begin(), name.end(), name.begin(), toupper);
+            add(name, ST_Macro);
+        } else if (kind < 0.90) {
+            add(ns + "::" + camelCase(rng, 1 + uniformInt(rng, 2)) + "Kind",
+                ST_Enum);
+            add(ns + "::k" + camelCase(rng, 1 + uniformInt(rng, 2)),
+                ST_Enumerator);
+        } else {
+            add(cls + "::" + camelCase(rng, 1 + uniformInt(rng, 2)) + "Type",
+                ST_Typedef);
+        }
+    }
+
+    // Make popularity independent of the generation order.
+    for (size_t i = names.size(); i > 1; --i) {
+        const size_t j = uniformInt(rng, i);
+        std::swap(names[i - 1], names[j]);
+        std::swap(types[i - 1], types[j]);
+    }
+}
+
+static std::string directoryName(std::mt19937_64 &rng)
+{
+    std::string result;
+    for (int i = uniformInt(rng, 3); i >= 0; --i) {
+        result += '/';
+        result += pick(rng, kNamespaceWords);
+    }
+    return result;
+}
+
+// TU sources come first, then headers.  A fifth of the headers are system
+// headers.
+static void generatePaths(
+        const WorkloadOptions &options,
+        std::mt19937_64 &rng,
+        std::vector<std::string> &paths)
+{
+    std::unordered_set<std::string> seen;
+    while (paths.size() < options.tuCount) {
+        const std::string path = "@/src/project" + directoryName(rng) + "/" +
+                camelCase(rng, 1 + uniformInt(rng, 2)) + ".cc";
+        if (seen.insert(path).second)
+            paths.push_back(path);
+    }
+    while (paths.size() < options.tuCount + options.headerCount) {
+        std::string path;
+        if (uniformDouble(rng) < 0.2) {
+            path = "@/usr/include/c++/4.9/bits/" +
+                    lowerCamelCase(rng, 1 + uniformInt(rng, 2)) + ".h";
+        } else {
+            path = "@/src/project/include" + directoryName(rng) + "/" +
+                    camelCase(rng, 1 + uniformInt(rng, 2)) + ".h";
+        }
+        if (seen.insert(path).second)
+            paths.push_back(path);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Workload
+
+Workload::Workload(const WorkloadOptions &options) :
+    m_options(options),
+    m_symbolZipf(std::max<uint32_t>(1, options.symbolCount),
+                 options.zipfExponent),
+    m_headerZipf(std::max<uint32_t>(1, options.headerCount),
+                 options.zipfExponent),
+    m_refTypeZipf(refTypes().size(), 1.5)
+{
+    std::mt19937_64 rng(options.seed);
+    generateSymbols(std::max<uint32_t>(1, options.symbolCount), rng,
+                    m_symbols, m_symbolTypes);
+    generatePaths(options, rng, m_paths);
+}
+
+// The indexer's reference types, most common first.
+const std::vector<std::string> &Workload::refTypes()
+{
+    static const std::vector<std::string> types = {
+        "Reference", "Called", "Read", "Qualifier", "Declaration",
+        "Definition", "Assigned", "Included", "Expansion", "Initialized",
+        "Other", "Modified", "Address-Taken", "Base-Class", "Using",
+        "Defined-Test", "Namespace-Alias", "Undefinition", "Using-Directive",
+    };
+    return types;
+}
+
+// Indexed by SymbolKind.
+const std::vector<std::string> &Workload::symbolTypes()
+{
+    static const std::vector<std::string> types = {
+        "Class", "Constructor", "Destructor", "Enum", "Enumerator", "Field",
+        "Function", "GlobalVariable", "LocalVariable", "Macro", "Method",
+        "Namespace", "Parameter", "Path", "Struct", "Typedef", "Union",
+    };
+    return types;
+}
+
+std::vector<uint32_t> Workload::tuFiles(uint32_t tu) const
+{
+    std::vector<uint32_t> files;
+    files.push_back(tu);
+    if (m_options.headerCount == 0)
+        return files;
+    std::mt19937_64 rng(mixSeed(m_options.seed, tu));
+    const uint32_t wanted =
+            std::min(m_options.headersPerTU, m_options.headerCount);
+    std::unordered_set<uint32_t> seen;
+    for (uint32_t attempt = 0;
+            seen.size() < wanted && attempt < wanted * 8; ++attempt) {
+        const uint32_t header = m_options.tuCount + m_headerZipf(rng);
+        if (seen.insert(header).second)
+            files.push_back(header);
+    }
+    return files;
+}
+
+// A TU's source file has 40% of its references, and its headers share the
+// rest.  A header's count varies from header to header, but not from TU to
+// TU.
+uint32_t Workload::fileRefCount(uint32_t tu, uint32_t path) const
+{
+    if (path == tu)
+        return m_options.refsPerTU * 2 / 5;
+    const uint32_t headers = std::max<uint32_t>(1, m_options.headersPerTU);
+    std::mt19937_64 rng(mixSeed(m_options.seed ^ 0x5bd1e995, path));
+    const double base = m_options.refsPerTU * 0.6 / headers;
+    return static_cast<uint32_t>(base * (0.5 + uniformDouble(rng)));
+}
+
+void Workload::fileRefs(
+        uint32_t tu,
+        uint32_t path,
+        std::vector<RefRow> &output) const
+{
+    const uint32_t count = fileRefCount(tu, path);
+    std::mt19937_64 rng(mixSeed(m_options.seed, uint64_t(1) << 32 | path));
+    const size_t kRecentCount = 16;
+    uint32_t recent[kRecentCount];
+    size_t recentSize = 0;
+    uint32_t line = 0;
+    uint32_t column = 1;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (i == 0 || uniformDouble(rng) < 0.45) {
+            line += 1;
+            if (uniformDouble(rng) < 0.2)
+                line += uniformInt(rng, 20);
+            column = 1 + 4 * uniformInt(rng, 4);
+        }
+        uint32_t symbol;
+        if (recentSize > 0 && uniformDouble(rng) < 0.35) {
+            symbol = recent[uniformInt(rng, std::min(recentSize, kRecentCount))];
+        } else {
+            symbol = m_symbolZipf(rng);
+            recent[recentSize++ % kRecentCount] = symbol;
+        }
+        RefRow row;
+        row.path = path;
+        row.line = line;
+        row.startColumn = column;
+        row.endColumn = column + 3 + uniformInt(rng, 14);
+        row.symbol = symbol;
+        row.refType = m_refTypeZipf(rng);
+        output.push_back(row);
+        column = row.endColumn + 1 + uniformInt(rng, 4);
+    }
+}
+
+// The same schema as the indexer's IndexBuilder, without the index tables.
+void Workload::addTables(indexdb::Index &index)
+{
+    index.addStringTable("Symbol");
+    index.addStringTable("SymbolType");
+    index.addStringTable("ReferenceType");
+
+    std::vector<std::string> refColumns;
+    refColumns.push_back("Symbol");         // Path symbol
+    refColumns.push_back("");               // Line
+    refColumns.push_back("");               // StartColumn
+    refColumns.push_back("");               // EndColumn
+    refColumns.push_back("Symbol");         // Symbol referenced
+    refColumns.push_back("ReferenceType");  // Type of reference
+    index.addTable("Reference", refColumns);
+
+    std::vector<std::string> symbolColumns;
+    symbolColumns.push_back("Symbol");
+    symbolColumns.push_back("SymbolType");
+    index.addTable("Symbol", symbolColumns);
+
+    std::vector<std::string> globalSymbolColumns;
+    globalSymbolColumns.push_back("Symbol");
+    index.addTable("GlobalSymbol", globalSymbolColumns);
+}
+
+void Workload::addFileRows(
+        uint32_t tu,
+        uint32_t path,
+        indexdb::Index &index) const
+{
+    indexdb::StringTable *symbolStrings = index.stringTable("Symbol");
+    indexdb::StringTable *symbolTypeStrings = index.stringTable("SymbolType");
+    indexdb::StringTable *refTypeStrings = index.stringTable("ReferenceType");
+    indexdb::Table *refTable = index.table("Reference");
+    indexdb::Table *symbolTable = index.table("Symbol");
+    indexdb::Table *globalSymbolTable = index.table("GlobalSymbol");
+
+    const std::vector<std::string> &types = symbolTypes();
+    indexdb::Row refRow(6);
+    indexdb::Row symbolRow(2);
+    indexdb::Row globalSymbolRow(1);
+
+    const indexdb::ID pathID = symbolStrings->insert(m_paths[path].c_str());
+    symbolRow[0] = pathID;
+    symbolRow[1] = symbolTypeStrings->insert(types[ST_Path].c_str());
+    symbolTable->add(symbolRow);
+
+    std::vector<RefRow> refs;
+    fileRefs(tu, path, refs);
+    for (const RefRow &ref : refs) {
+        const indexdb::ID symbolID =
+                symbolStrings->insert(m_symbols[ref.symbol].c_str());
+        const std::string &refType = refTypes()[ref.refType];
+        refRow[0] = pathID;
+        refRow[1] = ref.line;
+        refRow[2] = ref.startColumn;
+        refRow[3] = ref.endColumn;
+        refRow[4] = symbolID;
+        refRow[5] = refTypeStrings->insert(refType.c_str());
+        refTable->add(refRow);
+
+        symbolRow[0] = symbolID;
+        symbolRow[1] = symbolTypeStrings->insert(
+                    types[m_symbolTypes[ref.symbol]].c_str());
+        symbolTable->add(symbolRow);
+        if (refType == "Definition" || refType == "Declaration") {
+            globalSymbolRow[0] = symbolID;
+            globalSymbolTable->add(globalSymbolRow);
+        }
+    }
+}
+
+void Workload::buildTUArchive(
+        uint32_t tu,
+        indexdb::IndexArchiveBuilder &archive) const
+{
+    for (uint32_t path : tuFiles(tu)) {
+        indexdb::Index *index = new indexdb::Index;
+        addTables(*index);
+        addFileRows(tu, path, *index);
+        archive.insert(m_paths[path].substr(1), index);
+    }
+}
+
+} // namespace bench
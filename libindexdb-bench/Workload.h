@@ -0,0 +1,130 @@
+#ifndef BENCH_WORKLOAD_H
+#define BENCH_WORKLOAD_H
+
+#include <stdint.h>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace indexdb {
+class Index;
+class IndexArchiveBuilder;
+}
+
+namespace bench {
+
+// Synthetic libindexdb workloads
+//
+// The data is shaped like the indexer's output, without running Clang:
+//
+//  - Symbol names look like C++ qualified names ("llvm::detail::DenseMap::
+//    find(const KeyT &)"), so they share long prefixes the way real ones do.
+//    Their popularity follows a Zipf distribution: a few symbols (std::string,
+//    size_t, common macros) are referenced everywhere, and most only a few
+//    times.
+//
+//  - Each TU references its own source file and a set of headers, which are
+//    also Zipf-distributed, so the common headers are in most TUs.  A
+//    header's references are the same in every TU that includes it, as with
+//    real headers, so merging TUs deduplicates them.
+//
+//  - Within a file, the references go forward line by line, a few per line,
+//    and tend to repeat the symbols used just before.
+//
+// The random numbers come from std::mt19937_64, whose output is fixed by the
+// standard, and are turned into values here rather than with the
+// <random> distributions, whose output differs between standard libraries.
+// So a seed produces the same workload on every platform.
+
+struct WorkloadOptions {
+    WorkloadOptions();
+    uint32_t symbolCount;       // Distinct symbol names.
+    uint32_t headerCount;       // Distinct headers.
+    uint32_t tuCount;
+    uint32_t refsPerTU;
+    uint32_t headersPerTU;
+    double zipfExponent;
+    uint64_t seed;
+};
+
+// Draws ranks in [0, n), where rank k has a probability proportional to
+// 1 / (k + 1)^exponent.
+class ZipfDistribution
+{
+public:
+    ZipfDistribution(uint32_t n, double exponent);
+    uint32_t operator()(std::mt19937_64 &rng) const;
+
+private:
+    std::vector<double> m_cdf;
+};
+
+// A uniformly distributed double in [0, 1).
+double uniformDouble(std::mt19937_64 &rng);
+
+// A uniformly distributed integer in [0, n).
+uint32_t uniformInt(std::mt19937_64 &rng, uint32_t n);
+
+// A reference, as indices into a Workload's paths, symbols, and reference
+// types.  The columns are those of the indexer's Reference table.
+struct RefRow {
+    uint32_t path;
+    uint32_t line;
+    uint32_t startColumn;
+    uint32_t endColumn;
+    uint32_t symbol;
+    uint32_t refType;
+};
+
+class Workload
+{
+public:
+    explicit Workload(const WorkloadOptions &options);
+
+    const WorkloadOptions &options() const { return m_options; }
+
+    // Symbol names, most popular first.
+    const std::vector<std::string> &symbols() const { return m_symbols; }
+    uint32_t symbolType(uint32_t symbol) const { return m_symbolTypes[symbol]; }
+    uint32_t drawSymbol(std::mt19937_64 &rng) const { return m_symbolZipf(rng); }
+
+    // Path symbols ("@/path/to/file"): the TUs' source files, then the
+    // headers, most popular first.
+    const std::vector<std::string> &paths() const { return m_paths; }
+
+    static const std::vector<std::string> &refTypes();
+    static const std::vector<std::string> &symbolTypes();
+
+    // The paths of a TU's files, its source file first.
+    std::vector<uint32_t> tuFiles(uint32_t tu) const;
+
+    // Append the references of a file, as seen by a TU.  A header has the same
+    // references in every TU.
+    void fileRefs(uint32_t tu, uint32_t path, std::vector<RefRow> &output) const;
+
+    // Add the string tables and tables of the indexer's per-file indices.
+    static void addTables(indexdb::Index &index);
+
+    // Add a file's rows to an index created with addTables.
+    void addFileRows(uint32_t tu, uint32_t path, indexdb::Index &index) const;
+
+    // Build the archive an --index-file job would write for a TU, with an
+    // index per file.  The archive is not finalized.
+    void buildTUArchive(uint32_t tu,
+                        indexdb::IndexArchiveBuilder &archive) const;
+
+private:
+    uint32_t fileRefCount(uint32_t tu, uint32_t path) const;
+
+    WorkloadOptions m_options;
+    std::vector<std::string> m_symbols;
+    std::vector<uint8_t> m_symbolTypes;
+    ZipfDistribution m_symbolZipf;
+    std::vector<std::string> m_paths;
+    ZipfDistribution m_headerZipf;
+    ZipfDistribution m_refTypeZipf;
+};
+
+} // namespace bench
+
+#endif // BENCH_WORKLOAD_H
@@ -0,0 +1,26 @@
+include(../config.pri)
+
+QT -= core gui
+
+TARGET = libindexdb-bench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += \
+    main.cc \
+    Workload.cc
+
+HEADERS += \
+    Workload.h
+
+OTHER_FILES += \
+    dependencies.cfg
+
+ROOT_DIR = ..
+include(../add_dependencies.pri)
+
+win32: LIBS += -lpsapi
+
+include(../enable-cxx11.pri)
+QMAKE_CXXFLAGS_WARN_ON += -Wno-unused-parameter
@@ -0,0 +1,658 @@
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../libindexdb/IndexArchiveBuilder.h"
+#include "../libindexdb/IndexArchiveReader.h"
+#include "../libindexdb/IndexDb.h"
+#include "../libindexdb/PeakMemory.h"
+#include "Workload.h"
+
+// libindexdb micro-benchmarks
+//
+// Each benchmark times one libindexdb operation on a synthetic workload (see
+// Workload.h), and reports its throughput, the latency percentiles of its
+// samples, and the peak RSS while it ran.  Setup, such as generating the rows
+// to add, is not timed, but it does count towards the peak RSS.
+//
+// A sample is a batch of operations for the cheap operations (e.g. 1024
+// StringTable::insert calls), whose latency is the batch's time divided by
+// its size, or a single operation for the expensive ones (e.g. one
+// finalizeTables call).
+
+namespace bench {
+
+const char kUsageText[] =
+    "Usage: %s [options]\n"
+    "\n"
+    "Run the libindexdb micro-benchmarks on a synthetic workload.\n"
+    "\n"
+    "Options:\n"
+    "    --benchmark=NAME[,NAME...]\n"
+    "          Run only the named benchmarks.  --list shows the names.\n"
+    "    --list\n"
+    "          List the benchmarks and exit.\n"
+    "    --json\n"
+    "          Write the results as a JSON object instead of a table.\n"
+    "    --scale=FACTOR\n"
+    "          Multiply the number of symbols, headers, and TUs by FACTOR.\n"
+    "    --symbols=N         Distinct symbol names (default %u).\n"
+    "    --headers=N         Distinct headers (default %u).\n"
+    "    --tus=N             Translation units (default %u).\n"
+    "    --refs-per-tu=N     References per TU (default %u).\n"
+    "    --headers-per-tu=N  Headers included by each TU (default %u).\n"
+    "    --zipf=EXPONENT     Skew of symbol and header popularity (default %g).\n"
+    "    --seed=N            Workload random seed (default %llu).\n"
+    "    --tmp-dir=DIR\n"
+    "          Where the archive benchmarks write their files (default: the\n"
+    "          working directory).\n";
+
+// The number of operations in each sample of the batched benchmarks.
+const uint64_t kBatchSize = 1024;
+
+// The number of TUs whose per-TU operations are timed separately.
+const uint32_t kMaxTimedTUs = 50;
+
+static double monotonicSeconds()
+{
+    return std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t fileSize(const std::string &path)
+{
+    std::ifstream f(path.c_str(), std::ios::binary | std::ios::ate);
+    return f.good() ? static_cast<uint64_t>(f.tellg()) : 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Measurement
+
+class Measurement
+{
+public:
+    Measurement() : m_ops(0), m_bytes(0), m_seconds(0), m_start(0) {}
+
+    void begin() { m_start = monotonicSeconds(); }
+
+    // End a sample of opCount operations, which processed byteCount bytes.
+    void end(uint64_t opCount, uint64_t byteCount=0) {
+        const double seconds = monotonicSeconds() - m_start;
+        m_ops += opCount;
+        m_bytes += byteCount;
+        m_seconds += seconds;
+        if (opCount > 0)
+            m_latencies.push_back(seconds / opCount);
+    }
+
+    uint64_t ops() const { return m_ops; }
+    uint64_t bytes() const { return m_bytes; }
+    double seconds() const { return m_seconds; }
+
+    // The latency of an operation at a percentile in [0, 100], in seconds.
+    double percentile(double p) const {
+        if (m_latencies.empty())
+            return 0;
+        std::vector<double> sorted(m_latencies);
+        std::sort(sorted.begin(), sorted.end());
+        size_t rank = static_cast<size_t>(ceil(p / 100 * sorted.size()));
+        return sorted[std::max<size_t>(rank, 1) - 1];
+    }
+
+private:
+    uint64_t m_ops;
+    uint64_t m_bytes;
+    double m_seconds;
+    double m_start;
+    std::vector<double> m_latencies;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Fixture
+
+// The data that several benchmarks share, built on first use and untimed.
+class Fixture
+{
+public:
+    Fixture(const Workload &workload, const std::string &tmpDir) :
+        m_workload(workload), m_tmpDir(tmpDir) {}
+
+    ~Fixture() {
+        for (const std::string &path : m_archivePaths)
+            remove(path.c_str());
+    }
+
+    const Workload &workload() const { return m_workload; }
+
+    uint32_t timedTUCount() const {
+        return std::min(m_workload.options().tuCount, kMaxTimedTUs);
+    }
+
+    // The finalized archives of every TU.
+    const std::vector<std::unique_ptr<indexdb::IndexArchiveBuilder> > &
+    archives() {
+        if (m_archives.empty()) {
+            for (uint32_t tu = 0; tu < m_workload.options().tuCount; ++tu) {
+                m_archives.emplace_back(new indexdb::IndexArchiveBuilder);
+                m_workload.buildTUArchive(tu, *m_archives.back());
+                m_archives.back()->finalize();
+            }
+        }
+        return m_archives;
+    }
+
+    // The compressed archives of the first timedTUCount() TUs, on disk.
+    const std::vector<std::string> &archivePaths() {
+        if (m_archivePaths.empty()) {
+            for (uint32_t tu = 0; tu < timedTUCount(); ++tu) {
+                m_archivePaths.push_back(archivePath(tu));
+                archives()[tu]->write(m_archivePaths.back(),
+                                      /*compressed=*/true);
+            }
+        }
+        return m_archivePaths;
+    }
+
+    void setArchivePaths(const std::vector<std::string> &paths) {
+        m_archivePaths = paths;
+    }
+
+    std::string archivePath(uint32_t tu) const {
+        return m_tmpDir + "/libindexdb-bench." + std::to_string(tu) + ".idx";
+    }
+
+    // Every TU merged into one index, which is not finalized yet.
+    std::unique_ptr<indexdb::Index> unfinalizedMergedIndex() {
+        std::unique_ptr<indexdb::Index> index(new indexdb::Index);
+        Workload::addTables(*index);
+        for (const auto &archive : archives()) {
+            for (const auto &entry : archive->indices())
+                index->merge(*entry.second);
+        }
+        return index;
+    }
+
+    // The finalized merged index, with a ReferenceIndex table, like the
+    // indexer's output.
+    const indexdb::Index &mergedIndex() {
+        if (!m_mergedIndex)
+            setMergedIndex(unfinalizedMergedIndex());
+        return *m_mergedIndex;
+    }
+
+    // Take a merged index, finalizing it if necessary.
+    void setMergedIndex(std::unique_ptr<indexdb::Index> index) {
+        if (m_mergedIndex)
+            return;
+        index->finalizeTables();
+        addReferenceIndex(*index);
+        m_mergedIndex = std::move(index);
+    }
+
+private:
+    // Invert the Reference table, as the indexer's IndexBuilder does.
+    static void addReferenceIndex(indexdb::Index &index) {
+        std::vector<std::string> columns;
+        columns.push_back("Symbol");
+        columns.push_back("ReferenceType");
+        columns.push_back("Symbol");
+        columns.push_back("");
+        columns.push_back("");
+        columns.push_back("");
+        indexdb::Table *refIndex = index.addTable("ReferenceIndex", columns);
+        const indexdb::Table *refs = index.table("Reference");
+        indexdb::Row src(6);
+        indexdb::Row dest(6);
+        for (auto it = refs->begin(), itEnd = refs->end(); it != itEnd; ++it) {
+            it.value(src);
+            dest[0] = src[4];
+            dest[1] = src[5];
+            dest[2] = src[0];
+            dest[3] = src[1];
+            dest[4] = src[2];
+            dest[5] = src[3];
+            refIndex->add(dest);
+        }
+        index.finalizeTables();
+    }
+
+    const Workload &m_workload;
+    std::string m_tmpDir;
+    std::vector<std::unique_ptr<indexdb::IndexArchiveBuilder> > m_archives;
+    std::vector<std::string> m_archivePaths;
+    std::unique_ptr<indexdb::Index> m_mergedIndex;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+
+// Insert Zipf-distributed symbol names into a StringTable, as the indexer
+// does for each reference.  Most inserts find an existing string.
+static void benchStringInsert(Fixture &fixture, Measurement &m)
+{
+    const Workload &workload = fixture.workload();
+    std::mt19937_64 rng(workload.options().seed);
+    const uint64_t count = std::max<uint64_t>(
+                kBatchSize, uint64_t(workload.options().symbolCount) * 10);
+    std::vector<const std::string*> names(count);
+    for (auto &name : names)
+        name = &workload.symbols()[workload.drawSymbol(rng)];
+
+    indexdb::StringTable table;
+    for (uint64_t i = 0; i < count; i += kBatchSize) {
+        const uint64_t batchEnd = std::min(count, i + kBatchSize);
+        uint64_t bytes = 0;
+        m.begin();
+        for (uint64_t j = i; j < batchEnd; ++j) {
+            table.insert(names[j]->c_str());
+            bytes += names[j]->size();
+        }
+        m.end(batchEnd - i, bytes);
+    }
+}
+
+// Add the reference rows of every TU to one Table, as merging does.  The
+// headers' rows repeat from TU to TU.
+static void benchTableAdd(Fixture &fixture, Measurement &m)
+{
+    const Workload &workload = fixture.workload();
+    std::vector<RefRow> refs;
+    for (uint32_t tu = 0; tu < workload.options().tuCount; ++tu) {
+        for (uint32_t path : workload.tuFiles(tu))
+            workload.fileRefs(tu, path, refs);
+    }
+
+    indexdb::Index index;
+    std::vector<std::string> columns(6);
+    indexdb::Table *table = index.addTable("Reference", columns);
+    indexdb::Row row(6);
+    for (size_t i = 0; i < refs.size(); i += kBatchSize) {
+        const size_t batchEnd = std::min<size_t>(refs.size(), i + kBatchSize);
+        m.begin();
+        for (size_t j = i; j < batchEnd; ++j) {
+            const RefRow &ref = refs[j];
+            row[0] = ref.path;
+            row[1] = ref.line;
+            row[2] = ref.startColumn;
+            row[3] = ref.endColumn;
+            row[4] = ref.symbol;
+            row[5] = ref.refType;
+            table->add(row);
+        }
+        m.end(batchEnd - i, (batchEnd - i) * 6 * sizeof(uint32_t));
+    }
+}
+
+// Finalize the per-file indices of a TU, as each --index-file job does.
+static void benchFinalize(Fixture &fixture, Measurement &m)
+{
+    const Workload &workload = fixture.workload();
+    for (uint32_t tu = 0; tu < fixture.timedTUCount(); ++tu) {
+        indexdb::IndexArchiveBuilder archive;
+        workload.buildTUArchive(tu, archive);
+        m.begin();
+        archive.finalize();
+        m.end(1);
+    }
+}
+
+// Merge every TU's indices into one index, as IndexMerger does.
+static void benchMerge(Fixture &fixture, Measurement &m)
+{
+    const auto &archives = fixture.archives();
+    std::unique_ptr<indexdb::Index> index(new indexdb::Index);
+    Workload::addTables(*index);
+    for (const auto &archive : archives) {
+        m.begin();
+        for (const auto &entry : archive->indices())
+            index->merge(*entry.second);
+        m.end(1);
+    }
+    fixture.setMergedIndex(std::move(index));
+}
+
+// Finalize the merged index of every TU.
+static void benchFinalizeMerged(Fixture &fixture, Measurement &m)
+{
+    std::unique_ptr<indexdb::Index> index = fixture.unfinalizedMergedIndex();
+    m.begin();
+    index->finalizeTables();
+    m.end(1);
+    fixture.setMergedIndex(std::move(index));
+}
+
+// Look up the references of Zipf-distributed symbols in the ReferenceIndex
+// table, as the navigator does to show a symbol's references.
+static void benchLowerBound(Fixture &fixture, Measurement &m)
+{
+    const Workload &workload = fixture.workload();
+    const indexdb::Index &index = fixture.mergedIndex();
+    const indexdb::StringTable *symbols = index.stringTable("Symbol");
+    const indexdb::Table *refIndex = index.table("ReferenceIndex");
+    if (symbols == NULL || symbols->size() == 0 || refIndex == NULL) {
+        std::cerr << "warning: lower-bound: skipped, the index has no symbols"
+                  << std::endl;
+        return;
+    }
+    std::mt19937_64 rng(workload.options().seed);
+    std::vector<indexdb::ID> queries;
+    const size_t count = std::max<uint64_t>(
+                kBatchSize, workload.options().symbolCount * 2);
+    // Most drawn symbols are referenced, but stop drawing if few of them are.
+    for (size_t draws = 0; queries.size() < count && draws < count * 10;
+            ++draws) {
+        const std::string &name = workload.symbols()[workload.drawSymbol(rng)];
+        const indexdb::ID id = symbols->id(name.c_str());
+        if (id != indexdb::kInvalidID)
+            queries.push_back(id);
+    }
+    if (queries.empty()) {
+        std::cerr << "warning: lower-bound: skipped, the index has no "
+                  << "referenced symbols" << std::endl;
+        return;
+    }
+
+    indexdb::Row key(1);
+    indexdb::Row row(6);
+    uint64_t found = 0;
+    for (size_t i = 0; i < queries.size(); i += kBatchSize) {
+        const size_t batchEnd = std::min(queries.size(), i + kBatchSize);
+        m.begin();
+        for (size_t j = i; j < batchEnd; ++j) {
+            key[0] = queries[j];
+            auto it = refIndex->lowerBound(key);
+            if (it != refIndex->end()) {
+                it.value(row);
+                found += row[0] == key[0];
+            }
+        }
+        m.end(batchEnd - i);
+    }
+    if (found != queries.size())
+        std::cerr << "warning: lower-bound: only " << found << " of "
+                  << queries.size() << " symbols found" << std::endl;
+}
+
+// Decode every row of the ReferenceIndex table.
+static void benchScan(Fixture &fixture, Measurement &m)
+{
+    const indexdb::Table *table =
+            fixture.mergedIndex().table("ReferenceIndex");
+    indexdb::Row row(table->columnCount());
+    uint64_t checksum = 0;
+    for (int pass = 0; pass < 5; ++pass) {
+        m.begin();
+        for (auto it = table->begin(), itEnd = table->end();
+                it != itEnd; ++it) {
+            it.value(row);
+            checksum += row[3];
+        }
+        m.end(table->size(), table->bufferSize());
+    }
+    if (checksum == 1)
+        std::cerr << std::endl;   // Keep the loop from being optimized away.
+}
+
+// Write TU archives with compression, as each --index-file job does.
+static void benchArchiveWrite(Fixture &fixture, Measurement &m)
+{
+    const auto &archives = fixture.archives();
+    std::vector<std::string> paths;
+    for (uint32_t tu = 0; tu < fixture.timedTUCount(); ++tu) {
+        paths.push_back(fixture.archivePath(tu));
+        m.begin();
+        archives[tu]->write(paths.back(), /*compressed=*/true);
+        m.end(1, fileSize(paths.back()));
+    }
+    fixture.setArchivePaths(paths);
+}
+
+// Read compressed TU archives and open every entry, as merging does.
+static void benchArchiveRead(Fixture &fixture, Measurement &m)
+{
+    uint64_t rows = 0;
+    for (const std::string &path : fixture.archivePaths()) {
+        m.begin();
+        indexdb::IndexArchiveReader archive(path);
+        for (int i = 0; i < archive.size(); ++i) {
+            std::unique_ptr<indexdb::Index> index(archive.openEntry(i));
+            rows += index->table("Reference")->size();
+        }
+        m.end(1, fileSize(path));
+    }
+    if (rows == 0)
+        std::cerr << "warning: archive-read: the archives are empty"
+                  << std::endl;
+}
+
+struct Benchmark {
+    const char *name;
+    void (*run)(Fixture &fixture, Measurement &m);
+};
+
+// Ordered so that a benchmark's fixture data is usually built by an earlier
+// benchmark.
+const Benchmark kBenchmarks[] = {
+    { "string-insert",      benchStringInsert },
+    { "table-add",          benchTableAdd },
+    { "finalize",           benchFinalize },
+    { "merge",              benchMerge },
+    { "finalize-merged",    benchFinalizeMerged },
+    { "lower-bound",        benchLowerBound },
+    { "scan",               benchScan },
+    { "archive-write",      benchArchiveWrite },
+    { "archive-read",       benchArchiveRead },
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Reporting
+
+struct BenchmarkResult {
+    std::string name;
+    Measurement measurement;
+    uint64_t peakMemoryKB;
+};
+
+static void printTable(const std::vector<BenchmarkResult> &results)
+{
+    printf("%-16s %10s %9s %12s %9s %9s %9s %9s %9s %8s\n",
+           "benchmark", "ops", "seconds", "ops/s", "MB/s",
+           "p50 us", "p90 us", "p99 us", "max us", "RSS MB");
+    for (const BenchmarkResult &result : results) {
+        const Measurement &m = result.measurement;
+        const double seconds = std::max(m.seconds(), 1e-9);
+        printf("%-16s %10llu %9.3f %12.0f %9.1f %9.3f %9.3f %9.3f %9.3f %8.1f\n",
+               result.name.c_str(),
+               static_cast<unsigned long long>(m.ops()),
+               m.seconds(),
+               m.ops() / seconds,
+               m.bytes() / seconds / (1024 * 1024),
+               m.percentile(50) * 1e6,
+               m.percentile(90) * 1e6,
+               m.percentile(99) * 1e6,
+               m.percentile(100) * 1e6,
+               result.peakMemoryKB / 1024.0);
+    }
+}
+
+// One JSON object, so a series of runs can be tracked over time.  The
+// latencies are in microseconds.
+static void printJson(
+        const WorkloadOptions &options,
+        const std::vector<BenchmarkResult> &results)
+{
+    printf("{\n");
+    printf("  \"workload\": {\"symbols\": %u, \"headers\": %u, \"tus\": %u, "
+           "\"refsPerTU\": %u, \"headersPerTU\": %u, \"zipf\": %g, "
+           "\"seed\": %llu},\n",
+           options.symbolCount, options.headerCount, options.tuCount,
+           options.refsPerTU, options.headersPerTU, options.zipfExponent,
+           static_cast<unsigned long long>(options.seed));
+    printf("  \"benchmarks\": [");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult &result = results[i];
+        const Measurement &m = result.measurement;
+        const double seconds = std::max(m.seconds(), 1e-9);
+        printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, "
+               "\"opsPerSecond\": %.1f, \"bytesPerSecond\": %.1f, "
+               "\"latencyUs\": {\"p50\": %.3f, \"p90\": %.3f, "
+               "\"p99\": %.3f, \"max\": %.3f}, \"peakRssKB\": %llu}",
+               i > 0 ? "," : "",
+               result.name.c_str(),
+               static_cast<unsigned long long>(m.ops()),
+               m.seconds(),
+               m.ops() / seconds,
+               m.bytes() / seconds,
+               m.percentile(50) * 1e6,
+               m.percentile(90) * 1e6,
+               m.percentile(99) * 1e6,
+               m.percentile(100) * 1e6,
+               static_cast<unsigned long long>(result.peakMemoryKB));
+    }
+    printf("\n  ]\n}\n");
+}
+
+static bool parseUInt(const char *text, uint32_t &output)
+{
+    char *end = NULL;
+    const unsigned long value = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || value > UINT32_MAX)
+        return false;
+    output = static_cast<uint32_t>(value);
+    return true;
+}
+
+static bool startsWith(const std::string &str, const char *prefix)
+{
+    return str.compare(0, strlen(prefix), prefix) == 0;
+}
+
+static void printUsage(const char *argv0)
+{
+    const WorkloadOptions defaults;
+    printf(kUsageText, argv0, defaults.symbolCount, defaults.headerCount,
+           defaults.tuCount, defaults.refsPerTU, defaults.headersPerTU,
+           defaults.zipfExponent,
+           static_cast<unsigned long long>(defaults.seed));
+}
+
+static int benchMain(int argc, char *argv[])
+{
+    WorkloadOptions options;
+    double scale = 1.0;
+    bool json = false;
+    std::string tmpDir = ".";
+    std::vector<std::string> selected;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const char *value = strchr(argv[i], '=');
+        value = value != NULL ? value + 1 : "";
+        bool ok = true;
+        if (arg == "--json") {
+            json = true;
+        } else if (arg == "--list") {
+            for (const Benchmark &benchmark : kBenchmarks)
+                printf("%s\n", benchmark.name);
+            return 0;
+        } else if (startsWith(arg, "--benchmark=")) {
+            std::string names = value;
+            size_t start = 0;
+            while (start <= names.size()) {
+                size_t comma = names.find(',', start);
+                if (comma == std::string::npos)
+                    comma = names.size();
+                selected.push_back(names.substr(start, comma - start));
+                start = comma + 1;
+            }
+        } else if (startsWith(arg, "--scale=")) {
+            scale = atof(value);
+            ok = scale > 0;
+        } else if (startsWith(arg, "--symbols=")) {
+            ok = parseUInt(value, options.symbolCount) &&
+                    options.symbolCount > 0;
+        } else if (startsWith(arg, "--headers=")) {
+            ok = parseUInt(value, options.headerCount);
+        } else if (startsWith(arg, "--tus=")) {
+            ok = parseUInt(value, options.tuCount) && options.tuCount > 0;
+        } else if (startsWith(arg, "--refs-per-tu=")) {
+            ok = parseUInt(value, options.refsPerTU);
+        } else if (startsWith(arg, "--headers-per-tu=")) {
+            ok = parseUInt(value, options.headersPerTU);
+        } else if (startsWith(arg, "--zipf=")) {
+            options.zipfExponent = atof(value);
+            ok = options.zipfExponent > 0;
+        } else if (startsWith(arg, "--seed=")) {
+            options.seed = strtoull(value, NULL, 10);
+        } else if (startsWith(arg, "--tmp-dir=")) {
+            tmpDir = value;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (const std::string &name : selected) {
+        bool known = false;
+        for (const Benchmark &benchmark : kBenchmarks)
+            known = known || name == benchmark.name;
+        if (!known) {
+            std::cerr << "error: unknown benchmark " << name
+                      << " (see --list)" << std::endl;
+            return 1;
+        }
+    }
+
+    options.symbolCount = std::max<uint32_t>(1, options.symbolCount * scale);
+    options.headerCount = static_cast<uint32_t>(options.headerCount * scale);
+    options.tuCount = std::max<uint32_t>(1, options.tuCount * scale);
+
+    const Workload workload(options);
+    Fixture fixture(workload, tmpDir);
+    std::vector<BenchmarkResult> results;
+    for (const Benchmark &benchmark : kBenchmarks) {
+        if (!selected.empty() &&
+                std::find(selected.begin(), selected.end(), benchmark.name) ==
+                    selected.end())
+            continue;
+        if (!json)
+            std::cerr << "Running " << benchmark.name << "..." << std::endl;
+        BenchmarkResult result;
+        result.name = benchmark.name;
+        indexdb::resetPeakMemoryUsage();
+        benchmark.run(fixture, result.measurement);
+        result.peakMemoryKB = indexdb::peakMemoryUsageKB();
+        results.push_back(std::move(result));
+    }
+
+    if (json)
+        printJson(options, results);
+    else
+        printTable(results);
+    return 0;
+}
+
+} // namespace bench
+
+int main(int argc, char *argv[])
+{
+    return bench::benchMain(argc, argv);
+}
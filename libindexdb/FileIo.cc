@@ -76,7 +76,18 @@ Writer::Writer(const std::string &path) : m_sha256(NULL), m_compressed(false)
 
 Writer::~Writer()
 {
-    fclose(m_fp);
+    if (m_fp != NULL)
+        fclose(m_fp);
+}
+
+// Close the file.  Returns false if any of the writes failed (e.g. because the
+// disk is full).
+bool Writer::close()
+{
+    const bool success = fflush(m_fp) == 0 && !ferror(m_fp);
+    const bool closed = fclose(m_fp) == 0;
+    m_fp = NULL;
+    return success && closed;
 }
 
 // Write padding bytes until the output is aligned to the given power of 2.
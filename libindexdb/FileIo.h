@@ -32,6 +32,7 @@ public:
     void seek(uint64_t offset);
     void setSha256Hash(WriterSha256Context *sha256);
     void setCompressed(bool compressed);
+    bool close();
 private:
     WriterSha256Context *m_sha256;
     bool m_compressed;
@@ -28,6 +28,15 @@ Index *IndexArchiveBuilder::lookup(const std::string &entryName)
     return (it != m_indices.end()) ? it->second : NULL;
 }
 
+// Metadata is a set of strings describing the archive as a whole, such as how
+// it was produced.
+void IndexArchiveBuilder::setMetadata(
+        const std::string &key,
+        const std::string &value)
+{
+    m_metadata[key] = value;
+}
+
 void IndexArchiveBuilder::finalize()
 {
     for (const auto &pair : m_indices)
@@ -42,6 +51,11 @@ void IndexArchiveBuilder::write(const std::string &path, bool compressed)
 
     Writer writer(path);
     writer.writeSignature(kIndexArchiveSignature);
+    writer.writeUInt32(m_metadata.size());
+    for (const auto &pair : m_metadata) {
+        writer.writeString(pair.first);
+        writer.writeString(pair.second);
+    }
     writer.writeUInt32(m_indices.size());
     writer.setCompressed(compressed);
 
@@ -14,11 +14,14 @@ public:
     ~IndexArchiveBuilder();
     void insert(const std::string &entryName, Index *index);
     Index *lookup(const std::string &entryName);
+    const std::map<std::string, Index*> &indices() { return m_indices; }
+    void setMetadata(const std::string &key, const std::string &value);
     void finalize();
     void write(const std::string &path, bool compressed=false);
 
 private:
     std::map<std::string, Index*> m_indices;
+    std::map<std::string, std::string> m_metadata;
 };
 
 } // namespace indexdb
@@ -9,6 +9,11 @@ IndexArchiveReader::IndexArchiveReader(const std::string &path) : m_path(path)
 {
     UnmappedReader reader(path);
     reader.readSignature(kIndexArchiveSignature);
+    uint32_t metadataCount = reader.readUInt32();
+    for (uint32_t i = 0; i < metadataCount; ++i) {
+        std::string key = reader.readString();
+        m_metadata[key] = reader.readString();
+    }
     uint32_t entryCount = reader.readUInt32();
     for (uint32_t i = 0; i < entryCount; ++i) {
         Entry *entry = new Entry;
@@ -52,4 +57,11 @@ Index *IndexArchiveReader::openEntry(int index)
     return new Index(reader);
 }
 
+// Returns an empty string if the archive has no such metadata.
+std::string IndexArchiveReader::metadata(const std::string &key)
+{
+    auto it = m_metadata.find(key);
+    return (it != m_metadata.end()) ? it->second : std::string();
+}
+
 } // namespace indexdb
@@ -35,11 +35,14 @@ public:
     const Entry &entry(int index);
     int indexOf(const std::string &entryName);
     Index *openEntry(int index);
+    std::string metadata(const std::string &key);
+    const std::map<std::string, std::string> &allMetadata() { return m_metadata; }
 
 private:
     std::string m_path;
     std::vector<Entry*> m_entries;
     std::map<std::string, int> m_entryMap;
+    std::map<std::string, std::string> m_metadata;
 };
 
 } // namespace indexdb
@@ -287,7 +287,7 @@ void Table::setReadOnly(
 }
 
 // Find the first iterator that is greater than or equal to the given row.
-TableIterator Table::lowerBound(const Row &row)
+TableIterator Table::lowerBound(const Row &row) const
 {
     assert(m_readonly);
     assert(row.count() <= columnCount());
@@ -382,10 +382,12 @@ Index::~Index()
     delete m_reader;
 }
 
-void Index::write(const std::string &path)
+// Returns false if the file couldn't be written completely.
+bool Index::write(const std::string &path)
 {
     Writer writer(path);
     write(writer);
+    return writer.close();
 }
 
 void Index::write(Writer &writer)
@@ -408,12 +410,25 @@ void Index::write(Writer &writer)
 // A table must have the same number and name of columns in the two indices.
 void Index::merge(const Index &other)
 {
-    std::map<std::string, std::vector<ID> > idMap;
+    merge(other, std::map<std::string, std::vector<ID> >(),
+          std::set<std::string>());
+}
+
+// Like merge, but the caller provides the ID mappings of some string tables,
+// whose strings it has already added, and some tables are skipped.
+void Index::merge(
+        const Index &other,
+        const std::map<std::string, std::vector<ID> > &stringIdMaps,
+        const std::set<std::string> &skippedTables)
+{
+    std::map<std::string, std::vector<ID> > idMap(stringIdMaps);
 
     // For each string table in "other", add all of the strings to the
     // corresponding string table in "this", while also building a table
     // mapping each of the "other" IDs into "this" IDs.
     for (const auto &pair : other.m_stringTables) {
+        if (stringIdMaps.find(pair.first) != stringIdMaps.end())
+            continue;
         idMap[pair.first] = std::vector<ID>();
         std::vector<ID> &stringTableIdMap = idMap[pair.first];
         StringTable *destStringTable = addStringTable(pair.first);
@@ -431,6 +446,8 @@ void Index::merge(const Index &other)
     // For each row in each "other" table, add the row to the corresponding
     // table in "this", after remapping IDs.
     for (const auto &tablePair : other.m_tables) {
+        if (skippedTables.find(tablePair.first) != skippedTables.end())
+            continue;
         Table *srcTable = tablePair.second;
         Table *destTable = addTable(tablePair.first, srcTable->m_columnNames);
         mergeTable(destTable, srcTable, idMap);
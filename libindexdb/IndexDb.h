@@ -7,6 +7,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <map>
+#include <set>
 #include <string>
 #include <unordered_set>
 #include <utility>
@@ -26,7 +27,7 @@ class Table;
 // Miscellaneous
 
 const char kIndexSignature[]        = "\x7fIDX";
-const char kIndexArchiveSignature[] = "\x7fIAR";
+const char kIndexArchiveSignature[] = "\x7fIA2";
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -122,7 +123,7 @@ public:
         return m_columnNames[i];
     }
 
-    TableIterator lowerBound(const Row &row);
+    TableIterator lowerBound(const Row &row) const;
     void dumpStats() const;
 
     uint32_t size() const {
@@ -166,9 +167,12 @@ public:
     explicit Index(const std::string &path);
     explicit Index(Reader *reader);
     ~Index();
-    void write(const std::string &path);
+    bool write(const std::string &path);
     void write(Writer &writer);
     void merge(const Index &other);
+    void merge(const Index &other,
+               const std::map<std::string, std::vector<ID> > &stringIdMaps,
+               const std::set<std::string> &skippedTables);
 
     // Disable copying.
     Index(const Index &other) = delete;
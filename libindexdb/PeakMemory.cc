@@ -0,0 +1,68 @@
+#include "PeakMemory.h"
+#include "../shared_headers/host.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#if defined(SOURCEWEB_UNIX)
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX 1
+#endif
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+namespace indexdb {
+
+void resetPeakMemoryUsage()
+{
+#if defined(__linux__)
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (fp != NULL) {
+        fputs("5", fp);
+        fclose(fp);
+    }
+#endif
+}
+
+uint64_t peakMemoryUsageKB()
+{
+#if defined(__linux__)
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return strtoull(line.c_str() + 6, NULL, 10);
+    }
+    return 0;
+#elif defined(SOURCEWEB_UNIX)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    // OS X reports ru_maxrss in bytes rather than kilobytes.
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#elif defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    memset(&counters, 0, sizeof(counters));
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                              sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize / 1024;
+#else
+#error "Not implemented on this OS."
+#endif
+}
+
+} // namespace indexdb
@@ -0,0 +1,20 @@
+#ifndef INDEXDB_PEAKMEMORY_H
+#define INDEXDB_PEAKMEMORY_H
+
+#include <stdint.h>
+
+namespace indexdb {
+
+// Reset the process' peak memory usage to its current usage, so that a later
+// peakMemoryUsageKB call measures the peak of the work done in between.  This
+// is only possible on Linux (4.0 and up).  Elsewhere, the peak covers the
+// whole life of the process.
+void resetPeakMemoryUsage();
+
+// Returns the peak resident set size of this process, in kilobytes, or 0 if
+// it cannot be determined.  On Windows, the program must link against psapi.
+uint64_t peakMemoryUsageKB();
+
+} // namespace indexdb
+
+#endif // INDEXDB_PEAKMEMORY_H
@@ -0,0 +1,29 @@
+#include "RowCopier.h"
+
+namespace indexdb {
+
+// Returns the ID of the source string in the destination's string table of
+// the same name, copying the string if needed.
+ID RowCopier::copyString(const std::string &stringTableName, ID srcID)
+{
+    ID &destID = idMap(stringTableName)[srcID];
+    if (destID == kInvalidID) {
+        const StringTable *srcStrings = m_src.stringTable(stringTableName);
+        destID = m_dest.stringTable(stringTableName)->insert(
+                    srcStrings->item(srcID), srcStrings->itemSize(srcID));
+    }
+    return destID;
+}
+
+std::vector<ID> &RowCopier::idMap(const std::string &stringTableName)
+{
+    std::vector<ID> &result = m_idMaps[stringTableName];
+    if (result.empty()) {
+        const StringTable *srcStrings = m_src.stringTable(stringTableName);
+        assert(srcStrings != NULL);
+        result.resize(srcStrings->size(), kInvalidID);
+    }
+    return result;
+}
+
+} // namespace indexdb
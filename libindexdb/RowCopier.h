@@ -0,0 +1,115 @@
+#ifndef INDEXDB_ROWCOPIER_H
+#define INDEXDB_ROWCOPIER_H
+
+#include <cassert>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "IndexDb.h"
+#include "StringTable.h"
+
+namespace indexdb {
+
+// A source column number meaning "use the constant value".
+const int kConstantColumn = -1;
+
+// Copies rows from a finalized index to a writable index.  Unlike
+// Index::merge, only the strings used by the copied rows are copied, so
+// strings that are no longer referenced disappear from the new index.
+class RowCopier
+{
+public:
+    RowCopier(const Index &src, Index &dest) : m_src(src), m_dest(dest) {}
+
+    // Copy the rows of the source table for which keep returns true.  Column
+    // i of the destination row is taken from srcColumns[i] of the source row,
+    // or is the constant if srcColumns[i] is kConstantColumn.  The constant
+    // is a destination ID.
+    template <typename KeepFunc>
+    void copyRows(const std::string &srcTableName,
+                  const std::string &destTableName,
+                  const std::vector<int> &srcColumns,
+                  KeepFunc keep,
+                  ID constant=kInvalidID);
+
+    ID copyString(const std::string &stringTableName, ID srcID);
+
+private:
+    std::vector<ID> &idMap(const std::string &stringTableName);
+
+    const Index &m_src;
+    Index &m_dest;
+    std::map<std::string, std::vector<ID> > m_idMaps;
+};
+
+template <typename KeepFunc>
+void RowCopier::copyRows(
+        const std::string &srcTableName,
+        const std::string &destTableName,
+        const std::vector<int> &srcColumns,
+        KeepFunc keep,
+        ID constant)
+{
+    const Table *srcTable = m_src.table(srcTableName);
+    Table *destTable = m_dest.table(destTableName);
+    if (srcTable == NULL)
+        return;
+    assert(destTable != NULL);
+    assert(destTable->columnCount() == static_cast<int>(srcColumns.size()));
+
+    // Look up the string tables of each destination column once.
+    struct ColumnMap {
+        int srcColumn;
+        std::vector<ID> *idMap;
+        const StringTable *srcStrings;
+        StringTable *destStrings;
+    };
+    std::vector<ColumnMap> columns(srcColumns.size());
+    for (size_t i = 0; i < srcColumns.size(); ++i) {
+        ColumnMap &column = columns[i];
+        column.srcColumn = srcColumns[i];
+        column.idMap = NULL;
+        if (column.srcColumn == kConstantColumn)
+            continue;
+        const std::string name = srcTable->columnName(column.srcColumn);
+        assert(name == destTable->columnName(i));
+        if (!name.empty()) {
+            column.idMap = &idMap(name);
+            column.srcStrings = m_src.stringTable(name);
+            column.destStrings = m_dest.stringTable(name);
+        }
+    }
+
+    Row srcRow(srcTable->columnCount());
+    Row destRow(destTable->columnCount());
+    for (auto it = srcTable->begin(), itEnd = srcTable->end();
+            it != itEnd; ++it) {
+        it.value(srcRow);
+        if (!keep(srcRow))
+            continue;
+        for (size_t i = 0; i < columns.size(); ++i) {
+            const ColumnMap &column = columns[i];
+            if (column.srcColumn == kConstantColumn) {
+                destRow[i] = constant;
+                continue;
+            }
+            ID value = srcRow[column.srcColumn];
+            if (column.idMap != NULL) {
+                ID &destID = (*column.idMap)[value];
+                if (destID == kInvalidID) {
+                    destID = column.destStrings->insert(
+                                column.srcStrings->item(value),
+                                column.srcStrings->itemSize(value));
+                }
+                value = destID;
+            }
+            destRow[i] = value;
+        }
+        destTable->add(destRow);
+    }
+}
+
+} // namespace indexdb
+
+#endif // INDEXDB_ROWCOPIER_H
@@ -0,0 +1,295 @@
+#include "SegmentedIndex.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <unordered_set>
+
+#include "IndexDb.h"
+#include "RowCopier.h"
+
+namespace indexdb {
+
+const char kRemovedTablePrefix[] = "Removed:";
+
+static bool pathExists(const std::string &path)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+        return false;
+    fclose(fp);
+    return true;
+}
+
+static std::string deltaSegmentPath(const std::string &basePath, size_t number)
+{
+    return basePath + ".delta." + std::to_string(number);
+}
+
+std::vector<std::string> deltaSegmentPaths(const std::string &basePath)
+{
+    std::vector<std::string> result;
+    while (true) {
+        std::string path = deltaSegmentPath(basePath, result.size() + 1);
+        if (!pathExists(path))
+            break;
+        result.push_back(path);
+    }
+    return result;
+}
+
+std::string nextDeltaSegmentPath(const std::string &basePath)
+{
+    return deltaSegmentPath(basePath, deltaSegmentPaths(basePath).size() + 1);
+}
+
+void removeDeltaSegments(const std::string &basePath)
+{
+    for (const std::string &path : deltaSegmentPaths(basePath))
+        remove(path.c_str());
+}
+
+bool replaceIndexFile(Index &index, const std::string &path)
+{
+    const std::string tempPath = path + ".tmp";
+    if (!index.write(tempPath) ||
+            rename(tempPath.c_str(), path.c_str()) != 0) {
+        remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+void addTextRow(Index &index, const std::string &tableName,
+                const TextRow &text)
+{
+    Table *table = index.table(tableName);
+    assert(table != NULL);
+    assert(table->columnCount() == static_cast<int>(text.size()));
+    Row row(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        const std::string name = table->columnName(i);
+        if (name.empty())
+            row[i] = strtoul(text[i].c_str(), NULL, 10);
+        else
+            row[i] = index.stringTable(name)->insert(text[i].c_str());
+    }
+    table->add(row);
+}
+
+static void copyTables(const Index &src, Index &dest,
+                       const std::string &destPrefix)
+{
+    RowCopier copier(src, dest);
+    for (size_t i = 0; i < src.tableCount(); ++i) {
+        const std::string name = src.tableName(i);
+        const Table *table = src.table(name);
+        std::vector<std::string> columnNames;
+        std::vector<int> columns;
+        for (int j = 0; j < table->columnCount(); ++j) {
+            columnNames.push_back(table->columnName(j));
+            columns.push_back(j);
+        }
+        dest.addTable(destPrefix + name, columnNames);
+        copier.copyRows(name, destPrefix + name, columns,
+                        [](const Row &) { return true; });
+    }
+}
+
+// The delta only appears under its final name once it is complete, so a
+// reader never opens a partly written delta.
+bool writeDeltaSegment(const std::string &basePath,
+                       const Index &added,
+                       const Index &removed)
+{
+    Index delta;
+    copyTables(added, delta, "");
+    copyTables(removed, delta, kRemovedTablePrefix);
+    delta.finalizeTables();
+    return replaceIndexFile(delta, nextDeltaSegmentPath(basePath));
+}
+
+Index *openSegmentedIndex(const std::string &basePath)
+{
+    if (deltaSegmentPaths(basePath).empty())
+        return new Index(basePath);
+    SegmentedIndex segments(basePath);
+    return segments.merged();
+}
+
+static TextRow rowToText(const Index &index, const Table &table, const Row &row)
+{
+    TextRow result(row.count());
+    for (int i = 0; i < row.count(); ++i) {
+        const std::string name = table.columnName(i);
+        if (name.empty())
+            result[i] = std::to_string(row[i]);
+        else
+            result[i] = index.stringTable(name)->item(row[i]);
+    }
+    return result;
+}
+
+// Convert the leading columns of a row.  Returns false if a string of the
+// text row is not in the index, in which case the index can't contain the
+// row.
+static bool textToRow(
+        const Index &index,
+        const Table &table,
+        const TextRow &text,
+        Row &row)
+{
+    assert(row.count() == static_cast<int>(text.size()));
+    for (size_t i = 0; i < text.size(); ++i) {
+        const std::string name = table.columnName(i);
+        if (name.empty()) {
+            row[i] = strtoul(text[i].c_str(), NULL, 10);
+            continue;
+        }
+        const StringTable *strings = index.stringTable(name);
+        if (strings == NULL || strings->size() == 0)
+            return false;
+        row[i] = strings->id(text[i].c_str());
+        if (row[i] == kInvalidID)
+            return false;
+    }
+    return true;
+}
+
+static std::string rowKey(const Row &row)
+{
+    return std::string(reinterpret_cast<const char*>(&row[0]),
+                       row.count() * sizeof(ID));
+}
+
+// Append the table's rows whose leading columns equal the prefix.
+static void queryRows(
+        const Index &index,
+        const Table &table,
+        const TextRow &prefix,
+        std::vector<TextRow> &output)
+{
+    const int prefixCount = prefix.size();
+    Row prefixRow(std::max(prefixCount, 1));
+    TableIterator it = table.begin();
+    if (prefixCount > 0) {
+        if (!textToRow(index, table, prefix, prefixRow))
+            return;
+        it = table.lowerBound(prefixRow);
+    }
+    Row row(table.columnCount());
+    for (TableIterator itEnd = table.end(); it != itEnd; ++it) {
+        it.value(row);
+        bool matches = true;
+        for (int i = 0; i < prefixCount && matches; ++i)
+            matches = row[i] == prefixRow[i];
+        if (!matches)
+            break;
+        output.push_back(rowToText(index, table, row));
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SegmentedIndex
+
+SegmentedIndex::SegmentedIndex(const std::string &basePath)
+{
+    m_segments.emplace_back(new Index(basePath));
+    for (const std::string &path : deltaSegmentPaths(basePath))
+        m_segments.emplace_back(new Index(path));
+}
+
+SegmentedIndex::~SegmentedIndex()
+{
+}
+
+// Returns the rows of the table whose leading columns equal the prefix.  The
+// segments are searched from newest to oldest, so that each delta's removed
+// rows hide the rows of the older segments.
+std::set<TextRow> SegmentedIndex::query(
+        const std::string &tableName,
+        const TextRow &prefix)
+{
+    std::set<TextRow> result;
+    std::set<TextRow> removed;
+    std::vector<TextRow> rows;
+    for (size_t i = m_segments.size(); i-- > 0; ) {
+        const Index &segment = *m_segments[i];
+        const Table *table = segment.table(tableName);
+        if (table != NULL) {
+            rows.clear();
+            queryRows(segment, *table, prefix, rows);
+            for (TextRow &row : rows) {
+                if (removed.find(row) == removed.end())
+                    result.insert(std::move(row));
+            }
+        }
+        const Table *removedTable =
+                segment.table(kRemovedTablePrefix + tableName);
+        if (removedTable != NULL) {
+            rows.clear();
+            queryRows(segment, *removedTable, prefix, rows);
+            removed.insert(rows.begin(), rows.end());
+        }
+    }
+    return result;
+}
+
+// Merge all of the segments into a new, finalized index.
+Index *SegmentedIndex::merged()
+{
+    Index *result = new Index;
+    const size_t prefixLength = strlen(kRemovedTablePrefix);
+
+    // The rows removed by the segments processed so far (the newer ones),
+    // keyed by table name.
+    std::map<std::string, std::set<TextRow> > removed;
+
+    for (size_t i = m_segments.size(); i-- > 0; ) {
+        const Index &segment = *m_segments[i];
+        RowCopier copier(segment, *result);
+        for (size_t j = 0; j < segment.tableCount(); ++j) {
+            const std::string name = segment.tableName(j);
+            if (name.compare(0, prefixLength, kRemovedTablePrefix) == 0)
+                continue;
+            const Table *table = segment.table(name);
+            std::vector<std::string> columnNames;
+            std::vector<int> columns;
+            for (int k = 0; k < table->columnCount(); ++k) {
+                columnNames.push_back(table->columnName(k));
+                columns.push_back(k);
+            }
+            result->addTable(name, columnNames);
+
+            // Translate the removed rows into the segment's IDs.
+            std::unordered_set<std::string> removedKeys;
+            Row row(table->columnCount());
+            for (const TextRow &text : removed[name]) {
+                if (textToRow(segment, *table, text, row))
+                    removedKeys.insert(rowKey(row));
+            }
+            copier.copyRows(name, name, columns, [&](const Row &row) {
+                return removedKeys.empty() ||
+                        removedKeys.find(rowKey(row)) == removedKeys.end();
+            });
+        }
+        for (size_t j = 0; j < segment.tableCount(); ++j) {
+            const std::string name = segment.tableName(j);
+            if (name.compare(0, prefixLength, kRemovedTablePrefix) != 0)
+                continue;
+            std::vector<TextRow> rows;
+            queryRows(segment, *segment.table(name), TextRow(), rows);
+            removed[name.substr(prefixLength)].insert(rows.begin(),
+                                                      rows.end());
+        }
+    }
+
+    result->finalizeTables();
+    return result;
+}
+
+} // namespace indexdb
@@ -0,0 +1,70 @@
+#ifndef INDEXDB_SEGMENTEDINDEX_H
+#define INDEXDB_SEGMENTEDINDEX_H
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace indexdb {
+
+class Index;
+
+// A segmented index is a large, immutable base index file plus a series of
+// small delta files named "<base>.delta.1", "<base>.delta.2", etc.  Each delta
+// is an ordinary index file.  Its tables hold rows added to the index, and its
+// "Removed:<table>" tables hold rows removed from the earlier segments.  A
+// row removed by one delta can be added back by a later one.
+//
+// Writing a delta is cheap, so an index can be updated without rewriting the
+// base.  Compaction folds the deltas back into the base.
+
+extern const char kRemovedTablePrefix[];
+
+// A row with its strings spelled out, so rows from different segments can be
+// compared.  Integer columns are formatted in decimal.
+typedef std::vector<std::string> TextRow;
+
+std::vector<std::string> deltaSegmentPaths(const std::string &basePath);
+std::string nextDeltaSegmentPath(const std::string &basePath);
+void removeDeltaSegments(const std::string &basePath);
+
+// Write an index to "<path>.tmp" and rename it over the path, so that a reader
+// sees either the old file or the complete new one, and a reader that has the
+// old file mapped keeps its copy.  Returns false (and leaves the old file) if
+// the index couldn't be written.
+bool replaceIndexFile(Index &index, const std::string &path);
+
+// Add a row to a writable index, inserting its strings.
+void addTextRow(Index &index, const std::string &tableName,
+                const TextRow &row);
+
+// Write the finalized indices' rows as the next delta of the segmented index.
+// The tables of the removed index become the "Removed:<table>" tables.
+// Returns false if the delta couldn't be written.
+bool writeDeltaSegment(const std::string &basePath,
+                       const Index &added,
+                       const Index &removed);
+
+// Returns the contents of a segmented index as a single index.  Without
+// deltas, this is just the base index.  Otherwise, the segments are merged
+// in memory.
+Index *openSegmentedIndex(const std::string &basePath);
+
+class SegmentedIndex
+{
+public:
+    explicit SegmentedIndex(const std::string &basePath);
+    ~SegmentedIndex();
+    size_t deltaCount() { return m_segments.size() - 1; }
+    std::set<TextRow> query(const std::string &tableName,
+                            const TextRow &prefix);
+    Index *merged();
+
+private:
+    std::vector<std::unique_ptr<Index> > m_segments;
+};
+
+} // namespace indexdb
+
+#endif // INDEXDB_SEGMENTEDINDEX_H
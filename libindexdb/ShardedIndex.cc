@@ -0,0 +1,92 @@
+#include "ShardedIndex.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "IndexDb.h"
+#include "StringTable.h"
+
+namespace indexdb {
+
+const char kShardTable[] = "Shard";
+
+static bool pathExists(const std::string &path)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+        return false;
+    fclose(fp);
+    return true;
+}
+
+// The manifest names the shards relative to its own directory, so the files
+// can be moved together.
+static std::string directoryPrefix(const std::string &path)
+{
+    const size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+static std::string fileName(const std::string &path)
+{
+    return path.substr(directoryPrefix(path).size());
+}
+
+int shardOfString(const char *string, int shardCount)
+{
+    return shardOfHash(StringTable::hashString(string, strlen(string)),
+                       shardCount);
+}
+
+std::string shardPath(const std::string &basePath, int shard)
+{
+    return basePath + ".shard." + std::to_string(shard);
+}
+
+bool isShardManifest(const Index &index)
+{
+    return index.table(kShardTable) != NULL;
+}
+
+std::vector<std::string> readShardPaths(const std::string &basePath)
+{
+    std::vector<std::string> result;
+    Index manifest(basePath);
+    const Table *table = manifest.table(kShardTable);
+    if (table == NULL)
+        return result;
+    const StringTable *names = manifest.stringTable("ShardPath");
+    Row row(2);
+    for (auto it = table->begin(), itEnd = table->end(); it != itEnd; ++it) {
+        it.value(row);
+        assert(row[0] == result.size());
+        result.push_back(directoryPrefix(basePath) + names->item(row[1]));
+    }
+    return result;
+}
+
+void writeShardManifest(const std::string &basePath, int shardCount)
+{
+    Index manifest;
+    StringTable *names = manifest.addStringTable("ShardPath");
+    std::vector<std::string> columns;
+    columns.push_back("");              // Shard number
+    columns.push_back("ShardPath");     // File name
+    Table *table = manifest.addTable(kShardTable, columns);
+    Row row(2);
+    for (int i = 0; i < shardCount; ++i) {
+        row[0] = i;
+        row[1] = names->insert(fileName(shardPath(basePath, i)).c_str());
+        table->add(row);
+    }
+    manifest.finalizeTables();
+    manifest.write(basePath);
+}
+
+void removeShards(const std::string &basePath)
+{
+    for (int i = 0; pathExists(shardPath(basePath, i)); ++i)
+        remove(shardPath(basePath, i).c_str());
+}
+
+} // namespace indexdb
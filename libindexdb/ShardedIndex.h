@@ -0,0 +1,61 @@
+#ifndef INDEXDB_SHARDEDINDEX_H
+#define INDEXDB_SHARDEDINDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace indexdb {
+
+class Index;
+
+// A sharded index is a set of ordinary index files named "<base>.shard.0",
+// "<base>.shard.1", etc., plus a small manifest at the base path, whose
+// "Shard" table lists the shards' file names.  The shards can be built,
+// finalized, and written in parallel, and a reader maps them separately.
+//
+// Rows are assigned to shards by the hash of a string (see shardOfString):
+//
+//  - A Reference row goes to the shard of its file's path symbol, so the
+//    references of a file are in one shard.
+//
+//  - ReferenceIndex, Symbol, SymbolTypeIndex, and GlobalSymbol rows go to
+//    the shard of their symbol, so the references of a symbol are in one
+//    shard too.
+//
+// A symbol's shard is said to own it.  Each shard has its own string tables,
+// so a string can have a different ID in each shard it appears in, and the
+// owner's ID is the canonical one.  A path symbol is owned by the shard of
+// its file's Reference rows.
+
+extern const char kShardTable[];
+
+// An index can't have more shards than this.
+const int kMaxShardCount = 64;
+
+// The shard of a string, given StringTable::hashString's hash of it.  This
+// uses the high bits of the hash, because the string tables' buckets are
+// chosen with its low bits.
+inline int shardOfHash(uint32_t hash, int shardCount)
+{
+    return static_cast<int>((static_cast<uint64_t>(hash) * shardCount) >> 32);
+}
+
+int shardOfString(const char *string, int shardCount);
+
+std::string shardPath(const std::string &basePath, int shard);
+
+// Returns the paths of the shards of a sharded index, or an empty vector if
+// the file at basePath is not a shard manifest.
+std::vector<std::string> readShardPaths(const std::string &basePath);
+bool isShardManifest(const Index &index);
+
+// Write the manifest of a set of shards.  The shards are written separately.
+void writeShardManifest(const std::string &basePath, int shardCount);
+
+// Remove "<base>.shard.N" files, e.g. before writing an unsharded index.
+void removeShards(const std::string &basePath);
+
+} // namespace indexdb
+
+#endif // INDEXDB_SHARDEDINDEX_H
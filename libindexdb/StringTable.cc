@@ -190,20 +190,23 @@ StringTable::finalized()
     return std::make_pair(std::move(newTable), std::move(idMap));
 }
 
+uint32_t StringTable::hashString(const char *data, uint32_t dataSize)
+{
+    uint32_t hash;
+    MurmurHash3_x86_32(data, dataSize, 0, &hash);
+    return hash;
+}
+
 ID StringTable::id(const char *string) const
 {
     size_t size = strlen(string);
-    uint32_t hash;
-    MurmurHash3_x86_32(string, size, 0, &hash);
-    return lookup(string, size, hash);
+    return lookup(string, size, hashString(string, size));
 }
 
 ID StringTable::insert(const char *string)
 {
     size_t size = strlen(string);
-    uint32_t hash;
-    MurmurHash3_x86_32(string, size, 0, &hash);
-    return insert(string, size, hash);
+    return insert(string, size, hashString(string, size));
 }
 
 // This method can be used to insert strings containing NUL characters into
@@ -211,9 +214,7 @@ ID StringTable::insert(const char *string)
 // size does not include a terminating NUL character.
 ID StringTable::insert(const char *string, uint32_t size)
 {
-    uint32_t hash;
-    MurmurHash3_x86_32(string, size, 0, &hash);
-    return insert(string, size, hash);
+    return insert(string, size, hashString(string, size));
 }
 
 void StringTable::resizeHashTable(uint32_t newIndexSize)
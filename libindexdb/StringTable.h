@@ -71,7 +71,6 @@ private:
     uint32_t indexSize() const { return m_index.size() / sizeof(ID); }
     void resizeHashTable(uint32_t newIndexSize);
     inline ID lookup(const char *data, uint32_t dataSize, uint32_t hash) const;
-    ID insert(const char *data, uint32_t dataSize, uint32_t hash);
     std::pair<StringTable, std::vector<ID> > finalized();
 
 public:
@@ -84,6 +83,11 @@ public:
     ID id(const char *string) const;
     ID insert(const char *string);
     ID insert(const char *string, uint32_t size);
+
+    // Insert a string whose hash was already computed with hashString, e.g.
+    // by copying it from another string table.
+    ID insert(const char *data, uint32_t dataSize, uint32_t hash);
+    static uint32_t hashString(const char *data, uint32_t dataSize);
     void dumpStats() const;
 
     const char *item(ID id) const {
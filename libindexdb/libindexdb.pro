@@ -11,6 +11,10 @@ SOURCES += \
     IndexArchiveBuilder.cc \
     IndexArchiveReader.cc \
     IndexDb.cc \
+    PeakMemory.cc \
+    RowCopier.cc \
+    SegmentedIndex.cc \
+    ShardedIndex.cc \
     StringTable.cc
 
 HEADERS += \
@@ -21,6 +25,10 @@ HEADERS += \
     IndexArchiveBuilder.h \
     IndexArchiveReader.h \
     IndexDb.h \
+    PeakMemory.h \
+    RowCopier.h \
+    SegmentedIndex.h \
+    ShardedIndex.h \
     StringTable.h \
     Util.h \
     WriterSha256Context.h
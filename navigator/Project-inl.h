@@ -17,18 +17,24 @@ void Project::queryFileRefs(
         uint32_t firstLine,
         uint32_t lastLine)
 {
+    // A file's references are all in the shard that owns its path symbol.
+    const indexdb::ID fileID = this->fileID(file.path());
+    if (fileID == indexdb::kInvalidID)
+        return;
+    const Shard &shard = *m_shards[fileID % m_shards.size()];
+
     indexdb::Row rowLookup(2);
     assert(RC_File == 0);
     assert(RC_Line == 1);
-    rowLookup[RC_File] = fileID(file.path());
+    rowLookup[RC_File] = fileID / m_shards.size();
     rowLookup[RC_Line] = firstLine;
     // TODO: Add a class named TableIteratorRange (or TableRange) and a method
     // that accepts a lower bound and an upper bound.  It should do a single
     // O(log n) binary search, but produce two iterators.  This will
     // drastically simplify all of the querying code in this class.
-    indexdb::TableIterator it = m_refTable->lowerBound(rowLookup);
+    indexdb::TableIterator it = shard.refTable->lowerBound(rowLookup);
 
-    indexdb::TableIterator itEnd = m_refTable->end();
+    indexdb::TableIterator itEnd = shard.refTable->end();
     indexdb::Row rowItem(RC_Count);
     for (; it != itEnd; ++it) {
         it.value(rowItem);
@@ -38,12 +44,12 @@ void Project::queryFileRefs(
                 rowItem[RC_Line] > lastLine)
             break;
         Ref ref(*this,
-                rowItem[RC_Symbol],
-                rowItem[RC_File],
+                projectSymbolID(shard, rowItem[RC_Symbol]),
+                fileID,
                 rowItem[RC_Line],
                 rowItem[RC_StartColumn],
                 rowItem[RC_EndColumn],
-                rowItem[RC_RefType]);
+                shard.refTypeIDs[rowItem[RC_RefType]]);
         callback(ref);
     }
 }
@@ -6,7 +6,10 @@
 #include <QString>
 #include <QtConcurrentRun>
 #include <cassert>
+#include <cstring>
 #include <memory>
+#include <queue>
+#include <utility>
 #include <vector>
 
 #include "FileManager.h"
@@ -14,6 +17,8 @@
 #include "Misc.h"
 #include "Ref.h"
 #include "../libindexdb/IndexDb.h"
+#include "../libindexdb/SegmentedIndex.h"
+#include "../libindexdb/ShardedIndex.h"
 
 namespace Nav {
 
@@ -21,24 +26,77 @@ const char kPathSymbolPrefix = '@';
 
 std::unique_ptr<Project> theProject;
 
-Project::Project(const QString &path)
+// A shard's string table can be empty, and an empty mapped table can't be
+// searched.
+static indexdb::ID lookupString(const indexdb::StringTable *table,
+                                const char *string)
 {
-    m_index = new indexdb::Index(path.toStdString());
-    m_symbolStringTable = m_index->stringTable("Symbol");
-    m_symbolTypeStringTable = m_index->stringTable("SymbolType");
-    m_refTypeStringTable = m_index->stringTable("ReferenceType");
-    m_refTable = m_index->table("Reference");
-    m_refIndexTable = m_index->table("ReferenceIndex");
-    m_symbolTable = m_index->table("Symbol");
-    m_symbolTypeIndexTable = m_index->table("SymbolTypeIndex");
-    m_globalSymbolTable = m_index->table("GlobalSymbol");
-    assert(m_symbolStringTable != NULL);
-    assert(m_symbolTypeStringTable != NULL);
-    assert(m_refTypeStringTable != NULL);
-    assert(m_refTable != NULL);
-    assert(m_refIndexTable != NULL);
-    assert(m_symbolTable != NULL);
-    assert(m_symbolTypeIndexTable != NULL);
+    if (table->size() == 0)
+        return indexdb::kInvalidID;
+    return table->id(string);
+}
+
+// Add the strings of a shard's table to the project's, and return the
+// project's IDs of the shard's strings.
+static std::vector<indexdb::ID> unionStringTable(
+        indexdb::StringTable &dest,
+        const indexdb::StringTable &src)
+{
+    std::vector<indexdb::ID> result(src.size());
+    for (uint32_t i = 0; i < src.size(); ++i)
+        result[i] = dest.insert(src.item(i));
+    return result;
+}
+
+Project::Shard::Shard(int shardNumber, indexdb::Index *shardIndex) :
+    number(shardNumber), index(shardIndex)
+{
+    symbolStringTable = index->stringTable("Symbol");
+    symbolTypeStringTable = index->stringTable("SymbolType");
+    refTypeStringTable = index->stringTable("ReferenceType");
+    refTable = index->table("Reference");
+    refIndexTable = index->table("ReferenceIndex");
+    symbolTable = index->table("Symbol");
+    symbolTypeIndexTable = index->table("SymbolTypeIndex");
+    globalSymbolTable = index->table("GlobalSymbol");
+    assert(symbolStringTable != NULL);
+    assert(symbolTypeStringTable != NULL);
+    assert(refTypeStringTable != NULL);
+    assert(refTable != NULL);
+    assert(refIndexTable != NULL);
+    assert(symbolTable != NULL);
+    assert(symbolTypeIndexTable != NULL);
+}
+
+Project::Project(const QString &path) : m_haveGlobalSymbolDefinitions(false)
+{
+    // Any deltas written since the index was last rewritten are merged into
+    // the base index here.  A sharded index's base is just its manifest.
+    // The merge copies every row of the base into memory, so with deltas,
+    // opening the project costs time and memory in proportion to the whole
+    // index rather than to the deltas.  The queries below work on the IDs of
+    // a single index per shard, so they can't consult the deltas separately
+    // the way SegmentedIndex::query does.
+    const std::string indexPath = path.toStdString();
+    indexdb::Index *index = indexdb::openSegmentedIndex(indexPath);
+    if (indexdb::isShardManifest(*index)) {
+        delete index;
+        const std::vector<std::string> shardPaths =
+                indexdb::readShardPaths(indexPath);
+        for (size_t i = 0; i < shardPaths.size(); ++i) {
+            m_shards.emplace_back(
+                        new Shard(i, new indexdb::Index(shardPaths[i])));
+        }
+    } else {
+        m_shards.emplace_back(new Shard(0, index));
+    }
+
+    for (auto &shard : m_shards) {
+        shard->symbolTypeIDs = unionStringTable(m_symbolTypeStringTable,
+                                                *shard->symbolTypeStringTable);
+        shard->refTypeIDs = unionStringTable(m_refTypeStringTable,
+                                             *shard->refTypeStringTable);
+    }
 
     // Query all the paths, then use that to initialize the FileManager.
     m_fileManager = new FileManager(
@@ -46,51 +104,87 @@ Project::Project(const QString &path)
                 queryAllPaths());
 
     // Start this query in the background.
-    m_globalSymbolDefinitions =
-            QtConcurrent::run(this, &Project::queryGlobalSymbolDefinitions);
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        m_globalSymbolDefinitionFutures.append(
+                    QtConcurrent::run(this,
+                                      &Project::queryGlobalSymbolDefinitions,
+                                      static_cast<int>(i)));
+    }
 
     // Load the symbol->symbolType map into memory for faster accesses.
-    m_symbolType.resize(m_symbolStringTable->size(), indexdb::kInvalidID);
-    indexdb::Row symbolRow(SC_Count);
-    for (indexdb::TableIterator it = m_symbolTable->begin(),
-            itEnd = m_symbolTable->end(); it != itEnd; ++it) {
-        it.value(symbolRow);
-        m_symbolType[symbolRow[SC_Symbol]] = symbolRow[SC_SymbolType];
+    QList<QFuture<void> > symbolTypeFutures;
+    for (size_t i = 1; i < m_shards.size(); ++i) {
+        symbolTypeFutures.append(
+                    QtConcurrent::run(this, &Project::loadSymbolTypes,
+                                      static_cast<int>(i)));
     }
+    loadSymbolTypes(0);
+    for (QFuture<void> &future : symbolTypeFutures)
+        future.waitForFinished();
 }
 
 Project::~Project()
 {
     delete m_fileManager;
-    delete m_index;
-    delete m_globalSymbolDefinitions.result();
+    for (QFuture<std::vector<Ref>*> &future : m_globalSymbolDefinitionFutures)
+        delete future.result();
+}
+
+// Returns the project's ID of a string in the shard's Symbol table.  Other
+// shards than the owner have their own IDs for it.
+indexdb::ID Project::projectSymbolID(const Shard &shard, indexdb::ID shardID)
+{
+    const int shardCount = m_shards.size();
+    const int owner = indexdb::shardOfHash(
+                shard.symbolStringTable->itemHash(shardID), shardCount);
+    if (owner != shard.number) {
+        shardID = lookupString(m_shards[owner]->symbolStringTable,
+                               shard.symbolStringTable->item(shardID));
+        assert(shardID != indexdb::kInvalidID);
+    }
+    return shardID * shardCount + owner;
+}
+
+void Project::loadSymbolTypes(int shardNumber)
+{
+    Shard &shard = *m_shards[shardNumber];
+    shard.symbolType.resize(shard.symbolStringTable->size(),
+                            indexdb::kInvalidID);
+    indexdb::Row symbolRow(SC_Count);
+    for (indexdb::TableIterator it = shard.symbolTable->begin(),
+            itEnd = shard.symbolTable->end(); it != itEnd; ++it) {
+        it.value(symbolRow);
+        shard.symbolType[symbolRow[SC_Symbol]] =
+                shard.symbolTypeIDs[symbolRow[SC_SymbolType]];
+    }
 }
 
 QList<Ref> Project::queryReferencesOfSymbol(const QString &symbol)
 {
     QList<Ref> result;
 
-    indexdb::ID symbolID = m_symbolStringTable->id(symbol.toStdString().c_str());
+    indexdb::ID symbolID = this->symbolID(symbol.toStdString().c_str());
     if (symbolID == indexdb::kInvalidID)
         return result;
+    const Shard &shard = *m_shards[symbolID % m_shards.size()];
 
     indexdb::Row rowLookup(1);
     assert(RIC_Symbol == 0);
-    rowLookup[RIC_Symbol] = symbolID;
+    rowLookup[RIC_Symbol] = symbolID / m_shards.size();
 
     indexdb::Row rowItem(RIC_Count);
-    indexdb::TableIterator itEnd = m_refIndexTable->end();
-    indexdb::TableIterator it = m_refIndexTable->lowerBound(rowLookup);
+    indexdb::TableIterator itEnd = shard.refIndexTable->end();
+    indexdb::TableIterator it = shard.refIndexTable->lowerBound(rowLookup);
     for (; it != itEnd; ++it) {
         it.value(rowItem);
         if (rowLookup[RIC_Symbol] != rowItem[RIC_Symbol])
             break;
 
-        indexdb::ID fileID = rowItem[RIC_File];
+        indexdb::ID fileID = projectSymbolID(shard, rowItem[RIC_File]);
         int line = rowItem[RIC_Line];
         int startColumn = rowItem[RIC_StartColumn];
         int endColumn = rowItem[RIC_EndColumn];
-        indexdb::ID kindID = rowItem[RIC_RefType];
+        indexdb::ID kindID = shard.refTypeIDs[rowItem[RIC_RefType]];
 
         result << Ref(*this,
                       symbolID,
@@ -106,29 +200,47 @@ QList<Ref> Project::queryReferencesOfSymbol(const QString &symbol)
 
 void Project::queryAllSymbols(std::vector<const char*> &output)
 {
-    output.resize(m_symbolStringTable->size());
-    for (uint32_t i = 0, iEnd = m_symbolStringTable->size(); i < iEnd; ++i) {
-        const char *symbol = m_symbolStringTable->item(i);
-        output[i] = symbol;
-    }
+    const std::vector<indexdb::ID> &symbolIDs = allSymbolIDs();
+    output.resize(symbolIDs.size());
+    for (size_t i = 0; i < symbolIDs.size(); ++i)
+        output[i] = symbolName(symbolIDs[i]);
 }
 
 QStringList Project::queryAllPaths()
 {
-    const indexdb::ID pathTypeID = m_symbolTypeStringTable->id("Path");
+    if (m_shards.size() == 1)
+        return queryShardPaths(0);
+    QList<QFuture<QStringList> > futures;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        futures.append(QtConcurrent::run(this, &Project::queryShardPaths,
+                                         static_cast<int>(i)));
+    }
+    QStringList result;
+    for (QFuture<QStringList> &future : futures)
+        result.append(future.result());
+    // Within a shard, the paths are sorted, like the string table.
+    result.sort();
+    return result;
+}
+
+QStringList Project::queryShardPaths(int shardNumber)
+{
+    const Shard &shard = *m_shards[shardNumber];
+    const indexdb::ID pathTypeID =
+            lookupString(shard.symbolTypeStringTable, "Path");
     if (pathTypeID == indexdb::kInvalidID)
         return QStringList();
     indexdb::Row row(2);
     row[0] = pathTypeID;
     row[1] = 0;
-    indexdb::TableIterator itEnd = m_symbolTypeIndexTable->end();
-    indexdb::TableIterator it = m_symbolTypeIndexTable->lowerBound(row);
+    indexdb::TableIterator itEnd = shard.symbolTypeIndexTable->end();
+    indexdb::TableIterator it = shard.symbolTypeIndexTable->lowerBound(row);
     QStringList result;
     for (; it != itEnd; ++it) {
         it.value(row);
         if (row[0] != pathTypeID)
             break;
-        const char *path = m_symbolStringTable->item(row[1]);
+        const char *path = shard.symbolStringTable->item(row[1]);
         assert(path[0] == kPathSymbolPrefix);
         result.append(path + 1);
     }
@@ -170,15 +282,18 @@ Ref Project::findSingleDefinitionOfSymbol(const QString &symbol)
     }
 }
 
-std::vector<Ref> *Project::queryGlobalSymbolDefinitions()
+std::vector<Ref> *Project::queryGlobalSymbolDefinitions(int shardNumber)
 {
     std::vector<Ref> *ret = new std::vector<Ref>;
 
-    indexdb::ID defnKindID = m_refTypeStringTable->id("Definition");
-    indexdb::TableIterator it = m_refIndexTable->begin();
-    indexdb::TableIterator itEnd = m_refIndexTable->end();
-    indexdb::TableIterator git = m_globalSymbolTable->begin();
-    indexdb::TableIterator gitEnd = m_globalSymbolTable->end();
+    const Shard &shard = *m_shards[shardNumber];
+    const int shardCount = m_shards.size();
+    indexdb::ID defnKindID =
+            lookupString(shard.refTypeStringTable, "Definition");
+    indexdb::TableIterator it = shard.refIndexTable->begin();
+    indexdb::TableIterator itEnd = shard.refIndexTable->end();
+    indexdb::TableIterator git = shard.globalSymbolTable->begin();
+    indexdb::TableIterator gitEnd = shard.globalSymbolTable->end();
     indexdb::Row rowGlobal(1);
     indexdb::Row rowFilter(RIC_RefType + 1);
     indexdb::Row rowItem(RIC_Count);
@@ -204,12 +319,13 @@ std::vector<Ref> *Project::queryGlobalSymbolDefinitions()
 
             // Record this global symbol definition.
             it.value(rowItem);
-            indexdb::ID symbolID = rowItem[RIC_Symbol];
-            indexdb::ID fileID = rowItem[RIC_File];
+            indexdb::ID symbolID =
+                    rowItem[RIC_Symbol] * shardCount + shardNumber;
+            indexdb::ID fileID = projectSymbolID(shard, rowItem[RIC_File]);
             int line = rowItem[RIC_Line];
             int startColumn = rowItem[RIC_StartColumn];
             int endColumn = rowItem[RIC_EndColumn];
-            indexdb::ID kindID = rowItem[RIC_RefType];
+            indexdb::ID kindID = shard.refTypeIDs[rowItem[RIC_RefType]];
             ret->push_back(Ref(*this, symbolID, fileID, line, startColumn, endColumn, kindID));
         }
         end: ;
@@ -218,40 +334,123 @@ std::vector<Ref> *Project::queryGlobalSymbolDefinitions()
     return ret;
 }
 
+// Returns the IDs of the symbols the shard owns, which are in name order,
+// like its string table.
+std::vector<indexdb::ID> Project::queryOwnedSymbols(int shardNumber)
+{
+    const Shard &shard = *m_shards[shardNumber];
+    const int shardCount = m_shards.size();
+    std::vector<indexdb::ID> result;
+    for (uint32_t i = 0; i < shard.symbolStringTable->size(); ++i) {
+        if (indexdb::shardOfHash(shard.symbolStringTable->itemHash(i),
+                                 shardCount) == shardNumber)
+            result.push_back(i * shardCount + shardNumber);
+    }
+    return result;
+}
+
+const std::vector<indexdb::ID> &Project::allSymbolIDs()
+{
+    if (!m_allSymbolIDs.empty() || m_shards.empty())
+        return m_allSymbolIDs;
+    QList<QFuture<std::vector<indexdb::ID> > > futures;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        futures.append(QtConcurrent::run(this, &Project::queryOwnedSymbols,
+                                         static_cast<int>(i)));
+    }
+    std::vector<std::vector<indexdb::ID> > lists;
+    size_t total = 0;
+    for (QFuture<std::vector<indexdb::ID> > &future : futures) {
+        lists.push_back(future.result());
+        total += lists.back().size();
+    }
+
+    // Merge the shards' sorted lists, through a heap of each list's next
+    // name, so that merging takes O(N log shards) comparisons.
+    typedef std::pair<const char*, size_t> Head;    // Name, list index
+    auto laterHead = [](const Head &x, const Head &y) {
+        const int cmp = strcmp(x.first, y.first);
+        return cmp > 0 || (cmp == 0 && x.second > y.second);
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(laterHead)> heads(
+                laterHead);
+    std::vector<size_t> positions(lists.size());
+    for (size_t i = 0; i < lists.size(); ++i) {
+        if (!lists[i].empty())
+            heads.push(Head(symbolName(lists[i][0]), i));
+    }
+    m_allSymbolIDs.reserve(total);
+    while (!heads.empty()) {
+        const size_t list = heads.top().second;
+        heads.pop();
+        m_allSymbolIDs.push_back(lists[list][positions[list]++]);
+        if (positions[list] < lists[list].size())
+            heads.push(Head(symbolName(lists[list][positions[list]]), list));
+    }
+    return m_allSymbolIDs;
+}
+
+indexdb::ID Project::symbolID(const char *symbol)
+{
+    const int shardCount = m_shards.size();
+    const int owner = indexdb::shardOfString(symbol, shardCount);
+    const indexdb::ID id =
+            lookupString(m_shards[owner]->symbolStringTable, symbol);
+    if (id == indexdb::kInvalidID)
+        return id;
+    return id * shardCount + owner;
+}
+
+const char *Project::symbolName(indexdb::ID symbolID)
+{
+    const Shard &shard = *m_shards[symbolID % m_shards.size()];
+    return shard.symbolStringTable->item(symbolID / m_shards.size());
+}
+
 indexdb::ID Project::fileID(const QString &path)
 {
     std::string symbol = kPathSymbolPrefix + path.toStdString();
-    return m_symbolStringTable->id(symbol.c_str());
+    return symbolID(symbol.c_str());
 }
 
 QString Project::fileName(indexdb::ID fileID)
 {
-    const char *name = m_symbolStringTable->item(fileID);
-    assert(name[0] == kPathSymbolPrefix);
-    return name + 1;
+    return fileNameCStr(fileID);
 }
 
 const char *Project::fileNameCStr(indexdb::ID fileID)
 {
-    const char *name = m_symbolStringTable->item(fileID);
+    const char *name = symbolName(fileID);
     assert(name[0] == kPathSymbolPrefix);
     return name + 1;
 }
 
 const std::vector<Ref> &Project::globalSymbolDefinitions()
 {
-    return *m_globalSymbolDefinitions.result();
+    if (!m_haveGlobalSymbolDefinitions) {
+        for (QFuture<std::vector<Ref>*> &future :
+                m_globalSymbolDefinitionFutures) {
+            std::vector<Ref> *defs = future.result();
+            m_globalSymbolDefinitions.insert(m_globalSymbolDefinitions.end(),
+                                             defs->begin(), defs->end());
+            delete defs;
+        }
+        m_globalSymbolDefinitionFutures.clear();
+        m_haveGlobalSymbolDefinitions = true;
+    }
+    return m_globalSymbolDefinitions;
 }
 
 indexdb::ID Project::querySymbolType(indexdb::ID symbolID)
 {
-    assert(symbolID < m_symbolType.size());
-    return m_symbolType[symbolID];
+    const Shard &shard = *m_shards[symbolID % m_shards.size()];
+    assert(symbolID / m_shards.size() < shard.symbolType.size());
+    return shard.symbolType[symbolID / m_shards.size()];
 }
 
 indexdb::ID Project::getSymbolTypeID(const char *symbolType)
 {
-    return m_symbolTypeStringTable->id(symbolType);
+    return m_symbolTypeStringTable.id(symbolType);
 }
 
 const char *Project::getSymbolType(indexdb::ID symbolTypeID)
@@ -259,7 +458,7 @@ const char *Project::getSymbolType(indexdb::ID symbolTypeID)
     if (symbolTypeID == indexdb::kInvalidID)
         return "";
     else
-        return m_symbolTypeStringTable->item(symbolTypeID);
+        return m_symbolTypeStringTable.item(symbolTypeID);
 }
 
 } // namespace Nav
@@ -12,12 +12,6 @@
 #include "../libindexdb/IndexDb.h"
 #include "File.h"
 
-namespace indexdb {
-    class Index;
-    class StringTable;
-    class Table;
-}
-
 namespace Nav {
 
 class Project;
@@ -26,6 +20,16 @@ class Ref;
 
 extern std::unique_ptr<Project> theProject;
 
+// The project's index is either a single index file (with deltas) or a set
+// of shards (see ShardedIndex.h).  A shard is queried for the symbols and
+// files it owns: a symbol's references are in its owner's ReferenceIndex, and
+// a file's references are in its owner's Reference table.  The scans of all
+// symbols, paths, and definitions run on every shard at once.
+//
+// A symbol or file ID is the string's ID in the owning shard's Symbol table
+// times the shard count, plus the shard number, so an unsharded index's IDs
+// are unchanged.  The SymbolType and ReferenceType IDs are those of the
+// project's own string tables, which hold the strings of all the shards.
 class Project
 {
 public:
@@ -50,27 +54,50 @@ public:
     indexdb::ID getSymbolTypeID(const char *symbolType);
     const char *getSymbolType(indexdb::ID symbolTypeID);
 
-    indexdb::StringTable &symbolStringTable() { return *m_symbolStringTable; }
+    indexdb::ID symbolID(const char *symbol);
+    const char *symbolName(indexdb::ID symbolID);
+    // All of the symbol IDs, sorted by name.
+    const std::vector<indexdb::ID> &allSymbolIDs();
+
     indexdb::StringTable &refTypeStringTable() {
-        return *m_refTypeStringTable;
+        return m_refTypeStringTable;
     }
 
 private:
-    std::vector<Ref> *queryGlobalSymbolDefinitions();
+    struct Shard {
+        Shard(int number, indexdb::Index *index);
+        int number;
+        std::unique_ptr<indexdb::Index> index;
+        indexdb::StringTable *symbolStringTable;
+        indexdb::StringTable *symbolTypeStringTable;
+        indexdb::StringTable *refTypeStringTable;
+        indexdb::Table *refTable;
+        indexdb::Table *refIndexTable;
+        indexdb::Table *symbolTable;
+        indexdb::Table *symbolTypeIndexTable;
+        indexdb::Table *globalSymbolTable;
+        // The project's IDs of the shard's SymbolType and ReferenceType IDs.
+        std::vector<indexdb::ID> symbolTypeIDs;
+        std::vector<indexdb::ID> refTypeIDs;
+        // The project's SymbolType ID of each owned symbol.
+        std::vector<indexdb::ID> symbolType;
+    };
+
+    indexdb::ID projectSymbolID(const Shard &shard, indexdb::ID shardID);
+    void loadSymbolTypes(int shard);
+    QStringList queryShardPaths(int shard);
+    std::vector<indexdb::ID> queryOwnedSymbols(int shard);
+    std::vector<Ref> *queryGlobalSymbolDefinitions(int shard);
 
 private:
     FileManager *m_fileManager;
-    indexdb::Index *m_index;
-    indexdb::StringTable *m_symbolStringTable;
-    indexdb::StringTable *m_symbolTypeStringTable;
-    indexdb::StringTable *m_refTypeStringTable;
-    indexdb::Table *m_refTable;
-    indexdb::Table *m_refIndexTable;
-    indexdb::Table *m_symbolTable;
-    indexdb::Table *m_symbolTypeIndexTable;
-    indexdb::Table *m_globalSymbolTable;
-    QFuture<std::vector<Ref>*> m_globalSymbolDefinitions;
-    std::vector<indexdb::ID> m_symbolType;
+    std::vector<std::unique_ptr<Shard> > m_shards;
+    indexdb::StringTable m_symbolTypeStringTable;
+    indexdb::StringTable m_refTypeStringTable;
+    QList<QFuture<std::vector<Ref>*> > m_globalSymbolDefinitionFutures;
+    std::vector<Ref> m_globalSymbolDefinitions;
+    bool m_haveGlobalSymbolDefinitions;
+    std::vector<indexdb::ID> m_allSymbolIDs;
 };
 
 // Reference table
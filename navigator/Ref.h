@@ -48,7 +48,7 @@ public:
     bool isNull() const { return m_project == NULL; }
 
     const char *symbolCStr() const {
-        return m_project->symbolStringTable().item(m_symbolID);
+        return m_project->symbolName(m_symbolID);
     }
 
     indexdb::ID fileID() const { return m_fileID; }
@@ -5,6 +5,7 @@
 #include <QStringList>
 #include <cassert>
 #include <string>
+#include <vector>
 
 #include "Project.h"
 #include "ReportRefList.h"
@@ -34,15 +35,16 @@ QStringList ReportSymList::columns()
 
 int ReportSymList::rowCount()
 {
-    return m_project.symbolStringTable().size();
+    return m_project.allSymbolIDs().size();
 }
 
 const char *ReportSymList::text(int row, int column, std::string &tempBuf)
 {
+    const indexdb::ID symbolID = m_project.allSymbolIDs()[row];
     if (column == 0) {
-        return m_project.symbolStringTable().item(row);
+        return m_project.symbolName(symbolID);
     } else if (column == 1) {
-        return m_project.getSymbolType(m_project.querySymbolType(row));
+        return m_project.getSymbolType(m_project.querySymbolType(symbolID));
     } else {
         assert(false && "Invalid column");
     }
@@ -53,8 +55,9 @@ int ReportSymList::compare(int row1, int row2, int col)
     if (col == 0) {
         return row1 - row2;
     } else if (col == 1) {
-        return static_cast<int>(m_project.querySymbolType(row1)) -
-                static_cast<int>(m_project.querySymbolType(row2));
+        const std::vector<indexdb::ID> &symbolIDs = m_project.allSymbolIDs();
+        return static_cast<int>(m_project.querySymbolType(symbolIDs[row1])) -
+                static_cast<int>(m_project.querySymbolType(symbolIDs[row2]));
     } else {
         assert(false && "Invalid column");
     }
@@ -65,7 +68,8 @@ bool ReportSymList::activate(int row)
     TableReportWindow *tw = new TableReportWindow;
     tw->setTableReport(new ReportRefList(
                            m_project,
-                           m_project.symbolStringTable().item(row),
+                           m_project.symbolName(
+                               m_project.allSymbolIDs()[row]),
                            tw));
     tw->show();
     return false;
@@ -6,6 +6,7 @@ CONFIG += ordered
 SUBDIRS += \
     third_party \
     libindexdb \
+    libindexdb-bench \
     clang-indexer \
     index-tool \
     navigator